@@ -0,0 +1,668 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"demod.h"
+#include"dvparser.h"
+#include"meters.h"
+#include"serial.h"
+#include"shell.h"
+#include"stats.h"
+#include"util.h"
+#include"wmbus.h"
+#include"wmbus_utils.h"
+
+#include<algorithm>
+#include<map>
+#include<new>
+#include<stdlib.h>
+#include<string.h>
+
+using namespace std;
+
+// Measures the throughput and the number of heap allocations of each step
+// of the decode path, using the telegrams in the simulation files as input.
+//
+// wmbusmeters_bench [--time=<seconds>] [--compare=<baseline.json>] [--threshold=<percent>] {<simulation_file>}
+//
+// The results are printed as json on stdout. Save them as a baseline and
+// use --compare to flag benchmarks that got slower by more than the threshold
+// percentage (default 10) or that allocate more per telegram.
+
+static uint64_t num_allocs_;
+
+void *operator new(size_t size)
+{
+    num_allocs_++;
+    void *p = malloc(size ? size : 1);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+struct BenchBus : public WMBus
+{
+    WMBusDeviceType type() { return DEVICE_SIMULATOR; }
+    bool ping() { return true; }
+    uint32_t getDeviceId() { return 0; }
+    LinkModeSet getLinkModes() { return LinkModeSet(); }
+    LinkModeSet supportedLinkModes() { return LinkModeSet(); }
+    int numConcurrentLinkModes() { return 0; }
+    bool canSetLinkModes(LinkModeSet lms) { return true; }
+    void setMeters(vector<unique_ptr<Meter>> *meters) { }
+    void setLinkModes(LinkModeSet lms) { }
+    void onTelegram(function<bool(AboutTelegram&,vector<uchar>)> cb) { handle = cb; }
+    SerialDevice *serial() { return NULL; }
+    void simulate() { }
+
+    function<bool(AboutTelegram&,vector<uchar>)> handle; // Of the most recently created meter.
+};
+
+struct Template
+{
+    string hex;
+    vector<uchar> frame; // Without the dll crcs.
+    string driver;       // From the expected json output, if any.
+    string id;
+};
+
+struct Result
+{
+    string name;
+    double per_second;
+    double allocs;
+};
+
+static vector<Result> results_;
+static double min_seconds_ = 0.5;
+
+// Invokes op repeatedly for at least min_seconds_, each invocation handles n telegrams.
+// The time is split into rounds and the fastest round is reported, this filters out
+// most of the noise from other processes and frequency scaling.
+static void bench(string name, size_t n, function<void()> op)
+{
+    if (n == 0) return;
+    op(); // Warm up any lazily created state.
+
+    const int rounds = 5;
+    double best = 0;
+    uint64_t runs = 0;
+    uint64_t allocs = num_allocs_;
+    for (int r = 0; r < rounds; ++r)
+    {
+        uint64_t round_runs = 0;
+        uint64_t start = statsNow();
+        uint64_t stop = start + (uint64_t)(min_seconds_*1e9/rounds);
+        uint64_t now;
+        do
+        {
+            op();
+            round_runs++;
+            now = statsNow();
+        } while (now < stop);
+        double per_second = (double)round_runs*n*1e9/(now-start);
+        if (per_second > best) best = per_second;
+        runs += round_runs;
+    }
+    allocs = num_allocs_ - allocs;
+
+    results_.push_back({ name, best, allocs/((double)runs*n) });
+}
+
+static string jsonField(string &line, string key)
+{
+    string k = "\""+key+"\":";
+    size_t p = line.find(k);
+    if (p == string::npos) return "";
+    p += k.length();
+    if (line[p] == '"')
+    {
+        size_t e = line.find('"', p+1);
+        return e == string::npos ? "" : line.substr(p+1, e-p-1);
+    }
+    size_t e = line.find_first_of(",}", p);
+    return e == string::npos ? "" : line.substr(p, e-p);
+}
+
+static void loadTemplates(string file, vector<Template> *templates)
+{
+    vector<char> buf;
+    if (!loadFile(file, &buf)) error("Could not read %s\n", file.c_str());
+    string content(buf.begin(), buf.end());
+
+    int prev = -1; // Index of the telegram that expects its json output.
+    size_t pos = 0;
+    while (pos < content.length())
+    {
+        size_t eol = content.find('\n', pos);
+        if (eol == string::npos) eol = content.length();
+        string line = content.substr(pos, eol-pos);
+        pos = eol+1;
+
+        if (line.substr(0,9) == "telegram=")
+        {
+            Template t;
+            // telegram=|header|content|+time
+            for (char c : line.substr(9))
+            {
+                if (c == '+') break;
+                if (c != '|') t.hex += c;
+            }
+            if (!hex2bin(t.hex, &t.frame) || t.frame.size() < 11)
+            {
+                warning("(bench) skipping bad telegram in %s\n", file.c_str());
+                prev = -1;
+                continue;
+            }
+            templates->push_back(t);
+            prev = templates->size()-1;
+        }
+        else if (line.length() > 0 && line[0] == '{' && prev != -1)
+        {
+            (*templates)[prev].driver = jsonField(line, "meter");
+            (*templates)[prev].id = jsonField(line, "id");
+            prev = -1;
+        }
+    }
+}
+
+// Add the frame format A crcs, a first block of 10 bytes, then blocks of 16 bytes.
+static vector<uchar> addCRCsFrameFormatA(vector<uchar> &frame)
+{
+    vector<uchar> out;
+    size_t pos = 0;
+    while (pos < frame.size())
+    {
+        size_t len = pos == 0 ? 10 : 16;
+        if (pos+len > frame.size()) len = frame.size()-pos;
+        uint16_t crc = crc16_EN13757(&frame[pos], len);
+        out.insert(out.end(), frame.begin()+pos, frame.begin()+pos+len);
+        out.push_back(crc >> 8);
+        out.push_back(crc & 0xff);
+        pos += len;
+    }
+    return out;
+}
+
+static void benchCRC(vector<Template> &templates)
+{
+    vector<vector<uchar>> frames;
+    for (Template &t : templates) frames.push_back(addCRCsFrameFormatA(t.frame));
+
+    vector<uchar> copy;
+    bench("crc_trim_frame_a", frames.size(), [&]()
+    {
+        for (auto &f : frames)
+        {
+            copy = f;
+            if (!trimCRCsFrameFormatA(copy)) error("(bench) crc check failed\n");
+        }
+    });
+}
+
+static void benchHex2Bin(vector<Template> &templates)
+{
+    vector<uchar> bin;
+    bench("hex2bin", templates.size(), [&]()
+    {
+        for (Template &t : templates)
+        {
+            bin.clear();
+            hex2bin(t.hex, &bin);
+        }
+    });
+}
+
+static void benchParse(vector<Template> &templates)
+{
+    // The CI field directly after the dll header selects the parse path.
+    map<string,vector<vector<uchar>>> by_ci;
+    for (Template &t : templates)
+    {
+        by_ci["parse_ci_"+bin2hex(t.frame.begin()+10, t.frame.end(), 1)].push_back(t.frame);
+    }
+    for (auto &p : by_ci)
+    {
+        MeterKeys mk;
+        mk.simulation = true;
+        bench(p.first, p.second.size(), [&]()
+        {
+            for (auto &f : p.second)
+            {
+                Telegram t;
+                t.parse(f, &mk);
+            }
+        });
+    }
+}
+
+static void benchDecrypt()
+{
+    vector<uchar> key(16, 0x42);
+    vector<uchar> encrypted(64, 0x17);
+    vector<uchar> frame;
+    Telegram t;
+    t.dll_mfct_b[0] = 0x2d;
+    t.dll_mfct_b[1] = 0x2c;
+    t.dll_a.assign(6, 0x11);
+
+    bench("decrypt_aes_cbc_iv_64", 1, [&]()
+    {
+        frame = encrypted;
+        vector<uchar>::iterator pos = frame.begin();
+        decrypt_TPL_AES_CBC_IV(&t, frame, pos, key);
+    });
+    bench("decrypt_aes_ctr_64", 1, [&]()
+    {
+        frame = encrypted;
+        vector<uchar>::iterator pos = frame.begin();
+        decrypt_ELL_AES_CTR(&t, frame, pos, key);
+    });
+}
+
+static void benchParseDV(vector<Template> &templates)
+{
+    MeterKeys mk;
+    mk.simulation = true;
+    vector<vector<uchar>> payloads;
+    for (Template &tmpl : templates)
+    {
+        Telegram t;
+        if (!t.parse(tmpl.frame, &mk)) continue;
+        if (t.header_size+t.suffix_size >= (int)t.frame.size()) continue;
+        vector<uchar> payload(t.frame.begin()+t.header_size, t.frame.end()-t.suffix_size);
+        // Skip the manufacturer specific payloads that are not dif/vif records.
+        map<string,pair<int,DVEntry>> values;
+        vector<uchar>::iterator i = payload.begin();
+        if (!parseDV(&t, payload, i, payload.size(), &values)) continue;
+        payloads.push_back(payload);
+    }
+
+    bench("parse_dv", payloads.size(), [&]()
+    {
+        for (auto &p : payloads)
+        {
+            Telegram t;
+            map<string,pair<int,DVEntry>> values;
+            vector<uchar>::iterator i = p.begin();
+            parseDV(&t, p, i, p.size(), &values);
+        }
+    });
+}
+
+static bool isHex(const string &s, size_t len)
+{
+    if (s.length() != len) return false;
+    for (char c : s) if (!isxdigit((uchar)c)) return false;
+    return true;
+}
+
+// The keys given to the meters in the test scripts, by meter id. An id can have
+// several keys, since some tests use wrong keys on purpose.
+static map<string,vector<string>> loadTestKeys()
+{
+    map<string,vector<string>> keys;
+    vector<string> names;
+    listFiles("tests", &names);
+    for (string &n : names)
+    {
+        if (n.substr(0,5) != "test_" || n.substr(n.length()-3) != ".sh") continue;
+        vector<char> buf;
+        if (!loadFile("tests/"+n, &buf)) continue;
+        string content(buf.begin(), buf.end());
+        vector<string> words;
+        string w;
+        for (char c : content)
+        {
+            if (isspace((uchar)c) || c == '"' || c == '\'') { if (w != "") words.push_back(w); w = ""; }
+            else w += tolower(c);
+        }
+        for (size_t i = 0; i+1 < words.size(); ++i)
+        {
+            if (!isHex(words[i], 8) || !isHex(words[i+1], 32)) continue;
+            vector<string> &k = keys[words[i]];
+            if (find(k.begin(), k.end(), words[i+1]) == k.end()) k.push_back(words[i+1]);
+        }
+    }
+    return keys;
+}
+
+static unique_ptr<Meter> createBenchMeter(BenchBus *bus, string driver, string ids, string key)
+{
+    vector<string> no_shells, no_jsons;
+    MeterInfo mi(driver, driver, ids, key, LinkModeSet(), no_shells, no_jsons);
+    unique_ptr<Meter> meter;
+    switch (toMeterType(driver))
+    {
+#define X(mname,link,info,type,cname) \
+    case MeterType::type: meter = create##cname(bus, mi); break;
+LIST_OF_METERS
+#undef X
+    case MeterType::UNKNOWN:
+        break;
+    }
+    return meter;
+}
+
+static void benchDrivers(vector<Template> &templates)
+{
+    BenchBus bus;
+    map<string,vector<string>> test_keys = loadTestKeys();
+
+    // One meter per driver, listening to all ids found for the driver.
+    map<string,vector<Template*>> by_driver;
+    map<string,string> ids;
+    for (Template &t : templates)
+    {
+        if (t.driver == "" || t.id == "") continue;
+        by_driver[t.driver].push_back(&t);
+        if (ids[t.driver].find(t.id) == string::npos)
+        {
+            ids[t.driver] += (ids[t.driver] == "" ? "" : ",") + t.id;
+        }
+    }
+
+    for (auto &p : by_driver)
+    {
+        string driver = p.first;
+        AboutTelegram about;
+
+        // Use the key from the tests that decrypts the most telegrams, otherwise
+        // the encrypted telegrams would measure the failed decryption.
+        vector<string> keys = { "" };
+        for (Template *t : p.second)
+        {
+            string id = t->id;
+            for (char &c : id) c = tolower(c);
+            for (string &k : test_keys[id])
+            {
+                if (find(keys.begin(), keys.end(), k) == keys.end()) keys.push_back(k);
+            }
+        }
+        string key;
+        int most = -1;
+        for (string &k : keys)
+        {
+            unique_ptr<Meter> trial = createBenchMeter(&bus, driver, ids[driver], k);
+            if (!trial) break;
+            for (Template *t : p.second) bus.handle(about, t->frame);
+            if (trial->numUpdates() > most)
+            {
+                most = trial->numUpdates();
+                key = k;
+            }
+        }
+        unique_ptr<Meter> meter = createBenchMeter(&bus, driver, ids[driver], key);
+        if (!meter)
+        {
+            warning("(bench) unknown driver %s\n", driver.c_str());
+            continue;
+        }
+
+        // The processContent is measured through handleTelegram, ie including the
+        // header and tpl parsing that is also measured separately above.
+        bench("handle_"+driver, p.second.size(), [&]()
+        {
+            for (Template *t : p.second)
+            {
+                bus.handle(about, t->frame);
+            }
+        });
+        if (meter->numUpdates() == 0)
+        {
+            error("(bench) the %s meter was never updated, the telegrams did not reach processContent\n", driver.c_str());
+        }
+
+        Telegram t;
+        MeterKeys mk;
+        mk.simulation = true;
+        t.parse(p.second.back()->frame, &mk);
+        string hr, fields, json;
+        vector<string> envs, more_json;
+        // printMeter renders the hr, fields and json formats in one go.
+        bench("print_"+driver, 1, [&]()
+        {
+            envs.clear();
+            meter->printMeter(&t, &hr, &fields, ';', &json, &envs, &more_json);
+        });
+    }
+}
+
+// Feed the framers the byte streams of the dongles, one byte per read, which
+// is the worst case for a framer that rescans its buffer after each read.
+static void benchFramers(vector<Template> &templates)
+{
+    auto manager = createSerialCommunicationManager(0, 0, false);
+
+    vector<uchar> im871a, amb8465, d1tc, rtlwmbus, cul;
+    size_t n = 0, n_d1tc = 0;
+    for (Template &t : templates)
+    {
+        vector<uchar> &f = t.frame;
+        if (f[0] != f.size()-1) continue;
+        n++;
+        // Endpoint radio link, message wmbus indication, then the frame without the len byte.
+        im871a.insert(im871a.end(), { 0xa5, 0x02, 0x03, f[0] });
+        im871a.insert(im871a.end(), f.begin()+1, f.end());
+        amb8465.insert(amb8465.end(), f.begin(), f.end());
+        string line = "T1;1;1;2019-02-09 07:14:18.000;117;102;94740459;0x"+t.hex+"\n";
+        rtlwmbus.insert(rtlwmbus.end(), line.begin(), line.end());
+        vector<uchar> with_crcs = addCRCsFrameFormatA(f);
+        line = "b"+bin2hex(with_crcs)+"\r\n";
+        cul.insert(cul.end(), line.begin(), line.end());
+        // The d1tc only finds its way back after a frame that is not a 0x44 frame
+        // when the next frame ends exactly at the end of a read.
+        if (f[1] == 0x44)
+        {
+            d1tc.insert(d1tc.end(), f.begin(), f.end());
+            n_d1tc++;
+        }
+    }
+
+    struct Stream { string driver; vector<uchar> *bytes; size_t telegrams; };
+    vector<Stream> streams = {
+        { "im871a", &im871a, n }, { "amb8465", &amb8465, n }, { "d1tc", &d1tc, n_d1tc },
+        { "rtlwmbus", &rtlwmbus, n }, { "cul", &cul, n } };
+
+    for (Stream &s : streams)
+    {
+        auto serial = manager->createSerialDeviceSimulator();
+        SerialDevice *sd = serial.get();
+        unique_ptr<WMBus> bus;
+        if (s.driver == "im871a") bus = openIM871A("", manager.get(), std::move(serial));
+        if (s.driver == "amb8465") bus = openAMB8465("", manager.get(), std::move(serial));
+        if (s.driver == "d1tc") bus = openD1TC("", manager.get(), std::move(serial));
+        if (s.driver == "rtlwmbus") bus = openRTLWMBUS("", manager.get(), NULL, std::move(serial));
+        if (s.driver == "cul") bus = openCUL("", manager.get(), std::move(serial));
+
+        size_t received = 0;
+        bus->onTelegram([&](AboutTelegram &about, vector<uchar> frame) { received++; return true; });
+
+        vector<uchar> one(1);
+        bench("frame_"+s.driver+"_bytewise", s.telegrams, [&]()
+        {
+            received = 0;
+            for (uchar b : *s.bytes)
+            {
+                one[0] = b;
+                sd->fill(one);
+            }
+            if (received != s.telegrams)
+            {
+                error("(bench) the %s framer found %zu of %zu telegrams\n", s.driver.c_str(), received, s.telegrams);
+            }
+        });
+    }
+}
+
+static void benchDemod(vector<Template> &templates)
+{
+    // Each telegram as received by rtl_sdr, with some noise and a crystal offset.
+    vector<uchar> iq;
+    size_t n = 0;
+    for (Template &t : templates)
+    {
+        if (t.frame[0] != t.frame.size()-1 || t.frame.size() < 12) continue;
+        vector<uchar> samples = modulateIQ(LinkMode::T1, t.frame, false, DEMOD_SAMPLE_RATE, 10000, 10, n+1);
+        iq.insert(iq.end(), samples.begin(), samples.end());
+        n++;
+    }
+
+    size_t received = 0;
+    Demodulator demod(DEMOD_SAMPLE_RATE, NULL, [&](LinkMode lm, vector<uchar> &frame) { received++; });
+    bench("demod_t1", n, [&]()
+    {
+        received = 0;
+        // The reads from the rtl_sdr pipe.
+        for (size_t pos = 0; pos < iq.size(); pos += 16384)
+        {
+            demod.process(&iq[pos], min((size_t)16384, iq.size()-pos));
+        }
+        if (received != n)
+        {
+            error("(bench) the demodulator found %zu of %zu telegrams\n", received, n);
+        }
+    });
+}
+
+// The latency of starting a --shell= command, measured as invocations per second.
+// The allocations are those of wmbusmeters, not of the child. It is measured after
+// growing the heap of the benchmark with touched pages, the latency of posix_spawn
+// should stay the same while the latency of a fork grows with the resident size.
+static void benchSpawn()
+{
+    string sh = "/bin/sh";
+    vector<string> args = { "-c", "true" };
+    vector<string> envs = { "METER_JSON={\"id\":\"12345678\",\"total_m3\":6.408}",
+                            "METER_ID=12345678", "METER_TOTAL_M3=6.408",
+                            "METER_TIMESTAMP=2020-05-01T12:00:00Z" };
+    vector<char> ballast;
+    for (size_t mb : { 0, 64, 512 })
+    {
+        ballast.resize(mb*1024*1024);
+        // Touch every page so that it is resident.
+        for (size_t i = 0; i < ballast.size(); i += 4096) ballast[i] = 1;
+        string name = "spawn_shell";
+        if (mb > 0) name += "_rss_"+to_string(mb)+"m";
+        bench(name, 1, [&]()
+        {
+            if (!invokeShell(sh, args, envs)) error("(bench) could not invoke %s\n", sh.c_str());
+        });
+    }
+}
+
+static void printResults()
+{
+    printf("{\n\"benchmarks\":[\n");
+    for (size_t i = 0; i < results_.size(); ++i)
+    {
+        Result &r = results_[i];
+        printf("{\"name\":\"%s\",\"telegrams_per_second\":%.0f,\"allocs_per_telegram\":%.2f}%s\n",
+               r.name.c_str(), r.per_second, r.allocs, i+1 < results_.size() ? "," : "");
+    }
+    printf("]\n}\n");
+}
+
+// Returns the number of regressions compared to the baseline file.
+static int compareResults(string file, double threshold)
+{
+    vector<char> buf;
+    if (!loadFile(file, &buf)) error("Could not read baseline %s\n", file.c_str());
+    string content(buf.begin(), buf.end());
+
+    map<string,Result> baseline;
+    size_t pos = 0;
+    while ((pos = content.find("{\"name\":", pos)) != string::npos)
+    {
+        size_t eol = content.find('\n', pos);
+        string line = content.substr(pos, eol == string::npos ? string::npos : eol-pos);
+        Result r { jsonField(line, "name"),
+                   atof(jsonField(line, "telegrams_per_second").c_str()),
+                   atof(jsonField(line, "allocs_per_telegram").c_str()) };
+        baseline[r.name] = r;
+        pos++;
+    }
+
+    int regressions = 0;
+    for (Result &r : results_)
+    {
+        if (baseline.count(r.name) == 0) continue;
+        Result &b = baseline[r.name];
+        if (r.per_second < b.per_second*(1.0-threshold/100.0))
+        {
+            fprintf(stderr, "REGRESSION %s %.0f telegrams/s, baseline %.0f (%+.1f%%)\n",
+                    r.name.c_str(), r.per_second, b.per_second, 100.0*(r.per_second-b.per_second)/b.per_second);
+            regressions++;
+        }
+        // Allocations are deterministic, but the number of runs are not, allow rounding.
+        if (r.allocs > b.allocs+0.05)
+        {
+            fprintf(stderr, "REGRESSION %s %.2f allocs/telegram, baseline %.2f\n",
+                    r.name.c_str(), r.allocs, b.allocs);
+            regressions++;
+        }
+    }
+    return regressions;
+}
+
+int main(int argc, char **argv)
+{
+    string compare;
+    double threshold = 10;
+    vector<string> files;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        string a = argv[i];
+        if (a.substr(0,7) == "--time=") min_seconds_ = atof(a.substr(7).c_str());
+        else if (a.substr(0,10) == "--compare=") compare = a.substr(10);
+        else if (a.substr(0,12) == "--threshold=") threshold = atof(a.substr(12).c_str());
+        else if (a.substr(0,2) == "--") error("Unknown option \"%s\"\n", a.c_str());
+        else files.push_back(a);
+    }
+    if (files.size() == 0)
+    {
+        vector<string> names;
+        listFiles("simulations", &names);
+        for (string &n : names)
+        {
+            if (n.substr(0,11) == "simulation_" && n.substr(n.length()-4) == ".txt") files.push_back("simulations/"+n);
+        }
+    }
+    // The benchmarks run the normal debug and verbose off path, also without warnings.
+    warningSilenced(true);
+
+    vector<Template> templates;
+    for (string &f : files) loadTemplates(f, &templates);
+    if (templates.size() == 0) error("No telegrams found.\n");
+
+    benchCRC(templates);
+    benchHex2Bin(templates);
+    benchParse(templates);
+    benchDecrypt();
+    benchParseDV(templates);
+    benchDrivers(templates);
+    benchFramers(templates);
+    benchDemod(templates);
+    benchSpawn();
+
+    printResults();
+
+    if (compare != "" && compareResults(compare, threshold) > 0) return 1;
+    return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"cbor.h"
+
+#include<string.h>
+
+// Major types, stored in the top three bits of the initial byte.
+#define CBOR_UINT   0
+#define CBOR_NEGINT 1
+#define CBOR_TEXT   3
+#define CBOR_ARRAY  4
+#define CBOR_SIMPLE 7
+
+static void addHead(vector<uchar> &out, int major, uint64_t v)
+{
+    uchar m = major << 5;
+    if (v < 24)
+    {
+        out.push_back(m | v);
+    }
+    else if (v <= 0xff)
+    {
+        out.push_back(m | 24);
+        out.push_back(v);
+    }
+    else if (v <= 0xffff)
+    {
+        out.push_back(m | 25);
+        out.push_back(v >> 8);
+        out.push_back(v);
+    }
+    else if (v <= 0xffffffff)
+    {
+        out.push_back(m | 26);
+        for (int s = 24; s >= 0; s -= 8) out.push_back(v >> s);
+    }
+    else
+    {
+        out.push_back(m | 27);
+        for (int s = 56; s >= 0; s -= 8) out.push_back(v >> s);
+    }
+}
+
+void cborAddUInt(vector<uchar> &out, uint64_t v)
+{
+    addHead(out, CBOR_UINT, v);
+}
+
+void cborAddInt(vector<uchar> &out, int64_t v)
+{
+    if (v >= 0) addHead(out, CBOR_UINT, v);
+    else addHead(out, CBOR_NEGINT, -1-v);
+}
+
+void cborAddText(vector<uchar> &out, const string &s)
+{
+    addHead(out, CBOR_TEXT, s.length());
+    out.insert(out.end(), s.begin(), s.end());
+}
+
+void cborAddArray(vector<uchar> &out, size_t num_items)
+{
+    addHead(out, CBOR_ARRAY, num_items);
+}
+
+void cborAddDouble(vector<uchar> &out, double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    out.push_back((CBOR_SIMPLE << 5) | 27);
+    for (int s = 56; s >= 0; s -= 8) out.push_back(bits >> s);
+}
+
+static bool getBytes(const vector<uchar> &in, size_t *pos, int n, uint64_t *v)
+{
+    if (*pos+n > in.size()) return false;
+    *v = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        *v = (*v << 8) | in[(*pos)++];
+    }
+    return true;
+}
+
+// The records written by wmbusmeters are arrays holding arrays of scalars, i.e. the
+// scalars are at depth two. Allow a little more, deeper input is malformed.
+#define CBOR_MAX_DEPTH 4
+
+static bool decode(const vector<uchar> &in, size_t *pos, CborItem *item, int depth)
+{
+    if (*pos >= in.size() || depth > CBOR_MAX_DEPTH) return false;
+
+    uchar initial = in[(*pos)++];
+    int major = initial >> 5;
+    int info = initial & 0x1f;
+    uint64_t v = 0;
+
+    if (info < 24) v = info;
+    else if (info == 24) { if (!getBytes(in, pos, 1, &v)) return false; }
+    else if (info == 25) { if (!getBytes(in, pos, 2, &v)) return false; }
+    else if (info == 26) { if (!getBytes(in, pos, 4, &v)) return false; }
+    else if (info == 27) { if (!getBytes(in, pos, 8, &v)) return false; }
+    else return false; // Indefinite lengths are never produced.
+
+    item->items.clear();
+    item->s = "";
+
+    switch (major)
+    {
+    case CBOR_UINT:
+        item->type = CborType::UInt;
+        item->i = v;
+        return true;
+    case CBOR_NEGINT:
+        item->type = CborType::NegInt;
+        item->i = -1-(int64_t)v;
+        return true;
+    case CBOR_TEXT:
+        // Compared this way round, a huge length cannot overflow.
+        if (v > in.size()-*pos) return false;
+        item->type = CborType::Text;
+        item->s = string(in.begin()+*pos, in.begin()+*pos+v);
+        *pos += v;
+        return true;
+    case CBOR_ARRAY:
+        // Each item is at least one byte, a larger count cannot be valid.
+        if (v > in.size()-*pos) return false;
+        item->type = CborType::Array;
+        item->items.resize(v);
+        for (uint64_t j = 0; j < v; ++j)
+        {
+            if (!decode(in, pos, &item->items[j], depth+1)) return false;
+        }
+        return true;
+    case CBOR_SIMPLE:
+        if (info == 22)
+        {
+            item->type = CborType::Null;
+            return true;
+        }
+        if (info == 26)
+        {
+            uint32_t bits = v;
+            float f;
+            memcpy(&f, &bits, sizeof(f));
+            item->type = CborType::Double;
+            item->d = f;
+            return true;
+        }
+        if (info == 27)
+        {
+            item->type = CborType::Double;
+            memcpy(&item->d, &v, sizeof(item->d));
+            return true;
+        }
+        return false;
+    }
+    return false;
+}
+
+bool cborDecode(const vector<uchar> &in, size_t *pos, CborItem *item)
+{
+    return decode(in, pos, item, 0);
+}
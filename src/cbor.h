@@ -0,0 +1,75 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CBOR_H_
+#define CBOR_H_
+
+#include"util.h"
+
+#include<stdint.h>
+#include<string>
+#include<vector>
+
+using namespace std;
+
+/**
+  The compact binary output format (--format=cbor) is a sequence of
+  CBOR (RFC 7049) arrays written back to back, without any framing.
+
+  A schema record is written before the first reading from a meter, and again
+  if the schema changes. It lists the names of the values in the same order
+  as they appear in the json output:
+      [0, meter_index, media, meter, name, [field_names...], [extra_json...]]
+  The extra_json entries are the already quoted "key":"value" strings added
+  with json_xxx=yyy, since they never change they are only sent in the schema.
+
+  Each reading is then sent as a data record with only the values:
+      [1, meter_index, unix_timestamp, id, values...]
+  Numeric values are float64, textual values are text strings.
+  When the receiver told which device, rssi or link mode heard the reading,
+  they follow the values as one more array, "" or 0 when not known:
+      [1, meter_index, unix_timestamp, id, values..., [device, rssi_dbm, link_mode]]
+*/
+
+#define CBOR_SCHEMA_RECORD 0
+#define CBOR_DATA_RECORD 1
+
+void cborAddUInt(vector<uchar> &out, uint64_t v);
+void cborAddInt(vector<uchar> &out, int64_t v);
+void cborAddText(vector<uchar> &out, const string &s);
+void cborAddArray(vector<uchar> &out, size_t num_items);
+void cborAddDouble(vector<uchar> &out, double v);
+
+enum class CborType
+{
+    UInt, NegInt, Text, Array, Double, Null
+};
+
+struct CborItem
+{
+    CborType type {};
+    int64_t i {};
+    double d {};
+    string s;
+    vector<CborItem> items;
+};
+
+// Decode a single item at *pos and advance *pos past it.
+// Returns false if the data is truncated or uses a CBOR feature not produced by wmbusmeters.
+bool cborDecode(const vector<uchar> &in, size_t *pos, CborItem *item);
+
+#endif
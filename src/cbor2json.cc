@@ -0,0 +1,182 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Read the output from wmbusmeters --format=cbor (from a file or stdin)
+// and print the same json lines as wmbusmeters --format=json would have printed.
+
+#include"cbor.h"
+#include"units.h"
+#include"util.h"
+
+#include<map>
+#include<stdio.h>
+#include<string.h>
+#include<time.h>
+
+using namespace std;
+
+struct Schema
+{
+    string media, meter, name;
+    vector<string> fields;
+    vector<string> extras;
+};
+
+static bool isText(CborItem &i) { return i.type == CborType::Text; }
+static bool isUInt(CborItem &i) { return i.type == CborType::UInt; }
+
+static bool handleSchema(CborItem &r, map<int,Schema> *schemas)
+{
+    if (r.items.size() != 7 || !isUInt(r.items[1]) || !isText(r.items[2]) || !isText(r.items[3])
+        || !isText(r.items[4]) || r.items[5].type != CborType::Array || r.items[6].type != CborType::Array)
+    {
+        return false;
+    }
+    Schema s;
+    s.media = r.items[2].s;
+    s.meter = r.items[3].s;
+    s.name = r.items[4].s;
+    for (CborItem &f : r.items[5].items)
+    {
+        if (!isText(f)) return false;
+        s.fields.push_back(f.s);
+    }
+    for (CborItem &e : r.items[6].items)
+    {
+        if (!isText(e)) return false;
+        s.extras.push_back(e.s);
+    }
+    (*schemas)[r.items[1].i] = s;
+    return true;
+}
+
+static bool handleData(CborItem &r, map<int,Schema> &schemas)
+{
+    if (r.items.size() < 4 || !isUInt(r.items[1]) || !isUInt(r.items[2]) || !isText(r.items[3])) return false;
+
+    auto i = schemas.find(r.items[1].i);
+    if (i == schemas.end())
+    {
+        warning("(cbor2json) data record for meter %d without a schema.\n", (int)r.items[1].i);
+        return true;
+    }
+    Schema &schema = i->second;
+    CborItem *about = NULL;
+    if (r.items.size() == 5+schema.fields.size() && r.items.back().type == CborType::Array)
+    {
+        about = &r.items.back();
+        if (about->items.size() != 3 || !isText(about->items[0]) || !isText(about->items[2]) ||
+            (about->items[1].type != CborType::NegInt && !isUInt(about->items[1])))
+        {
+            return false;
+        }
+    }
+    else if (r.items.size() != 4+schema.fields.size())
+    {
+        warning("(cbor2json) data record for meter %d does not match its schema.\n", (int)r.items[1].i);
+        return true;
+    }
+
+    string s;
+    s += "{";
+    s += "\"media\":\""+schema.media+"\",";
+    s += "\"meter\":\""+schema.meter+"\",";
+    s += "\"name\":\""+schema.name+"\",";
+    s += "\"id\":\""+r.items[3].s+"\",";
+    for (size_t f = 0; f < schema.fields.size(); ++f)
+    {
+        CborItem &v = r.items[4+f];
+        if (v.type == CborType::Text)
+        {
+            s += "\""+schema.fields[f]+"\":\""+v.s+"\",";
+        }
+        else if (v.type == CborType::Double)
+        {
+            s += "\""+schema.fields[f]+"\":"+valueToString(v.d, Unit::Unknown)+",";
+        }
+        else
+        {
+            return false;
+        }
+    }
+    char datetime[40];
+    time_t ts = r.items[2].i;
+    memset(datetime, 0, sizeof(datetime));
+    strftime(datetime, sizeof(datetime), "%FT%TZ", gmtime(&ts));
+    s += "\"timestamp\":\""+string(datetime)+"\"";
+    if (about)
+    {
+        // In the same order and with the same defaults as the json output.
+        if (about->items[0].s != "") s += ",\"device\":\""+about->items[0].s+"\"";
+        if (about->items[1].i != 0) s += ",\"rssi_dbm\":"+to_string(about->items[1].i);
+        if (about->items[2].s != "") s += ",\"link_mode\":\""+about->items[2].s+"\"";
+    }
+    for (string &e : schema.extras)
+    {
+        s += ","+e;
+    }
+    s += "}";
+    printf("%s\n", s.c_str());
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    vector<uchar> buf;
+    FILE *in = stdin;
+
+    if (argc > 2 || (argc == 2 && !strcmp(argv[1], "--help")))
+    {
+        printf("Usage: cbor2json [file]\n"
+               "Converts the output of wmbusmeters --format=cbor into json lines.\n");
+        return 0;
+    }
+    if (argc == 2 && strcmp(argv[1], "-"))
+    {
+        in = fopen(argv[1], "rb");
+        if (!in) error("Could not open \"%s\"\n", argv[1]);
+    }
+
+    uchar block[4096];
+    size_t n;
+    while ((n = fread(block, 1, sizeof(block), in)) > 0)
+    {
+        buf.insert(buf.end(), block, block+n);
+    }
+
+    map<int,Schema> schemas;
+    size_t pos = 0;
+    while (pos < buf.size())
+    {
+        CborItem r;
+        size_t start = pos;
+        if (!cborDecode(buf, &pos, &r) || r.type != CborType::Array || r.items.size() < 1 || !isUInt(r.items[0]))
+        {
+            error("(cbor2json) bad record at offset %zu\n", start);
+        }
+        bool ok = false;
+        if (r.items[0].i == CBOR_SCHEMA_RECORD) ok = handleSchema(r, &schemas);
+        else if (r.items[0].i == CBOR_DATA_RECORD) ok = handleData(r, schemas);
+        else
+        {
+            // Unknown record types are skipped to allow extending the format.
+            ok = true;
+        }
+        if (!ok) error("(cbor2json) malformed record at offset %zu\n", start);
+    }
+    return 0;
+}
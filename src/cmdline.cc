@@ -47,8 +47,8 @@ unique_ptr<Configuration> parseCommandLine(int argc, char **argv) {
             if (argv[i] == NULL) break;
             if (!strncmp(argv[i], "--device=", 9))
             {
-                c->device_override = string(argv[i]+9);
-                debug("(daemon) device override \"%s\"\n", c->device_override.c_str());
+                c->device_overrides.push_back(string(argv[i]+9));
+                debug("(daemon) device override \"%s\"\n", argv[i]+9);
                 i++;
                 continue;
             }
@@ -68,6 +68,7 @@ unique_ptr<Configuration> parseCommandLine(int argc, char **argv) {
         c->need_help = true;
         return unique_ptr<Configuration>(c);
     }
+    vector<string> more_devices;
     while (argv[i] && argv[i][0] == '-') {
         if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "-help") || !strcmp(argv[i], "--help")) {
             c->need_help = true;
@@ -96,6 +97,29 @@ unique_ptr<Configuration> parseCommandLine(int argc, char **argv) {
             i++;
             continue;
         }
+        if (!strncmp(argv[i], "--dedup=", 8)) {
+            c->dedup = parseTime(string(argv[i]+8));
+            if (c->dedup <= 0) {
+                error("Not a valid dedup window, eg 10s 1m.\n");
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--dedupmax=", 11)) {
+            string max = string(argv[i]+11);
+            c->dedupmax = atoi(max.c_str());
+            if (!isNumber(max) || c->dedupmax <= 0) {
+                error("Not a valid dedup max, eg 100000.\n");
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--device=", 9)) {
+            // More receivers, added after the device given last on the command line.
+            more_devices.push_back(argv[i]+9);
+            i++;
+            continue;
+        }
         if (!strncmp(argv[i], "--listento=", 11)) {
             LinkModeSet lms = parseLinkModes(argv[i]+11);
             if (lms.bits() == 0) {
@@ -151,8 +175,8 @@ unique_ptr<Configuration> parseCommandLine(int argc, char **argv) {
                 if (argv[i] == NULL) break;
                 if (!strncmp(argv[i], "--device=", 9))
                 {
-                    c->device_override = string(argv[i]+9);
-                    debug("(useconfig) device override \"%s\"\n", c->device_override.c_str());
+                    c->device_overrides.push_back(string(argv[i]+9));
+                    debug("(useconfig) device override \"%s\"\n", argv[i]+9);
                     i++;
                     continue;
                 }
@@ -184,12 +208,14 @@ unique_ptr<Configuration> parseCommandLine(int argc, char **argv) {
             {
                 c->json = true;
                 c->fields = false;
+                c->cbor = false;
             }
             else
             if (!strcmp(argv[i]+9, "fields"))
             {
                 c->json = false;
                 c->fields = true;
+                c->cbor = false;
                 c->separator = ';';
             }
             else
@@ -197,9 +223,17 @@ unique_ptr<Configuration> parseCommandLine(int argc, char **argv) {
             {
                 c->json = false;
                 c->fields = false;
+                c->cbor = false;
                 c->separator = '\t';
             }
             else
+            if (!strcmp(argv[i]+9, "cbor"))
+            {
+                c->json = false;
+                c->fields = false;
+                c->cbor = true;
+            }
+            else
             {
                 error("Unknown output format: \"%s\"\n", argv[i]+9);
             }
@@ -297,6 +331,15 @@ unique_ptr<Configuration> parseCommandLine(int argc, char **argv) {
             i++;
             continue;
         }
+        if (!strncmp(argv[i], "--metrics=", 10)) {
+            string port = string(argv[i]+10);
+            if (!isNumber(port) || atoi(port.c_str()) < 1 || atoi(port.c_str()) > 65535) {
+                error("Not a valid metrics port.\n");
+            }
+            c->metrics_port = atoi(port.c_str());
+            i++;
+            continue;
+        }
         if (!strcmp(argv[i], "--meterfiles") ||
             (!strncmp(argv[i], "--meterfiles", 12) &&
              strlen(argv[i]) > 12 &&
@@ -328,6 +371,31 @@ unique_ptr<Configuration> parseCommandLine(int argc, char **argv) {
             i++;
             continue;
         }
+        if (!strncmp(argv[i], "--logkeep=", 10)) {
+            string keep = string(argv[i]+10);
+            if (!isNumber(keep) || atoi(keep.c_str()) < 1) {
+                error("Not a valid number of log files to keep.\n");
+            }
+            c->logkeep = atoi(keep.c_str());
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--logrotatesize=", 16)) {
+            c->logrotate_size = parseSize(string(argv[i]+16));
+            if (c->logrotate_size == 0) {
+                error("Not a valid log rotate size, eg 512k 10M 1G.\n");
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--logrotatetime=", 16)) {
+            c->logrotate_seconds = parseTime(string(argv[i]+16));
+            if (c->logrotate_seconds <= 0) {
+                error("Not a valid log rotate time, eg 24h 60m.\n");
+            }
+            i++;
+            continue;
+        }
         if (!strncmp(argv[i], "--usestderr=", 10)) {
             c->use_stderr = true;
             i++;
@@ -342,6 +410,47 @@ unique_ptr<Configuration> parseCommandLine(int argc, char **argv) {
             i++;
             continue;
         }
+        if (!strncmp(argv[i], "--publish=", 10)) {
+            string spec = string(argv[i]+10);
+            if (spec == "") {
+                error("The publish address cannot be empty.\n");
+            }
+            c->publish.push_back(spec);
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--spool=", 8)) {
+            c->spool = string(argv[i]+8);
+            if (c->spool == "") {
+                error("The spool directory cannot be empty.\n");
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--spoolmax=", 11)) {
+            c->spool_max = parseSize(string(argv[i]+11));
+            if (c->spool_max == 0) {
+                error("Not a valid spool size, eg 512k 10M 1G.\n");
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--forward=", 10)) {
+            c->forward = string(argv[i]+10);
+            if (c->forward == "") {
+                error("The forward address cannot be empty.\n");
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--forwardmax=", 13)) {
+            c->forward_max = parseSize(string(argv[i]+13));
+            if (c->forward_max == 0) {
+                error("Not a valid forward buffer size, eg 512k 10M 1G.\n");
+            }
+            i++;
+            continue;
+        }
         if (!strncmp(argv[i], "--json_", 7))
         {
             // For example: --json_floor=42
@@ -360,6 +469,52 @@ unique_ptr<Configuration> parseCommandLine(int argc, char **argv) {
             i++;
             continue;
         }
+        if (!strncmp(argv[i], "--statsfile=", 12)) {
+            c->statsfile = string(argv[i]+12);
+            if (c->statsfile == "") {
+                error("The stats file cannot be empty.\n");
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--statsinterval=", 16)) {
+            c->statsinterval = parseTime(string(argv[i]+16));
+            if (c->statsinterval <= 0) {
+                error("Not a valid stats interval, eg 10s 5m.\n");
+            }
+            i++;
+            continue;
+        }
+        if (!strcmp(argv[i], "--stats")) {
+            c->stats = true;
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--trace=", 8)) {
+            c->trace = string(argv[i]+8);
+            if (c->trace == "") {
+                error("The trace file cannot be empty.\n");
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--tracesample=", 14)) {
+            c->tracesample = parsePercent(string(argv[i]+14));
+            if (c->tracesample < 0) {
+                error("Not a valid trace sample, eg 1% 0.1%.\n");
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--traceids=", 11)) {
+            string ids = string(argv[i]+11);
+            if (!isValidMatchExpressions(ids, true)) {
+                error("Not a valid id match expression \"%s\".\n", ids.c_str());
+            }
+            c->traceids = splitMatchExpressions(ids);
+            i++;
+            continue;
+        }
         if (!strcmp(argv[i], "--oneshot")) {
             c->oneshot = true;
             i++;
@@ -388,19 +543,12 @@ unique_ptr<Configuration> parseCommandLine(int argc, char **argv) {
         error("Unknown option \"%s\"\n", argv[i]);
     }
 
-    char *extra = argv[i] ? strchr(argv[i], ':') : NULL ;
-    if (extra) {
-        *extra = 0;
-        extra++;
-        c->device_extra = extra;
-    }
-    if (argv[i]) {
-        c->device = argv[i];
-    }
-    i++;
-    if (c->device.length() == 0) {
+    if (argv[i] == NULL || argv[i][0] == 0) {
         error("You must supply the usb device to which the wmbus dongle is connected.\n");
     }
+    handleDevice(c, argv[i]);
+    for (string &d : more_devices) handleDevice(c, d);
+    i++;
 
     if ((argc-i) % 4 != 0) {
         error("For each meter you must supply a: name,type,id and key.\n");
@@ -158,6 +158,20 @@ void handleLoglevel(Configuration *c, string loglevel)
     }
 }
 
+static bool isLinkModes(string modes)
+{
+    if (modes == "") return false;
+    size_t b = 0;
+    for (;;)
+    {
+        size_t e = modes.find(',', b);
+        string mode = modes.substr(b, e == string::npos ? string::npos : e-b);
+        if (isLinkMode(mode.c_str()) == LinkMode::UNKNOWN) return false;
+        if (e == string::npos) return true;
+        b = e+1;
+    }
+}
+
 void handleDevice(Configuration *c, string device)
 {
     // device can be:
@@ -165,14 +179,25 @@ void handleDevice(Configuration *c, string device)
     // auto
     // rtlwmbus:/usr/bin/rtl_sdr -f 868.9M -s 1600000 - | /usr/bin/rtl_wmbus
     // simulation....txt (read telegrams from file)
+    // /dev/ttyUSB0:im871a:c1 (this receiver listens to c1)
+    // Several device= lines add several receivers.
+    SpecifiedDevice d;
+    size_t last = device.rfind(':');
+    if (last != string::npos && last > 0 && isLinkModes(device.substr(last+1)))
+    {
+        d.link_modes = parseLinkModes(device.substr(last+1));
+        d.link_modes_configured = true;
+        device = device.substr(0, last);
+    }
     size_t p = device.find (':');
     if (p != string::npos)
     {
-        c->device_extra = device.substr(p+1);
-        c->device = device.substr(0,p);
+        d.extra = device.substr(p+1);
+        d.file = device.substr(0,p);
     } else {
-        c->device = device;
+        d.file = device;
     }
+    c->devices.push_back(d);
 }
 
 void handleListenTo(Configuration *c, string mode)
@@ -197,6 +222,88 @@ void handleLogtelegrams(Configuration *c, string logtelegrams)
     }
 }
 
+void handleStats(Configuration *c, string stats)
+{
+    if (stats == "true") { c->stats = true; }
+    else if (stats == "false") { c->stats = false;}
+    else {
+        warning("No such stats setting: \"%s\"\n", stats.c_str());
+    }
+}
+
+void handleStatsfile(Configuration *c, string file)
+{
+    c->statsfile = file;
+}
+
+void handleStatsinterval(Configuration *c, string time)
+{
+    int s = parseTime(time);
+    if (s <= 0)
+    {
+        warning("Not a valid stats interval \"%s\"\n", time.c_str());
+        return;
+    }
+    c->statsinterval = s;
+}
+
+void handleDedup(Configuration *c, string time)
+{
+    int s = parseTime(time);
+    if (s <= 0)
+    {
+        warning("Not a valid dedup window \"%s\"\n", time.c_str());
+        return;
+    }
+    c->dedup = s;
+}
+
+void handleDedupmax(Configuration *c, string max)
+{
+    if (!isNumber(max) || atoi(max.c_str()) <= 0)
+    {
+        warning("Not a valid dedup max \"%s\"\n", max.c_str());
+        return;
+    }
+    c->dedupmax = atoi(max.c_str());
+}
+
+void handleTrace(Configuration *c, string file)
+{
+    c->trace = file;
+}
+
+void handleTracesample(Configuration *c, string percent)
+{
+    double p = parsePercent(percent);
+    if (p < 0)
+    {
+        warning("Not a valid trace sample \"%s\"\n", percent.c_str());
+        return;
+    }
+    c->tracesample = p;
+}
+
+void handleTraceids(Configuration *c, string ids)
+{
+    if (!isValidMatchExpressions(ids, true))
+    {
+        warning("Not a valid id match expression \"%s\"\n", ids.c_str());
+        return;
+    }
+    c->traceids = splitMatchExpressions(ids);
+}
+
+void handleMetrics(Configuration *c, string port)
+{
+    if (!isNumber(port) || atoi(port.c_str()) < 1 || atoi(port.c_str()) > 65535)
+    {
+        warning("Not a valid metrics port \"%s\"\n", port.c_str());
+        return;
+    }
+    c->metrics_port = atoi(port.c_str());
+}
+
 void handleMeterfiles(Configuration *c, string meterfiles)
 {
     if (meterfiles.length() > 0)
@@ -279,22 +386,59 @@ void handleLogfile(Configuration *c, string logfile)
     }
 }
 
+void handleLogrotateSize(Configuration *c, string size)
+{
+    c->logrotate_size = parseSize(size);
+    if (c->logrotate_size == 0)
+    {
+        warning("Not a valid log rotate size \"%s\"\n", size.c_str());
+    }
+}
+
+void handleLogrotateTime(Configuration *c, string time)
+{
+    c->logrotate_seconds = parseTime(time);
+    if (c->logrotate_seconds <= 0)
+    {
+        warning("Not a valid log rotate time \"%s\"\n", time.c_str());
+    }
+}
+
+void handleLogkeep(Configuration *c, string keep)
+{
+    if (!isNumber(keep) || atoi(keep.c_str()) < 1)
+    {
+        warning("Not a valid number of log files to keep \"%s\"\n", keep.c_str());
+        return;
+    }
+    c->logkeep = atoi(keep.c_str());
+}
+
 void handleFormat(Configuration *c, string format)
 {
     if (format == "hr")
     {
         c->json = false;
         c->fields = false;
+        c->cbor = false;
     } else if (format == "json")
     {
         c->json = true;
         c->fields = false;
+        c->cbor = false;
     }
     else if (format == "fields")
     {
         c->json = false;
         c->fields = true;
+        c->cbor = false;
         c->separator = ';';
+    }
+    else if (format == "cbor")
+    {
+        c->json = false;
+        c->fields = false;
+        c->cbor = true;
     } else {
         warning("Unknown output format: \"%s\"\n", format.c_str());
     }
@@ -347,12 +491,49 @@ void handleShell(Configuration *c, string cmdline)
     c->shells.push_back(cmdline);
 }
 
+void handlePublish(Configuration *c, string spec)
+{
+    c->publish.push_back(spec);
+}
+
+void handleSpool(Configuration *c, string dir)
+{
+    c->spool = dir;
+}
+
+void handleSpoolmax(Configuration *c, string size)
+{
+    size_t s = parseSize(size);
+    if (s == 0)
+    {
+        warning("Not a valid spool size \"%s\"\n", size.c_str());
+        return;
+    }
+    c->spool_max = s;
+}
+
+void handleForward(Configuration *c, string host_port)
+{
+    c->forward = host_port;
+}
+
+void handleForwardmax(Configuration *c, string size)
+{
+    size_t s = parseSize(size);
+    if (s == 0)
+    {
+        warning("Not a valid forward buffer size \"%s\"\n", size.c_str());
+        return;
+    }
+    c->forward_max = s;
+}
+
 void handleJson(Configuration *c, string json)
 {
     c->jsons.push_back(json);
 }
 
-unique_ptr<Configuration> loadConfiguration(string root, string device_override, string listento_override)
+unique_ptr<Configuration> loadConfiguration(string root, vector<string> device_overrides, string listento_override)
 {
     Configuration *c = new Configuration;
 
@@ -384,11 +565,28 @@ unique_ptr<Configuration> loadConfiguration(string root, string device_override,
         else if (p.first == "meterfilesnaming") handleMeterfilesNaming(c, p.second);
         else if (p.first == "meterfilestimestamp") handleMeterfilesTimestamp(c, p.second);
         else if (p.first == "logfile") handleLogfile(c, p.second);
+        else if (p.first == "logrotatesize") handleLogrotateSize(c, p.second);
+        else if (p.first == "logrotatetime") handleLogrotateTime(c, p.second);
+        else if (p.first == "logkeep") handleLogkeep(c, p.second);
         else if (p.first == "format") handleFormat(c, p.second);
         else if (p.first == "reopenafter") handleReopenAfter(c, p.second);
         else if (p.first == "separator") handleSeparator(c, p.second);
         else if (p.first == "addconversions") handleConversions(c, p.second);
         else if (p.first == "shell") handleShell(c, p.second);
+        else if (p.first == "publish") handlePublish(c, p.second);
+        else if (p.first == "spool") handleSpool(c, p.second);
+        else if (p.first == "spoolmax") handleSpoolmax(c, p.second);
+        else if (p.first == "forward") handleForward(c, p.second);
+        else if (p.first == "forwardmax") handleForwardmax(c, p.second);
+        else if (p.first == "stats") handleStats(c, p.second);
+        else if (p.first == "statsfile") handleStatsfile(c, p.second);
+        else if (p.first == "statsinterval") handleStatsinterval(c, p.second);
+        else if (p.first == "dedup") handleDedup(c, p.second);
+        else if (p.first == "dedupmax") handleDedupmax(c, p.second);
+        else if (p.first == "trace") handleTrace(c, p.second);
+        else if (p.first == "tracesample") handleTracesample(c, p.second);
+        else if (p.first == "traceids") handleTraceids(c, p.second);
+        else if (p.first == "metrics") handleMetrics(c, p.second);
         else if (startsWith(p.first, "json_"))
         {
             string s = p.first.substr(5);
@@ -413,7 +611,11 @@ unique_ptr<Configuration> loadConfiguration(string root, string device_override,
         parseMeterConfig(c, meter_conf, file);
     }
 
-    if (device_override != "")
+    if (device_overrides.size() > 0)
+    {
+        c->devices.clear();
+    }
+    for (string &device_override : device_overrides)
     {
         if (startsWith(device_override, "/dev/rtlsdr"))
         {
@@ -431,8 +633,22 @@ unique_ptr<Configuration> loadConfiguration(string root, string device_override,
     return unique_ptr<Configuration>(c);
 }
 
-LinkModeCalculationResult calculateLinkModes(Configuration *config, WMBus *wmbus, bool link_modes_matter)
+static LinkModeSet metersLinkModes(Configuration *config)
+{
+    LinkModeSet meters_union = UNKNOWN_bit;
+    for (auto &m : config->meters)
+    {
+        meters_union.unionLinkModeSet(m.link_modes);
+    }
+    return meters_union;
+}
+
+LinkModeCalculationResult calculateLinkModes(Configuration *config, WMBus *wmbus, bool link_modes_matter,
+                                             SpecifiedDevice *device, bool only_receiver)
 {
+    SpecifiedDevice single;
+    if (device == NULL) device = &single;
+
     int n = wmbus->numConcurrentLinkModes();
     string num = to_string(n);
     if (n == 0) num = "any combination";
@@ -440,40 +656,50 @@ LinkModeCalculationResult calculateLinkModes(Configuration *config, WMBus *wmbus
     string dongle;
     strprintf(dongle, "%s of %s", num.c_str(), dongles.c_str());
 
+    // The link modes of the device win over --listento.
+    LinkModeSet listen_to = config->listen_to_link_modes;
+    bool configured = config->link_mode_configured;
+    if (device->link_modes_configured)
+    {
+        listen_to = device->link_modes;
+        configured = true;
+    }
+
     // Calculate the possible listen_to linkmodes for this collection of meters.
-    LinkModeSet meters_union = UNKNOWN_bit;
     for (auto &m : config->meters)
     {
-        meters_union.unionLinkModeSet(m.link_modes);
         string meter = m.link_modes.hr();
         debug("(config) meter %s link mode(s): %s\n", m.type.c_str(), meter.c_str());
     }
+    LinkModeSet meters_union = metersLinkModes(config);
     string metersu = meters_union.hr();
     debug("(config) all possible link modes that the meters might transmit on: %s\n", metersu.c_str());
     if (meters_union.bits() == 0)
     {
-        if (link_modes_matter && !config->link_mode_configured)
+        if (link_modes_matter && !configured)
         {
             string msg;
             strprintf(msg,"(config) No meters supplied. You must supply which link modes to listen to. Eg. --listento=<modes>");
             debug("%s\n", msg.c_str());
             return { LinkModeCalculationResultType::NoMetersMustSupplyModes , msg};
         }
+        device->listen_to = listen_to;
         return { LinkModeCalculationResultType::Success, "" };
     }
-    if (!config->link_mode_configured)
+    if (!configured)
     {
         // A listen_to link mode has not been set explicitly. Pick a listen_to link
         // mode that is supported by the wmbus dongle and works for the meters.
-        config->listen_to_link_modes = wmbus->supportedLinkModes();
-        config->listen_to_link_modes.disjunctionLinkModeSet(meters_union);
-        if (!wmbus->canSetLinkModes(config->listen_to_link_modes))
+        listen_to = wmbus->supportedLinkModes();
+        listen_to.disjunctionLinkModeSet(meters_union);
+        if (!wmbus->canSetLinkModes(listen_to))
         {
             // The automatically calculated link modes cannot be set in the dongle.
             // Ie the dongle needs help....
             string msg;
             strprintf(msg,"(config) Automatic deduction of which link mode to listen to failed since the meters might transmit using: %s\n"
                       "(config) But the dongle can only listen to: %s Please supply the exact link mode(s) to listen to, eg: --listento=<mode>\n"
+                      "(config) or for this device only, eg: /dev/ttyUSB0:im871a:<mode>\n"
                       "(config) and/or specify the expected transmit modes for the meters, eg: apator162:t1\n"
                       "(config) or use a dongle that can listen to all the required link modes at the same time.",
                       metersu.c_str(), dongle.c_str());
@@ -481,16 +707,15 @@ LinkModeCalculationResult calculateLinkModes(Configuration *config, WMBus *wmbus
             debug("%s\n", msg.c_str());
             return { LinkModeCalculationResultType::AutomaticDeductionFailed , msg};
         }
-        config->link_mode_configured = true;
     }
     else
     {
-        string listen = config->listen_to_link_modes.hr();
+        string listen = listen_to.hr();
         debug("(config) explicitly listening to: %s\n", listen.c_str());
     }
 
-    string listen = config->listen_to_link_modes.hr();
-    if (!wmbus->canSetLinkModes(config->listen_to_link_modes))
+    string listen = listen_to.hr();
+    if (!wmbus->canSetLinkModes(listen_to))
     {
         string msg;
         strprintf(msg, "(config) You have specified to listen to the link modes: %s but the dongle can only listen to: %s",
@@ -498,8 +723,9 @@ LinkModeCalculationResult calculateLinkModes(Configuration *config, WMBus *wmbus
         debug("%s\n", msg.c_str());
         return { LinkModeCalculationResultType::DongleCannotListenTo , msg};
     }
+    device->listen_to = listen_to;
 
-    if (!config->listen_to_link_modes.hasAll(meters_union))
+    if (only_receiver && !listen_to.hasAll(meters_union))
     {
         string msg;
         strprintf(msg, "(config) You have specified to listen to the link modes: %s but the meters might transmit on: %s\n"
@@ -514,3 +740,23 @@ LinkModeCalculationResult calculateLinkModes(Configuration *config, WMBus *wmbus
 
     return { LinkModeCalculationResultType::Success, "" };
 }
+
+LinkModeCalculationResult checkLinkModesCoverage(Configuration *config)
+{
+    LinkModeSet meters_union = metersLinkModes(config);
+    LinkModeSet receivers_union;
+    for (SpecifiedDevice &d : config->devices) receivers_union.unionLinkModeSet(d.listen_to);
+    if (meters_union.bits() == 0 || receivers_union.hasAll(meters_union))
+    {
+        return { LinkModeCalculationResultType::Success, "" };
+    }
+    string listen = receivers_union.hr();
+    string metersu = meters_union.hr();
+    string msg;
+    strprintf(msg, "(config) The receivers together listen to the link modes: %s but the meters might transmit on: %s\n"
+              "(config) Therefore you might miss telegrams! Please specify the link modes per device, eg: /dev/ttyUSB0:im871a:c1\n"
+              "(config) or the expected transmit mode for the meters, eg: apator162:t1",
+              listen.c_str(), metersu.c_str());
+    debug("%s\n", msg.c_str());
+    return { LinkModeCalculationResultType::MightMissTelegrams, msg};
+}
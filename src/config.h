@@ -36,6 +36,16 @@ enum class MeterFileNaming
     Name, Id, NameId
 };
 
+// A receiver as given to device=, eg /dev/ttyUSB0:im871a or rtlwmbus:868.9M
+struct SpecifiedDevice
+{
+    string file; // auto, /dev/ttyUSB0, simulation.txt, rtlwmbus
+    string extra; // The frequency or the command line that will start rtlwmbus
+    LinkModeSet link_modes; // Given for this device, eg /dev/ttyUSB0:im871a:c1
+    bool link_modes_configured {};
+    LinkModeSet listen_to; // Calculated by calculateLinkModes.
+};
+
 enum class MeterFileTimestamp
 {
     Never, Day, Hour, Minute, Micros
@@ -45,7 +55,7 @@ struct Configuration
 {
     bool daemon {};
     std::string pid_file;
-    std::string device_override;
+    std::vector<std::string> device_overrides; // Replaces the devices in the config files.
     std::string listento_override;
     bool useconfig {};
     std::string config_root;
@@ -65,16 +75,34 @@ struct Configuration
     bool use_logfile {};
     bool use_stderr {};
     std::string logfile;
+    size_t logrotate_size {}; // Rotate the log file when it is this big, zero means never.
+    int logrotate_seconds {}; // Rotate the log file when it is this old, zero means never.
+    int logkeep { 1 }; // Number of rotated log files to keep.
     bool json {};
     bool fields {};
+    bool cbor {}; // Compact binary output, see cbor.h
     char separator { ';' };
     std::vector<std::string> shells;
+    std::vector<std::string> publish; // unix:/path/to/socket or tcp:port
+    std::string spool; // Directory where readings wait until delivered to shells and files.
+    size_t spool_max { 64*1024*1024 }; // Bytes of readings kept in the spool.
+    std::string forward; // host:port, ship the frames undecoded to a wmbusmeters there.
+    size_t forward_max { 16*1024*1024 }; // Bytes of frames buffered in the spool while the collector is away.
     bool list_shell_envs {};
     bool oneshot {};
+    bool stats {}; // Print the pipeline stage latencies at exit and on kill -USR1.
+    std::string statsfile; // Rewrite this file with the telegram counters as json.
+    int statsinterval { 60 }; // Seconds between rewrites of the statsfile.
+    std::string trace; // Write Chrome trace events for the selected telegrams to this file.
+    double tracesample { -1 }; // Percent of the telegrams to trace, -1 means 1% unless traceids are given.
+    std::vector<std::string> traceids; // Always trace the telegrams from these ids.
+    int dedup {}; // Drop the copies of a frame received within this many seconds, zero means off.
+    int dedupmax { 100000 }; // Remember at most this many frames for the dedup.
+    int metrics_port {}; // Serve http://localhost:port/metrics for Prometheus, zero means off.
     int  exitafter {}; // Seconds to exit.
     int  reopenafter {}; // Re-open the serial device repeatedly. Silly dongle.
-    string device; // auto, /dev/ttyUSB0, simulation.txt, rtlwmbus
-    string device_extra; // The frequency or the command line that will start rtlwmbus
+    // All receivers feed the same meters. Each device= line in the config adds one.
+    std::vector<SpecifiedDevice> devices;
     string telegram_reader;
     // A set of all link modes (union) that the user requests the wmbus dongle to listen to.
     LinkModeSet listen_to_link_modes;
@@ -87,9 +115,10 @@ struct Configuration
     ~Configuration() = default;
 };
 
-unique_ptr<Configuration> loadConfiguration(string root, string device_override, string listento_override);
+unique_ptr<Configuration> loadConfiguration(string root, vector<string> device_overrides, string listento_override);
 
 void handleConversions(Configuration *c, string s);
+void handleDevice(Configuration *c, string device);
 
 enum class LinkModeCalculationResultType
 {
@@ -106,6 +135,11 @@ struct LinkModeCalculationResult
     std::string msg;
 };
 
-LinkModeCalculationResult calculateLinkModes(Configuration *c, WMBus *wmbus, bool link_modes_matter = true);
+// Calculates the link modes that the receiver for device listens to, into device->listen_to.
+// With several receivers, each of them need only hear some of the meters, then
+// checkLinkModesCoverage checks that the receivers together hear all of them.
+LinkModeCalculationResult calculateLinkModes(Configuration *c, WMBus *wmbus, bool link_modes_matter = true,
+                                             SpecifiedDevice *device = NULL, bool only_receiver = true);
+LinkModeCalculationResult checkLinkModesCoverage(Configuration *c);
 
 #endif
@@ -0,0 +1,142 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"dedup.h"
+#include"stats.h"
+
+#include<deque>
+#include<pthread.h>
+#include<stdint.h>
+#include<unordered_map>
+
+bool dedup_enabled_ = false;
+
+struct DedupKey
+{
+    uint64_t address; // The manufacturer, id and access number.
+    uint64_t hash; // The payload after the dll.
+
+    bool operator==(const DedupKey &k) const { return address == k.address && hash == k.hash; }
+};
+
+struct DedupKeyHash
+{
+    size_t operator()(const DedupKey &k) const { return k.address*0x9e3779b97f4a7c15ull ^ k.hash; }
+};
+
+struct DedupSeen
+{
+    time_t first; // When the first copy arrived, the window starts here.
+    int rssi_dbm; // The strongest copy so far.
+};
+
+static pthread_mutex_t dedup_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static int window_ {};
+static size_t max_entries_ {};
+// When each frame was first seen, and the same frames oldest first to expire them.
+static unordered_map<DedupKey,DedupSeen,DedupKeyHash> seen_;
+static deque<pair<time_t,DedupKey>> order_;
+static MemoryTracker memory_ { Memory::dedup_cache };
+
+void dedupEnabled(int window_seconds, size_t max_entries)
+{
+    pthread_mutex_lock(&dedup_lock_);
+    window_ = window_seconds;
+    max_entries_ = max_entries;
+    seen_.clear();
+    order_.clear();
+    memory_.update(0);
+    dedup_enabled_ = window_seconds > 0;
+    pthread_mutex_unlock(&dedup_lock_);
+}
+
+// The frame starts with the dll: L C M M A A A A A A CI.
+static bool dedupKey(vector<unsigned char> &frame, DedupKey *key)
+{
+    if (frame.size() < 12) return false;
+    int ci = frame[10];
+    size_t skip = 0; // The ell cc field changes when a repeater relays the frame.
+    int acc = 0;
+    if (ci == 0x8c || ci == 0x8d)
+    {
+        skip = 11;
+        acc = frame[12];
+    }
+    else if (ci == 0x7a)
+    {
+        acc = frame[11];
+    }
+    else if (ci == 0x72 && frame.size() > 19)
+    {
+        acc = frame[19];
+    }
+    key->address = (uint64_t)frame[2] | (uint64_t)frame[3] << 8 | (uint64_t)frame[4] << 16 | (uint64_t)frame[5] << 24
+        | (uint64_t)frame[6] << 32 | (uint64_t)frame[7] << 40 | (uint64_t)acc << 48;
+
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 10; i < frame.size(); ++i)
+    {
+        if (i == skip) continue;
+        h = (h ^ frame[i]) * 0x100000001b3ull;
+    }
+    key->hash = h;
+    return true;
+}
+
+static bool stronger(int rssi_dbm, int than)
+{
+    return rssi_dbm != 0 && (than == 0 || rssi_dbm > than);
+}
+
+bool isDuplicate(vector<unsigned char> &frame, time_t now, int rssi_dbm)
+{
+    DedupKey key;
+    if (!dedupKey(frame, &key)) return false;
+
+    bool duplicate = false;
+    pthread_mutex_lock(&dedup_lock_);
+    while (order_.size() > 0 && (now-order_.front().first >= window_ || order_.size() >= max_entries_))
+    {
+        seen_.erase(order_.front().second);
+        order_.pop_front();
+    }
+    auto i = seen_.find(key);
+    if (i != seen_.end())
+    {
+        duplicate = !stronger(rssi_dbm, i->second.rssi_dbm);
+        if (!duplicate) i->second.rssi_dbm = rssi_dbm;
+    }
+    else
+    {
+        seen_[key] = { now, rssi_dbm };
+        order_.push_back({ now, key });
+    }
+    memory_.update(seen_.size()*(sizeof(pair<DedupKey,DedupSeen>)+MAP_NODE_OVERHEAD)
+                   + seen_.bucket_count()*sizeof(void*)
+                   + order_.size()*sizeof(pair<time_t,DedupKey>));
+    pthread_mutex_unlock(&dedup_lock_);
+    return duplicate;
+}
+
+size_t dedupEntries()
+{
+    pthread_mutex_lock(&dedup_lock_);
+    size_t n = seen_.size();
+    pthread_mutex_unlock(&dedup_lock_);
+    return n;
+}
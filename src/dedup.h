@@ -0,0 +1,45 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEDUP_H_
+#define DEDUP_H_
+
+#include<stddef.h>
+#include<time.h>
+#include<vector>
+
+using namespace std;
+
+// A meter heard by several receivers, relayed by a repeater or sending the
+// same frame twice, arrives more than once. The copies of a frame that arrive
+// within the window are dropped before the meters decrypt and decode them.
+// The frames are matched on id, manufacturer, access number and a hash of the
+// payload, the hop count and relayed bits of the ell cc field are ignored.
+// A copy heard with a stronger signal than the best copy so far is not dropped,
+// then the latest reading tells which receiver hears the meter best.
+extern bool dedup_enabled_;
+
+// Zero seconds turns the deduplication off. The oldest frames are forgotten
+// early when more than max_entries frames are remembered.
+void dedupEnabled(int window_seconds, size_t max_entries);
+// True if the same frame was received less than window seconds before now,
+// with at least the same rssi. Zero rssi means not reported and is the weakest.
+bool isDuplicate(vector<unsigned char> &frame, time_t now, int rssi_dbm);
+// The number of remembered frames.
+size_t dedupEntries();
+
+#endif
@@ -0,0 +1,328 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"demod.h"
+#include"stats.h"
+
+#include<math.h>
+
+using namespace std;
+
+// The preamble 01010101 followed by the sync word 0000111101, as 18 chips.
+#define SYNC_CHIPS 0x1543d
+#define SYNC_MASK 0x3ffff
+// A c1 frame continues with 0x54 and then 0xcd for frame format a or 0x3d for format b.
+#define C1_FORMAT_A 0x54cd
+#define C1_FORMAT_B 0x543d
+
+// The t1 bytes are sent as two 6 chip codes, with three ones each, high nibble first.
+static const uchar code_3of6_[16] = {
+    0x16, 0x0d, 0x0e, 0x0b, 0x1c, 0x19, 0x1a, 0x13,
+    0x2c, 0x25, 0x26, 0x23, 0x34, 0x31, 0x32, 0x29
+};
+
+static int decode_3of6_[64];
+
+static bool buildDecodeTable()
+{
+    for (int i = 0; i < 64; ++i) decode_3of6_[i] = -1;
+    for (int i = 0; i < 16; ++i) decode_3of6_[code_3of6_[i]] = i;
+    return true;
+}
+
+static bool decode_table_built_ = buildDecodeTable();
+
+Demodulator::Demodulator(int sample_rate, FateCounters *fates, function<void(LinkMode,vector<uchar>&)> on_frame)
+    : fates_(fates), on_frame_(on_frame)
+{
+    samples_per_chip_ = sample_rate/DEMOD_CHIP_RATE;
+    ring_.resize(samples_per_chip_);
+    countdown_ = samples_per_chip_;
+    hunt();
+}
+
+void Demodulator::process(const uchar *iq, size_t len)
+{
+    if (pending_ >= 0 && len > 0)
+    {
+        uchar pair[2] = { (uchar)pending_, iq[0] };
+        pending_ = -1;
+        process(pair, 2);
+        iq++;
+        len--;
+    }
+    while (len >= 2)
+    {
+        size_t n = len/2;
+        if (n > DEMOD_BLOCK) n = DEMOD_BLOCK;
+        discriminate(iq, n);
+        for (size_t k = 0; k < n; ++k) sample(d_[k]);
+        iq += 2*n;
+        len -= 2*n;
+    }
+    if (len == 1) pending_ = iq[0];
+}
+
+// The fm discriminator, the imaginary part of the sample times the conjugate of the
+// previous sample, positive when the phase turns counter clockwise, ie above the carrier.
+// No branches and no dependencies between the iterations, so the compiler vectorizes it.
+void Demodulator::discriminate(const uchar *iq, size_t n)
+{
+    int16_t i[DEMOD_BLOCK+1], q[DEMOD_BLOCK+1];
+    i[0] = prev_i_;
+    q[0] = prev_q_;
+    for (size_t k = 0; k < n; ++k)
+    {
+        i[k+1] = iq[2*k]-128;
+        q[k+1] = iq[2*k+1]-128;
+    }
+    for (size_t k = 0; k < n; ++k)
+    {
+        d_[k] = q[k+1]*i[k] - i[k+1]*q[k];
+    }
+    prev_i_ = i[n];
+    prev_q_ = q[n];
+}
+
+void Demodulator::sample(int d)
+{
+    // The matched filter for a chip of constant frequency.
+    sum_ += d - ring_[ring_pos_];
+    ring_[ring_pos_] = d;
+    if (++ring_pos_ == samples_per_chip_) ring_pos_ = 0;
+
+    // The balanced preamble lets the mean follow the offset of the dongle crystal.
+    if (!in_frame_) level_ += (sum_-level_)*(1.0f/256);
+
+    bool c = sum_ > level_;
+    if (c != last_chip_)
+    {
+        // The filter crosses the mean half a chip after the chip boundary,
+        // then the next chip is best sampled half a chip later.
+        last_chip_ = c;
+        countdown_ = samples_per_chip_/2;
+        return;
+    }
+    if (--countdown_ > 0) return;
+    countdown_ = samples_per_chip_;
+    chip(c);
+}
+
+void Demodulator::hunt()
+{
+    in_frame_ = false;
+    shift_ = 0;
+    mode_ = LinkMode::UNKNOWN;
+    format_b_ = false;
+    header_chips_ = 0;
+    num_chips_ = 0;
+    expected_chips_ = 16;
+    expected_bytes_ = 0;
+}
+
+bool Demodulator::decodeByte(size_t i, int *b)
+{
+    if (mode_ == LinkMode::C1)
+    {
+        int v = 0;
+        for (size_t k = 0; k < 8; ++k) v = v << 1 | chips_[header_chips_+i*8+k];
+        *b = v;
+        return true;
+    }
+    int hi = 0, lo = 0;
+    for (size_t k = 0; k < 6; ++k) hi = hi << 1 | chips_[i*12+k];
+    for (size_t k = 6; k < 12; ++k) lo = lo << 1 | chips_[i*12+k];
+    if (decode_3of6_[hi] < 0 || decode_3of6_[lo] < 0) return false;
+    *b = decode_3of6_[hi] << 4 | decode_3of6_[lo];
+    return true;
+}
+
+void Demodulator::chip(int c)
+{
+    if (!in_frame_)
+    {
+        shift_ = ((shift_ << 1) | c) & SYNC_MASK;
+        if (shift_ == SYNC_CHIPS || shift_ == (~SYNC_CHIPS & SYNC_MASK))
+        {
+            // The polarity depends on the dongle, the preamble tells.
+            inverted_ = shift_ != SYNC_CHIPS;
+            in_frame_ = true;
+        }
+        return;
+    }
+    chips_[num_chips_++] = c ^ inverted_;
+    if (num_chips_ < expected_chips_) return;
+
+    if (mode_ == LinkMode::UNKNOWN)
+    {
+        int marker = 0;
+        for (size_t k = 0; k < 16; ++k) marker = marker << 1 | chips_[k];
+        if (marker == C1_FORMAT_A || marker == C1_FORMAT_B)
+        {
+            mode_ = LinkMode::C1;
+            format_b_ = marker == C1_FORMAT_B;
+            header_chips_ = 16;
+            expected_chips_ = 16+8;
+            return;
+        }
+        // Not a valid 3 out of 6 code, so this is the start of a t1 frame.
+        mode_ = LinkMode::T1;
+    }
+    int chips_per_byte = mode_ == LinkMode::C1 ? 8 : 12;
+    if (expected_bytes_ == 0)
+    {
+        int l;
+        if (!decodeByte(0, &l) || l < 11)
+        {
+            countFate(Fate::framing_error, fates_);
+            hunt();
+            return;
+        }
+        if (format_b_)
+        {
+            // The l field counts the crcs as well.
+            expected_bytes_ = l+1;
+        }
+        else
+        {
+            // A first block of 10 bytes and then blocks of 16 bytes, each with a crc.
+            expected_bytes_ = l+1 + 2*(1+(l+1-10+15)/16);
+        }
+        expected_chips_ = header_chips_ + expected_bytes_*chips_per_byte;
+        if (num_chips_ < expected_chips_) return;
+    }
+    frameDone();
+}
+
+void Demodulator::frameDone()
+{
+    vector<uchar> frame;
+    frame.reserve(expected_bytes_);
+    for (size_t i = 0; i < expected_bytes_; ++i)
+    {
+        int b;
+        if (!decodeByte(i, &b))
+        {
+            debug("(demod) bad 3 out of 6 code in t1 frame at byte %zu\n", i);
+            countFate(Fate::framing_error, fates_);
+            hunt();
+            return;
+        }
+        frame.push_back(b);
+    }
+    LinkMode mode = mode_;
+    bool ok = format_b_ ? trimCRCsFrameFormatB(frame) : trimCRCsFrameFormatA(frame);
+    hunt();
+    if (!ok)
+    {
+        debug("(demod) %s frame with bad crcs\n", mode == LinkMode::C1 ? "c1" : "t1");
+        return;
+    }
+    debug("(demod) received %s frame\n", mode == LinkMode::C1 ? "c1" : "t1");
+    on_frame_(mode, frame);
+}
+
+static uint32_t nextRandom(uint32_t *state)
+{
+    // xorshift32
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Roughly normal, the sum of four uniform numbers, with unit variance.
+static double gaussian(uint32_t *state)
+{
+    double s = 0;
+    for (int i = 0; i < 4; ++i) s += nextRandom(state)/4294967296.0;
+    return (s-2.0)*sqrt(3.0);
+}
+
+vector<uchar> modulateIQ(LinkMode mode, vector<uchar> &frame, bool format_b, int sample_rate,
+                         double offset_hz, double noise, uint32_t seed)
+{
+    vector<uchar> bytes;
+    if (format_b)
+    {
+        // Only a single block, the l field then counts the final crc.
+        bytes = frame;
+        bytes[0] = frame.size()+1;
+        uint16_t crc = crc16_EN13757(&bytes[0], bytes.size());
+        bytes.push_back(crc >> 8);
+        bytes.push_back(crc & 0xff);
+    }
+    else
+    {
+        size_t pos = 0;
+        while (pos < frame.size())
+        {
+            size_t len = pos == 0 ? 10 : 16;
+            if (pos+len > frame.size()) len = frame.size()-pos;
+            uint16_t crc = crc16_EN13757(&frame[pos], len);
+            bytes.insert(bytes.end(), frame.begin()+pos, frame.begin()+pos+len);
+            bytes.push_back(crc >> 8);
+            bytes.push_back(crc & 0xff);
+            pos += len;
+        }
+    }
+
+    vector<int> chips;
+    auto add = [&](uint32_t bits, int n) { for (int b = n-1; b >= 0; --b) chips.push_back(bits >> b & 1); };
+    int preamble = mode == LinkMode::C1 ? 16 : 19;
+    for (int i = 0; i < preamble; ++i) add(1, 2);
+    add(0x3d, 10);
+    if (mode == LinkMode::C1)
+    {
+        add(format_b ? C1_FORMAT_B : C1_FORMAT_A, 16);
+        for (uchar b : bytes) add(b, 8);
+    }
+    else
+    {
+        for (uchar b : bytes)
+        {
+            add(code_3of6_[b >> 4], 6);
+            add(code_3of6_[b & 15], 6);
+        }
+    }
+    add(0x5, 4); // Postamble.
+
+    int spc = sample_rate/DEMOD_CHIP_RATE;
+    double deviation = mode == LinkMode::C1 ? 45000 : 50000;
+    double amplitude = 100;
+    double phase = 0;
+    uint32_t state = seed ? seed : 1;
+    vector<uchar> iq;
+    auto emit = [&](double freq, double a)
+    {
+        phase += 2*M_PI*freq/sample_rate;
+        double i = 127.5 + a*cos(phase) + noise*gaussian(&state);
+        double q = 127.5 + a*sin(phase) + noise*gaussian(&state);
+        iq.push_back(i < 0 ? 0 : i > 255 ? 255 : (uchar)i);
+        iq.push_back(q < 0 ? 0 : q > 255 ? 255 : (uchar)q);
+    };
+    int silence = 2000;
+    for (int i = 0; i < silence; ++i) emit(offset_hz, 0);
+    for (int c : chips)
+    {
+        for (int k = 0; k < spc; ++k) emit(offset_hz + (c ? deviation : -deviation), amplitude);
+    }
+    for (int i = 0; i < silence; ++i) emit(offset_hz, 0);
+    return iq;
+}
@@ -0,0 +1,94 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEMOD_H_
+#define DEMOD_H_
+
+#include"util.h"
+#include"wmbus.h"
+
+#include<functional>
+#include<stdint.h>
+#include<vector>
+
+struct FateCounters;
+
+// The samples per second that rtl_sdr is told to deliver, 16 samples per chip.
+#define DEMOD_SAMPLE_RATE 1600000
+// Both T1 and C1 (meter to other) send 100 kchips per second.
+#define DEMOD_CHIP_RATE 100000
+// The samples are demodulated in blocks of this size, small enough for the stack.
+#define DEMOD_BLOCK 4096
+// The longest frame, L=255 in frame format A with its 17 crcs.
+#define DEMOD_MAX_FRAME_BYTES 290
+
+// Demodulates the T1 and C1 frames in the unsigned 8 bit IQ samples from rtl_sdr.
+// The samples pass an fm discriminator and a matched filter, the chips are
+// sampled mid chip, timed from the latest transition, and then the preamble,
+// the sync word and the 3 out of 6 or nrz coded bytes are found in one pass.
+// Only frames that pass the dll crc checks are delivered, without the crcs.
+struct Demodulator
+{
+    Demodulator(int sample_rate, FateCounters *fates, std::function<void(LinkMode,vector<uchar>&)> on_frame);
+
+    // Feed interleaved I and Q bytes, any amount, also an odd number of bytes.
+    void process(const uchar *iq, size_t len);
+
+private:
+
+    void discriminate(const uchar *iq, size_t n);
+    void sample(int d);
+    void chip(int c);
+    bool decodeByte(size_t i, int *b);
+    void frameDone();
+    void hunt();
+
+    FateCounters *fates_ {};
+    std::function<void(LinkMode,vector<uchar>&)> on_frame_;
+
+    int samples_per_chip_ {};
+    int d_[DEMOD_BLOCK]; // The discriminator output for the current block.
+    int16_t prev_i_ {}, prev_q_ {};
+    int pending_ {-1}; // An I byte waiting for its Q byte.
+
+    // The matched filter, a moving sum over one chip.
+    std::vector<int> ring_;
+    int ring_pos_ {};
+    int sum_ {};
+    float level_ {}; // The mean of the filter, the carrier offset, frozen during a frame.
+    bool last_chip_ {};
+    int countdown_ {}; // Samples until the middle of the next chip.
+
+    bool in_frame_ {};
+    bool inverted_ {}; // The sync word was found with the chips inverted.
+    uint32_t shift_ {}; // The latest chips while hunting for the sync word.
+    LinkMode mode_ {};
+    bool format_b_ {};
+    int header_chips_ {}; // The c1 marker after the sync word, or zero for t1.
+    uchar chips_[DEMOD_MAX_FRAME_BYTES*12];
+    size_t num_chips_ {};
+    size_t expected_chips_ {};
+    size_t expected_bytes_ {}; // Known when the l field has been received.
+};
+
+// The IQ samples of a frame as a meter would send it, with preamble and sync, and with
+// noise before and after. For tests and benchmarks. The frame has no crcs, they are added
+// in format A, or in format B for a c1 frame when format_b is set.
+vector<uchar> modulateIQ(LinkMode mode, vector<uchar> &frame, bool format_b, int sample_rate,
+                         double offset_hz, double noise, uint32_t seed);
+
+#endif
@@ -16,6 +16,7 @@
 */
 
 #include"dvparser.h"
+#include"stats.h"
 #include"util.h"
 
 #include<assert.h>
@@ -289,6 +290,8 @@ bool parseDV(Telegram *t,
     if (data_has_difvifs) {
         if (hash_to_format_.count(hash) == 0) {
             hash_to_format_[hash] = format_string;
+            // The map is bounded by the 16 bit hash, but each entry stays forever.
+            addMemory(Memory::format_cache, sizeof(pair<uint16_t,string>)+MAP_NODE_OVERHEAD+format_string.capacity());
             debug("(dvparser) found new format \"%s\" with hash %x, remembering!\n", format_string.c_str(), hash);
         }
     }
@@ -0,0 +1,272 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"forward.h"
+#include"spool.h"
+
+#include<errno.h>
+#include<fcntl.h>
+#include<netdb.h>
+#include<poll.h>
+#include<string.h>
+#include<sys/ioctl.h>
+#include<sys/socket.h>
+#include<sys/time.h>
+#include<sys/uio.h>
+#include<time.h>
+#include<unistd.h>
+
+#if defined(__linux__)
+#include<linux/sockios.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct ForwarderImp : public Forwarder
+{
+    ForwarderImp(string host, string port);
+    ~ForwarderImp();
+
+    void start(string buf, size_t max_bytes);
+    void forward(AboutTelegram &about, vector<uchar> &frame);
+    uint64_t pending() { return spool_->pending(); }
+
+private:
+
+    bool connectCollector();
+    bool send(vector<SpoolRecord> &records);
+    bool waitAcked();
+    void lostConnection(const char *why);
+
+    string host_;
+    string port_;
+    unique_ptr<Spool> spool_;
+    // Only used from the delivery thread of the spool.
+    int fd_ {-1};
+    bool lost_ {}; // Warn once per outage.
+    bool full_ {}; // Likewise when the spool is full.
+};
+
+ForwarderImp::ForwarderImp(string host, string port)
+{
+    host_ = host;
+    port_ = port;
+}
+
+ForwarderImp::~ForwarderImp()
+{
+    // Stop the delivery thread before the connection is closed.
+    spool_.reset();
+    if (fd_ != -1) close(fd_);
+}
+
+void ForwarderImp::start(string buf, size_t max_bytes)
+{
+    spool_ = createSpool(buf, SPOOL_SEGMENT_SIZE, max_bytes);
+    // A failure means the collector cannot be reached, keep the frames until it can.
+    spool_->addBatchSink("forward", FORWARD_BATCH, 0, [this](vector<SpoolRecord> &records) { return send(records); });
+}
+
+string forwardLine(AboutTelegram &about, vector<uchar> &frame)
+{
+    // Unknown link modes are sent as ANY.
+    LinkMode lm = about.link_mode == LinkMode::UNKNOWN ? LinkMode::Any : about.link_mode;
+    string mode = toLowerCaseString(lm);
+    for (char &c : mode) c = toupper(c);
+
+    char ts[32];
+    struct tm tm;
+    time_t t = about.timestamp ? about.timestamp : time(NULL);
+    gmtime_r(&t, &tm);
+    strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+    string id = "00000000";
+    if (frame.size() >= 8) strprintf(id, "%02x%02x%02x%02x", frame[7], frame[6], frame[5], frame[4]);
+
+    string line;
+    strprintf(line, "%s;1;1;%s;%d;0;%s;0x", mode.c_str(), ts, about.rssi_dbm, id.c_str());
+    line += bin2hex(frame);
+    line += "\n";
+    return line;
+}
+
+void ForwarderImp::forward(AboutTelegram &about, vector<uchar> &frame)
+{
+    string line = forwardLine(about, frame);
+    if (!spool_->append((const uchar*)line.c_str(), line.length()))
+    {
+        if (!full_) warning("(forward) the buffer is full, dropping frames until the collector can be reached.\n");
+        full_ = true;
+        return;
+    }
+    full_ = false;
+}
+
+bool ForwarderImp::connectCollector()
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(host_.c_str(), port_.c_str(), &hints, &res);
+    if (rc != 0)
+    {
+        debug("(forward) could not resolve %s %s\n", host_.c_str(), gai_strerror(rc));
+        return false;
+    }
+    for (struct addrinfo *a = res; a != NULL && fd_ == -1; a = a->ai_next)
+    {
+        int fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd == -1) continue;
+        // Connect with a timeout, an unreachable host would otherwise block for minutes.
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        bool ok = connect(fd, a->ai_addr, a->ai_addrlen) == 0;
+        if (!ok && errno == EINPROGRESS)
+        {
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+            ok = poll(&pfd, 1, FORWARD_CONNECT_TIMEOUT_MS) == 1 &&
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 && err == 0;
+        }
+        if (!ok)
+        {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, 0);
+        struct timeval tv { FORWARD_SEND_TIMEOUT_S, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        fd_ = fd;
+    }
+    freeaddrinfo(res);
+    return fd_ != -1;
+}
+
+void ForwarderImp::lostConnection(const char *why)
+{
+    warning("(forward) lost the connection to %s:%s %s\n", host_.c_str(), port_.c_str(), why);
+    lost_ = true;
+    close(fd_);
+    fd_ = -1;
+}
+
+bool ForwarderImp::waitAcked()
+{
+#ifdef SIOCOUTQ
+    // The records leave the spool when the collector host has acked them,
+    // not merely when they are in our socket buffer.
+    // There is no notification for acks, so poll the send queue, quickly at first
+    // since a collector nearby acks within a millisecond, then backing off.
+    time_t until = time(NULL)+FORWARD_SEND_TIMEOUT_S;
+    int wait_ms = 1;
+    for (;;)
+    {
+        int unacked = 0;
+        if (ioctl(fd_, SIOCOUTQ, &unacked) != 0) return true; // Not supported, trust the send.
+        if (unacked == 0) return true;
+        if (time(NULL) > until)
+        {
+            lostConnection("no ack from the collector");
+            return false;
+        }
+        // The collector never sends anything, so the socket only becomes readable
+        // when the connection is closed, which wakes the wait up early.
+        struct pollfd pfd = { fd_, POLLIN, 0 };
+        if (poll(&pfd, 1, wait_ms) > 0)
+        {
+            char c;
+            ssize_t n = recv(fd_, &c, 1, MSG_DONTWAIT|MSG_PEEK);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                lostConnection("closed by the collector");
+                return false;
+            }
+        }
+        wait_ms = min(wait_ms*2, FORWARD_ACK_POLL_MAX_MS);
+    }
+#else
+    return true;
+#endif
+}
+
+bool ForwarderImp::send(vector<SpoolRecord> &records)
+{
+    if (fd_ == -1)
+    {
+        if (!connectCollector())
+        {
+            if (!lost_) warning("(forward) could not connect to %s:%s\n", host_.c_str(), port_.c_str());
+            lost_ = true;
+            return false;
+        }
+        if (lost_) notice("(forward) connected to %s:%s again\n", host_.c_str(), port_.c_str());
+        else verbose("(forward) connected to %s:%s\n", host_.c_str(), port_.c_str());
+        lost_ = false;
+    }
+    // Write the whole batch of lines at once.
+    struct iovec iov[FORWARD_BATCH];
+    size_t count = min(records.size(), (size_t)FORWARD_BATCH);
+    for (size_t i = 0; i < count; ++i)
+    {
+        iov[i].iov_base = (void*)records[i].data;
+        iov[i].iov_len = records[i].len;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    while (msg.msg_iovlen > 0)
+    {
+        ssize_t n = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            lostConnection(strerror(errno));
+            return false;
+        }
+        // Skip what was written, a partial write can end inside a line.
+        while (n > 0 && (size_t)n >= msg.msg_iov->iov_len)
+        {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (n > 0)
+        {
+            msg.msg_iov->iov_base = (uchar*)msg.msg_iov->iov_base+n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return waitAcked();
+}
+
+unique_ptr<Forwarder> createForwarder(string host_port, string buf, size_t max_bytes)
+{
+    size_t p = host_port.rfind(':');
+    string port = p == string::npos ? "" : host_port.substr(p+1);
+    if (p == 0 || port == "" || !isNumber(port))
+    {
+        error("Expected host:port to forward to, but got \"%s\"\n", host_port.c_str());
+    }
+    ForwarderImp *f = new ForwarderImp(host_port.substr(0, p), port);
+    unique_ptr<Forwarder> forwarder(f);
+    f->start(buf, max_bytes);
+    return forwarder;
+}
@@ -0,0 +1,63 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FORWARD_H_
+#define FORWARD_H_
+
+#include"util.h"
+#include"wmbus.h"
+
+#include<memory>
+#include<string>
+#include<vector>
+
+/**
+  A Forwarder ships the frames heard by the local receivers, without decoding
+  them, to a central wmbusmeters listening on tcp:<port>:rtlwmbus. Each frame
+  is sent as an rtlwmbus line, that also carries the time it was received,
+  the rssi and the link mode. The lines first go to a spool, which keeps them
+  on disk while the collector cannot be reached, and are then sent in order
+  over a single connection that is kept open, several lines per write.
+
+  The collector does not acknowledge the lines. A batch leaves the spool
+  when the tcp stack of the collector host has acked it, so delivery is not
+  guaranteed: lines acked by the host but not yet read by a collector that
+  crashes are lost. A batch is sent again when the connection was lost
+  before it was acked, use --dedup on the collector to drop such repeats.
+*/
+struct Forwarder
+{
+    virtual void forward(AboutTelegram &about, vector<uchar> &frame) = 0;
+    // Number of frames not yet sent.
+    virtual uint64_t pending() = 0;
+    virtual ~Forwarder() = default;
+};
+
+#define FORWARD_CONNECT_TIMEOUT_MS 5000
+#define FORWARD_SEND_TIMEOUT_S 10
+// Longest sleep between checks that the collector has acked a batch.
+#define FORWARD_ACK_POLL_MAX_MS 50
+// Max number of lines written at once.
+#define FORWARD_BATCH 64
+
+// The spool directory buf is created if necessary, it holds at most max_bytes.
+unique_ptr<Forwarder> createForwarder(string host_port, string buf, size_t max_bytes);
+
+// The rtlwmbus line for a frame, eg T1;1;1;2020-05-01T12:00:00Z;-75;0;12345678;0x2e44...
+string forwardLine(AboutTelegram &about, vector<uchar> &frame);
+
+#endif
@@ -0,0 +1,411 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"logwriter.h"
+#include"stats.h"
+
+#include<atomic>
+#include<errno.h>
+#include<fcntl.h>
+#include<pthread.h>
+#include<sched.h>
+#include<semaphore.h>
+#include<stdio.h>
+#include<string.h>
+#include<sys/stat.h>
+#include<time.h>
+#include<unistd.h>
+
+// A cell in the ring. The sequence tells the state of the cell, for position pos
+// the cell is free when sequence==pos, and filled when sequence==pos+1.
+// This is the bounded queue by Dmitry Vyukov, extended so that a producer
+// can claim several consecutive cells at once for a long text.
+struct Cell
+{
+    atomic<size_t> sequence;
+    uint16_t len;
+    bool more; // The text continues in the next cell.
+    char data[LOG_CELL_SIZE];
+};
+
+#define RING_MASK (LOG_RING_CELLS-1)
+#define MAX_CELLS_PER_WRITE (LOG_RING_CELLS/16)
+
+struct LogWriterImp : public LogWriter
+{
+    LogWriterImp(string path, size_t rotate_size, int rotate_seconds, int keep,
+                 function<void(const char *data, size_t len)> fallback);
+    ~LogWriterImp();
+
+    bool open();
+    bool write(const char *data, size_t len);
+    bool writeAndWait(const char *data, size_t len);
+    void reopen();
+    void flush();
+    string path() { return path_; }
+    uint64_t dropped() { return dropped_.load(); }
+    uint64_t generation() { return generation_.load(); }
+
+private:
+
+    static void *startLoop(void *);
+    void *writerLoop();
+    bool enqueue(const char *data, size_t len, size_t *end);
+    bool waitWritten(size_t pos);
+    bool drain(string *batch);
+    void writeBatch(string &batch);
+    void writeFallback(const char *data, size_t len);
+    void rotate();
+    void openFile();
+    void checkExternalRotation();
+
+    string path_;
+    size_t rotate_size_ {};
+    int rotate_seconds_ {};
+    int keep_ {};
+    function<void(const char *data, size_t len)> fallback_;
+
+    Cell *ring_ {};
+    MemoryTracker ring_memory_ { Memory::output_queues };
+    atomic<size_t> enqueue_pos_ {0};
+    size_t dequeue_pos_ {0}; // Only touched by the writer thread.
+    atomic<size_t> written_pos_ {0};
+    atomic<uint64_t> dropped_ {0};
+    atomic<uint64_t> failures_ {0}; // Batches that could not be written.
+    uint64_t reported_dropped_ {};
+    atomic<bool> reopen_ {false};
+    atomic<bool> running_ {false};
+    atomic<uint64_t> generation_ {0};
+
+    sem_t wakeup_;
+    pthread_t thread_ {};
+
+    int fd_ {-1};
+    size_t size_ {};
+    time_t opened_ {};
+    time_t last_check_ {};
+    bool failed_ {};
+};
+
+LogWriterImp::LogWriterImp(string path, size_t rotate_size, int rotate_seconds, int keep,
+                           function<void(const char *data, size_t len)> fallback)
+{
+    path_ = path;
+    fallback_ = fallback;
+    rotate_size_ = rotate_size;
+    rotate_seconds_ = rotate_seconds;
+    keep_ = keep < 1 ? 1 : keep;
+    ring_ = new Cell[LOG_RING_CELLS];
+    ring_memory_.update(LOG_RING_CELLS*sizeof(Cell));
+    for (size_t i = 0; i < LOG_RING_CELLS; ++i)
+    {
+        ring_[i].sequence.store(i, memory_order_relaxed);
+    }
+    sem_init(&wakeup_, 0, 0);
+}
+
+LogWriterImp::~LogWriterImp()
+{
+    if (running_)
+    {
+        running_ = false;
+        sem_post(&wakeup_);
+        pthread_join(thread_, NULL);
+    }
+    if (fd_ != -1) close(fd_);
+    sem_destroy(&wakeup_);
+    delete [] ring_;
+}
+
+void LogWriterImp::openFile()
+{
+    if (fd_ != -1) close(fd_);
+    fd_ = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    size_ = (fd_ != -1 && fstat(fd_, &st) == 0) ? st.st_size : 0;
+    opened_ = time(NULL);
+    generation_++;
+}
+
+void LogWriterImp::checkExternalRotation()
+{
+    time_t now = time(NULL);
+    if (now == last_check_) return;
+    last_check_ = now;
+
+    struct stat open_st, path_st;
+    if (fd_ == -1 || fstat(fd_, &open_st) != 0 || stat(path_.c_str(), &path_st) != 0)
+    {
+        // The file was moved away and nothing has been created at the path yet.
+        openFile();
+        return;
+    }
+    if (open_st.st_ino != path_st.st_ino || open_st.st_dev != path_st.st_dev)
+    {
+        // A new file was created at the path.
+        openFile();
+        return;
+    }
+    if ((size_t)path_st.st_size < size_)
+    {
+        // The file was truncated (copytruncate), we append at the new end.
+        size_ = path_st.st_size;
+    }
+}
+
+bool LogWriterImp::open()
+{
+    openFile();
+    if (fd_ == -1) return false;
+    running_ = true;
+    pthread_create(&thread_, NULL, startLoop, this);
+    return true;
+}
+
+bool LogWriterImp::write(const char *data, size_t len)
+{
+    size_t end;
+    if (!enqueue(data, len, &end))
+    {
+        dropped_++;
+        countDrop(Drop::log_ring_full);
+        return false;
+    }
+    return true;
+}
+
+bool LogWriterImp::writeAndWait(const char *data, size_t len)
+{
+    // A longer text would be cut, let the caller write it some other way.
+    if (len > MAX_CELLS_PER_WRITE*LOG_CELL_SIZE) return false;
+    uint64_t failures = failures_.load();
+    size_t end;
+    if (!enqueue(data, len, &end)) return false;
+    // A failure of any batch written meanwhile counts, at worst the text is written again.
+    return waitWritten(end) && failures_.load() == failures;
+}
+
+bool LogWriterImp::enqueue(const char *data, size_t len, size_t *end)
+{
+    *end = enqueue_pos_.load();
+    if (len == 0) return true;
+    size_t k = (len+LOG_CELL_SIZE-1)/LOG_CELL_SIZE;
+    if (k > MAX_CELLS_PER_WRITE)
+    {
+        k = MAX_CELLS_PER_WRITE;
+        len = k*LOG_CELL_SIZE;
+    }
+
+    size_t pos = enqueue_pos_.load(memory_order_relaxed);
+    for (;;)
+    {
+        bool claimable = true;
+        for (size_t i = 0; i < k; ++i)
+        {
+            size_t seq = ring_[(pos+i) & RING_MASK].sequence.load(memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos+i);
+            if (dif < 0)
+            {
+                // The writer thread has not yet emptied this cell, the ring is full.
+                return false;
+            }
+            if (dif > 0)
+            {
+                // Another producer claimed the cells, try again at the new position.
+                pos = enqueue_pos_.load(memory_order_relaxed);
+                claimable = false;
+                break;
+            }
+        }
+        if (claimable && enqueue_pos_.compare_exchange_weak(pos, pos+k, memory_order_relaxed)) break;
+    }
+
+    for (size_t i = 0; i < k; ++i)
+    {
+        Cell &c = ring_[(pos+i) & RING_MASK];
+        size_t n = (i == k-1) ? len-i*LOG_CELL_SIZE : LOG_CELL_SIZE;
+        memcpy(c.data, data+i*LOG_CELL_SIZE, n);
+        c.len = n;
+        c.more = (i != k-1);
+        c.sequence.store(pos+i+1, memory_order_release);
+    }
+    *end = pos+k;
+    sem_post(&wakeup_);
+    return true;
+}
+
+void LogWriterImp::reopen()
+{
+    reopen_ = true;
+    sem_post(&wakeup_);
+}
+
+void LogWriterImp::flush()
+{
+    waitWritten(enqueue_pos_.load());
+}
+
+bool LogWriterImp::waitWritten(size_t pos)
+{
+    sem_post(&wakeup_);
+    // Do not hang forever if the disk is stuck, give up after two seconds.
+    for (int i = 0; i < 2000 && written_pos_.load() < pos && running_; ++i)
+    {
+        usleep(1000);
+    }
+    return written_pos_.load() >= pos;
+}
+
+bool LogWriterImp::drain(string *batch)
+{
+    bool more = false;
+    for (;;)
+    {
+        Cell &c = ring_[dequeue_pos_ & RING_MASK];
+        size_t seq = c.sequence.load(memory_order_acquire);
+        if (seq != dequeue_pos_+1)
+        {
+            // Empty, or the producer is still copying into a claimed cell.
+            // Wait for the rest of a long text to get whole lines in the file.
+            if (more)
+            {
+                sched_yield();
+                continue;
+            }
+            return batch->length() > 0;
+        }
+        batch->append(c.data, c.len);
+        more = c.more;
+        c.sequence.store(dequeue_pos_+LOG_RING_CELLS, memory_order_release);
+        dequeue_pos_++;
+    }
+}
+
+void LogWriterImp::writeBatch(string &batch)
+{
+    size_t written = 0;
+    while (written < batch.length() && fd_ != -1)
+    {
+        ssize_t n = ::write(fd_, batch.data()+written, batch.length()-written);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += n;
+    }
+    size_ += written;
+    if (written < batch.length())
+    {
+        // Cannot use warning() here, it would end up in this log writer again.
+        if (!failed_)
+        {
+            string msg = "(wmbusmeters) log file "+path_+" could not be written!\n";
+            writeFallback(msg.c_str(), msg.length());
+        }
+        failed_ = true;
+        failures_++;
+        countDrop(Drop::log_write_error);
+        writeFallback(batch.data()+written, batch.length()-written);
+        return;
+    }
+    failed_ = false;
+}
+
+void LogWriterImp::writeFallback(const char *data, size_t len)
+{
+    if (fallback_) fallback_(data, len);
+    else fwrite(data, 1, len, stderr);
+}
+
+void LogWriterImp::rotate()
+{
+    // Shift <file>.1 to <file>.2 etc, the oldest is overwritten.
+    for (int i = keep_-1; i >= 1; --i)
+    {
+        string from = path_+"."+to_string(i);
+        string to = path_+"."+to_string(i+1);
+        rename(from.c_str(), to.c_str());
+    }
+    string old = path_+".1";
+    if (rename(path_.c_str(), old.c_str()) == -1)
+    {
+        string msg = "(wmbusmeters) could not rotate log file "+path_+"\n";
+        writeFallback(msg.c_str(), msg.length());
+    }
+    openFile();
+}
+
+void *LogWriterImp::startLoop(void *a)
+{
+    LogWriterImp *w = (LogWriterImp*)a;
+    return w->writerLoop();
+}
+
+void *LogWriterImp::writerLoop()
+{
+    string batch;
+    batch.reserve(LOG_RING_CELLS*LOG_CELL_SIZE/4);
+
+    for (;;)
+    {
+        bool stopping = !running_;
+        if (reopen_.exchange(false))
+        {
+            openFile();
+        }
+        checkExternalRotation();
+
+        batch.clear();
+        if (drain(&batch))
+        {
+            writeBatch(batch);
+        }
+        uint64_t d = dropped_.load();
+        if (d != reported_dropped_)
+        {
+            string msg = "(wmbusmeters) log ring full, "+to_string(d-reported_dropped_)+" log writes did not reach this file\n";
+            writeBatch(msg);
+            reported_dropped_ = d;
+        }
+        if ((rotate_size_ > 0 && size_ >= rotate_size_) ||
+            (rotate_seconds_ > 0 && time(NULL)-opened_ >= rotate_seconds_))
+        {
+            rotate();
+        }
+        written_pos_.store(dequeue_pos_);
+        if (stopping) break;
+
+        // Sleep until the next write, but wake up every second to check the rotation time.
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        while (sem_timedwait(&wakeup_, &ts) == -1 && errno == EINTR) {}
+        // Many posts might have accumulated, one drain handles them all.
+        while (sem_trywait(&wakeup_) == 0) {}
+    }
+    return NULL;
+}
+
+unique_ptr<LogWriter> createLogWriter(string path, size_t rotate_size, int rotate_seconds, int keep,
+                                      function<void(const char *data, size_t len)> fallback)
+{
+    LogWriterImp *w = new LogWriterImp(path, rotate_size, rotate_seconds, keep, fallback);
+    if (!w->open())
+    {
+        delete w;
+        return NULL;
+    }
+    return unique_ptr<LogWriter>(w);
+}
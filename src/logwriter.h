@@ -0,0 +1,72 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LOGWRITER_H_
+#define LOGWRITER_H_
+
+#include<functional>
+#include<memory>
+#include<stdint.h>
+#include<string>
+
+using namespace std;
+
+/**
+  A LogWriter owns the log file. Any thread can write to it without
+  blocking on disk io, the text is copied into a lock free ring buffer
+  (a bounded multi producer queue) and a writer thread, which keeps the
+  file open, drains the ring and writes the text to the file.
+
+  If the ring is full, the text is dropped and counted, the number of
+  dropped writes is later reported in the log file and in the stats.
+  Text that cannot be written to the file, and the reports about it, go
+  to the fallback instead (syslog or stdout), called from the writer thread.
+
+  The log file is rotated (renamed to <file>.1, the old <file>.1 to <file>.2
+  and so on, keeping at most keep old files) when it grows beyond rotate_size
+  bytes or when it is older than rotate_seconds, zero means never.
+
+  An external rotation (logrotate moving or truncating the file) is detected
+  by comparing the inode and size of the path with the open file, then the
+  file is reopened.
+*/
+struct LogWriter
+{
+    // Never blocks, returns false if the text was dropped.
+    virtual bool write(const char *data, size_t len) = 0;
+    // Blocks until the text has reached the file. Returns false if it did not,
+    // because the ring was full, the write failed or the disk is stuck.
+    virtual bool writeAndWait(const char *data, size_t len) = 0;
+    // Close and open the file again, for example after an external rotation.
+    virtual void reopen() = 0;
+    // Wait until everything written so far has reached the file.
+    virtual void flush() = 0;
+    virtual string path() = 0;
+    virtual uint64_t dropped() = 0;
+    // Increases every time a new file has been opened after a rotation or reopen.
+    virtual uint64_t generation() = 0;
+    virtual ~LogWriter() = default;
+};
+
+#define LOG_RING_CELLS 4096 // Must be a power of two.
+#define LOG_CELL_SIZE 248   // Text bytes per cell, longer writes use consecutive cells.
+
+// Returns NULL if the file cannot be opened for appending.
+unique_ptr<LogWriter> createLogWriter(string path, size_t rotate_size = 0, int rotate_seconds = 0, int keep = 1,
+                                      function<void(const char *data, size_t len)> fallback = NULL);
+
+#endif
@@ -17,9 +17,13 @@
 
 #include"cmdline.h"
 #include"config.h"
+#include"dedup.h"
+#include"forward.h"
 #include"meters.h"
+#include"metrics.h"
 #include"printer.h"
 #include"serial.h"
+#include"stats.h"
 #include"util.h"
 #include"version.h"
 #include"wmbus.h"
@@ -40,8 +44,11 @@ using namespace std;
 
 void oneshotCheck(Configuration *cmdline, SerialCommunicationManager *manager, Telegram *t, Meter *meter, vector<unique_ptr<Meter>> &meters);
 bool startUsingCommandline(Configuration *cmdline);
-void startUsingConfigFiles(string root, bool is_daemon, string device_override, string listento_override);
-void startDaemon(string pid_file, string device_override, string listento_override); // Will use config files.
+unique_ptr<WMBus> openReceiver(Configuration *config, SpecifiedDevice &device, SerialCommunicationManager *manager);
+void startUsingConfigFiles(string root, bool is_daemon, vector<string> device_overrides, string listento_override);
+void startDaemon(string pid_file, vector<string> device_overrides, string listento_override); // Will use config files.
+void writeStats(string file);
+void writeTrace(string file);
 
 int main(int argc, char **argv)
 {
@@ -85,12 +92,12 @@ provided you with this binary. Read the full license for all details.
     }
     else
     if (cmdline->daemon) {
-        startDaemon(cmdline->pid_file, cmdline->device_override, cmdline->listento_override);
+        startDaemon(cmdline->pid_file, cmdline->device_overrides, cmdline->listento_override);
         exit(0);
     }
     else
     if (cmdline->useconfig) {
-        startUsingConfigFiles(cmdline->config_root, false, cmdline->device_override, cmdline->listento_override);
+        startUsingConfigFiles(cmdline->config_root, false, cmdline->device_overrides, cmdline->listento_override);
         exit(0);
     }
     else {
@@ -105,6 +112,7 @@ bool startUsingCommandline(Configuration *config)
     if (config->use_logfile)
     {
         verbose("(wmbusmeters) using log file %s\n", config->logfile.c_str());
+        setLogfileRotation(config->logrotate_size, config->logrotate_seconds, config->logkeep);
         bool ok = enableLogfile(config->logfile, config->daemon);
         if (!ok) {
             if (config->daemon) {
@@ -123,6 +131,10 @@ bool startUsingCommandline(Configuration *config)
     verboseEnabled(config->verbose);
     logTelegramsEnabled(config->logtelegrams);
     debugEnabled(config->debug);
+    if (config->debug && LOGLEVEL_FLOOR >= 1)
+    {
+        warning("(wmbusmeters) debug output was removed from this build (LOGLEVEL_FLOOR=%d)\n", LOGLEVEL_FLOOR);
+    }
     stderrEnabled(config->use_stderr);
 
     debug("(wmbusmeters) version: " VERSION "\n");
@@ -138,139 +150,141 @@ bool startUsingCommandline(Configuration *config)
     if (config->meterfiles) {
         verbose("(config) store meter files in: \"%s\"\n", config->meterfiles_dir.c_str());
     }
-    verbose("(config) using device: %s\n", config->device.c_str());
-    if (config->device_extra.length() > 0) {
-        verbose("(config) with: %s\n", config->device_extra.c_str());
+    for (SpecifiedDevice &device : config->devices) {
+        verbose("(config) using device: %s\n", device.file.c_str());
+        if (device.extra.length() > 0) {
+            verbose("(config) with: %s\n", device.extra.c_str());
+        }
     }
     verbose("(config) number of meters: %d\n", config->meters.size());
 
     auto manager = createSerialCommunicationManager(config->exitafter, config->reopenafter);
     onExit(call(manager.get(),stop));
 
-    Detected settings = detectWMBusDeviceSetting(config->device, config->device_extra, manager.get());
-
-    unique_ptr<SerialDevice> serial_override;
-    bool link_modes_matter = true;
-
-    if (settings.override_tty)
+    if (config->stats)
     {
-        serial_override = manager->createSerialDeviceFile(settings.devicefile);
-        verbose("(serial) override with devicefile: %s\n", settings.devicefile.c_str());
-        link_modes_matter = false;
+#ifdef DISABLE_STATS
+        warning("(wmbusmeters) the statistics were removed from this build (STATS=false)\n");
+#endif
+        statsEnabled(true);
     }
-
-    unique_ptr<WMBus> wmbus;
-
-    switch (settings.type)
+    if (config->trace != "")
     {
-    case DEVICE_IM871A:
-        verbose("(im871a) on %s\n", settings.devicefile.c_str());
-        wmbus = openIM871A(settings.devicefile, manager.get(), std::move(serial_override));
-        break;
-    case DEVICE_AMB8465:
-        verbose("(amb8465) on %s\n", settings.devicefile.c_str());
-        wmbus = openAMB8465(settings.devicefile, manager.get(), std::move(serial_override));
-        break;
-    case DEVICE_SIMULATOR:
-        verbose("(simulator) in %s\n", settings.devicefile.c_str());
-        wmbus = openSimulator(settings.devicefile, manager.get(), std::move(serial_override));
-        link_modes_matter = false;
-        break;
-    case DEVICE_RAWTTY:
-        verbose("(rawtty) on %s\n", settings.devicefile.c_str());
-        wmbus = openRawTTY(settings.devicefile, settings.baudrate, manager.get(), std::move(serial_override));
-        link_modes_matter = false;
-        break;
-    case DEVICE_RFMRX2:
-        verbose("(rfmrx2) on %s\n", settings.devicefile.c_str());
-        if (config->reopenafter == 0)
-        {
-            manager->setReopenAfter(600); // Close and reopen the fd, because of some bug in the device.
-        }
-        wmbus = openRawTTY(settings.devicefile, 38400, manager.get(), std::move(serial_override));
-        break;
-    case DEVICE_RTLWMBUS:
+#ifdef DISABLE_STATS
+        warning("(wmbusmeters) the tracing was removed from this build (STATS=false)\n");
+#endif
+        // Without a sample or ids, trace 1% which is cheap enough to leave on.
+        double sample = config->tracesample;
+        if (sample < 0) sample = config->traceids.size() > 0 ? 0 : 1;
+        verbose("(config) trace %g%% of the telegrams and %zu ids to %s\n", sample, config->traceids.size(), config->trace.c_str());
+        traceEnabled(sample, config->traceids);
+    }
+    if (config->stats || config->trace != "")
     {
-        string command;
-        if (!settings.override_tty)
+        manager->addRegularCallback(1, [&]()
         {
-            command = config->device_extra;
-            string freq = "868.95M";
-            string prefix = "";
-            if (isFrequency(command)) {
-                freq = command;
-                command = "";
-            }
-            if (config->daemon) {
-                prefix = "/usr/bin/";
-                if (command == "")
-                {
-                    // Default command is used, check that the binaries are in place.
-                    if (!checkFileExists("/usr/bin/rtl_sdr"))
-                    {
-                        error("(rtlwmbus) error: when starting as daemon, wmbusmeters expects /usr/bin/rtl_sdr to exist!\n");
-                    }
-                    if (!checkFileExists("/usr/bin/rtl_wmbus"))
-                    {
-                        error("(rtlwmbus) error: when starting as daemon, wmbusmeters expects /usr/bin/rtl_wmbus to exist!\n");
-                    }
-                }
-            }
-            if (command == "") {
-                command = prefix+"rtl_sdr -f "+freq+" -s 1.6e6 - 2>/dev/null | "+prefix+"rtl_wmbus";
-            }
-            verbose("(rtlwmbus) using command: %s\n", command.c_str());
-        }
-        wmbus = openRTLWMBUS(command, manager.get(),
-                             [command](){
-                                 warning("(rtlwmbus) child process exited! "
-                                         "Command was: \"%s\"\n", command.c_str());
-                             },
-                             std::move(serial_override));
-        break;
+            if (!gotStatsRequest()) return;
+            if (config->stats) notice("%s", statsTable().c_str());
+            if (config->trace != "") writeTrace(config->trace);
+        });
     }
-    case DEVICE_CUL:
+    if (config->dedup > 0)
     {
-        verbose("(cul) on %s\n", settings.devicefile.c_str());
-        wmbus = openCUL(settings.devicefile, manager.get(), std::move(serial_override));
-        break;
+        verbose("(config) drop the copies of a telegram within %d seconds, remember at most %d\n", config->dedup, config->dedupmax);
+        dedupEnabled(config->dedup, config->dedupmax);
     }
-    case DEVICE_D1TC:
+    if (config->statsfile != "")
     {
-        verbose("(d1tc) on %s\n", settings.devicefile.c_str());
-        wmbus = openD1TC(settings.devicefile, manager.get(), std::move(serial_override));
-        break;
+        verbose("(config) write stats to %s every %d seconds\n", config->statsfile.c_str(), config->statsinterval);
+        manager->addRegularCallback(config->statsinterval, [&](){ writeStats(config->statsfile); });
     }
-    case DEVICE_WMB13U:
+
+    vector<unique_ptr<WMBus>> receivers;
+    vector<WMBus*> listeners; // Each receiver listens to the link modes of its device.
+    vector<string> names;
+    bool all_simulated = true;
+    for (SpecifiedDevice &device : config->devices)
     {
-        verbose("(wmb13u) on %s\n", settings.devicefile.c_str());
-        wmbus = openWMB13U(settings.devicefile, manager.get(), std::move(serial_override));
-        break;
-    }
-    case DEVICE_UNKNOWN:
-        warning("No wmbus device found! Exiting!\n");
-        if (config->daemon) {
-            // If starting as a daemon, wait a bit so that systemd have time to catch up.
-            sleep(1);
+        receivers.push_back(openReceiver(config, device, manager.get()));
+        listeners.push_back(receivers.back().get());
+        // Tell rtlwmbus:868.9M and rtlwmbus:868.95M apart, otherwise /dev/ttyUSB0 is enough.
+        string name = device.file;
+        for (SpecifiedDevice &other : config->devices)
+        {
+            if (&other != &device && other.file == device.file) name += ":"+device.extra;
         }
-        exit(1);
-        break;
+        names.push_back(name);
+        if (!isSimulated(receivers.back()->type())) all_simulated = false;
     }
-
-    LinkModeCalculationResult lmcr = calculateLinkModes(config, wmbus.get(), link_modes_matter);
-    if (lmcr.type != LinkModeCalculationResultType::Success) {
-        error("%s\n", lmcr.msg.c_str());
+    unique_ptr<WMBus> wmbus;
+    if (receivers.size() == 1)
+    {
+        wmbus = std::move(receivers[0]);
+    }
+    else
+    {
+        wmbus = openReceivers(std::move(receivers), names);
+        LinkModeCalculationResult lmcr = checkLinkModesCoverage(config);
+        if (lmcr.type != LinkModeCalculationResultType::Success) {
+            error("%s\n", lmcr.msg.c_str());
+        }
     }
 
-    auto output = unique_ptr<Printer>(new Printer(config->json, config->fields,
+    auto output = unique_ptr<Printer>(new Printer(config->json, config->fields, config->cbor,
                                                   config->separator, config->meterfiles, config->meterfiles_dir,
                                                   config->use_logfile, config->logfile,
                                                   config->shells,
                                                   config->meterfiles_action == MeterFileType::Overwrite,
                                                   config->meterfiles_naming,
                                                   config->meterfiles_timestamp));
+    unique_ptr<Publisher> publisher;
+    if (config->publish.size() > 0)
+    {
+        publisher = createPublisher(config->publish, manager.get());
+        output->setPublisher(publisher.get());
+    }
+    // Declared after the output, since the spool must stop delivering before the output is gone.
+    unique_ptr<Spool> spool;
+    if (config->spool != "")
+    {
+        spool = createSpool(config->spool, SPOOL_SEGMENT_SIZE, config->spool_max);
+        output->setSpool(spool.get());
+    }
+    unique_ptr<Forwarder> forwarder;
+    if (config->forward != "")
+    {
+        if (config->spool == "")
+        {
+            error("(forward) --forward needs --spool=<dir> to buffer the frames while the collector is away.\n");
+        }
+        forwarder = createForwarder(config->forward, config->spool+"/forward", config->forward_max);
+        verbose("(config) forward the frames to %s\n", config->forward.c_str());
+    }
+    unique_ptr<Metrics> metrics;
+    if (config->metrics_port != 0)
+    {
+        metrics = createMetrics(config->metrics_port, manager.get());
+        if (!metrics) error("Could not serve metrics on port %d\n", config->metrics_port);
+        Spool *sp = spool.get();
+        Publisher *pb = publisher.get();
+        if (sp) metrics->addGauge("spool_pending", "Readings not yet delivered from the spool.",
+                                  [sp](){ return (double)sp->pending(); });
+        Forwarder *fw = forwarder.get();
+        if (fw) metrics->addGauge("forward_pending", "Frames not yet sent to the collector.",
+                                  [fw](){ return (double)fw->pending(); });
+        if (pb) metrics->addGauge("publish_subscribers", "Connected subscribers.",
+                                  [pb](){ return (double)pb->numSubscribers(); });
+    }
     vector<unique_ptr<Meter>> meters;
 
+    if (forwarder)
+    {
+        // Before any decoding, the collector has the meters and the keys.
+        wmbus->onTelegram([&](AboutTelegram &about, vector<uchar> frame){
+                forwarder->forward(about, frame);
+                return true;
+            });
+    }
     if (config->meters.size() > 0)
     {
         for (auto &m : config->meters)
@@ -313,14 +327,19 @@ LIST_OF_METERS
             }
             meters.back()->onUpdate([&](Telegram*t,Meter* meter) { output->print(t,meter,&config->jsons); });
             meters.back()->onUpdate([&](Telegram*t, Meter* meter) { oneshotCheck(config, manager.get(), t, meter, meters); });
+            if (metrics)
+            {
+                meters.back()->onUpdate([&](Telegram*t, Meter* meter) { metrics->update(t, meter); });
+            }
         }
     }
-    else
+    else if (!forwarder)
     {
         notice("No meters configured. Printing id:s of all telegrams heard!\n\n");
 
-        wmbus->onTelegram([](vector<uchar> frame){
+        wmbus->onTelegram([](AboutTelegram &about, vector<uchar> frame){
                 Telegram t;
+                t.about = about;
                 MeterKeys mk;
                 t.parserNoWarnings(); // Try a best effort parse, do not print any warnings.
                 t.parse(frame, &mk);
@@ -333,13 +352,18 @@ LIST_OF_METERS
 
     wmbus->setMeters(&meters);
     manager->startEventLoop();
-    wmbus->setLinkModes(config->listen_to_link_modes);
+    for (size_t i = 0; i < listeners.size(); ++i)
+    {
+        listeners[i]->setLinkModes(config->devices[i].listen_to);
+    }
     string using_link_modes = wmbus->getLinkModes().hr();
 
     verbose("(config) listen to link modes: %s\n", using_link_modes.c_str());
 
-    if (settings.type == DEVICE_SIMULATOR) {
-        wmbus->simulate();
+    wmbus->simulate();
+    if (all_simulated) {
+        // Nothing more will arrive.
+        manager->stop();
     }
 
     if (config->daemon) {
@@ -348,6 +372,16 @@ LIST_OF_METERS
 
     manager->waitForStop();
 
+    if (config->stats) {
+        notice("%s", statsTable().c_str());
+    }
+    if (config->statsfile != "") {
+        writeStats(config->statsfile);
+    }
+    if (config->trace != "") {
+        writeTrace(config->trace);
+    }
+
     if (config->daemon) {
         notice("(wmbusmeters) shutting down\n");
     }
@@ -356,6 +390,158 @@ LIST_OF_METERS
     return gotHupped();
 }
 
+// Detect and open a single receiver and check that it can listen to the link modes.
+unique_ptr<WMBus> openReceiver(Configuration *config, SpecifiedDevice &device, SerialCommunicationManager *manager)
+{
+    Detected settings = detectWMBusDeviceSetting(device.file, device.extra, manager);
+
+    unique_ptr<SerialDevice> serial_override;
+    bool link_modes_matter = true;
+
+    if (settings.override_tty)
+    {
+        if (startsWith(settings.devicefile, "tcp:") || startsWith(settings.devicefile, "udp:"))
+        {
+            bool lines = settings.type == DEVICE_RTLWMBUS;
+            serial_override = manager->createSerialDeviceSocket(settings.devicefile, lines);
+            verbose("(serial) override with remote receivers on: %s\n", settings.devicefile.c_str());
+        }
+        else
+        {
+            serial_override = manager->createSerialDeviceFile(settings.devicefile);
+            verbose("(serial) override with devicefile: %s\n", settings.devicefile.c_str());
+        }
+        link_modes_matter = false;
+    }
+
+    unique_ptr<WMBus> wmbus;
+
+    switch (settings.type)
+    {
+    case DEVICE_IM871A:
+        verbose("(im871a) on %s\n", settings.devicefile.c_str());
+        wmbus = openIM871A(settings.devicefile, manager, std::move(serial_override));
+        break;
+    case DEVICE_AMB8465:
+        verbose("(amb8465) on %s\n", settings.devicefile.c_str());
+        wmbus = openAMB8465(settings.devicefile, manager, std::move(serial_override));
+        break;
+    case DEVICE_SIMULATOR:
+        verbose("(simulator) in %s\n", settings.devicefile.c_str());
+        wmbus = openSimulator(settings.devicefile, manager, std::move(serial_override));
+        link_modes_matter = false;
+        break;
+    case DEVICE_REPLAY:
+        verbose("(replay) of %s\n", settings.devicefile.c_str());
+        wmbus = openReplay(settings.devicefile, device.extra, manager);
+        link_modes_matter = false;
+        break;
+    case DEVICE_SYNTHETIC:
+        verbose("(synthetic) %s\n", device.extra.c_str());
+        wmbus = openSynthetic(device.extra, manager, &config->meters);
+        link_modes_matter = false;
+        break;
+    case DEVICE_RAWTTY:
+        verbose("(rawtty) on %s\n", settings.devicefile.c_str());
+        wmbus = openRawTTY(settings.devicefile, settings.baudrate, manager, std::move(serial_override));
+        link_modes_matter = false;
+        break;
+    case DEVICE_RFMRX2:
+        verbose("(rfmrx2) on %s\n", settings.devicefile.c_str());
+        if (config->reopenafter == 0)
+        {
+            manager->setReopenAfter(600); // Close and reopen the fd, because of some bug in the device.
+        }
+        wmbus = openRawTTY(settings.devicefile, 38400, manager, std::move(serial_override));
+        break;
+    case DEVICE_RTLWMBUS:
+    case DEVICE_RTLSDR:
+    {
+        // The rtlsdr demodulates the samples from rtl_sdr itself, without rtl_wmbus.
+        bool demod = settings.type == DEVICE_RTLSDR;
+        const char *driver = demod ? "rtlsdr" : "rtlwmbus";
+        string command;
+        if (!settings.override_tty)
+        {
+            command = device.extra;
+            string freq = "868.95M";
+            string prefix = "";
+            if (isFrequency(command)) {
+                freq = command;
+                command = "";
+            }
+            if (config->daemon) {
+                prefix = "/usr/bin/";
+                if (command == "")
+                {
+                    // Default command is used, check that the binaries are in place.
+                    if (!checkFileExists("/usr/bin/rtl_sdr"))
+                    {
+                        error("(%s) error: when starting as daemon, wmbusmeters expects /usr/bin/rtl_sdr to exist!\n", driver);
+                    }
+                    if (!demod && !checkFileExists("/usr/bin/rtl_wmbus"))
+                    {
+                        error("(rtlwmbus) error: when starting as daemon, wmbusmeters expects /usr/bin/rtl_wmbus to exist!\n");
+                    }
+                }
+            }
+            if (command == "") {
+                command = prefix+"rtl_sdr -f "+freq+" -s 1.6e6 - 2>/dev/null";
+                if (!demod) command += " | "+prefix+"rtl_wmbus";
+            }
+            verbose("(%s) using command: %s\n", driver, command.c_str());
+        }
+        auto on_exit = [command,driver](){
+            warning("(%s) child process exited! "
+                    "Command was: \"%s\"\n", driver, command.c_str());
+        };
+        if (demod)
+        {
+            wmbus = openRTLSDR(command, manager, on_exit, std::move(serial_override));
+        }
+        else
+        {
+            wmbus = openRTLWMBUS(command, manager, on_exit, std::move(serial_override));
+        }
+        break;
+    }
+    case DEVICE_CUL:
+    {
+        verbose("(cul) on %s\n", settings.devicefile.c_str());
+        wmbus = openCUL(settings.devicefile, manager, std::move(serial_override));
+        break;
+    }
+    case DEVICE_D1TC:
+    {
+        verbose("(d1tc) on %s\n", settings.devicefile.c_str());
+        wmbus = openD1TC(settings.devicefile, manager, std::move(serial_override));
+        break;
+    }
+    case DEVICE_WMB13U:
+    {
+        verbose("(wmb13u) on %s\n", settings.devicefile.c_str());
+        wmbus = openWMB13U(settings.devicefile, manager, std::move(serial_override));
+        break;
+    }
+    case DEVICE_UNKNOWN:
+        warning("No wmbus device found! Exiting!\n");
+        if (config->daemon) {
+            // If starting as a daemon, wait a bit so that systemd have time to catch up.
+            sleep(1);
+        }
+        exit(1);
+        break;
+    }
+
+    LinkModeCalculationResult lmcr = calculateLinkModes(config, wmbus.get(), link_modes_matter,
+                                                        &device, config->devices.size() == 1);
+    if (lmcr.type != LinkModeCalculationResultType::Success) {
+        error("%s\n", lmcr.msg.c_str());
+    }
+
+    return wmbus;
+}
+
 void oneshotCheck(Configuration *config, SerialCommunicationManager *manager, Telegram *t, Meter *meter, vector<unique_ptr<Meter>> &meters)
 {
     if (!config->oneshot) return;
@@ -385,7 +571,20 @@ void writePid(string pid_file, int pid)
     return;
 }
 
-void startDaemon(string pid_file, string device_override, string listento_override)
+void writeStats(string file)
+{
+    static bool warned = false;
+    bool ok = writeStatsFile(file);
+    if (!ok && !warned) warning("(wmbusmeters) could not write stats file %s\n", file.c_str());
+    warned = !ok;
+}
+
+void writeTrace(string file)
+{
+    if (!writeTraceFile(file)) warning("(wmbusmeters) could not write trace file %s\n", file.c_str());
+}
+
+void startDaemon(string pid_file, vector<string> device_overrides, string listento_override)
 {
     setlogmask(LOG_UPTO (LOG_INFO));
     openlog("wmbusmetersd", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
@@ -435,15 +634,15 @@ void startDaemon(string pid_file, string device_override, string listento_overri
     if (open("/dev/null", O_RDWR) == -1) {
         error("Failed to reopen stderr while daemonising (errno=%d)",errno);
     }
-    startUsingConfigFiles("", true, device_override, listento_override);
+    startUsingConfigFiles("", true, device_overrides, listento_override);
 }
 
-void startUsingConfigFiles(string root, bool is_daemon, string device_override, string listento_override)
+void startUsingConfigFiles(string root, bool is_daemon, vector<string> device_overrides, string listento_override)
 {
     bool restart = false;
     do
     {
-        unique_ptr<Configuration> config = loadConfiguration(root, device_override, listento_override);
+        unique_ptr<Configuration> config = loadConfiguration(root, device_overrides, listento_override);
         config->daemon = is_daemon;
         restart = startUsingCommandline(config.get());
         if (restart)
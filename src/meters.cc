@@ -15,8 +15,10 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include"cbor.h"
 #include"meters.h"
 #include"meters_common_implementation.h"
+#include"stats.h"
 #include"units.h"
 #include"wmbus.h"
 #include"wmbus_utils.h"
@@ -34,7 +36,7 @@ MeterCommonImplementation::MeterCommonImplementation(WMBus *bus, MeterInfo &mi,
     {
         hex2bin(mi.key, &meter_keys_.confidentiality_key);
     }
-    if (bus->type() == DEVICE_SIMULATOR)
+    if (bus->type() == DEVICE_SIMULATOR || bus->type() == DEVICE_SYNTHETIC || bus->type() == DEVICE_REPLAY)
     {
         meter_keys_.simulation = true;
     }
@@ -47,7 +49,8 @@ MeterCommonImplementation::MeterCommonImplementation(WMBus *bus, MeterInfo &mi,
     for (auto j : mi.jsons) {
         addJson(j);
     }
-    MeterCommonImplementation::bus()->onTelegram([this](vector<uchar>input_frame){return this->handleTelegram(input_frame);});
+    accountMemory();
+    MeterCommonImplementation::bus()->onTelegram([this](AboutTelegram &about, vector<uchar>input_frame){return this->handleTelegram(about, input_frame);});
 }
 
 void MeterCommonImplementation::addConversions(std::vector<Unit> cs)
@@ -102,12 +105,14 @@ void MeterCommonImplementation::addPrint(string vname, Quantity vquantity,
                                          function<double(Unit)> getValueFunc, string help, bool field, bool json)
 {
     prints_.push_back( { vname, vquantity, defaultUnitForQuantity(vquantity), getValueFunc, NULL, help, field, json });
+    accountMemory();
 }
 
 void MeterCommonImplementation::addPrint(string vname, Quantity vquantity, Unit unit,
                                          function<double(Unit)> getValueFunc, string help, bool field, bool json)
 {
     prints_.push_back( { vname, vquantity, unit, getValueFunc, NULL, help, field, json });
+    accountMemory();
 }
 
 void MeterCommonImplementation::addPrint(string vname, Quantity vquantity,
@@ -115,6 +120,7 @@ void MeterCommonImplementation::addPrint(string vname, Quantity vquantity,
                                          string help, bool field, bool json)
 {
     prints_.push_back( { vname, vquantity, defaultUnitForQuantity(vquantity), NULL, getValueFunc, help, field, json } );
+    accountMemory();
 }
 
 void MeterCommonImplementation::addManufacturer(int m)
@@ -140,6 +146,7 @@ WMBus *MeterCommonImplementation::bus()
 void MeterCommonImplementation::onUpdate(function<void(Telegram*,Meter*)> cb)
 {
     on_update_.push_back(cb);
+    accountMemory();
 }
 
 int MeterCommonImplementation::numUpdates()
@@ -248,10 +255,22 @@ uint16_t MeterCommonImplementation::getRecordAsUInt16(string record)
     return 0;
 }
 
+// An estimate of the heap held by the meter, the drivers' own fields are not included.
+void MeterCommonImplementation::accountMemory()
+{
+    size_t bytes = sizeof(MeterCommonImplementation);
+    bytes += prints_.capacity()*sizeof(Print);
+    bytes += on_update_.capacity()*sizeof(function<void(Telegram*,Meter*)>);
+    bytes += values_.size()*(sizeof(pair<string,pair<int,string>>)+MAP_NODE_OVERHEAD);
+    bytes += (ids_.capacity()+shell_cmdlines_.capacity()+jsons_.capacity())*sizeof(string);
+    memory_.update(bytes);
+}
+
 void MeterCommonImplementation::triggerUpdate(Telegram *t)
 {
-    datetime_of_update_ = time(NULL);
+    datetime_of_update_ = t->about.timestamp ? t->about.timestamp : time(NULL);
     num_updates_++;
+    accountMemory();
     for (auto &cb : on_update_) if (cb) cb(t, this);
     t->handled = true;
 }
@@ -288,16 +307,19 @@ string concatFields(Meter *m, Telegram *t, char c, vector<Print> &prints, vector
     return s;
 }
 
-bool MeterCommonImplementation::handleTelegram(vector<uchar> input_frame)
+bool MeterCommonImplementation::handleTelegram(AboutTelegram &about, vector<uchar> input_frame)
 {
     Telegram t;
+    t.about = about;
     bool ok = t.parseHeader(input_frame);
+    if (!ok) about.header_failed = true;
 
     if (!ok || !isTelegramForMe(&t))
     {
         // This telegram is not intended for this meter.
         return false;
     }
+    if (fates_ == NULL) fates_ = meterFateCounters(name_);
 
     if (isDebugEnabled())
     {
@@ -308,12 +330,15 @@ bool MeterCommonImplementation::handleTelegram(vector<uchar> input_frame)
     ok = t.parse(input_frame, &meter_keys_);
     if (!ok)
     {
-        // Ignoring telegram since it could not be parsed.
-        return false;
+        // Ignoring telegram since it could not be parsed. But it was for this
+        // meter, so it does not count as ignored by all meters.
+        countFate(t.decryption_failed ? Fate::decrypt_failure : Fate::parse_failure, fates_);
+        return true;
     }
 
     if (!isExpectedVersion(t.dll_version))
     {
+        countFate(Fate::unexpected_version, fates_);
         warning("(%s) unexpected meter version 0x%02x !\n", meterName().c_str(), t.dll_version);
     }
 
@@ -322,7 +347,11 @@ bool MeterCommonImplementation::handleTelegram(vector<uchar> input_frame)
     logTelegram(log_prefix, t.frame, t.header_size, t.suffix_size);
 
     // Invoke meter specific parsing!
-    processContent(&t);
+    {
+        STAGE_TIMER(process_content);
+        processContent(&t);
+    }
+    countFate(Fate::update, fates_);
     // All done....
 
     if (isDebugEnabled())
@@ -373,6 +402,18 @@ void MeterCommonImplementation::printMeter(Telegram *t,
         }
     }
     s += "\"timestamp\":\""+datetimeOfUpdateRobot()+"\"";
+    if (t->about.device != "")
+    {
+        s += ",\"device\":\""+t->about.device+"\"";
+    }
+    if (t->about.rssi_dbm != 0)
+    {
+        s += ",\"rssi_dbm\":"+to_string(t->about.rssi_dbm);
+    }
+    if (t->about.link_mode != LinkMode::UNKNOWN)
+    {
+        s += ",\"link_mode\":\""+string(toLowerCaseString(t->about.link_mode))+"\"";
+    }
     for (string add_json : additionalJsons())
     {
         s += ",";
@@ -417,6 +458,18 @@ void MeterCommonImplementation::printMeter(Telegram *t,
         }
     }
     envs->push_back(string("METER_TIMESTAMP=")+datetimeOfUpdateRobot());
+    if (t->about.device != "")
+    {
+        envs->push_back(string("METER_DEVICE=")+t->about.device);
+    }
+    if (t->about.rssi_dbm != 0)
+    {
+        envs->push_back(string("METER_RSSI_DBM=")+to_string(t->about.rssi_dbm));
+    }
+    if (t->about.link_mode != LinkMode::UNKNOWN)
+    {
+        envs->push_back(string("METER_LINK_MODE=")+toLowerCaseString(t->about.link_mode));
+    }
     // If the configuration has supplied json_address=Roodroad 123
     // then the env variable METER_address will available and have the content "Roodroad 123"
     for (string add_json : additionalJsons())
@@ -429,6 +482,86 @@ void MeterCommonImplementation::printMeter(Telegram *t,
     }
 }
 
+void MeterCommonImplementation::printMeterCbor(Telegram *t, int meter_index,
+                                               vector<uchar> *schema,
+                                               vector<uchar> *record,
+                                               vector<string> *more_json)
+{
+    // The fields and values are emitted in exactly the same order as in printMeter,
+    // which makes it possible to rebuild the json output from the cbor output.
+    vector<string> names;
+    vector<uchar> values;
+    for (Print p : prints_)
+    {
+        if (p.json)
+        {
+            if (p.getValueString) {
+                names.push_back(p.vname);
+                cborAddText(values, p.getValueString());
+            }
+            if (p.getValueDouble) {
+                names.push_back(p.vname+"_"+unitToStringLowerCase(p.default_unit));
+                cborAddDouble(values, p.getValueDouble(p.default_unit));
+
+                Unit u = replaceWithConversionUnit(p.default_unit, conversions_);
+                if (u != p.default_unit)
+                {
+                    names.push_back(p.vname+"_"+unitToStringLowerCase(u));
+                    cborAddDouble(values, p.getValueDouble(u));
+                }
+            }
+        }
+    }
+
+    schema->clear();
+    cborAddArray(*schema, 7);
+    cborAddUInt(*schema, CBOR_SCHEMA_RECORD);
+    cborAddUInt(*schema, meter_index);
+    cborAddText(*schema, mediaTypeJSON(t->dll_type));
+    cborAddText(*schema, meterName());
+    cborAddText(*schema, name());
+    cborAddArray(*schema, names.size());
+    for (string &n : names) cborAddText(*schema, n);
+    cborAddArray(*schema, additionalJsons().size()+more_json->size());
+    for (string add_json : additionalJsons()) cborAddText(*schema, makeQuotedJson(add_json));
+    for (string add_json : *more_json) cborAddText(*schema, makeQuotedJson(add_json));
+
+    AboutTelegram &about = t->about;
+    bool has_about = about.device != "" || about.rssi_dbm != 0 || about.link_mode != LinkMode::UNKNOWN;
+
+    record->clear();
+    cborAddArray(*record, 4+names.size()+(has_about ? 1 : 0));
+    cborAddUInt(*record, CBOR_DATA_RECORD);
+    cborAddUInt(*record, meter_index);
+    cborAddUInt(*record, datetime_of_update_);
+    cborAddText(*record, t->id);
+    record->insert(record->end(), values.begin(), values.end());
+    if (has_about)
+    {
+        cborAddArray(*record, 3);
+        cborAddText(*record, about.device);
+        cborAddInt(*record, about.rssi_dbm);
+        cborAddText(*record, about.link_mode != LinkMode::UNKNOWN ? toLowerCaseString(about.link_mode) : "");
+    }
+}
+
+void MeterCommonImplementation::printMeterMetrics(vector<pair<string,double>> *values)
+{
+    for (Print p : prints_)
+    {
+        if (p.json && p.getValueDouble)
+        {
+            values->push_back({ p.vname+"_"+unitToStringLowerCase(p.default_unit), p.getValueDouble(p.default_unit) });
+
+            Unit u = replaceWithConversionUnit(p.default_unit, conversions_);
+            if (u != p.default_unit)
+            {
+                values->push_back({ p.vname+"_"+unitToStringLowerCase(u), p.getValueDouble(u) });
+            }
+        }
+    }
+}
+
 double WaterMeter::totalWaterConsumption(Unit u) { return -47.11; }
 bool  WaterMeter::hasTotalWaterConsumption() { return false; }
 double WaterMeter::targetWaterConsumption(Unit u) { return -47.11; }
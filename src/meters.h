@@ -107,9 +107,17 @@ struct Meter
                             string *json,
                             vector<string> *envs,
                             vector<string> *more_json) = 0;
+    // The compact binary format, see cbor.h. The schema only depends on the
+    // meter and its prints, the record holds the values from this telegram.
+    virtual void printMeterCbor(Telegram *t, int meter_index,
+                                vector<uchar> *schema,
+                                vector<uchar> *record,
+                                vector<string> *more_json) = 0;
+    // The numeric values, named as in the json, for example total_m3 and total_l.
+    virtual void printMeterMetrics(vector<pair<string,double>> *values) = 0;
 
     // The handleTelegram expects an input_frame where the DLL crcs have been removed.
-    bool handleTelegram(vector<uchar> input_frame);
+    bool handleTelegram(AboutTelegram &about, vector<uchar> input_frame);
     virtual bool isTelegramForMe(Telegram *t) = 0;
     virtual MeterKeys *meterKeys() = 0;
     virtual bool isExpectedVersion(int version) = 0;
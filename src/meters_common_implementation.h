@@ -19,11 +19,14 @@
 #define METERS_COMMON_IMPLEMENTATION_H_
 
 #include"meters.h"
+#include"stats.h"
 #include"units.h"
 
 #include<map>
 #include<set>
 
+struct FateCounters;
+
 struct Print
 {
     string vname; // Value name, like: total current previous target
@@ -70,6 +73,7 @@ struct MeterCommonImplementation : public virtual Meter
 protected:
 
     void triggerUpdate(Telegram *t);
+    void accountMemory();
     void addExpectedVersion(int version);
     void setExpectedELLSecurityMode(ELLSecurityMode dsm);
     void setExpectedTPLSecurityMode(TPLSecurityMode tsm);
@@ -88,13 +92,18 @@ protected:
                   function<double(Unit)> getValueFunc, string help, bool field, bool json);
     void addPrint(string vname, Quantity vquantity,
                   function<std::string()> getValueFunc, string help, bool field, bool json);
-    bool handleTelegram(vector<uchar> frame);
+    bool handleTelegram(AboutTelegram &about, vector<uchar> frame);
     void printMeter(Telegram *t,
                     string *human_readable,
                     string *fields, char separator,
                     string *json,
                     vector<string> *envs,
                     vector<string> *more_json); // Add this json "key"="value" strings.
+    void printMeterCbor(Telegram *t, int meter_index,
+                        vector<uchar> *schema,
+                        vector<uchar> *record,
+                        vector<string> *more_json);
+    void printMeterMetrics(vector<pair<string,double>> *values);
 
     virtual void processContent(Telegram *t) = 0;
 
@@ -116,6 +125,8 @@ private:
     LinkModeSet link_modes_ {};
     vector<string> shell_cmdlines_;
     vector<string> jsons_;
+    FateCounters *fates_ {}; // Found on the first telegram for this meter.
+    MemoryTracker memory_ { Memory::meters };
 
 protected:
     std::map<std::string,std::pair<int,std::string>> values_;
@@ -0,0 +1,473 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"metrics.h"
+#include"stats.h"
+#include"util.h"
+
+#include<arpa/inet.h>
+#include<atomic>
+#include<errno.h>
+#include<fcntl.h>
+#include<map>
+#include<netinet/in.h>
+#include<pthread.h>
+#include<string.h>
+#include<sys/socket.h>
+#include<unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define MAX_REQUEST_SIZE 8192
+#define METRICS_MAX_CLIENTS 64
+#define METRICS_IDLE_SECONDS 10 // A client that has not been served by then is dropped.
+
+struct MeterSamples
+{
+    string labels; // name="MyTapWater",id="12345678",meter="multical21",media="water"
+    vector<pair<string,double>> values;
+    time_t timestamp;
+    size_t bytes; // Accounted memory.
+};
+
+// The latest samples of a meter id, replaced with an atomic swap by the meter updates.
+struct MeterSlot
+{
+    shared_ptr<const MeterSamples> samples;
+};
+
+// The slots are never removed, a new meter id copies the index.
+typedef map<string,shared_ptr<MeterSlot>> MeterIndex;
+
+struct Gauge
+{
+    string name, help;
+    function<double()> sample;
+};
+
+struct HttpClient
+{
+    int fd {-1};
+    string request;
+    shared_ptr<const string> response; // Keeps the snapshot alive while sending.
+    string header;
+    size_t sent {};
+    time_t connected {};
+};
+
+struct MetricsImp : public Metrics
+{
+    MetricsImp(SerialCommunicationManager *manager);
+    ~MetricsImp();
+
+    bool listen(int port);
+    void update(Telegram *t, Meter *meter);
+    void addGauge(string name, string help, function<double()> sample);
+    void render();
+    shared_ptr<const string> snapshot() { return atomic_load(&snapshot_); }
+
+private:
+
+    void accept();
+    void expireIdle();
+    void readable(int fd);
+    void writable(int fd);
+    void respond(HttpClient *c);
+    void flush(HttpClient *c);
+    void remove(int fd);
+    void addBytes(int64_t bytes);
+    string renderMeters();
+    string renderInternals();
+
+    SerialCommunicationManager *manager_;
+    int listen_fd_ {-1};
+    map<int,unique_ptr<HttpClient>> clients_; // Only touched by the event loop thread.
+
+    // The decoding only takes the lock when a new meter id is heard,
+    // updates of known meters and the rendering never take it.
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    shared_ptr<const MeterIndex> meters_;
+    atomic<bool> dirty_ {};
+    // With wildcard ids, the samples grow with each new meter id heard.
+    atomic<int64_t> meters_bytes_ {};
+
+    vector<Gauge> gauges_;
+    string meters_text_; // Cached until a meter is updated.
+    uint64_t prev_frames_ {};
+    uint64_t prev_nanos_ {};
+    time_t rendered_ {};
+    shared_ptr<const string> snapshot_;
+};
+
+MetricsImp::MetricsImp(SerialCommunicationManager *manager)
+{
+    manager_ = manager;
+    snapshot_ = make_shared<const string>("");
+    meters_ = make_shared<const MeterIndex>();
+}
+
+MetricsImp::~MetricsImp()
+{
+    addMemory(Memory::metrics, -meters_bytes_.load());
+    for (auto &p : clients_)
+    {
+        manager_->unwatchFd(p.first);
+        close(p.first);
+    }
+    if (listen_fd_ != -1)
+    {
+        manager_->unwatchFd(listen_fd_);
+        close(listen_fd_);
+    }
+}
+
+bool MetricsImp::listen(int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    // Only localhost, there is neither authentication nor encryption.
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd_ == -1) return false;
+    int on = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(listen_fd_, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        ::listen(listen_fd_, 16) == -1 ||
+        fcntl(listen_fd_, F_SETFL, fcntl(listen_fd_, F_GETFL, 0) | O_NONBLOCK) == -1)
+    {
+        warning("(metrics) could not listen on localhost port %d %s\n", port, strerror(errno));
+        close(listen_fd_);
+        listen_fd_ = -1;
+        return false;
+    }
+    fcntl(listen_fd_, F_SETFD, FD_CLOEXEC);
+    render();
+    if (!manager_->watchFd(listen_fd_, [this](){ accept(); }, NULL))
+    {
+        close(listen_fd_);
+        listen_fd_ = -1;
+        return false;
+    }
+    verbose("(metrics) serving http://localhost:%d/metrics\n", port);
+    return true;
+}
+
+void MetricsImp::accept()
+{
+    // Clients only come and go here, a good time to drop those that never sent a request.
+    expireIdle();
+    for (;;)
+    {
+        int fd = ::accept(listen_fd_, NULL, NULL);
+        if (fd == -1)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (clients_.size() >= METRICS_MAX_CLIENTS)
+        {
+            warning("(metrics) too many http clients, refusing fd=%d\n", fd);
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        HttpClient *c = new HttpClient();
+        c->fd = fd;
+        c->connected = time(NULL);
+        clients_[fd] = unique_ptr<HttpClient>(c);
+        if (!manager_->watchFd(fd, [this,fd](){ readable(fd); }, [this,fd](){ writable(fd); }))
+        {
+            close(fd);
+            clients_.erase(fd);
+        }
+    }
+}
+
+void MetricsImp::expireIdle()
+{
+    time_t now = time(NULL);
+    vector<int> idle;
+    for (auto &p : clients_)
+    {
+        if (now-p.second->connected >= METRICS_IDLE_SECONDS) idle.push_back(p.first);
+    }
+    for (int fd : idle)
+    {
+        debug("(metrics) dropping idle http client fd=%d\n", fd);
+        remove(fd);
+    }
+}
+
+void MetricsImp::remove(int fd)
+{
+    // Close last, the client sees the end of the response only when the client is gone here.
+    manager_->unwatchFd(fd);
+    clients_.erase(fd);
+    close(fd);
+}
+
+void MetricsImp::readable(int fd)
+{
+    auto i = clients_.find(fd);
+    if (i == clients_.end()) return;
+    HttpClient *c = i->second.get();
+
+    char buf[1024];
+    for (;;)
+    {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n > 0)
+        {
+            c->request.append(buf, n);
+            if (c->request.length() > MAX_REQUEST_SIZE)
+            {
+                remove(fd);
+                return;
+            }
+            continue;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        remove(fd);
+        return;
+    }
+    if (c->response == NULL && c->request.find("\r\n\r\n") != string::npos)
+    {
+        respond(c);
+    }
+}
+
+void MetricsImp::respond(HttpClient *c)
+{
+    bool get = c->request.compare(0, 4, "GET ") == 0;
+    size_t end = c->request.find(' ', 4);
+    string path = get && end != string::npos ? c->request.substr(4, end-4) : "";
+
+    if (path == "/metrics")
+    {
+        if (time(NULL) != rendered_) render();
+        c->response = snapshot();
+        c->header = "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: "+to_string(c->response->length())+"\r\n"
+            "Connection: close\r\n\r\n";
+    }
+    else
+    {
+        c->response = make_shared<const string>("Not found, try /metrics\n");
+        c->header = "HTTP/1.0 404 Not Found\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: "+to_string(c->response->length())+"\r\n"
+            "Connection: close\r\n\r\n";
+    }
+    flush(c);
+}
+
+void MetricsImp::writable(int fd)
+{
+    auto i = clients_.find(fd);
+    if (i != clients_.end()) flush(i->second.get());
+}
+
+void MetricsImp::flush(HttpClient *c)
+{
+    size_t total = c->header.length()+c->response->length();
+    while (c->sent < total)
+    {
+        bool in_header = c->sent < c->header.length();
+        const char *data = in_header ? c->header.data()+c->sent : c->response->data()+(c->sent-c->header.length());
+        size_t len = in_header ? c->header.length()-c->sent : total-c->sent;
+        ssize_t n = send(c->fd, data, len, MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                manager_->wantWrite(c->fd, true);
+                return;
+            }
+            break;
+        }
+        c->sent += n;
+    }
+    // Sent everything, or the client went away.
+    remove(c->fd);
+}
+
+static string metricName(string s)
+{
+    for (char &c : s)
+    {
+        if (!isalnum(c) && c != '_') c = '_';
+    }
+    return s;
+}
+
+static string labelValue(string s)
+{
+    string r;
+    for (char c : s)
+    {
+        if (c == '\\' || c == '"') r += '\\';
+        if (c == '\n') { r += "\\n"; continue; }
+        r += c;
+    }
+    return r;
+}
+
+static string number(double v)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.10g", v);
+    return buf;
+}
+
+void MetricsImp::update(Telegram *t, Meter *meter)
+{
+    MeterSamples *ms = new MeterSamples();
+    ms->labels = "name=\""+labelValue(meter->name())+"\",id=\""+labelValue(t->id)+
+        "\",meter=\""+labelValue(meter->meterName())+"\",media=\""+labelValue(mediaTypeJSON(t->dll_type))+"\"";
+    meter->printMeterMetrics(&ms->values);
+    if (t->about.rssi_dbm != 0) ms->values.push_back({ "rssi_dbm", t->about.rssi_dbm });
+    ms->timestamp = time(NULL);
+    ms->bytes = sizeof(MeterSamples)+ms->labels.capacity()+ms->values.capacity()*sizeof(pair<string,double>);
+    for (auto &v : ms->values) ms->bytes += v.first.capacity();
+
+    shared_ptr<const MeterSamples> p(ms);
+    string key = meter->name()+"/"+t->id;
+    shared_ptr<const MeterIndex> index = atomic_load(&meters_);
+    auto i = index->find(key);
+    if (i == index->end())
+    {
+        // A new meter id, add a slot to a copy of the index.
+        pthread_mutex_lock(&lock_);
+        index = atomic_load(&meters_);
+        i = index->find(key);
+        if (i == index->end())
+        {
+            MeterIndex *copy = new MeterIndex(*index);
+            (*copy)[key] = make_shared<MeterSlot>();
+            index = shared_ptr<const MeterIndex>(copy);
+            atomic_store(&meters_, index);
+            i = index->find(key);
+            addBytes(sizeof(pair<string,shared_ptr<MeterSlot>>)+MAP_NODE_OVERHEAD+key.capacity()+sizeof(MeterSlot));
+        }
+        pthread_mutex_unlock(&lock_);
+    }
+    shared_ptr<const MeterSamples> old = atomic_exchange(&i->second->samples, p);
+    addBytes((int64_t)ms->bytes-(old ? (int64_t)old->bytes : 0));
+    dirty_ = true;
+}
+
+void MetricsImp::addBytes(int64_t bytes)
+{
+    meters_bytes_ += bytes;
+    addMemory(Memory::metrics, bytes);
+}
+
+void MetricsImp::addGauge(string name, string help, function<double()> sample)
+{
+    gauges_.push_back({ name, help, sample });
+}
+
+string MetricsImp::renderMeters()
+{
+    if (!dirty_.exchange(false)) return meters_text_;
+
+    // Take the latest samples, an update after this sets dirty_ again.
+    shared_ptr<const MeterIndex> index = atomic_load(&meters_);
+    vector<shared_ptr<const MeterSamples>> meters;
+    for (auto &p : *index)
+    {
+        shared_ptr<const MeterSamples> ms = atomic_load(&p.second->samples);
+        if (ms) meters.push_back(ms);
+    }
+
+    // All samples of a metric must be grouped together.
+    map<string,string> groups;
+    for (auto &m : meters)
+    {
+        for (auto &v : m->values)
+        {
+            string name = "wmbusmeters_"+metricName(v.first);
+            groups[name] += name+"{"+m->labels+"} "+number(v.second)+"\n";
+        }
+        groups["wmbusmeters_last_update_seconds"] +=
+            "wmbusmeters_last_update_seconds{"+m->labels+"} "+to_string(m->timestamp)+"\n";
+    }
+    string s;
+    for (auto &g : groups)
+    {
+        s += "# TYPE "+g.first+" gauge\n";
+        s += g.second;
+    }
+    meters_text_ = s;
+    return s;
+}
+
+string MetricsImp::renderInternals()
+{
+    string s = fatesPrometheus();
+    s += dropsPrometheus();
+    s += memoryPrometheus();
+
+    uint64_t now = statsNow();
+    uint64_t frames = fateCount(Fate::received);
+    double fps = 0;
+    if (prev_nanos_ != 0 && now > prev_nanos_)
+    {
+        fps = (frames-prev_frames_)*1e9/(now-prev_nanos_);
+    }
+    prev_frames_ = frames;
+    prev_nanos_ = now;
+    s += "# HELP wmbusmeters_telegrams_per_second Frames received per second since the previous snapshot.\n";
+    s += "# TYPE wmbusmeters_telegrams_per_second gauge\n";
+    s += "wmbusmeters_telegrams_per_second "+number(fps)+"\n";
+
+    for (Gauge &g : gauges_)
+    {
+        s += "# HELP wmbusmeters_"+g.name+" "+g.help+"\n";
+        s += "# TYPE wmbusmeters_"+g.name+" gauge\n";
+        s += "wmbusmeters_"+g.name+" "+number(g.sample())+"\n";
+    }
+    return s;
+}
+
+void MetricsImp::render()
+{
+    rendered_ = time(NULL);
+    string s = renderMeters();
+    s += renderInternals();
+    atomic_store(&snapshot_, shared_ptr<const string>(make_shared<const string>(s)));
+}
+
+unique_ptr<Metrics> createMetrics(int port, SerialCommunicationManager *manager)
+{
+    MetricsImp *m = new MetricsImp(manager);
+    if (!m->listen(port))
+    {
+        delete m;
+        return NULL;
+    }
+    return unique_ptr<Metrics>(m);
+}
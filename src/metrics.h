@@ -0,0 +1,58 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include"meters.h"
+#include"serial.h"
+
+#include<functional>
+#include<memory>
+#include<string>
+
+using namespace std;
+
+/**
+  Metrics serves http://localhost:<port>/metrics in the Prometheus text format.
+  It contains the latest values of every meter and the internal counters.
+
+  The meter updates only swap in the latest values of the meter. The text is
+  rendered into an immutable snapshot, at most once per second, when scraped.
+  A scrape never waits for the decoding and the decoding never waits for a scrape.
+
+  The http connections are handled by the event loop of the manager. There is
+  a limit on the number of connections, and a connection that has not been
+  served within a few seconds is dropped when the next one arrives.
+*/
+struct Metrics
+{
+    // Store the latest values of the meter, invoked from the meter update callback.
+    virtual void update(Telegram *t, Meter *meter) = 0;
+    // A gauge is sampled when the snapshot is rendered, for example a queue depth.
+    virtual void addGauge(string name, string help, function<double()> sample) = 0;
+    // Render a new snapshot, a scrape does this if the snapshot is older than a second.
+    virtual void render() = 0;
+    // The latest snapshot.
+    virtual shared_ptr<const string> snapshot() = 0;
+    virtual ~Metrics() = default;
+};
+
+// Returns NULL if the port cannot be listened to.
+unique_ptr<Metrics> createMetrics(int port, SerialCommunicationManager *manager);
+
+#endif
@@ -17,10 +17,11 @@
 
 #include"printer.h"
 #include"shell.h"
+#include"stats.h"
 
 using namespace std;
 
-Printer::Printer(bool json, bool fields, char separator,
+Printer::Printer(bool json, bool fields, bool cbor, char separator,
                  bool use_meterfiles, string &meterfiles_dir,
                  bool use_logfile, string &logfile,
                  vector<string> shell_cmdlines, bool overwrite,
@@ -29,6 +30,7 @@ Printer::Printer(bool json, bool fields, char separator,
 {
     json_ = json;
     fields_ = fields;
+    cbor_ = cbor;
     separator_ = separator;
     use_meterfiles_ = use_meterfiles;
     meterfiles_dir_ = meterfiles_dir;
@@ -44,43 +46,197 @@ void Printer::print(Telegram *t, Meter *meter, vector<string> *more_json)
 {
     string human_readable, fields, json;
     vector<string> envs;
-    bool printed = false;
+    vector<uchar> cbor_schema, cbor_record;
+    CborMeter *cm = NULL;
+    bool shells = shell_cmdlines_.size() > 0 || meter->shellCmdlines().size() > 0;
 
-    meter->printMeter(t, &human_readable, &fields, separator_, &json, &envs, more_json);
+    // The text formats are still needed for the shell env variables and the json subscribers.
+    if (!cbor_ || shells || publisher_) {
+        STAGE_TIMER(print_meter);
+        meter->printMeter(t, &human_readable, &fields, separator_, &json, &envs, more_json);
+    }
+    // Only build the cbor when it is printed or when a subscriber asked for it.
+    if (cbor_ || (publisher_ && publisher_->wantsCbor())) {
+        cm = cborMeter(meter);
+        meter->printMeterCbor(t, cm->index, &cbor_schema, &cbor_record, more_json);
+        string schema(cbor_schema.begin(), cbor_schema.end());
+        if (cm->schema == NULL || *cm->schema != schema)
+        {
+            cm->schema = make_shared<const string>(schema);
+            cm->schema_printed = false;
+        }
+        if (use_logfile_ && logfile_generation_ != logfileGeneration())
+        {
+            // A new log file must be readable on its own.
+            logfile_generation_ = logfileGeneration();
+            for (auto &p : cbor_meters_) p.second.schema_printed = false;
+        }
+    }
 
-    if (shell_cmdlines_.size() > 0 || meter->shellCmdlines().size() > 0) {
-        printShells(meter, envs);
-        printed = true;
+    // Print on stdout or in the logfile when there is nothing else to do.
+    bool files = use_meterfiles_ || !shells;
+    string filename, text;
+    const char *mode = "a";
+    if (files) {
+        filename = outputFilename(meter, t, &mode);
+        text = outputText(human_readable, fields, json, cm, cbor_record);
     }
-    if (use_meterfiles_) {
-        printFiles(meter, t, human_readable, fields, json);
-        printed = true;
+
+    if (spool_ && (shells || filename != "")) {
+        // The spool delivers to the shells and files, and retries if they fail.
+        spoolReading(shellsFor(meter), envs, filename, mode, text);
+        if (files && filename == "") printFiles(filename, mode, text);
     }
-    if (!printed) {
-        // This will print on stdout or in the logfile.
-        printFiles(meter, t, human_readable, fields, json);
-        fflush(stdout);
+    else {
+        if (shells) printShells(shellsFor(meter), envs);
+        if (files) printFiles(filename, mode, text);
+    }
+    if (publisher_) {
+        publish(meter, t, json, cm, cbor_record);
+    }
+}
+
+Printer::CborMeter *Printer::cborMeter(Meter *meter)
+{
+    auto i = cbor_meters_.find(meter);
+    if (i == cbor_meters_.end())
+    {
+        CborMeter cm { (int)cbor_meters_.size(), NULL, false };
+        i = cbor_meters_.insert({ meter, cm }).first;
+    }
+    return &i->second;
+}
+
+void Printer::publish(Meter *meter, Telegram *t, string &json, CborMeter *cm, vector<uchar> &cbor_record)
+{
+    STAGE_TIMER(sink_publish);
+    Publication p;
+    p.name = meter->name();
+    p.id = t->id;
+    p.type = meter->meterName();
+    // Serialized once, the same line is then queued for every matching subscriber.
+    p.json = make_shared<const string>(json+"\n");
+    if (cm)
+    {
+        p.index = cm->index;
+        p.cbor_schema = cm->schema;
+        p.cbor = make_shared<const string>(cbor_record.begin(), cbor_record.end());
+    }
+    publisher_->publish(p);
+}
+
+// A spooled reading is stored as a sequence of length prefixed strings:
+// filename mode text num_shells shells... num_envs envs...
+struct SpooledReading
+{
+    string filename, mode, text;
+    vector<string> shells, envs;
+};
+
+static void addString(vector<uchar> &out, const string &s)
+{
+    uint32_t n = s.length();
+    out.insert(out.end(), (uchar*)&n, (uchar*)&n+sizeof(n));
+    out.insert(out.end(), s.begin(), s.end());
+}
+
+static bool takeString(const uchar **p, const uchar *end, string *s)
+{
+    uint32_t n;
+    if (end-*p < (long)sizeof(n)) return false;
+    memcpy(&n, *p, sizeof(n));
+    *p += sizeof(n);
+    if ((uint32_t)(end-*p) < n) return false;
+    s->assign((const char*)*p, n);
+    *p += n;
+    return true;
+}
+
+static bool takeStrings(const uchar **p, const uchar *end, vector<string> *v)
+{
+    string num;
+    if (!takeString(p, end, &num)) return false;
+    int n = atoi(num.c_str());
+    v->resize(n);
+    for (int i = 0; i < n; ++i)
+    {
+        if (!takeString(p, end, &(*v)[i])) return false;
     }
+    return true;
+}
+
+static bool decodeSpooledReading(const uchar *data, size_t len, SpooledReading *r)
+{
+    const uchar *end = data+len;
+    return takeString(&data, end, &r->filename)
+        && takeString(&data, end, &r->mode)
+        && takeString(&data, end, &r->text)
+        && takeStrings(&data, end, &r->shells)
+        && takeStrings(&data, end, &r->envs);
 }
 
-void Printer::printShells(Meter *meter, vector<string> &envs)
+void Printer::setSpool(Spool *spool)
 {
-    vector<string> *shells = &shell_cmdlines_;
-    if (meter->shellCmdlines().size() > 0) {
-        shells = &meter->shellCmdlines();
+    spool_ = spool;
+    spool_->addSink("shells", SPOOL_MAX_ATTEMPTS, [this](const uchar *data, size_t len)
+                    {
+                        SpooledReading r;
+                        if (!decodeSpooledReading(data, len, &r)) return true; // Skip broken readings.
+                        return printShells(r.shells, r.envs);
+                    });
+    if (use_meterfiles_ || use_logfile_)
+    {
+        spool_->addSink("files", SPOOL_MAX_ATTEMPTS, [this](const uchar *data, size_t len)
+                        {
+                            SpooledReading r;
+                            if (!decodeSpooledReading(data, len, &r) || r.filename == "") return true;
+                            return printFiles(r.filename, r.mode.c_str(), r.text);
+                        });
     }
-    for (auto &s : *shells) {
-        vector<string> args;
-        args.push_back("-c");
-        args.push_back(s);
-        invokeShell("/bin/sh", args, envs);
+}
+
+void Printer::spoolReading(vector<string> &shells, vector<string> &envs,
+                           string &filename, const char *mode, string &text)
+{
+    STAGE_TIMER(sink_spool);
+    vector<uchar> record;
+    addString(record, filename);
+    addString(record, mode);
+    addString(record, text);
+    addString(record, to_string(shells.size()));
+    for (string &s : shells) addString(record, s);
+    addString(record, to_string(envs.size()));
+    for (string &e : envs) addString(record, e);
+
+    if (!spool_->append(&record[0], record.size()))
+    {
+        // Better to try to deliver it now than to drop it.
+        printShells(shells, envs);
+        if (filename != "") printFiles(filename, mode, text);
     }
 }
 
-void Printer::printFiles(Meter *meter, Telegram *t, string &human_readable, string &fields, string &json)
+vector<string> &Printer::shellsFor(Meter *meter)
 {
-    FILE *output = stdout;
+    if (meter->shellCmdlines().size() > 0) return meter->shellCmdlines();
+    return shell_cmdlines_;
+}
 
+bool Printer::printShells(vector<string> &shells, vector<string> &envs)
+{
+    STAGE_TIMER(sink_shell);
+    bool ok = true;
+    static const string sh = "/bin/sh";
+    vector<string> args = { "-c", "" };
+    for (auto &s : shells) {
+        args[1] = s;
+        if (!invokeShell(sh, args, envs)) ok = false;
+    }
+    return ok;
+}
+
+string Printer::outputFilename(Meter *meter, Telegram *t, const char **mode)
+{
     if (use_meterfiles_) {
         char filename[256];
         memset(filename, 0, sizeof(filename));
@@ -121,43 +277,59 @@ void Printer::printFiles(Meter *meter, Telegram *t, string &human_readable, stri
             strcat(filename, "_");
             strcat(filename, stamp.c_str());
         }
+        *mode = overwrite_ ? "w" : "a";
+        return filename;
+    }
+    if (use_logfile_) {
+        *mode = "a";
+        return logfile_;
+    }
+    // Empty means stdout.
+    return "";
+}
 
-        const char *mode = overwrite_ ? "w" : "a";
-        output = fopen(filename, mode);
-        if (!output) {
-            warning("Could not open file \"%s\" for writing!\n", filename);
-            return;
-        }
-    } else if (use_logfile_) {
-        output = fopen(logfile_.c_str(), "a");
-        if (!output) {
-            warning("Could not open file \"%s\" for writing!\n", logfile_.c_str());
-            return;
+string Printer::outputText(string &human_readable, string &fields, string &json,
+                           CborMeter *cm, vector<uchar> &cbor_record)
+{
+    if (cbor_) {
+        string text;
+        // A meter file must be readable on its own, therefore it always gets the schema.
+        if (use_meterfiles_ || !cm->schema_printed) {
+            text = *cm->schema;
+            if (!use_meterfiles_) cm->schema_printed = true;
         }
+        text.append(cbor_record.begin(), cbor_record.end());
+        return text;
     }
-    if (json_) {
-        if (output) {
-            fprintf(output, "%s\n", json.c_str());
-        } else {
-            notice("%s\n", json.c_str());
-        }
+    if (json_) return json+"\n";
+    if (fields_) return fields+"\n";
+    return human_readable+"\n";
+}
+
+bool Printer::printFiles(string &filename, const char *mode, string &text)
+{
+    STAGE_TIMER(sink_file);
+    if (filename == "") {
+        fwrite(text.data(), 1, text.length(), stdout);
+        fflush(stdout);
+        return true;
     }
-    else if (fields_) {
-        if (output) {
-            fprintf(output, "%s\n", fields.c_str());
-        } else {
-            notice("%s\n", fields.c_str());
-        }
+    if (use_logfile_ && filename == logfile_ && writeLogfileAndWait(text.data(), text.length()))
+    {
+        // The log writer thread owns the open log file. Wait for the write,
+        // a spooled reading must not be acked before it is in the file.
+        return true;
     }
-    else {
-        if (output) {
-            fprintf(output, "%s\n", human_readable.c_str());
-        } else {
-            notice("%s\n", human_readable.c_str());
-        }
+    FILE *output = fopen(filename.c_str(), mode);
+    if (!output) {
+        warning("Could not open file \"%s\" for writing!\n", filename.c_str());
+        return false;
     }
-
-    if (output != stdout && output) {
-        fclose(output);
+    size_t n = fwrite(text.data(), 1, text.length(), output);
+    int rc = fclose(output);
+    if (n != text.length() || rc != 0) {
+        warning("Could not write to file \"%s\"!\n", filename.c_str());
+        return false;
     }
+    return true;
 }
@@ -17,13 +17,18 @@
 
 #include"cmdline.h"
 #include"meters.h"
+#include"publisher.h"
+#include"spool.h"
 #include"wmbus.h"
 
+#include<map>
+
 using namespace std;
 
 struct Printer {
     Printer(bool json,
             bool fields,
+            bool cbor,
             char separator,
             bool meterfiles, string &meterfiles_dir,
             bool use_logfile, string &logfile,
@@ -33,10 +38,14 @@ struct Printer {
             MeterFileTimestamp timestamp);
 
     void print(Telegram *t, Meter *meter, vector<string> *more_json);
+    // Also hand every printed reading over to the publisher.
+    void setPublisher(Publisher *publisher) { publisher_ = publisher; }
+    // Pass readings to shells and files through the spool, which retries failed deliveries.
+    void setSpool(Spool *spool);
 
     private:
 
-    bool json_, fields_;
+    bool json_, fields_, cbor_;
     bool use_meterfiles_;
     string meterfiles_dir_;
     bool use_logfile_;
@@ -46,8 +55,29 @@ struct Printer {
     bool overwrite_;
     MeterFileNaming naming_;
     MeterFileTimestamp timestamp_;
+    Publisher *publisher_ {};
+    Spool *spool_ {};
+
+    // Each meter gets an index in the cbor output, its schema is only written
+    // again to stdout/logfile when it changes, or when the logfile was rotated.
+    struct CborMeter
+    {
+        int index;
+        shared_ptr<const string> schema;
+        bool schema_printed;
+    };
+    map<Meter*,CborMeter> cbor_meters_;
+    uint64_t logfile_generation_ {};
 
-    void printShells(Meter *meter, vector<string> &envs);
-    void printFiles(Meter *meter, Telegram *t, string &human_readable, string &fields, string &json);
+    CborMeter *cborMeter(Meter *meter);
+    vector<string> &shellsFor(Meter *meter);
+    bool printShells(vector<string> &shells, vector<string> &envs);
+    string outputFilename(Meter *meter, Telegram *t, const char **mode);
+    string outputText(string &human_readable, string &fields, string &json,
+                      CborMeter *cm, vector<uchar> &cbor_record);
+    bool printFiles(string &filename, const char *mode, string &text);
+    void spoolReading(vector<string> &shells, vector<string> &envs,
+                      string &filename, const char *mode, string &text);
+    void publish(Meter *meter, Telegram *t, string &json, CborMeter *cm, vector<uchar> &cbor_record);
 
 };
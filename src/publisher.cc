@@ -0,0 +1,482 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"publisher.h"
+#include"stats.h"
+#include"util.h"
+
+#include<arpa/inet.h>
+#include<atomic>
+#include<deque>
+#include<map>
+#include<errno.h>
+#include<fcntl.h>
+#include<netinet/in.h>
+#include<pthread.h>
+#include<string.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Beyond this the fds would no longer fit in the fd_set of the event loop.
+#define PUBLISH_MAX_SUBSCRIBERS 256
+
+struct Listener
+{
+    int fd {-1};
+    string spec;
+    string unix_path; // Removed when the publisher shuts down.
+};
+
+struct Subscriber
+{
+    int fd {-1};
+    string partial_line;
+
+    // Filters, empty means match anything.
+    string name;
+    string type;
+    vector<string> ids;
+    bool cbor {};
+    // The schema last sent for each meter index, when using cbor.
+    map<int,shared_ptr<const string>> sent_schemas;
+
+    deque<shared_ptr<const string>> queue;
+    size_t offset {}; // Bytes of the front entry in queue already sent.
+    size_t queued_bytes {};
+    MemoryTracker queue_memory { Memory::output_queues };
+    bool disconnect {};
+};
+
+struct PublisherImp : public Publisher
+{
+    PublisherImp(SerialCommunicationManager *manager, size_t max_queue_bytes);
+    ~PublisherImp();
+
+    bool listen(string spec);
+    void publish(Publication &p);
+    int numSubscribers();
+    bool wantsCbor() { return cbor_subscribers_ > 0; }
+
+private:
+
+    void accept(int listen_fd);
+    void readable(int fd);
+    void writable(int fd);
+
+    Subscriber *lookup(int fd);
+    bool matches(Subscriber *s, Publication &p);
+    void setFilter(Subscriber *s, string line);
+    void flush(Subscriber *s);
+    void enqueue(Subscriber *s, shared_ptr<const string> msg);
+    void removeDisconnected();
+
+    SerialCommunicationManager *manager_;
+    size_t max_queue_bytes_;
+
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    vector<Listener> listeners_;
+    vector<unique_ptr<Subscriber>> subscribers_;
+    atomic<int> cbor_subscribers_ {};
+};
+
+PublisherImp::PublisherImp(SerialCommunicationManager *manager, size_t max_queue_bytes)
+{
+    manager_ = manager;
+    max_queue_bytes_ = max_queue_bytes;
+}
+
+PublisherImp::~PublisherImp()
+{
+    // The callbacks take the lock, wait for them without holding it.
+    // Stop accepting first, so that no new subscriber is added meanwhile.
+    vector<int> fds;
+    pthread_mutex_lock(&lock_);
+    for (auto &l : listeners_) fds.push_back(l.fd);
+    pthread_mutex_unlock(&lock_);
+    for (int fd : fds) manager_->unwatchFdAndWait(fd);
+
+    fds.clear();
+    pthread_mutex_lock(&lock_);
+    for (auto &s : subscribers_) fds.push_back(s->fd);
+    pthread_mutex_unlock(&lock_);
+    for (int fd : fds) manager_->unwatchFdAndWait(fd);
+
+    pthread_mutex_lock(&lock_);
+    for (auto &s : subscribers_) close(s->fd);
+    subscribers_.clear();
+    for (auto &l : listeners_)
+    {
+        close(l.fd);
+        if (l.unix_path != "") unlink(l.unix_path.c_str());
+    }
+    listeners_.clear();
+    pthread_mutex_unlock(&lock_);
+}
+
+static bool setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) return false;
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) return false;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return true;
+}
+
+bool PublisherImp::listen(string spec)
+{
+    Listener l;
+    l.spec = spec;
+
+    if (spec.rfind("unix:", 0) == 0)
+    {
+        string path = spec.substr(5);
+        struct sockaddr_un addr;
+        if (path.length() == 0 || path.length() >= sizeof(addr.sun_path))
+        {
+            warning("(publish) bad unix socket path \"%s\"\n", path.c_str());
+            return false;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path.c_str());
+
+        l.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (l.fd == -1) return false;
+        // Remove a stale socket left behind by a previous run.
+        unlink(path.c_str());
+        if (bind(l.fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+        {
+            warning("(publish) could not bind to \"%s\" %s\n", path.c_str(), strerror(errno));
+            close(l.fd);
+            return false;
+        }
+        l.unix_path = path;
+    }
+    else if (spec.rfind("tcp:", 0) == 0)
+    {
+        string port = spec.substr(4);
+        if (!isNumber(port) || atoi(port.c_str()) <= 0 || atoi(port.c_str()) > 65535)
+        {
+            warning("(publish) bad tcp port \"%s\"\n", port.c_str());
+            return false;
+        }
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(port.c_str()));
+        // Only localhost, there is neither authentication nor encryption.
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        l.fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (l.fd == -1) return false;
+        int on = 1;
+        setsockopt(l.fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(l.fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+        {
+            warning("(publish) could not bind to localhost port %s %s\n", port.c_str(), strerror(errno));
+            close(l.fd);
+            return false;
+        }
+    }
+    else
+    {
+        warning("(publish) expected unix:<path> or tcp:<port> but got \"%s\"\n", spec.c_str());
+        return false;
+    }
+
+    if (::listen(l.fd, 16) == -1 || !setNonBlocking(l.fd))
+    {
+        warning("(publish) could not listen on %s %s\n", spec.c_str(), strerror(errno));
+        close(l.fd);
+        if (l.unix_path != "") unlink(l.unix_path.c_str());
+        return false;
+    }
+
+    int fd = l.fd;
+    if (!manager_->watchFd(fd, [this,fd](){ accept(fd); }, NULL))
+    {
+        close(fd);
+        if (l.unix_path != "") unlink(l.unix_path.c_str());
+        return false;
+    }
+    pthread_mutex_lock(&lock_);
+    listeners_.push_back(l);
+    pthread_mutex_unlock(&lock_);
+    verbose("(publish) listening on %s\n", spec.c_str());
+    return true;
+}
+
+void PublisherImp::accept(int listen_fd)
+{
+    for (;;)
+    {
+        int fd = ::accept(listen_fd, NULL, NULL);
+        if (fd == -1)
+        {
+            if (errno == EINTR) continue;
+            // EAGAIN, no more pending connections.
+            break;
+        }
+        pthread_mutex_lock(&lock_);
+        size_t n = subscribers_.size();
+        pthread_mutex_unlock(&lock_);
+        if (n >= PUBLISH_MAX_SUBSCRIBERS)
+        {
+            warning("(publish) too many subscribers, refusing fd=%d\n", fd);
+            close(fd);
+            continue;
+        }
+        if (!setNonBlocking(fd))
+        {
+            close(fd);
+            continue;
+        }
+#ifdef SO_NOSIGPIPE
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        Subscriber *s = new Subscriber();
+        s->fd = fd;
+        // Watch before adding, a publish from another thread might want to write to it at once.
+        if (!manager_->watchFd(fd, [this,fd](){ readable(fd); }, [this,fd](){ writable(fd); }))
+        {
+            delete s;
+            close(fd);
+            continue;
+        }
+        pthread_mutex_lock(&lock_);
+        subscribers_.push_back(unique_ptr<Subscriber>(s));
+        pthread_mutex_unlock(&lock_);
+        verbose("(publish) subscriber connected fd=%d\n", fd);
+    }
+}
+
+Subscriber *PublisherImp::lookup(int fd)
+{
+    for (auto &s : subscribers_)
+    {
+        if (s->fd == fd) return s.get();
+    }
+    return NULL;
+}
+
+void PublisherImp::setFilter(Subscriber *s, string line)
+{
+    s->name = "";
+    s->type = "";
+    s->ids.clear();
+    if (s->cbor) cbor_subscribers_--;
+    s->cbor = false;
+    s->sent_schemas.clear();
+
+    size_t pos = 0;
+    while (pos < line.length())
+    {
+        size_t end = line.find_first_of(" \t\r", pos);
+        if (end == string::npos) end = line.length();
+        string term = line.substr(pos, end-pos);
+        pos = end+1;
+        if (term == "") continue;
+
+        size_t eq = term.find('=');
+        string key = term.substr(0, eq);
+        string value = (eq == string::npos) ? "" : term.substr(eq+1);
+
+        if (key == "name") s->name = value;
+        else if (key == "type") s->type = value;
+        else if (key == "id" && isValidMatchExpressions(value, true)) s->ids = splitMatchExpressions(value);
+        else if (key == "format" && (value == "json" || value == "cbor")) s->cbor = (value == "cbor");
+        else warning("(publish) subscriber fd=%d sent unknown filter \"%s\"\n", s->fd, term.c_str());
+    }
+    if (s->cbor) cbor_subscribers_++;
+    debug("(publish) subscriber fd=%d filter \"%s\"\n", s->fd, line.c_str());
+}
+
+void PublisherImp::readable(int fd)
+{
+    pthread_mutex_lock(&lock_);
+    Subscriber *s = lookup(fd);
+    if (s == NULL)
+    {
+        pthread_mutex_unlock(&lock_);
+        return;
+    }
+
+    char buf[256];
+    for (;;)
+    {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n > 0)
+        {
+            s->partial_line.append(buf, n);
+            size_t nl;
+            while ((nl = s->partial_line.find('\n')) != string::npos)
+            {
+                setFilter(s, s->partial_line.substr(0, nl));
+                s->partial_line.erase(0, nl+1);
+            }
+            if (s->partial_line.length() > 4096) s->disconnect = true;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        // The subscriber closed the connection, or something went wrong.
+        s->disconnect = true;
+        break;
+    }
+    removeDisconnected();
+    pthread_mutex_unlock(&lock_);
+}
+
+void PublisherImp::writable(int fd)
+{
+    pthread_mutex_lock(&lock_);
+    Subscriber *s = lookup(fd);
+    if (s != NULL)
+    {
+        flush(s);
+        removeDisconnected();
+    }
+    pthread_mutex_unlock(&lock_);
+}
+
+void PublisherImp::flush(Subscriber *s)
+{
+    while (s->queue.size() > 0)
+    {
+        const string &msg = *s->queue.front();
+        ssize_t n = send(s->fd, msg.data()+s->offset, msg.length()-s->offset, MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) s->disconnect = true;
+            break;
+        }
+        s->offset += n;
+        s->queued_bytes -= n;
+        s->queue_memory.update(s->queued_bytes);
+        if (s->offset == msg.length())
+        {
+            s->queue.pop_front();
+            s->offset = 0;
+        }
+    }
+    // Only ask the event loop for writability when there is something left to send.
+    manager_->wantWrite(s->fd, s->queue.size() > 0 && !s->disconnect);
+}
+
+void PublisherImp::enqueue(Subscriber *s, shared_ptr<const string> msg)
+{
+    // A subscriber with an empty queue always gets the message, even when it is
+    // larger than the queue limit, the limit only applies to unsent backlog.
+    if (s->queue.size() > 0 && s->queued_bytes+msg->length() > max_queue_bytes_)
+    {
+        warning("(publish) subscriber fd=%d is too slow, disconnecting.\n", s->fd);
+        s->disconnect = true;
+        return;
+    }
+    bool was_empty = s->queue.size() == 0;
+    s->queue.push_back(msg);
+    s->queued_bytes += msg->length();
+    s->queue_memory.update(s->queued_bytes);
+    // Try to send immediately, this avoids a round trip through the event loop
+    // for the common case where the subscriber keeps up.
+    if (was_empty) flush(s);
+}
+
+void PublisherImp::removeDisconnected()
+{
+    for (auto i = subscribers_.begin(); i != subscribers_.end(); )
+    {
+        if ((*i)->disconnect)
+        {
+            verbose("(publish) subscriber disconnected fd=%d\n", (*i)->fd);
+            if ((*i)->cbor) cbor_subscribers_--;
+            manager_->unwatchFd((*i)->fd);
+            close((*i)->fd);
+            i = subscribers_.erase(i);
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
+
+bool PublisherImp::matches(Subscriber *s, Publication &p)
+{
+    if (s->name != "" && s->name != p.name) return false;
+    if (s->type != "" && s->type != p.type) return false;
+    if (s->ids.size() > 0 && !doesIdMatchExpressions(p.id, s->ids)) return false;
+    return true;
+}
+
+void PublisherImp::publish(Publication &p)
+{
+    pthread_mutex_lock(&lock_);
+    for (auto &s : subscribers_)
+    {
+        if (!matches(s.get(), p)) continue;
+
+        if (!s->cbor)
+        {
+            enqueue(s.get(), p.json);
+            continue;
+        }
+        // The subscriber asked for cbor after the reading was printed.
+        if (!p.cbor) continue;
+        shared_ptr<const string> &sent = s->sent_schemas[p.index];
+        if (sent != p.cbor_schema)
+        {
+            enqueue(s.get(), p.cbor_schema);
+            sent = p.cbor_schema;
+        }
+        enqueue(s.get(), p.cbor);
+    }
+    removeDisconnected();
+    pthread_mutex_unlock(&lock_);
+}
+
+int PublisherImp::numSubscribers()
+{
+    pthread_mutex_lock(&lock_);
+    int n = subscribers_.size();
+    pthread_mutex_unlock(&lock_);
+    return n;
+}
+
+unique_ptr<Publisher> createPublisher(vector<string> specs,
+                                      SerialCommunicationManager *manager,
+                                      size_t max_queue_bytes)
+{
+    PublisherImp *p = new PublisherImp(manager, max_queue_bytes);
+    unique_ptr<Publisher> publisher(p);
+
+    for (string &spec : specs)
+    {
+        if (!p->listen(spec))
+        {
+            error("Could not publish on \"%s\"\n", spec.c_str());
+        }
+    }
+    return publisher;
+}
@@ -0,0 +1,71 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PUBLISHER_H_
+#define PUBLISHER_H_
+
+#include"serial.h"
+
+#include<memory>
+#include<string>
+#include<vector>
+
+using namespace std;
+
+// A decoded reading handed over to the publisher. Each representation
+// is serialized once and then shared by all subscribers that want it.
+struct Publication
+{
+    string name; // The name of the meter in the config.
+    string id;   // The id of the meter that sent the telegram.
+    string type; // The meter driver, eg multical21.
+    shared_ptr<const string> json; // A single line, terminated with a newline.
+    int index {}; // The meter index used in the cbor records.
+    shared_ptr<const string> cbor_schema; // The same object as long as the schema is unchanged.
+    shared_ptr<const string> cbor; // Null when no subscriber wanted cbor.
+};
+
+/**
+  A Publisher listens on unix domain sockets (unix:/run/wmbusmeters.sock)
+  and/or localhost tcp ports (tcp:4711) and sends each decoded reading,
+  one json object per line, to all connected subscribers.
+
+  A subscriber can at any time send a line with space separated filters:
+      name=<meter name> id=<id match expressions> type=<meter driver>
+  Only readings that match all given filters are then sent to the subscriber.
+  An empty line removes the filters. Add format=cbor to the line to receive
+  the compact binary records described in cbor.h instead of json.
+
+  Each subscriber has a bounded send queue, a subscriber that
+  does not keep up with the readings is disconnected.
+*/
+struct Publisher
+{
+    virtual void publish(Publication &p) = 0;
+    virtual int numSubscribers() = 0;
+    // True if any subscriber wants cbor, otherwise only the json has to be printed.
+    virtual bool wantsCbor() = 0;
+    virtual ~Publisher() = default;
+};
+
+#define DEFAULT_PUBLISH_QUEUE_BYTES (1024*1024)
+
+unique_ptr<Publisher> createPublisher(vector<string> specs,
+                                      SerialCommunicationManager *manager,
+                                      size_t max_queue_bytes = DEFAULT_PUBLISH_QUEUE_BYTES);
+
+#endif
@@ -18,15 +18,21 @@
 #include"util.h"
 #include"serial.h"
 #include"shell.h"
+#include"stats.h"
 
 #include <algorithm>
+#include <arpa/inet.h>
 #include <fcntl.h>
 #include <functional>
+#include <map>
 #include <memory.h>
+#include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -36,10 +42,14 @@
 
 static int openSerialTTY(const char *tty, int baud_rate);
 
+// Before the event loop runs, a send gives up when the tty accepts nothing for this long.
+#define SERIAL_SEND_TIMEOUT_MS 1000
+
 struct SerialDeviceImp;
 struct SerialDeviceTTY;
 struct SerialDeviceCommand;
 struct SerialDeviceFile;
+struct SerialDeviceSocket;
 struct SerialDeviceSimulator;
 
 struct SerialCommunicationManagerImp : public SerialCommunicationManager
@@ -51,6 +61,7 @@ struct SerialCommunicationManagerImp : public SerialCommunicationManager
     unique_ptr<SerialDevice> createSerialDeviceCommand(string command, vector<string> args, vector<string> envs,
                                                        function<void()> on_exit);
     unique_ptr<SerialDevice> createSerialDeviceFile(string file);
+    unique_ptr<SerialDevice> createSerialDeviceSocket(string spec, bool lines);
     unique_ptr<SerialDevice> createSerialDeviceSimulator();
 
     void listenTo(SerialDevice *sd, function<void()> cb);
@@ -59,10 +70,19 @@ struct SerialCommunicationManagerImp : public SerialCommunicationManager
     void waitForStop();
     bool isRunning();
     void setReopenAfter(int seconds);
+    bool watchFd(int fd, function<void()> on_readable, function<void()> on_writable);
+    void wantWrite(int fd, bool want);
+    void unwatchFd(int fd);
+    void unwatchFdAndWait(int fd);
+    void addRegularCallback(int seconds, function<void()> cb);
+    void invokeRegularCallbacks();
 
     void opened(SerialDeviceImp *sd);
     void closed(SerialDeviceImp *sd);
     void closeAll();
+    // True when the sends can be queued for the event loop, which is then woken up.
+    bool writesQueued();
+    void wakeEventLoop();
 
     time_t reopenAfter() { return reopen_after_seconds_; }
 
@@ -71,7 +91,16 @@ private:
     void *eventLoop();
     static void *startLoop(void *);
 
+    struct WatchedFd
+    {
+        int fd;
+        function<void()> on_readable;
+        function<void()> on_writable;
+        bool want_write;
+    };
+
     bool running_ {};
+    bool loop_active_ {}; // The event loop has been released and has not yet stopped.
     bool expect_devices_to_work_ {}; // false during detection phase, true when running.
     pthread_t main_thread_ {};
     pthread_t thread_ {};
@@ -83,6 +112,19 @@ private:
     pthread_mutex_t event_loop_lock_ = PTHREAD_MUTEX_INITIALIZER;
     pthread_mutex_t devices_lock_ = PTHREAD_MUTEX_INITIALIZER;
     vector<SerialDeviceImp*> devices_;
+    pthread_mutex_t watched_lock_ = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t watched_done_ = PTHREAD_COND_INITIALIZER;
+    vector<WatchedFd> watched_;
+    int running_fd_ {-1}; // The fd whose callback the event loop is running.
+    pthread_t running_thread_ {};
+
+    struct RegularCallback
+    {
+        int seconds;
+        time_t last;
+        function<void()> cb;
+    };
+    vector<RegularCallback> regular_callbacks_;
 };
 
 SerialCommunicationManagerImp::~SerialCommunicationManagerImp()
@@ -102,16 +144,28 @@ struct SerialDeviceImp : public SerialDevice
     int fd() { return fd_; }
     void fill(vector<uchar> &data) {};
     int receive(vector<uchar> *data);
+    string source() { return ""; }
     bool working() { return fd_ != -1; }
     bool readonly() { return is_stdin_ || is_file_; }
     void expectAscii() { expecting_ascii_ = true; }
     void setIsFile() { is_file_ = true; }
     void setIsStdin() { is_stdin_ = true; }
+    bool hasQueuedOutput();
+    bool writeQueued(bool wait);
 
 protected:
 
+    bool queueSend(vector<uchar> &data, function<void(bool)> on_sent, SerialCommunicationManagerImp *manager);
+    void failQueued();
+    void closeWritten();
+
     pthread_mutex_t read_lock_ = PTHREAD_MUTEX_INITIALIZER;
     pthread_mutex_t write_lock_ = PTHREAD_MUTEX_INITIALIZER;
+    // The bytes from out_pos_ are not yet written. The callbacks are invoked
+    // when out_pos_ has passed their offset.
+    vector<uchar> out_;
+    size_t out_pos_ {};
+    vector<pair<size_t,function<void(bool)>>> out_done_;
     function<void()> on_data_;
     int fd_ = -1;
     bool expecting_ascii_ {}; // If true, print using safeString instead if bin2hex
@@ -125,6 +179,7 @@ protected:
 
 int SerialDeviceImp::receive(vector<uchar> *data)
 {
+    STAGE_TIMER(serial_receive);
     bool close_me = false;
 
     pthread_mutex_lock(&read_lock_);
@@ -184,6 +239,108 @@ int SerialDeviceImp::receive(vector<uchar> *data)
     return num_read;
 }
 
+bool SerialDeviceImp::hasQueuedOutput()
+{
+    pthread_mutex_lock(&write_lock_);
+    bool has = out_pos_ < out_.size();
+    pthread_mutex_unlock(&write_lock_);
+    return has;
+}
+
+bool SerialDeviceImp::queueSend(vector<uchar> &data, function<void(bool)> on_sent,
+                                SerialCommunicationManagerImp *manager)
+{
+    pthread_mutex_lock(&write_lock_);
+    if (fd_ == -1)
+    {
+        pthread_mutex_unlock(&write_lock_);
+        return false;
+    }
+    bool was_empty = out_pos_ == out_.size();
+    out_.insert(out_.end(), data.begin(), data.end());
+    if (on_sent) out_done_.push_back({ out_.size(), on_sent });
+    bool queued = manager->writesQueued();
+    pthread_mutex_unlock(&write_lock_);
+
+    if (!queued) return writeQueued(true);
+    // Otherwise the event loop already waits for the tty to become writable.
+    if (was_empty) manager->wakeEventLoop();
+    return true;
+}
+
+// Writes the queued bytes, the commands queued since the last write are coalesced
+// into a single write. With wait, it does not return until all bytes are written.
+bool SerialDeviceImp::writeQueued(bool wait)
+{
+    bool ok = true;
+    pthread_mutex_lock(&write_lock_);
+    while (out_pos_ < out_.size())
+    {
+        int nw = write(fd_, &out_[out_pos_], out_.size()-out_pos_);
+        if (nw > 0)
+        {
+            if (isDebugEnabled())
+            {
+                string msg = bin2hex(out_.begin()+out_pos_, out_.end(), nw);
+                debug("(serial) sent \"%s\" to fd=%d\n", msg.c_str(), fd_);
+            }
+            out_pos_ += nw;
+            continue;
+        }
+        if (nw < 0 && errno == EINTR) continue;
+        if (nw < 0 && errno == EAGAIN)
+        {
+            if (!wait) break;
+            struct pollfd pfd = { fd_, POLLOUT, 0 };
+            if (poll(&pfd, 1, SERIAL_SEND_TIMEOUT_MS) == 1) continue;
+        }
+        debug("(serial) write to fd=%d failed, dropping %zu queued bytes\n", fd_, out_.size()-out_pos_);
+        ok = false;
+        break;
+    }
+    vector<pair<function<void(bool)>,bool>> done;
+    size_t n = 0;
+    for (; n < out_done_.size() && out_done_[n].first <= out_pos_; ++n) done.push_back({ out_done_[n].second, true });
+    if (!ok)
+    {
+        for (; n < out_done_.size(); ++n) done.push_back({ out_done_[n].second, false });
+    }
+    out_done_.erase(out_done_.begin(), out_done_.begin()+n);
+    if (!ok || out_pos_ == out_.size())
+    {
+        out_.clear();
+        out_pos_ = 0;
+    }
+    pthread_mutex_unlock(&write_lock_);
+
+    for (auto &d : done) d.first(d.second);
+    return ok;
+}
+
+// The device is closed, the queued bytes will never be written.
+void SerialDeviceImp::failQueued()
+{
+    pthread_mutex_lock(&write_lock_);
+    vector<pair<size_t,function<void(bool)>>> done;
+    done.swap(out_done_);
+    out_.clear();
+    out_pos_ = 0;
+    pthread_mutex_unlock(&write_lock_);
+
+    for (auto &d : done) d.second(false);
+}
+
+// Close the fd in the write lock, the event loop might be writing the queued bytes to it.
+void SerialDeviceImp::closeWritten()
+{
+    pthread_mutex_lock(&write_lock_);
+    ::flock(fd_, LOCK_UN);
+    ::close(fd_);
+    fd_ = -1;
+    pthread_mutex_unlock(&write_lock_);
+    failQueued();
+}
+
 struct SerialDeviceTTY : public SerialDeviceImp
 {
     SerialDeviceTTY(string device, int baud_rate, SerialCommunicationManagerImp *manager);
@@ -192,7 +349,7 @@ struct SerialDeviceTTY : public SerialDeviceImp
     bool open(bool fail_if_not_ok);
     void close();
     void checkIfShouldReopen();
-    bool send(vector<uchar> &data);
+    bool send(vector<uchar> &data, function<void(bool)> on_sent);
     bool working();
     SerialCommunicationManager *manager() { return manager_; }
 
@@ -241,9 +398,7 @@ bool SerialDeviceTTY::open(bool fail_if_not_ok)
 void SerialDeviceTTY::close()
 {
     if (fd_ == -1) return;
-    ::flock(fd_, LOCK_UN);
-    ::close(fd_);
-    fd_ = -1;
+    closeWritten();
     manager_->closed(this);
     verbose("(serialtty) closed %s\n", device_.c_str());
 }
@@ -273,34 +428,11 @@ void SerialDeviceTTY::checkIfShouldReopen()
     }
 }
 
-bool SerialDeviceTTY::send(vector<uchar> &data)
+bool SerialDeviceTTY::send(vector<uchar> &data, function<void(bool)> on_sent)
 {
     if (data.size() == 0) return true;
 
-    pthread_mutex_lock(&write_lock_);
-
-    bool rc = true;
-    int n = data.size();
-    int written = 0;
-    while (true) {
-        int nw = write(fd_, &data[written], n-written);
-        if (nw > 0) written += nw;
-        if (nw < 0) {
-            if (errno==EINTR) continue;
-            rc = false;
-            goto end;
-        }
-        if (written == n) break;
-    }
-
-    if (isDebugEnabled()) {
-        string msg = bin2hex(data);
-        debug("(serial %s) sent \"%s\"\n", device_.c_str(), msg.c_str());
-    }
-
-    end:
-    pthread_mutex_unlock(&write_lock_);
-    return rc;
+    return queueSend(data, on_sent, manager_);
 }
 
 bool SerialDeviceTTY::working()
@@ -327,7 +459,7 @@ struct SerialDeviceCommand : public SerialDeviceImp
     bool open(bool fail_if_not_ok);
     void close();
     void checkIfShouldReopen() {}
-    bool send(vector<uchar> &data);
+    bool send(vector<uchar> &data, function<void(bool)> on_sent);
     int available();
     bool working();
 
@@ -340,7 +472,6 @@ struct SerialDeviceCommand : public SerialDeviceImp
     vector<string> args_;
     vector<string> envs_;
 
-    pthread_mutex_t write_lock_ = PTHREAD_MUTEX_INITIALIZER;
     pthread_mutex_t read_lock_ = PTHREAD_MUTEX_INITIALIZER;
     SerialCommunicationManagerImp *manager_;
     function<void()> on_exit_;
@@ -383,9 +514,7 @@ void SerialDeviceCommand::close()
         stopBackgroundShell(pid_);
         pid_ = 0;
     }
-    ::flock(fd_, LOCK_UN);
-    ::close(fd_);
-    fd_ = -1;
+    closeWritten();
     manager_->closed(this);
     verbose("(serialcmd) closed %s\n", command_.c_str());
 }
@@ -399,34 +528,11 @@ bool SerialDeviceCommand::working()
     return false;
 }
 
-bool SerialDeviceCommand::send(vector<uchar> &data)
+bool SerialDeviceCommand::send(vector<uchar> &data, function<void(bool)> on_sent)
 {
     if (data.size() == 0) return true;
 
-    pthread_mutex_lock(&write_lock_);
-
-    bool rc = true;
-    int n = data.size();
-    int written = 0;
-    while (true) {
-        int nw = write(fd_, &data[written], n-written);
-        if (nw > 0) written += nw;
-        if (nw < 0) {
-            if (errno==EINTR) continue;
-            rc = false;
-            goto end;
-        }
-        if (written == n) break;
-    }
-
-    if (isDebugEnabled()) {
-        string msg = bin2hex(data);
-        debug("(serial %s) sent \"%s\"\n", command_.c_str(), msg.c_str());
-    }
-
-    end:
-    pthread_mutex_unlock(&write_lock_);
-    return rc;
+    return queueSend(data, on_sent, manager_);
 }
 
 struct SerialDeviceFile : public SerialDeviceImp
@@ -437,7 +543,7 @@ struct SerialDeviceFile : public SerialDeviceImp
     bool open(bool fail_if_not_ok);
     void close();
     void checkIfShouldReopen();
-    bool send(vector<uchar> &data);
+    bool send(vector<uchar> &data, function<void(bool)> on_sent);
     int available();
     SerialCommunicationManager *manager() { return manager_; }
 
@@ -507,11 +613,314 @@ void SerialDeviceFile::checkIfShouldReopen()
 {
 }
 
-bool SerialDeviceFile::send(vector<uchar> &data)
+bool SerialDeviceFile::send(vector<uchar> &data, function<void(bool)> on_sent)
 {
+    if (on_sent) on_sent(true);
     return true;
 }
 
+// A remote receiver that sends more bytes than this without completing a line is dropped,
+// and a receiver is read until this many bytes of complete lines are waiting to be handled.
+#define SOCKET_MAX_PARTIAL 65536
+// Beyond this the fds would no longer fit in the fd_set of the event loop.
+#define SOCKET_MAX_SENDERS 256
+
+// Listens for the frames forwarded by remote receivers, many at the same time.
+// Each tcp sender gets its own buffer and only complete frames (or complete lines)
+// are handed over, so the frames from different senders are never mixed up
+// in the read buffer of the driver. The senders are watched by the event loop,
+// there is no thread per connection.
+struct SerialDeviceSocket : public SerialDeviceImp
+{
+    SerialDeviceSocket(string spec, bool lines, SerialCommunicationManagerImp *manager);
+    ~SerialDeviceSocket();
+
+    bool open(bool fail_if_not_ok);
+    void close();
+    void checkIfShouldReopen() { }
+    bool send(vector<uchar> &data, function<void(bool)> on_sent) { return false; }
+    int receive(vector<uchar> *data);
+    bool readonly() { return true; }
+    string source() { return source_; }
+    SerialCommunicationManager *manager() { return manager_; }
+
+private:
+
+    struct Sender
+    {
+        int fd;
+        string address;
+        vector<uchar> buffer; // The start of an incomplete frame.
+    };
+
+    void acceptSenders();
+    void senderReadable(int fd);
+    void closeSender(int fd);
+    size_t completeLength(vector<uchar> &buffer);
+    void updateMemory();
+
+    string spec_;
+    bool tcp_ {};
+    int port_ {};
+    bool lines_ {};
+    SerialCommunicationManagerImp *manager_;
+    map<int,Sender> senders_;
+    vector<uchar> pending_; // Complete frames from one sender, picked up by the next receive.
+    string source_;
+    MemoryTracker buffers_memory_ { Memory::frame_buffers };
+};
+
+SerialDeviceSocket::SerialDeviceSocket(string spec, bool lines, SerialCommunicationManagerImp *manager)
+{
+    spec_ = spec;
+    tcp_ = startsWith(spec, "tcp:");
+    port_ = atoi(spec.c_str()+4);
+    lines_ = lines;
+    manager_ = manager;
+    expecting_ascii_ = lines;
+}
+
+SerialDeviceSocket::~SerialDeviceSocket()
+{
+    close();
+}
+
+static string addressOf(struct sockaddr_in &addr)
+{
+    char buf[INET_ADDRSTRLEN];
+    if (!inet_ntop(AF_INET, &addr.sin_addr, buf, sizeof(buf))) return "?";
+    return buf;
+}
+
+bool SerialDeviceSocket::open(bool fail_if_not_ok)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port_);
+    // The receivers are remote.
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    fd_ = socket(AF_INET, tcp_ ? SOCK_STREAM : SOCK_DGRAM, 0);
+    bool ok = fd_ != -1;
+    if (ok)
+    {
+        int on = 1;
+        setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        ok = bind(fd_, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+            (!tcp_ || listen(fd_, 16) == 0) &&
+            fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK) == 0;
+    }
+    if (!ok)
+    {
+        string err = strerror(errno);
+        if (fd_ != -1) ::close(fd_);
+        fd_ = -1;
+        if (fail_if_not_ok)
+        {
+            error("Could not listen on %s %s\n", spec_.c_str(), err.c_str());
+        }
+        return false;
+    }
+    fcntl(fd_, F_SETFD, FD_CLOEXEC);
+    verbose("(socket) listening on %s\n", spec_.c_str());
+    manager_->opened(this);
+    return true;
+}
+
+void SerialDeviceSocket::close()
+{
+    if (fd_ == -1) return;
+    pthread_mutex_lock(&read_lock_);
+    vector<int> fds;
+    for (auto &p : senders_) fds.push_back(p.first);
+    pthread_mutex_unlock(&read_lock_);
+    // A sender callback takes the read lock, wait for it without holding the lock.
+    for (int fd : fds) manager_->unwatchFdAndWait(fd);
+    pthread_mutex_lock(&read_lock_);
+    for (auto &p : senders_)
+    {
+        manager_->unwatchFd(p.first);
+        ::close(p.first);
+    }
+    senders_.clear();
+    updateMemory();
+    pthread_mutex_unlock(&read_lock_);
+    ::close(fd_);
+    fd_ = -1;
+    manager_->closed(this);
+    verbose("(socket) closed %s\n", spec_.c_str());
+}
+
+size_t SerialDeviceSocket::completeLength(vector<uchar> &buffer)
+{
+    if (lines_)
+    {
+        for (size_t i = buffer.size(); i > 0; --i)
+        {
+            if (buffer[i-1] == '\n') return i;
+        }
+        return 0;
+    }
+    // Each frame begins with its length byte.
+    size_t len = 0;
+    while (len < buffer.size() && len+1+buffer[len] <= buffer.size())
+    {
+        len += 1+buffer[len];
+    }
+    return len;
+}
+
+void SerialDeviceSocket::updateMemory()
+{
+    size_t bytes = pending_.capacity();
+    for (auto &p : senders_) bytes += sizeof(Sender)+p.second.buffer.capacity();
+    buffers_memory_.update(bytes);
+}
+
+int SerialDeviceSocket::receive(vector<uchar> *data)
+{
+    STAGE_TIMER(serial_receive);
+    data->clear();
+    if (pending_.size() > 0)
+    {
+        // Handed over from senderReadable.
+        data->swap(pending_);
+        return data->size();
+    }
+    if (fd_ == -1) return 0;
+    if (tcp_)
+    {
+        // The listening socket is readable.
+        acceptSenders();
+        return 0;
+    }
+
+    // Each datagram is one or more frames from a single sender.
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    data->resize(65536);
+    ssize_t n = recvfrom(fd_, &(*data)[0], data->size(), 0, (struct sockaddr*)&from, &from_len);
+    if (n <= 0)
+    {
+        data->clear();
+        return 0;
+    }
+    data->resize(n);
+    source_ = addressOf(from);
+    size_t len = completeLength(*data);
+    if (len < data->size())
+    {
+        debug("(socket) dropping %zu bytes of an incomplete frame from %s\n", data->size()-len, source_.c_str());
+        data->resize(len);
+    }
+    return data->size();
+}
+
+void SerialDeviceSocket::acceptSenders()
+{
+    for (;;)
+    {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept(fd_, (struct sockaddr*)&addr, &addr_len);
+        if (fd == -1) break;
+        string address = addressOf(addr);
+        if (senders_.size() >= SOCKET_MAX_SENDERS)
+        {
+            warning("(socket) too many receivers connected to %s, refusing %s\n", spec_.c_str(), address.c_str());
+            ::close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        pthread_mutex_lock(&read_lock_);
+        senders_[fd] = { fd, address, {} };
+        updateMemory();
+        pthread_mutex_unlock(&read_lock_);
+        if (!manager_->watchFd(fd, [this,fd](){ senderReadable(fd); }, NULL))
+        {
+            closeSender(fd);
+            continue;
+        }
+        verbose("(socket) receiver %s connected to %s\n", address.c_str(), spec_.c_str());
+    }
+}
+
+void SerialDeviceSocket::senderReadable(int fd)
+{
+    pthread_mutex_lock(&read_lock_);
+    auto i = senders_.find(fd);
+    if (i == senders_.end())
+    {
+        pthread_mutex_unlock(&read_lock_);
+        return;
+    }
+    Sender &s = i->second;
+    bool gone = false;
+    bool too_long = false;
+    uchar buf[4096];
+    for (;;)
+    {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n > 0)
+        {
+            s.buffer.insert(s.buffer.end(), buf, buf+n);
+            size_t len = completeLength(s.buffer);
+            pending_.insert(pending_.end(), s.buffer.begin(), s.buffer.begin()+len);
+            s.buffer.erase(s.buffer.begin(), s.buffer.begin()+len);
+            if (s.buffer.size() > SOCKET_MAX_PARTIAL)
+            {
+                too_long = true;
+                break;
+            }
+            // Hand over what has been read so far, a fast sender is read again
+            // when the event loop finds the fd readable.
+            if (pending_.size() >= SOCKET_MAX_PARTIAL) break;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        gone = true;
+        break;
+    }
+    string address = s.address;
+    if (too_long)
+    {
+        warning("(socket) receiver %s sent %zu bytes without completing a frame, disconnecting\n",
+                address.c_str(), s.buffer.size());
+        gone = true;
+    }
+    else if (gone && s.buffer.size() > 0)
+    {
+        debug("(socket) dropping %zu bytes of an incomplete frame from %s\n", s.buffer.size(), address.c_str());
+    }
+    updateMemory();
+    pthread_mutex_unlock(&read_lock_);
+
+    if (pending_.size() > 0)
+    {
+        source_ = address;
+        if (on_data_) on_data_();
+        pending_.clear();
+    }
+    if (gone)
+    {
+        verbose("(socket) receiver %s disconnected from %s\n", address.c_str(), spec_.c_str());
+        closeSender(fd);
+    }
+}
+
+void SerialDeviceSocket::closeSender(int fd)
+{
+    manager_->unwatchFd(fd);
+    ::close(fd);
+    pthread_mutex_lock(&read_lock_);
+    senders_.erase(fd);
+    updateMemory();
+    pthread_mutex_unlock(&read_lock_);
+}
+
 struct SerialDeviceSimulator : public SerialDeviceImp
 {
     SerialDeviceSimulator(SerialCommunicationManagerImp *m) :
@@ -524,7 +933,7 @@ struct SerialDeviceSimulator : public SerialDeviceImp
     bool open(bool fail_if_not_ok) { return true; };
     void close() { manager_->closed(this); };
     void checkIfShouldReopen() { }
-    bool send(vector<uchar> &data) { return true; };
+    bool send(vector<uchar> &data, function<void(bool)> on_sent) { if (on_sent) on_sent(true); return true; };
     void fill(vector<uchar> &data) { data_ = data; on_data_(); }; // Fill buffer and trigger callback.
 
     int receive(vector<uchar> *data)
@@ -588,6 +997,11 @@ unique_ptr<SerialDevice> SerialCommunicationManagerImp::createSerialDeviceFile(s
     return unique_ptr<SerialDevice>(new SerialDeviceFile(file, this));
 }
 
+unique_ptr<SerialDevice> SerialCommunicationManagerImp::createSerialDeviceSocket(string spec, bool lines)
+{
+    return unique_ptr<SerialDevice>(new SerialDeviceSocket(spec, lines, this));
+}
+
 unique_ptr<SerialDevice> SerialCommunicationManagerImp::createSerialDeviceSimulator()
 {
     return unique_ptr<SerialDevice>(new SerialDeviceSimulator(this));
@@ -623,7 +1037,8 @@ void SerialCommunicationManagerImp::stop()
 
 void SerialCommunicationManagerImp::startEventLoop()
 {
-    // Release the event loop!
+    // Release the event loop! From now on it writes the queued sends.
+    if (thread_) loop_active_ = true;
     pthread_mutex_unlock(&event_loop_lock_);
 }
 
@@ -643,6 +1058,7 @@ void SerialCommunicationManagerImp::waitForStop()
             break;
         }
         usleep(1000*1000);
+        invokeRegularCallbacks();
     }
     if (signalsInstalled())
     {
@@ -664,6 +1080,100 @@ void SerialCommunicationManagerImp::setReopenAfter(int seconds)
     reopen_after_seconds_ = seconds;
 }
 
+bool SerialCommunicationManagerImp::watchFd(int fd, function<void()> on_readable, function<void()> on_writable)
+{
+    // FD_SET on a larger fd would write outside the fd_set.
+    if (fd < 0 || fd >= FD_SETSIZE)
+    {
+        warning("(serial) cannot watch fd=%d, it does not fit in the fd_set\n", fd);
+        return false;
+    }
+    pthread_mutex_lock(&watched_lock_);
+    watched_.push_back({ fd, on_readable, on_writable, false });
+    pthread_mutex_unlock(&watched_lock_);
+    debug("(serial) watching fd=%d\n", fd);
+    wakeEventLoop();
+    return true;
+}
+
+void SerialCommunicationManagerImp::wantWrite(int fd, bool want)
+{
+    bool changed = false;
+    pthread_mutex_lock(&watched_lock_);
+    for (WatchedFd &w : watched_)
+    {
+        if (w.fd == fd && w.want_write != want)
+        {
+            w.want_write = want;
+            changed = true;
+        }
+    }
+    pthread_mutex_unlock(&watched_lock_);
+    // The event loop only needs to be woken up when it must add the fd to its write set.
+    if (changed && want) wakeEventLoop();
+}
+
+void SerialCommunicationManagerImp::unwatchFd(int fd)
+{
+    pthread_mutex_lock(&watched_lock_);
+    for (auto i = watched_.begin(); i != watched_.end(); ++i)
+    {
+        if (i->fd == fd)
+        {
+            watched_.erase(i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&watched_lock_);
+    debug("(serial) stopped watching fd=%d\n", fd);
+}
+
+void SerialCommunicationManagerImp::unwatchFdAndWait(int fd)
+{
+    unwatchFd(fd);
+    pthread_mutex_lock(&watched_lock_);
+    // A callback that unwatches its own fd must not wait for itself.
+    while (running_fd_ == fd && !pthread_equal(running_thread_, pthread_self()))
+    {
+        pthread_cond_wait(&watched_done_, &watched_lock_);
+    }
+    pthread_mutex_unlock(&watched_lock_);
+}
+
+void SerialCommunicationManagerImp::addRegularCallback(int seconds, function<void()> cb)
+{
+    regular_callbacks_.push_back({ seconds, time(NULL), cb });
+}
+
+void SerialCommunicationManagerImp::invokeRegularCallbacks()
+{
+    time_t now = time(NULL);
+    for (RegularCallback &r : regular_callbacks_)
+    {
+        if (now-r.last >= r.seconds)
+        {
+            r.last = now;
+            r.cb();
+        }
+    }
+}
+
+bool SerialCommunicationManagerImp::writesQueued()
+{
+    if (!loop_active_) return false;
+    // A send from a callback in the event loop is written after the next select.
+    return signalsInstalled() || pthread_equal(thread_, pthread_self());
+}
+
+void SerialCommunicationManagerImp::wakeEventLoop()
+{
+    // No need to signal the event loop when we are running inside it.
+    if (signalsInstalled() && thread_ && !pthread_equal(thread_, pthread_self()))
+    {
+        pthread_kill(thread_, SIGUSR1);
+    }
+}
+
 void SerialCommunicationManagerImp::opened(SerialDeviceImp *sd)
 {
     pthread_mutex_lock(&devices_lock_);
@@ -715,22 +1225,35 @@ void SerialCommunicationManagerImp::closeAll()
 void *SerialCommunicationManagerImp::eventLoop()
 {
     fd_set readfds;
+    fd_set writefds;
 
     pthread_mutex_lock(&event_loop_lock_);
 
     while (running_)
     {
         FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
 
         bool all_working = true;
         pthread_mutex_lock(&devices_lock_);
-        for (SerialDevice *d : devices_)
+        for (SerialDeviceImp *d : devices_)
         {
             FD_SET(d->fd(), &readfds);
+            if (d->hasQueuedOutput()) FD_SET(d->fd(), &writefds);
             if (!d->working()) all_working = false;
         }
+        int max_fd = max_fd_;
         pthread_mutex_unlock(&devices_lock_);
 
+        pthread_mutex_lock(&watched_lock_);
+        for (WatchedFd &w : watched_)
+        {
+            if (w.on_readable) FD_SET(w.fd, &readfds);
+            if (w.want_write && w.on_writable) FD_SET(w.fd, &writefds);
+            max_fd = max(w.fd, max_fd);
+        }
+        pthread_mutex_unlock(&watched_lock_);
+
         if (!all_working)
         {
             stop();
@@ -767,7 +1290,7 @@ void *SerialCommunicationManagerImp::eventLoop()
             break;
         }
 
-        int activity = select(max_fd_+1 , &readfds, NULL , NULL, &timeout);
+        int activity = select(max_fd+1 , &readfds, &writefds, NULL, &timeout);
         if (!running_) break;
         if (activity < 0 && errno!=EINTR)
         {
@@ -777,17 +1300,20 @@ void *SerialCommunicationManagerImp::eventLoop()
         {
             // Something has happened that caused the sleeping select to wake up.
             vector<SerialDeviceImp*> to_be_notified;
+            vector<SerialDeviceImp*> writable;
             pthread_mutex_lock(&devices_lock_);
-            for (SerialDevice *d : devices_)
+            for (SerialDeviceImp *d : devices_)
             {
-                if (FD_ISSET(d->fd(), &readfds))
-                {
-                    SerialDeviceImp *si = dynamic_cast<SerialDeviceImp*>(d);
-                    to_be_notified.push_back(si);
-                }
+                if (FD_ISSET(d->fd(), &readfds)) to_be_notified.push_back(d);
+                if (FD_ISSET(d->fd(), &writefds)) writable.push_back(d);
             }
             pthread_mutex_unlock(&devices_lock_);
 
+            for (SerialDeviceImp *si : writable)
+            {
+                si->writeQueued(false);
+            }
+
             for (SerialDeviceImp *si : to_be_notified)
             {
                 if (si->on_data_)
@@ -795,6 +1321,39 @@ void *SerialCommunicationManagerImp::eventLoop()
                     si->on_data_();
                 }
             }
+
+            vector<pair<int,function<void()>>> watchers;
+            pthread_mutex_lock(&watched_lock_);
+            for (WatchedFd &w : watched_)
+            {
+                if (w.on_writable && FD_ISSET(w.fd, &writefds)) watchers.push_back({ w.fd, w.on_writable });
+                if (w.on_readable && FD_ISSET(w.fd, &readfds)) watchers.push_back({ w.fd, w.on_readable });
+            }
+            pthread_mutex_unlock(&watched_lock_);
+
+            for (auto &p : watchers)
+            {
+                // A previous callback might have closed and unwatched this fd.
+                // Mark it as running in the same lock, unwatchFdAndWait then waits for it.
+                pthread_mutex_lock(&watched_lock_);
+                bool watched = false;
+                for (WatchedFd &w : watched_)
+                {
+                    if (w.fd == p.first) watched = true;
+                }
+                if (watched)
+                {
+                    running_fd_ = p.first;
+                    running_thread_ = pthread_self();
+                }
+                pthread_mutex_unlock(&watched_lock_);
+                if (!watched) continue;
+                p.second();
+                pthread_mutex_lock(&watched_lock_);
+                running_fd_ = -1;
+                pthread_cond_broadcast(&watched_done_);
+                pthread_mutex_unlock(&watched_lock_);
+            }
         }
         vector<SerialDeviceImp*> non_working;
 
@@ -816,6 +1375,7 @@ void *SerialCommunicationManagerImp::eventLoop()
             break;
         }
     }
+    loop_active_ = false;
     verbose("(serial) event loop stopped!\n");
     pthread_mutex_unlock(&event_loop_lock_);
     return NULL;
@@ -38,8 +38,12 @@ struct SerialDevice
 {
     virtual bool open(bool fail_if_not_ok) = 0;
     virtual void close() = 0;
-    // Send will return true only if sending on a tty.
-    virtual bool send(std::vector<uchar> &data) = 0;
+    // Send will return true only if sending on a tty. The bytes are queued and written
+    // by the event loop when the tty is writable, together with the other queued bytes,
+    // so send never blocks on a full tty. Then on_sent is invoked from the event loop,
+    // with true when the bytes are written or with false if the write failed. Before the
+    // event loop runs, eg while detecting the dongle, the bytes are written at once.
+    virtual bool send(std::vector<uchar> &data, function<void(bool)> on_sent = NULL) = 0;
     // Receive returns the number of bytes received.
     virtual int receive(std::vector<uchar> *data) = 0;
     virtual int fd() = 0;
@@ -49,6 +53,8 @@ struct SerialDevice
 
     virtual void checkIfShouldReopen() = 0;
     virtual void fill(std::vector<uchar> &data) = 0; // Fill buffer with raw data.
+    // Where the latest received bytes came from, eg the address of a remote receiver, or empty.
+    virtual std::string source() = 0;
     virtual SerialCommunicationManager *manager() = 0;
     virtual ~SerialDevice() = default;
 };
@@ -64,6 +70,9 @@ struct SerialCommunicationManager
                                                                function<void()> on_exit) = 0;
     // Read from stdin (file="stdin") or a specific file.
     virtual unique_ptr<SerialDevice> createSerialDeviceFile(string file) = 0;
+    // Listen on tcp:<port> or udp:<port> for frames forwarded by remote receivers, either
+    // length prefixed frames like a raw tty, or rtl_wmbus lines when lines is true.
+    virtual unique_ptr<SerialDevice> createSerialDeviceSocket(string spec, bool lines) = 0;
     // A serial device simulator used for internal testing.
     virtual unique_ptr<SerialDevice> createSerialDeviceSimulator() = 0;
 
@@ -73,6 +82,24 @@ struct SerialCommunicationManager
     virtual void waitForStop() = 0;
     virtual bool isRunning() = 0;
     virtual void setReopenAfter(int seconds) = 0;
+
+    // Let the event loop also watch an fd that is not a serial device, for example
+    // a listening socket or a connected client. Watched fds do not count as devices,
+    // ie the manager will stop when the last device is closed even if fds are watched.
+    // on_writable is only invoked after wantWrite(fd, true) has been called.
+    // Returns false, and the fd is not watched, when it does not fit in the fd_set.
+    virtual bool watchFd(int fd, function<void()> on_readable, function<void()> on_writable) = 0;
+    virtual void wantWrite(int fd, bool want) = 0;
+    virtual void unwatchFd(int fd) = 0;
+    // Like unwatchFd, but also waits for a callback for fd that is running in the
+    // event loop to return. Do not hold a lock that the callback takes.
+    virtual void unwatchFdAndWait(int fd) = 0;
+    // Invoke cb every seconds (at one second resolution) from the thread that
+    // called waitForStop, ie not from the event loop. Add them before waitForStop.
+    virtual void addRegularCallback(int seconds, function<void()> cb) = 0;
+    // The simulated devices generate telegrams in the main thread before waitForStop,
+    // they call this now and then so that the stats are written while they run.
+    virtual void invokeRegularCallbacks() = 0;
     virtual ~SerialCommunicationManager();
 };
 
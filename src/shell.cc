@@ -19,9 +19,13 @@
 #include "util.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <algorithm>
+#include <memory>
 #include <memory.h>
 #include <pthread.h>
+#include <spawn.h>
 #include <sys/types.h>
 #if defined(__APPLE__) && defined(__MACH__) or defined(__FreeBSD__)
 #include <sys/wait.h>
@@ -31,115 +35,184 @@
 
 #include <unistd.h>
 
-void invokeShell(string program, vector<string> args, vector<string> envs)
+// Prebuilt argv and envp arrays for a single command line. A shell
+// configured with --shell= is invoked for every telegram with the same
+// program and args, only the METER_ env variables differ. We therefore
+// keep the arrays around and copy the env strings into the buffers of the
+// previous invocation. The callers still build all the env strings for each
+// telegram and each one is compared here, what is saved are the allocations
+// of the argv, the envp and the env strings that fit in their old buffers.
+struct SpawnArgs
 {
-    vector<const char*> argv(args.size()+2);
-    char *p = new char[program.length()+1];
-    strcpy(p, program.c_str());
-    argv[0] = p;
-    int i = 1;
-    debug("(shell) exec \"%s\"\n", program.c_str());
-    for (auto &a : args) {
-        argv[i] = a.c_str();
-        i++;
-        debug("(shell) arg \"%s\"\n", a.c_str());
-    }
-    argv[i] = NULL;
-
-    vector<const char*> env(envs.size()+1);
-    env[0] = p;
-    i = 0;
-    for (auto &e : envs) {
-        env[i] = e.c_str();
-        i++;
-        debug("(shell) env \"%s\"\n", e.c_str());
-    }
-    env[i] = NULL;
-
-    pid_t pid = fork();
-    int status;
-    if (pid == 0) {
-        // I am the child!
-        close(0); // Close stdin
-#if (defined(__APPLE__) && defined(__MACH__)) || defined(__FreeBSD__)
-        execve(program.c_str(), (char*const*)&argv[0], (char*const*)&env[0]);
-#else
-        execvpe(program.c_str(), (char*const*)&argv[0], (char*const*)&env[0]);
+    vector<string> args; // args[0] is the program name.
+    vector<string> envs;
+    vector<char*> argv;
+    vector<char*> envp;
+};
+
+static pthread_mutex_t spawn_cache_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static vector<unique_ptr<SpawnArgs>> spawn_cache_;
+
+// Do not let the cache grow without bounds if the cmdlines are generated.
+#define MAX_SPAWN_CACHE_ENTRIES 64
+
+static bool sameCmdline(SpawnArgs *sa, const string &program, const vector<string> &args)
+{
+    if (sa->args.size() != args.size()+1 || sa->args[0] != program) return false;
+    return equal(args.begin(), args.end(), sa->args.begin()+1);
+}
+
+// Compares the strings in place, a lookup of a cached cmdline does not allocate.
+static SpawnArgs *lookupSpawnArgs(const string &program, const vector<string> &args)
+{
+    for (auto &p : spawn_cache_)
+    {
+        if (sameCmdline(p.get(), program, args)) return p.get();
+    }
+
+    if (spawn_cache_.size() >= MAX_SPAWN_CACHE_ENTRIES) spawn_cache_.clear();
+
+    spawn_cache_.push_back(unique_ptr<SpawnArgs>(new SpawnArgs));
+    SpawnArgs *sa = spawn_cache_.back().get();
+    sa->args.push_back(program);
+    sa->args.insert(sa->args.end(), args.begin(), args.end());
+    for (auto &a : sa->args) sa->argv.push_back(&a[0]);
+    sa->argv.push_back(NULL);
+    return sa;
+}
+
+static void updateSpawnEnvs(SpawnArgs *sa, const vector<string> &envs)
+{
+    if (sa->envs.size() != envs.size())
+    {
+        sa->envs.resize(envs.size());
+    }
+    for (size_t i = 0; i < envs.size(); ++i)
+    {
+        // Assignment reuses the already allocated buffer of the old string, if it is large enough.
+        if (sa->envs[i] != envs[i]) sa->envs[i] = envs[i];
+    }
+    sa->envp.resize(envs.size()+1);
+    for (size_t i = 0; i < envs.size(); ++i)
+    {
+        sa->envp[i] = &sa->envs[i][0];
+    }
+    sa->envp[envs.size()] = NULL;
+}
+
+static void debugSpawnArgs(const char *intro, SpawnArgs *sa)
+{
+    if (!isDebugEnabled()) return;
+
+    debug("(%s) exec \"%s\"\n", intro, sa->args[0].c_str());
+    for (size_t i = 1; i < sa->args.size(); ++i)
+    {
+        debug("(%s) arg \"%s\"\n", intro, sa->args[i].c_str());
+    }
+    for (auto &e : sa->envs)
+    {
+        debug("(%s) env \"%s\"\n", intro, e.c_str());
+    }
+}
+
+// Use posix_spawn instead of fork+exec. Fork has to duplicate the page tables
+// of wmbusmeters, which gets more expensive the larger the process is.
+// Posix_spawn uses vfork semantics (clone with CLONE_VM|CLONE_VFORK on glibc),
+// so the cost of starting a child is independent of our own size.
+static int spawn(const char *intro, SpawnArgs *sa, posix_spawn_file_actions_t *actions, pid_t *pid)
+{
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+#ifdef POSIX_SPAWN_USEVFORK
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_USEVFORK);
 #endif
+    int rc = posix_spawnp(pid, sa->argv[0], actions, &attr, &sa->argv[0], &sa->envp[0]);
+    posix_spawnattr_destroy(&attr);
+    if (rc != 0)
+    {
+        warning("(%s) invoking %s failed! %s\n", intro, sa->args[0].c_str(), strerror(rc));
+    }
+    return rc;
+}
 
-        perror("Execvp failed:");
-        error("(shell) invoking %s failed!\n", program.c_str());
-    } else {
-        if (pid == -1) {
-            error("(shell) could not fork!\n");
-        }
-        debug("(shell) waiting for child %d to complete.\n", pid);
-        // Wait for the child to finish!
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status)) {
-            // Child exited properly.
-            int rc = WEXITSTATUS(status);
-            debug("(shell) %s: return code %d\n", program.c_str(), rc);
-            if (rc != 0) {
-                warning("(shell) %s exited with non-zero return code: %d\n", program.c_str(), rc);
-            }
+bool invokeShell(const string &program, const vector<string> &args, const vector<string> &envs)
+{
+    pid_t pid;
+    int rc;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addclose(&actions, 0); // Close stdin
+
+    pthread_mutex_lock(&spawn_cache_lock_);
+    SpawnArgs *sa = lookupSpawnArgs(program, args);
+    updateSpawnEnvs(sa, envs);
+    debugSpawnArgs("shell", sa);
+    rc = spawn("shell", sa, &actions, &pid);
+    pthread_mutex_unlock(&spawn_cache_lock_);
+
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (rc != 0) return false;
+
+    debug("(shell) waiting for child %d to complete.\n", pid);
+    // Wait for the child to finish!
+    int status;
+    while (waitpid(pid, &status, 0) == -1)
+    {
+        if (errno != EINTR) return false;
+    }
+    if (WIFEXITED(status)) {
+        // Child exited properly.
+        rc = WEXITSTATUS(status);
+        debug("(shell) %s: return code %d\n", program.c_str(), rc);
+        if (rc != 0) {
+            warning("(shell) %s exited with non-zero return code: %d\n", program.c_str(), rc);
+            return false;
         }
+        return true;
     }
-    delete[] p;
+    warning("(shell) %s was terminated by a signal\n", program.c_str());
+    return false;
 }
 
-bool invokeBackgroundShell(string program, vector<string> args, vector<string> envs, int *fd_out, int *pid)
+bool invokeBackgroundShell(const string &program, const vector<string> &args, const vector<string> &envs,
+                           int *fd_out, int *pid)
 {
     int link[2];
-    vector<const char*> argv(args.size()+2);
-    char *p = new char[program.length()+1];
-    strcpy(p, program.c_str());
-    argv[0] = p;
-    int i = 1;
-    debug("(bgshell) exec background \"%s\"\n", program.c_str());
-    for (auto &a : args) {
-        argv[i] = a.c_str();
-        i++;
-        debug("(bgshell) arg \"%s\"\n", a.c_str());
-    }
-    argv[i] = NULL;
-
-    vector<const char*> env(envs.size()+1);
-    env[0] = p;
-    i = 0;
-    for (auto &e : envs) {
-        env[i] = e.c_str();
-        i++;
-        debug("(bgshell) env \"%s\"\n", e.c_str());
-    }
-    env[i] = NULL;
 
     if (pipe(link) == -1) {
         error("(bgshell) could not create pipe!\n");
     }
 
-    *pid = fork();
-    if (*pid == 0) {
-        // I am the child!
-        // Redirect stdout and stderr to pipe
-        dup2 (link[1], STDOUT_FILENO);
-        dup2 (link[1], STDERR_FILENO);
-        // Close return pipe, not duped.
-        close(link[0]);
-        // Close old forward fd pipe.
-        close(link[1]);
-        close(0); // Close stdin
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    // Redirect stdout and stderr to pipe
+    posix_spawn_file_actions_adddup2(&actions, link[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, link[1], STDERR_FILENO);
+    // Close return pipe, not duped.
+    posix_spawn_file_actions_addclose(&actions, link[0]);
+    // Close old forward fd pipe.
+    posix_spawn_file_actions_addclose(&actions, link[1]);
+    posix_spawn_file_actions_addclose(&actions, 0); // Close stdin
 
-#if (defined(__APPLE__) && defined(__MACH__)) || defined(__FreeBSD__)
-        execve(program.c_str(), (char*const*)&argv[0], (char*const*)&env[0]);
-#else
-        execvpe(program.c_str(), (char*const*)&argv[0], (char*const*)&env[0]);
-#endif
+    pthread_mutex_lock(&spawn_cache_lock_);
+    SpawnArgs *sa = lookupSpawnArgs(program, args);
+    updateSpawnEnvs(sa, envs);
+    debugSpawnArgs("bgshell", sa);
+    pid_t p;
+    int rc = spawn("bgshell", sa, &actions, &p);
+    pthread_mutex_unlock(&spawn_cache_lock_);
+
+    posix_spawn_file_actions_destroy(&actions);
 
-        perror("Execvp failed:");
-        error("(bgshell) invoking %s failed!\n", program.c_str());
+    if (rc != 0)
+    {
+        close(link[0]);
+        close(link[1]);
         return false;
     }
+    *pid = p;
 
     // Make reads from the pipe non-blocking.
     int flags = fcntl(link[0], F_GETFL);
@@ -147,7 +220,6 @@ bool invokeBackgroundShell(string program, vector<string> args, vector<string> e
     fcntl(link[0], F_SETFL, flags);
 
     *fd_out = link[0];
-    delete[] p;
     return true;
 }
 
@@ -20,7 +20,9 @@
 
 using namespace std;
 
-void invokeShell(string program, vector<string> args, vector<string> envs);
-bool invokeBackgroundShell(string program, vector<string> args, vector<string> envs, int *out, int *pid);
+// Returns true if the program was started and exited with return code 0.
+bool invokeShell(const string &program, const vector<string> &args, const vector<string> &envs);
+bool invokeBackgroundShell(const string &program, const vector<string> &args, const vector<string> &envs,
+                           int *out, int *pid);
 bool stillRunning(int pid);
 void stopBackgroundShell(int pid);
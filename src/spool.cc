@@ -0,0 +1,632 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"spool.h"
+#include"stats.h"
+
+#include<algorithm>
+#include<dirent.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<pthread.h>
+#include<string.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/time.h>
+#include<unistd.h>
+#include<vector>
+
+// Each record in a segment starts with this header, followed by len bytes of payload.
+// A record is only valid if its seq is the expected next seq and the check matches,
+// this finds the end of the records in a segment after a crash or after a segment has
+// been reused, since a reused segment only contains older seqs.
+struct RecordHeader
+{
+    uint32_t len;
+    uint32_t check;
+    uint64_t seq;
+};
+
+#define MAX_FREE_SEGMENTS 2 // Keep this many delivered segments for reuse.
+#define MAX_RETRY_SECONDS 60
+
+struct Segment
+{
+    string path;
+    int fd {-1};
+    uchar *data {};
+    uint64_t first_seq {};
+    uint64_t end_seq {}; // The seq after the last record in this segment.
+    size_t used {};
+    size_t synced {};
+    MemoryTracker memory { Memory::output_queues }; // The mapped segment.
+};
+
+struct SpoolImp;
+
+struct Sink
+{
+    string name;
+    function<bool(vector<SpoolRecord> &records)> deliver;
+    size_t max_batch {};
+    int max_attempts {};
+    int attempts {}; // Failed deliveries of the record at the cursor.
+    vector<SpoolRecord> batch;
+    uint64_t cursor {}; // The seq of the next record to deliver.
+    int cursor_fd {-1};
+    time_t retry_at {};
+    int backoff {};
+    // Each sink has its own delivery thread, a sink that hangs does not hold up the others.
+    SpoolImp *spool {};
+    pthread_t thread {};
+    // The segment the thread is delivering from without the lock, it must not be dropped.
+    Segment *busy {};
+    // Where the next record was found, to avoid scanning the segment for each record.
+    uint64_t cached_first_seq {};
+    uint64_t cached_seq {};
+    size_t cached_offset {};
+};
+
+struct SpoolImp : public Spool
+{
+    SpoolImp(string dir, size_t segment_size, size_t max_bytes);
+    ~SpoolImp();
+
+    bool open();
+    void addSink(string name, int max_attempts, function<bool(const uchar *data, size_t len)> deliver);
+    void addBatchSink(string name, size_t max_batch, int max_attempts,
+                      function<bool(vector<SpoolRecord> &records)> deliver);
+    bool append(const uchar *data, size_t len);
+    uint64_t pending();
+
+private:
+
+    static void *startLoop(void *);
+    void *deliveryLoop(Sink *s);
+    void deliverSink(Sink *s, bool final);
+    bool findRecord(Sink *s, uint64_t seq, const uchar **data, size_t *len, Segment **found);
+    void syncAll();
+    void recycle();
+    bool dropOldest();
+
+    Segment *openSegment(string path, uint64_t first_seq);
+    Segment *newSegment(uint64_t first_seq);
+    void scanSegment(Segment *seg);
+    void closeSegment(Segment *seg, bool remove);
+    string segmentPath(uint64_t first_seq);
+
+    string dir_;
+    size_t segment_size_;
+    size_t max_segments_ {}; // Zero means no limit.
+    uint64_t next_seq_ {1};
+    int unsynced_ {};
+    time_t last_sync_ {};
+
+    vector<Segment*> segments_; // Ordered by first_seq, the last one is written to.
+    vector<Segment*> free_;
+    vector<unique_ptr<Sink>> sinks_;
+
+    bool running_ {};
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond_ = PTHREAD_COND_INITIALIZER;
+};
+
+static uint32_t checksum(const uchar *data, size_t len, uint64_t seq)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= data[i];
+        h *= 16777619u;
+    }
+    return h ^ (uint32_t)seq;
+}
+
+SpoolImp::SpoolImp(string dir, size_t segment_size, size_t max_bytes)
+{
+    dir_ = dir;
+    segment_size_ = segment_size;
+    if (max_bytes > 0) max_segments_ = max((size_t)1, max_bytes/segment_size);
+}
+
+SpoolImp::~SpoolImp()
+{
+    pthread_mutex_lock(&lock_);
+    running_ = false;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&lock_);
+    // Each delivery thread makes a last delivery attempt before it exits.
+    for (auto &s : sinks_)
+    {
+        if (s->thread) pthread_join(s->thread, NULL);
+    }
+
+    syncAll();
+    for (Segment *seg : segments_) closeSegment(seg, false);
+    for (Segment *seg : free_) closeSegment(seg, false);
+    for (auto &s : sinks_)
+    {
+        if (s->cursor_fd != -1)
+        {
+            fdatasync(s->cursor_fd);
+            close(s->cursor_fd);
+        }
+    }
+    uint64_t left = 0;
+    for (auto &s : sinks_) left = max(left, next_seq_-s->cursor);
+    if (left > 0)
+    {
+        warning("(spool) %zu readings in %s are not yet delivered.\n", (size_t)left, dir_.c_str());
+    }
+}
+
+string SpoolImp::segmentPath(uint64_t first_seq)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/seg-%016llx", (unsigned long long)first_seq);
+    return dir_+name;
+}
+
+Segment *SpoolImp::openSegment(string path, uint64_t first_seq)
+{
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) return NULL;
+    if (ftruncate(fd, segment_size_) == -1)
+    {
+        close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL, segment_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        close(fd);
+        return NULL;
+    }
+    Segment *seg = new Segment();
+    seg->path = path;
+    seg->fd = fd;
+    seg->data = (uchar*)data;
+    seg->first_seq = first_seq;
+    seg->end_seq = first_seq;
+    seg->memory.update(segment_size_);
+    return seg;
+}
+
+void SpoolImp::scanSegment(Segment *seg)
+{
+    size_t offset = 0;
+    uint64_t seq = seg->first_seq;
+    while (offset+sizeof(RecordHeader) <= segment_size_)
+    {
+        RecordHeader h;
+        memcpy(&h, seg->data+offset, sizeof(h));
+        if (h.len == 0 || h.seq != seq) break;
+        if (offset+sizeof(h)+h.len > segment_size_) break;
+        if (h.check != checksum(seg->data+offset+sizeof(h), h.len, h.seq)) break;
+        offset += sizeof(h)+h.len;
+        seq++;
+    }
+    seg->used = seg->synced = offset;
+    seg->end_seq = seq;
+}
+
+void SpoolImp::closeSegment(Segment *seg, bool remove)
+{
+    munmap(seg->data, segment_size_);
+    close(seg->fd);
+    if (remove) unlink(seg->path.c_str());
+    delete seg;
+}
+
+Segment *SpoolImp::newSegment(uint64_t first_seq)
+{
+    string path = segmentPath(first_seq);
+    Segment *seg = NULL;
+    if (free_.size() > 0)
+    {
+        // Reuse an already allocated and mapped segment, its old records all
+        // have lower seqs and will therefore not be mistaken for new records.
+        seg = free_.back();
+        free_.pop_back();
+        if (rename(seg->path.c_str(), path.c_str()) == -1)
+        {
+            warning("(spool) could not rename %s to %s\n", seg->path.c_str(), path.c_str());
+            closeSegment(seg, true);
+            return NULL;
+        }
+        seg->path = path;
+        seg->first_seq = seg->end_seq = first_seq;
+        seg->used = seg->synced = 0;
+    }
+    else
+    {
+        seg = openSegment(path, first_seq);
+        if (seg == NULL)
+        {
+            warning("(spool) could not create %s %s\n", path.c_str(), strerror(errno));
+            return NULL;
+        }
+    }
+    debug("(spool) new segment %s\n", path.c_str());
+    return seg;
+}
+
+bool SpoolImp::open()
+{
+    mkdir(dir_.c_str(), 0755);
+    DIR *d = opendir(dir_.c_str());
+    if (!d)
+    {
+        warning("(spool) could not open directory %s %s\n", dir_.c_str(), strerror(errno));
+        return false;
+    }
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL)
+    {
+        unsigned long long first_seq;
+        if (strncmp(e->d_name, "seg-", 4) || sscanf(e->d_name+4, "%llx", &first_seq) != 1) continue;
+        Segment *seg = openSegment(dir_+"/"+e->d_name, first_seq);
+        if (seg == NULL)
+        {
+            warning("(spool) could not open segment %s\n", e->d_name);
+            continue;
+        }
+        scanSegment(seg);
+        segments_.push_back(seg);
+    }
+    closedir(d);
+
+    sort(segments_.begin(), segments_.end(), [](Segment *a, Segment *b) { return a->first_seq < b->first_seq; });
+
+    // Segments without records can be reused at once.
+    for (auto i = segments_.begin(); i != segments_.end(); )
+    {
+        if ((*i)->end_seq == (*i)->first_seq && free_.size() < MAX_FREE_SEGMENTS)
+        {
+            free_.push_back(*i);
+            i = segments_.erase(i);
+        }
+        else if ((*i)->end_seq == (*i)->first_seq)
+        {
+            closeSegment(*i, true);
+            i = segments_.erase(i);
+        }
+        else
+        {
+            ++i;
+        }
+    }
+    if (segments_.size() > 0) next_seq_ = segments_.back()->end_seq;
+    last_sync_ = time(NULL);
+
+    verbose("(spool) using %s with %zu segments, next reading %llu\n",
+            dir_.c_str(), segments_.size(), (unsigned long long)next_seq_);
+
+    running_ = true;
+    return true;
+}
+
+void SpoolImp::addSink(string name, int max_attempts, function<bool(const uchar *data, size_t len)> deliver)
+{
+    addBatchSink(name, 1, max_attempts,
+                 [deliver](vector<SpoolRecord> &records) { return deliver(records[0].data, records[0].len); });
+}
+
+void SpoolImp::addBatchSink(string name, size_t max_batch, int max_attempts,
+                            function<bool(vector<SpoolRecord> &records)> deliver)
+{
+    Sink *s = new Sink();
+    s->name = name;
+    s->deliver = deliver;
+    s->max_batch = max((size_t)1, max_batch);
+    s->max_attempts = max_attempts;
+    s->batch.reserve(s->max_batch);
+    s->spool = this;
+
+    string path = dir_+"/"+name+".cursor";
+    s->cursor_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (s->cursor_fd == -1)
+    {
+        error("(spool) could not open cursor file %s %s\n", path.c_str(), strerror(errno));
+    }
+
+    pthread_mutex_lock(&lock_);
+    uint64_t oldest = segments_.size() > 0 ? segments_.front()->first_seq : next_seq_;
+    uint64_t cursor;
+    if (pread(s->cursor_fd, &cursor, sizeof(cursor), 0) == sizeof(cursor))
+    {
+        s->cursor = max(oldest, min(cursor, next_seq_));
+        if (s->cursor < next_seq_)
+        {
+            verbose("(spool) sink %s resumes with %llu undelivered readings\n",
+                    name.c_str(), (unsigned long long)(next_seq_-s->cursor));
+        }
+    }
+    else
+    {
+        s->cursor = next_seq_;
+        pwrite(s->cursor_fd, &s->cursor, sizeof(s->cursor), 0);
+    }
+    sinks_.push_back(unique_ptr<Sink>(s));
+    if (running_) pthread_create(&s->thread, NULL, startLoop, s);
+    pthread_mutex_unlock(&lock_);
+}
+
+bool SpoolImp::append(const uchar *data, size_t len)
+{
+    size_t need = sizeof(RecordHeader)+len;
+    if (need > segment_size_)
+    {
+        warning("(spool) reading of %zu bytes does not fit in a spool segment.\n", len);
+        return false;
+    }
+
+    pthread_mutex_lock(&lock_);
+    if (segments_.size() == 0 || segments_.back()->used+need > segment_size_)
+    {
+        if (max_segments_ > 0 && segments_.size() >= max_segments_ && !dropOldest())
+        {
+            debug("(spool) %s is full\n", dir_.c_str());
+            pthread_mutex_unlock(&lock_);
+            return false;
+        }
+        Segment *seg = newSegment(next_seq_);
+        if (seg == NULL)
+        {
+            pthread_mutex_unlock(&lock_);
+            return false;
+        }
+        segments_.push_back(seg);
+    }
+    Segment *seg = segments_.back();
+
+    RecordHeader h;
+    h.len = len;
+    h.seq = next_seq_;
+    h.check = checksum(data, len, h.seq);
+
+    // Write the payload before the header, a torn write then fails the check.
+    memcpy(seg->data+seg->used+sizeof(h), data, len);
+    memcpy(seg->data+seg->used, &h, sizeof(h));
+    seg->used += need;
+    next_seq_++;
+    seg->end_seq = next_seq_;
+    unsynced_++;
+
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&lock_);
+    return true;
+}
+
+uint64_t SpoolImp::pending()
+{
+    pthread_mutex_lock(&lock_);
+    uint64_t left = 0;
+    for (auto &s : sinks_) left = max(left, next_seq_-s->cursor);
+    pthread_mutex_unlock(&lock_);
+    return left;
+}
+
+bool SpoolImp::findRecord(Sink *s, uint64_t want, const uchar **data, size_t *len, Segment **found)
+{
+    Segment *seg = NULL;
+    for (Segment *i : segments_)
+    {
+        if (i->first_seq <= want && want < i->end_seq)
+        {
+            seg = i;
+            break;
+        }
+    }
+    if (seg == NULL) return false;
+    *found = seg;
+
+    size_t offset = 0;
+    uint64_t seq = seg->first_seq;
+    if (s->cached_first_seq == seg->first_seq && s->cached_seq == want)
+    {
+        offset = s->cached_offset;
+        seq = s->cached_seq;
+    }
+    for (;;)
+    {
+        RecordHeader h;
+        memcpy(&h, seg->data+offset, sizeof(h));
+        if (seq == want)
+        {
+            *data = seg->data+offset+sizeof(h);
+            *len = h.len;
+            s->cached_first_seq = seg->first_seq;
+            s->cached_seq = seq+1;
+            s->cached_offset = offset+sizeof(h)+h.len;
+            return true;
+        }
+        offset += sizeof(h)+h.len;
+        seq++;
+    }
+}
+
+// Called with the lock taken, the lock is released while the sink is busy.
+void SpoolImp::deliverSink(Sink *s, bool final)
+{
+    time_t now = time(NULL);
+    if (!final && now < s->retry_at) return;
+
+    while (s->cursor < next_seq_)
+    {
+        SpoolRecord r;
+        Segment *seg;
+        if (!findRecord(s, s->cursor, &r.data, &r.len, &seg))
+        {
+            // Can only happen if a segment could not be opened at startup.
+            warning("(spool) reading %llu for sink %s is missing, skipping it.\n",
+                    (unsigned long long)s->cursor, s->name.c_str());
+            s->cursor++;
+            continue;
+        }
+        s->batch.clear();
+        s->batch.push_back(r);
+        // A batch stays within one segment.
+        Segment *next;
+        while (s->batch.size() < s->max_batch && s->cursor+s->batch.size() < next_seq_ &&
+               findRecord(s, s->cursor+s->batch.size(), &r.data, &r.len, &next) && next == seg)
+        {
+            s->batch.push_back(r);
+        }
+        // The segment with these records is neither reused nor dropped while it is busy,
+        // and only this thread moves the cursor. Safe to deliver without the lock.
+        s->busy = seg;
+        pthread_mutex_unlock(&lock_);
+        bool ok = s->deliver(s->batch);
+        pthread_mutex_lock(&lock_);
+        s->busy = NULL;
+
+        if (!ok && s->max_attempts > 0 && ++s->attempts >= s->max_attempts)
+        {
+            // Give up on these records, a reading that always fails must not block the later ones.
+            warning("(spool) giving up on %zu reading(s) from %llu for sink %s after %d attempts.\n",
+                    s->batch.size(), (unsigned long long)s->cursor, s->name.c_str(), s->attempts);
+            countDrop(Drop::spool_gave_up, s->batch.size());
+            ok = true;
+        }
+        if (!ok)
+        {
+            s->backoff = min(max(1, s->backoff*2), MAX_RETRY_SECONDS);
+            s->retry_at = time(NULL)+s->backoff;
+            if (!final)
+            {
+                warning("(spool) delivery to %s failed, will retry in %d seconds.\n", s->name.c_str(), s->backoff);
+            }
+            return;
+        }
+        s->backoff = 0;
+        s->attempts = 0;
+        s->cursor += s->batch.size();
+        pwrite(s->cursor_fd, &s->cursor, sizeof(s->cursor), 0);
+    }
+}
+
+void SpoolImp::syncAll()
+{
+    for (Segment *seg : segments_)
+    {
+        if (seg->synced == seg->used) continue;
+        // msync needs a page aligned start address.
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t from = seg->synced - seg->synced%page;
+        msync(seg->data+from, seg->used-from, MS_SYNC);
+        seg->synced = seg->used;
+    }
+    for (auto &s : sinks_) fdatasync(s->cursor_fd);
+    unsynced_ = 0;
+    last_sync_ = time(NULL);
+}
+
+void SpoolImp::recycle()
+{
+    uint64_t min_cursor = next_seq_;
+    for (auto &s : sinks_) min_cursor = min(min_cursor, s->cursor);
+
+    // Never recycle the last segment, it is the one being written to.
+    while (segments_.size() > 1 && segments_.front()->end_seq <= min_cursor)
+    {
+        Segment *seg = segments_.front();
+        segments_.erase(segments_.begin());
+        if (free_.size() < MAX_FREE_SEGMENTS)
+        {
+            free_.push_back(seg);
+        }
+        else
+        {
+            closeSegment(seg, true);
+        }
+    }
+}
+
+// Called with the lock taken when the spool is full. The oldest segment is dropped
+// if some sink has delivered all of it, the sinks that lag behind skip its readings.
+// Then a sink that keeps failing cannot stop the others from getting new readings.
+bool SpoolImp::dropOldest()
+{
+    if (segments_.size() < 2) return false;
+    Segment *seg = segments_.front();
+    bool passed = false;
+    for (auto &s : sinks_)
+    {
+        if (s->cursor >= seg->end_seq) passed = true;
+        else if (s->busy == seg) return false;
+    }
+    if (!passed) return false;
+
+    for (auto &s : sinks_)
+    {
+        if (s->cursor >= seg->end_seq) continue;
+        warning("(spool) %s is full, sink %s skips %llu undelivered readings.\n",
+                dir_.c_str(), s->name.c_str(), (unsigned long long)(seg->end_seq-s->cursor));
+        s->cursor = seg->end_seq;
+        pwrite(s->cursor_fd, &s->cursor, sizeof(s->cursor), 0);
+    }
+    recycle();
+    return true;
+}
+
+void *SpoolImp::startLoop(void *a)
+{
+    Sink *s = (Sink*)a;
+    return s->spool->deliveryLoop(s);
+}
+
+void *SpoolImp::deliveryLoop(Sink *s)
+{
+    pthread_mutex_lock(&lock_);
+    while (running_)
+    {
+        deliverSink(s, false);
+
+        if (unsynced_ >= SPOOL_SYNC_BATCH || (unsynced_ > 0 && time(NULL) > last_sync_))
+        {
+            syncAll();
+        }
+        recycle();
+
+        if (!running_) break;
+
+        // Sleep until the next append, or at most a second to retry failed sinks and sync.
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        bool work = s->cursor < next_seq_ && time(NULL) >= s->retry_at;
+        if (!work) pthread_cond_timedwait(&cond_, &lock_, &ts);
+    }
+    // Make a last attempt to deliver before exiting.
+    deliverSink(s, true);
+    recycle();
+    pthread_mutex_unlock(&lock_);
+    return NULL;
+}
+
+unique_ptr<Spool> createSpool(string dir, size_t segment_size, size_t max_bytes)
+{
+    SpoolImp *s = new SpoolImp(dir, segment_size, max_bytes);
+    unique_ptr<Spool> spool(s);
+    if (!s->open())
+    {
+        error("Could not use spool directory \"%s\"\n", dir.c_str());
+    }
+    return spool;
+}
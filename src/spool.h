@@ -0,0 +1,80 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPOOL_H_
+#define SPOOL_H_
+
+#include"util.h"
+
+#include<functional>
+#include<memory>
+#include<stdint.h>
+#include<string>
+#include<vector>
+
+using namespace std;
+
+/**
+  A Spool is a directory with append-only, memory mapped segment files.
+  Readings are appended to the spool first, then each sink has a delivery
+  thread that hands them over to the sink in order. A sink that fails (a shell
+  command that returns non-zero, a file that cannot be opened) is retried later,
+  with backoff, starting with the same record. Delivery is at least once, unless
+  the sink has a max_attempts and the record failed that many times in a row,
+  then the record is skipped with a warning and counted as dropped.
+
+  The spool holds at most max_bytes. When it is full and some sink has already
+  delivered the oldest segment, that segment is dropped and the sinks lagging
+  behind skip its readings, a dead sink does not stop the others. When no sink
+  has passed the oldest segment, append fails instead.
+
+  Each sink has a cursor file in the spool directory, which is how delivery
+  resumes after a restart. Segments that all sinks have passed are reused
+  for new records, so in steady state the spool does not allocate and writes
+  the disk sequentially. The segments are synced in batches.
+*/
+struct SpoolRecord
+{
+    const uchar *data;
+    size_t len;
+};
+
+struct Spool
+{
+    // Sinks must be added before the first append. A new sink starts
+    // with the next appended record, an old sink continues at its cursor.
+    // Zero max_attempts retries a failing record forever.
+    virtual void addSink(string name, int max_attempts, function<bool(const uchar *data, size_t len)> deliver) = 0;
+    // A batch sink is handed up to max_batch waiting records at once,
+    // they are all delivered again, or skipped, if it fails.
+    virtual void addBatchSink(string name, size_t max_batch, int max_attempts,
+                              function<bool(vector<SpoolRecord> &records)> deliver) = 0;
+    virtual bool append(const uchar *data, size_t len) = 0;
+    // Number of records not yet delivered to all sinks.
+    virtual uint64_t pending() = 0;
+    virtual ~Spool() = default;
+};
+
+#define SPOOL_SEGMENT_SIZE (1024*1024)
+#define SPOOL_SYNC_BATCH 32 // Sync after this many records, or after one second.
+#define SPOOL_MAX_BYTES (64*1024*1024)
+#define SPOOL_MAX_ATTEMPTS 5 // For sinks where a failure belongs to the record, eg a shell that exits non-zero.
+
+// Never uses more segments than fit in max_bytes, zero means no limit.
+unique_ptr<Spool> createSpool(string dir, size_t segment_size = SPOOL_SEGMENT_SIZE, size_t max_bytes = SPOOL_MAX_BYTES);
+
+#endif
@@ -0,0 +1,450 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"stats.h"
+#include"util.h"
+
+#include<atomic>
+#include<map>
+#include<memory>
+#include<pthread.h>
+#include<stdio.h>
+#include<unistd.h>
+#include<vector>
+
+bool stats_enabled_ = false;
+
+#define NUM_STAGES ((int)Stage::NUM_STAGES)
+
+const char *stage_names_[] = {
+#define X(name,hrname) hrname,
+LIST_OF_STAGES
+#undef X
+};
+
+const char *fate_names_[] = {
+#define X(name,hrname) #name,
+LIST_OF_TELEGRAM_FATES
+#undef X
+};
+
+const char *fate_hrnames_[] = {
+#define X(name,hrname) hrname,
+LIST_OF_TELEGRAM_FATES
+#undef X
+};
+
+const char *drop_names_[] = {
+#define X(name,hrname) #name,
+LIST_OF_DROPS
+#undef X
+};
+
+const char *drop_hrnames_[] = {
+#define X(name,hrname) hrname,
+LIST_OF_DROPS
+#undef X
+};
+
+const char *memory_names_[] = {
+#define X(name,hrname) #name,
+LIST_OF_MEMORY_USERS
+#undef X
+};
+
+const char *memory_hrnames_[] = {
+#define X(name,hrname) hrname,
+LIST_OF_MEMORY_USERS
+#undef X
+};
+
+// Only the owning thread writes, therefore a relaxed load and store is
+// enough to increment, the atomics are there for the reader.
+struct ThreadStats
+{
+    atomic<uint64_t> buckets[NUM_STAGES][STATS_BUCKETS];
+    atomic<uint64_t> sum[NUM_STAGES];
+    atomic<uint64_t> max[NUM_STAGES];
+};
+
+static pthread_mutex_t all_stats_lock_ = PTHREAD_MUTEX_INITIALIZER;
+// Never freed, a thread that exits leaves its numbers behind for the totals.
+static vector<ThreadStats*> all_stats_;
+static thread_local ThreadStats *my_stats_ = NULL;
+
+void statsEnabled(bool b)
+{
+    stats_enabled_ = b;
+}
+
+static int bucketFor(uint64_t nanos)
+{
+    // Below 16ns every nanosecond has its own bucket.
+    if (nanos < 4*STATS_SUB_BUCKETS) return nanos;
+    int msb = 63-__builtin_clzll(nanos);
+    int sub = (nanos >> (msb-2)) & (STATS_SUB_BUCKETS-1);
+    return msb*STATS_SUB_BUCKETS+sub;
+}
+
+static uint64_t bucketStart(int b)
+{
+    if (b < 4*STATS_SUB_BUCKETS) return b;
+    int msb = b/STATS_SUB_BUCKETS;
+    int sub = b%STATS_SUB_BUCKETS;
+    return (uint64_t)(STATS_SUB_BUCKETS+sub) << (msb-2);
+}
+
+static inline void add(atomic<uint64_t> &a, uint64_t v)
+{
+    a.store(a.load(memory_order_relaxed)+v, memory_order_relaxed);
+}
+
+void recordStage(Stage s, uint64_t nanos)
+{
+    if (my_stats_ == NULL)
+    {
+        my_stats_ = new ThreadStats();
+        pthread_mutex_lock(&all_stats_lock_);
+        all_stats_.push_back(my_stats_);
+        pthread_mutex_unlock(&all_stats_lock_);
+    }
+    int i = (int)s;
+    add(my_stats_->buckets[i][bucketFor(nanos)], 1);
+    add(my_stats_->sum[i], nanos);
+    if (nanos > my_stats_->max[i].load(memory_order_relaxed))
+    {
+        my_stats_->max[i].store(nanos, memory_order_relaxed);
+    }
+}
+
+// Returns the upper bound of the bucket, but never more than the max.
+static double percentile(vector<uint64_t> &buckets, uint64_t count, uint64_t max, double p)
+{
+    uint64_t target = (uint64_t)(count*p);
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; ++b)
+    {
+        seen += buckets[b];
+        if (seen > target) return min(bucketStart(b+1), max)/1000.0;
+    }
+    return max/1000.0;
+}
+
+string statsTable()
+{
+    string s;
+    strprintf(s, "(stats) %-16s %10s %10s %10s %10s %10s %10s (us)\n",
+              "stage", "count", "mean", "p50", "p90", "p99", "max");
+
+    pthread_mutex_lock(&all_stats_lock_);
+    vector<ThreadStats*> all = all_stats_;
+    pthread_mutex_unlock(&all_stats_lock_);
+
+    for (int i = 0; i < NUM_STAGES; ++i)
+    {
+        vector<uint64_t> buckets(STATS_BUCKETS);
+        uint64_t count = 0, sum = 0, max = 0;
+        for (ThreadStats *ts : all)
+        {
+            for (int b = 0; b < STATS_BUCKETS; ++b)
+            {
+                uint64_t n = ts->buckets[i][b].load(memory_order_relaxed);
+                buckets[b] += n;
+                count += n;
+            }
+            sum += ts->sum[i].load(memory_order_relaxed);
+            uint64_t m = ts->max[i].load(memory_order_relaxed);
+            if (m > max) max = m;
+        }
+        if (count == 0) continue;
+        string line;
+        strprintf(line, "(stats) %-16s %10ju %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                  stage_names_[i], (uintmax_t)count, sum/1000.0/count,
+                  percentile(buckets, count, max, 0.5),
+                  percentile(buckets, count, max, 0.9),
+                  percentile(buckets, count, max, 0.99),
+                  max/1000.0);
+        s += line;
+    }
+    for (int i = 0; i < (int)Fate::NUM_FATES; ++i)
+    {
+        string line;
+        strprintf(line, "(stats) %-24s %10ju\n", fate_hrnames_[i], (uintmax_t)fateCount((Fate)i));
+        s += line;
+    }
+    for (int i = 0; i < (int)Drop::NUM_DROPS; ++i)
+    {
+        uint64_t n = dropCount((Drop)i);
+        if (n == 0) continue;
+        string line;
+        strprintf(line, "(stats) %-24s %10ju\n", drop_hrnames_[i], (uintmax_t)n);
+        s += line;
+    }
+    string line;
+    strprintf(line, "(stats) memory %-17s %10ju bytes\n", "rss", (uintmax_t)residentBytes());
+    s += line;
+    for (int i = 0; i < (int)Memory::NUM_MEMORY_USERS; ++i)
+    {
+        strprintf(line, "(stats) memory %-17s %10jd bytes\n", memory_hrnames_[i], (intmax_t)memoryUsage((Memory)i));
+        s += line;
+    }
+    return s;
+}
+
+static atomic<uint64_t> drops_[(int)Drop::NUM_DROPS];
+
+void countDrop(Drop d, uint64_t n)
+{
+    drops_[(int)d].fetch_add(n, memory_order_relaxed);
+}
+
+uint64_t dropCount(Drop d)
+{
+    return drops_[(int)d].load(memory_order_relaxed);
+}
+
+string dropsJson()
+{
+    string s = "{";
+    for (int i = 0; i < (int)Drop::NUM_DROPS; ++i)
+    {
+        if (i > 0) s += ",";
+        s += "\""+string(drop_names_[i])+"\":"+to_string(dropCount((Drop)i));
+    }
+    return s+"}";
+}
+
+string dropsPrometheus()
+{
+    string s = "# HELP wmbusmeters_dropped_total Output that did not reach its destination.\n";
+    s += "# TYPE wmbusmeters_dropped_total counter\n";
+    for (int i = 0; i < (int)Drop::NUM_DROPS; ++i)
+    {
+        s += "wmbusmeters_dropped_total{what=\""+string(drop_names_[i])+"\"} "+
+            to_string(dropCount((Drop)i))+"\n";
+    }
+    return s;
+}
+
+static atomic<int64_t> memory_[(int)Memory::NUM_MEMORY_USERS];
+
+void addMemory(Memory m, int64_t bytes)
+{
+    memory_[(int)m].fetch_add(bytes, memory_order_relaxed);
+}
+
+int64_t memoryUsage(Memory m)
+{
+    return memory_[(int)m].load(memory_order_relaxed);
+}
+
+uint64_t residentBytes()
+{
+    // The second number in statm is the resident pages.
+    uint64_t size = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    int n = fscanf(f, "%ju %ju", (uintmax_t*)&size, (uintmax_t*)&resident);
+    fclose(f);
+    if (n != 2) return 0;
+    return resident*sysconf(_SC_PAGESIZE);
+}
+
+string memoryJson()
+{
+    string s = "{\"rss\":"+to_string(residentBytes());
+    for (int i = 0; i < (int)Memory::NUM_MEMORY_USERS; ++i)
+    {
+        s += ",\""+string(memory_names_[i])+"\":"+to_string(memoryUsage((Memory)i));
+    }
+    return s+"}";
+}
+
+string memoryPrometheus()
+{
+    string s = "# HELP wmbusmeters_resident_bytes Resident set size of the process.\n";
+    s += "# TYPE wmbusmeters_resident_bytes gauge\n";
+    s += "wmbusmeters_resident_bytes "+to_string(residentBytes())+"\n";
+    s += "# HELP wmbusmeters_memory_bytes Estimated heap bytes held by each subsystem.\n";
+    s += "# TYPE wmbusmeters_memory_bytes gauge\n";
+    for (int i = 0; i < (int)Memory::NUM_MEMORY_USERS; ++i)
+    {
+        s += "wmbusmeters_memory_bytes{subsystem=\""+string(memory_names_[i])+"\"} "+
+            to_string(memoryUsage((Memory)i))+"\n";
+    }
+    return s;
+}
+
+static FateCounters global_fates_;
+static pthread_mutex_t fates_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static map<string,unique_ptr<FateCounters>> meter_fates_;
+static map<string,unique_ptr<FateCounters>> driver_fates_;
+static time_t fates_start_ = time(NULL);
+
+static FateCounters *lookupFates(map<string,unique_ptr<FateCounters>> &m, string &name)
+{
+    pthread_mutex_lock(&fates_lock_);
+    unique_ptr<FateCounters> &fc = m[name];
+    if (!fc) fc = unique_ptr<FateCounters>(new FateCounters());
+    FateCounters *r = fc.get();
+    pthread_mutex_unlock(&fates_lock_);
+    return r;
+}
+
+FateCounters *meterFateCounters(string name)
+{
+    return lookupFates(meter_fates_, name);
+}
+
+FateCounters *driverFateCounters(string driver)
+{
+    return lookupFates(driver_fates_, driver);
+}
+
+void countFate(Fate f, FateCounters *fc)
+{
+    global_fates_.counts[(int)f].fetch_add(1, memory_order_relaxed);
+    if (fc) fc->counts[(int)f].fetch_add(1, memory_order_relaxed);
+}
+
+uint64_t fateCount(Fate f, FateCounters *fc)
+{
+    if (fc == NULL) fc = &global_fates_;
+    return fc->counts[(int)f].load(memory_order_relaxed);
+}
+
+static string countersJson(FateCounters *fc)
+{
+    string s = "{";
+    for (int i = 0; i < (int)Fate::NUM_FATES; ++i)
+    {
+        if (i > 0) s += ",";
+        s += "\""+string(fate_names_[i])+"\":"+to_string(fc->counts[i].load(memory_order_relaxed));
+    }
+    return s+"}";
+}
+
+// The meter names come from the configuration and can contain anything.
+static string jsonString(const string &in)
+{
+    string s = "\"";
+    for (unsigned char c : in)
+    {
+        if (c == '\\' || c == '"')
+        {
+            s += '\\';
+            s += c;
+        }
+        else if (c < 0x20)
+        {
+            char hex[8];
+            snprintf(hex, sizeof(hex), "\\u%04x", c);
+            s += hex;
+        }
+        else
+        {
+            s += c;
+        }
+    }
+    return s+"\"";
+}
+
+static string mapJson(map<string,unique_ptr<FateCounters>> &m)
+{
+    string s = "{";
+    for (auto &p : m)
+    {
+        if (s.length() > 1) s += ",";
+        s += jsonString(p.first)+":"+countersJson(p.second.get());
+    }
+    return s+"}";
+}
+
+string fatesJson()
+{
+    char datetime[40];
+    time_t now = time(NULL);
+    strftime(datetime, sizeof(datetime), "%FT%TZ", gmtime(&now));
+
+    string s = "{";
+    s += "\"timestamp\":\""+string(datetime)+"\",";
+    s += "\"uptime\":"+to_string(now-fates_start_)+",";
+    s += "\"telegrams\":"+countersJson(&global_fates_)+",";
+    pthread_mutex_lock(&fates_lock_);
+    s += "\"drivers\":"+mapJson(driver_fates_)+",";
+    s += "\"meters\":"+mapJson(meter_fates_)+",";
+    pthread_mutex_unlock(&fates_lock_);
+    s += "\"dropped\":"+dropsJson()+",";
+    s += "\"memory\":"+memoryJson();
+    s += "}\n";
+    return s;
+}
+
+static string promCounters(map<string,unique_ptr<FateCounters>> &m, const char *label, int fate)
+{
+    string s;
+    for (auto &p : m)
+    {
+        string name;
+        for (char c : p.first)
+        {
+            if (c == '\n')
+            {
+                name += "\\n";
+                continue;
+            }
+            if (c == '\\' || c == '"') name += '\\';
+            name += c;
+        }
+        s += "wmbusmeters_"+string(label)+"_telegrams_total{fate=\""+fate_names_[fate]+"\","+
+            label+"=\""+name+"\"} "+to_string(p.second->counts[fate].load(memory_order_relaxed))+"\n";
+    }
+    return s;
+}
+
+string fatesPrometheus()
+{
+    string s = "# HELP wmbusmeters_telegrams_total What happened to the received frames.\n";
+    s += "# TYPE wmbusmeters_telegrams_total counter\n";
+    for (int i = 0; i < (int)Fate::NUM_FATES; ++i)
+    {
+        s += "wmbusmeters_telegrams_total{fate=\""+string(fate_names_[i])+"\"} "+
+            to_string(fateCount((Fate)i))+"\n";
+    }
+    string drivers, meters;
+    pthread_mutex_lock(&fates_lock_);
+    for (int i = 0; i < (int)Fate::NUM_FATES; ++i)
+    {
+        drivers += promCounters(driver_fates_, "driver", i);
+        meters += promCounters(meter_fates_, "meter", i);
+    }
+    pthread_mutex_unlock(&fates_lock_);
+    if (drivers.length() > 0)
+    {
+        s += "# TYPE wmbusmeters_driver_telegrams_total counter\n"+drivers;
+    }
+    if (meters.length() > 0)
+    {
+        s += "# TYPE wmbusmeters_meter_telegrams_total counter\n"+meters;
+    }
+    return s;
+}
+
+bool writeStatsFile(string file)
+{
+    return replaceFile(file, fatesJson());
+}
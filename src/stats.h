@@ -0,0 +1,232 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include<atomic>
+#include<stdint.h>
+#include<string>
+#include<time.h>
+#include<vector>
+
+using namespace std;
+
+// The stages of the pipeline from a byte arriving on the tty to a printed reading.
+#define LIST_OF_STAGES \
+    X(serial_receive,  "serial receive")  \
+    X(frame_check,     "frame check")     \
+    X(parse_header,    "parse header")    \
+    X(parse,           "parse")           \
+    X(decrypt,         "decrypt")         \
+    X(process_content, "process content") \
+    X(print_meter,     "print meter")     \
+    X(sink_shell,      "sink shell")      \
+    X(sink_file,       "sink file")       \
+    X(sink_spool,      "sink spool")      \
+    X(sink_publish,    "sink publish")    \
+
+enum class Stage {
+#define X(name,hrname) name,
+LIST_OF_STAGES
+#undef X
+    NUM_STAGES
+};
+
+// Each thread records into its own histograms, no locks and no atomic
+// read-modify-write on the hot path. A histogram bucket covers a quarter
+// of a power of two of nanoseconds, ie the relative error is below 25%.
+#define STATS_SUB_BUCKETS 4
+#define STATS_BUCKETS (64*STATS_SUB_BUCKETS)
+
+extern bool stats_enabled_;
+
+void statsEnabled(bool b);
+void recordStage(Stage s, uint64_t nanos);
+// Sum the histograms of all threads and return a printable table.
+string statsTable();
+
+inline uint64_t statsNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+// The tracer records the stages of selected telegrams as Chrome trace events,
+// see trace.cc. A telegram is selected when it enters the pipeline, either
+// because its dll id matches one of the ids or because it is sampled.
+extern bool trace_enabled_;
+
+void traceEnabled(double sample_percent, std::vector<std::string> ids);
+void traceStage(Stage s, uint64_t start, uint64_t end);
+void traceTelegramBegin(std::vector<unsigned char> &frame);
+void traceTelegramEnd();
+// The recorded events of all threads in the Chrome trace event format.
+string traceJson();
+bool writeTraceFile(string file);
+
+// Measures the time until the end of the scope.
+struct StageTimer
+{
+    StageTimer(Stage s) : stage_(s), start_(stats_enabled_ || trace_enabled_ ? statsNow() : 0) {}
+    ~StageTimer()
+    {
+        if (!start_) return;
+        uint64_t end = statsNow();
+        if (stats_enabled_) recordStage(stage_, end-start_);
+        if (trace_enabled_) traceStage(stage_, start_, end);
+    }
+
+private:
+    Stage stage_;
+    uint64_t start_;
+};
+
+// The stages recorded in this scope belong to the telegram in frame, if it is traced.
+struct TraceScope
+{
+    TraceScope(std::vector<unsigned char> &frame) : traced_(trace_enabled_)
+    {
+        if (traced_) traceTelegramBegin(frame);
+    }
+    ~TraceScope() { if (traced_) traceTelegramEnd(); }
+
+private:
+    bool traced_;
+};
+
+// What happened to a received frame. The counters are always on.
+#define LIST_OF_TELEGRAM_FATES \
+    X(received,           "frames received")         \
+    X(framing_error,      "framing errors")          \
+    X(crc_failure,        "dll crc failures")        \
+    X(duplicate,          "duplicates dropped")      \
+    X(header_failure,     "header parse failures")   \
+    X(id_mismatch,        "ignored by all meters")   \
+    X(decrypt_failure,    "decrypt or mac failures") \
+    X(parse_failure,      "content parse failures")  \
+    X(unexpected_version, "unexpected versions")     \
+    X(update,             "updates")                 \
+
+enum class Fate {
+#define X(name,hrname) name,
+LIST_OF_TELEGRAM_FATES
+#undef X
+    NUM_FATES
+};
+
+struct FateCounters
+{
+    atomic<uint64_t> counts[(int)Fate::NUM_FATES] {};
+};
+
+// The counters for a meter name or a driver (im871a, rtlwmbus...) are
+// created on first use and live as long as the program.
+FateCounters *meterFateCounters(string name);
+FateCounters *driverFateCounters(string driver);
+
+// Count the fate globally and, if not NULL, for a meter or driver as well.
+void countFate(Fate f, FateCounters *fc = NULL);
+uint64_t fateCount(Fate f, FateCounters *fc = NULL);
+
+// The counters as a json object.
+string fatesJson();
+// The counters in the Prometheus text format, labeled by fate and driver or meter.
+string fatesPrometheus();
+// Write the json to file.tmp then rename it to file, readers never see a half written file.
+bool writeStatsFile(string file);
+
+// Output that did not reach its destination. The counters are always on.
+#define LIST_OF_DROPS \
+    X(log_ring_full,   "log writes dropped, ring full")   \
+    X(log_write_error, "log writes sent to the fallback") \
+    X(spool_gave_up,   "spooled readings given up")       \
+
+enum class Drop {
+#define X(name,hrname) name,
+LIST_OF_DROPS
+#undef X
+    NUM_DROPS
+};
+
+void countDrop(Drop d, uint64_t n = 1);
+uint64_t dropCount(Drop d);
+// The drop counters as a json object and in the Prometheus text format.
+string dropsJson();
+string dropsPrometheus();
+
+// The long lived data structures that could grow while running for months.
+#define LIST_OF_MEMORY_USERS \
+    X(meters,        "meters")        \
+    X(format_cache,  "format cache")  \
+    X(frame_buffers, "frame buffers") \
+    X(output_queues, "output queues") \
+    X(metrics,       "metrics")       \
+    X(dedup_cache,   "dedup cache")   \
+
+enum class Memory {
+#define X(name,hrname) name,
+LIST_OF_MEMORY_USERS
+#undef X
+    NUM_MEMORY_USERS
+};
+
+// The pointers and color of a std::map or std::set node.
+#define MAP_NODE_OVERHEAD 32
+
+// The accounting is an estimate of the heap bytes held, always on.
+void addMemory(Memory m, int64_t bytes);
+int64_t memoryUsage(Memory m);
+// The resident set size of the process, or 0 if not known on this platform.
+uint64_t residentBytes();
+// The memory usage as a json object and in the Prometheus text format.
+string memoryJson();
+string memoryPrometheus();
+
+// Keeps the accounted size of a data structure, call update when it might have changed.
+// The accounted bytes are released when the tracker is destructed.
+struct MemoryTracker
+{
+    MemoryTracker(Memory m) : memory_(m) {}
+    MemoryTracker(const MemoryTracker&) = delete;
+    MemoryTracker &operator=(const MemoryTracker&) = delete;
+    ~MemoryTracker() { update(0); }
+
+    void update(size_t bytes)
+    {
+        if (bytes != bytes_) addMemory(memory_, (int64_t)bytes-(int64_t)bytes_);
+        bytes_ = bytes;
+    }
+
+private:
+    Memory memory_;
+    size_t bytes_ {};
+};
+
+// Build with STATS=false to remove the instrumentation from the binary.
+#ifdef DISABLE_STATS
+#define STAGE_TIMER(stage)
+#define TRACE_SCOPE(frame)
+#else
+#define STAGE_TIMER_CONCAT(a,b) a##b
+#define STAGE_TIMER_NAME(line) STAGE_TIMER_CONCAT(stage_timer_,line)
+#define STAGE_TIMER(stage) StageTimer STAGE_TIMER_NAME(__LINE__)(Stage::stage)
+#define TRACE_SCOPE(frame) TraceScope trace_scope(frame)
+#endif
+
+#endif
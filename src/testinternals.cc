@@ -16,16 +16,37 @@
 */
 
 #include"aescmac.h"
+#include"cbor.h"
 #include"cmdline.h"
 #include"config.h"
+#include"dedup.h"
+#include"demod.h"
+#include"forward.h"
 #include"meters.h"
+#include"metrics.h"
 #include"printer.h"
+#include"publisher.h"
 #include"serial.h"
+#include"spool.h"
+#include"stats.h"
 #include"util.h"
 #include"wmbus.h"
 #include"dvparser.h"
-
+#include"logwriter.h"
+
+#include<algorithm>
+#include<atomic>
+#include<fcntl.h>
+#include<new>
+#include<poll.h>
+#include<stdlib.h>
 #include<string.h>
+#include<dirent.h>
+#include<netinet/in.h>
+#include<pthread.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<unistd.h>
 
 using namespace std;
 
@@ -34,6 +55,36 @@ int test_dvparser();
 int test_linkmodes();
 void test_ids();
 void test_kdf();
+void test_publish();
+void test_cbor();
+void test_spool();
+void test_logwriter();
+void test_disabled_logging();
+void test_stats();
+void test_metrics();
+void test_detect();
+void test_commands();
+void test_dedup();
+void test_demod();
+void test_network();
+void test_forward();
+void test_serial_send();
+
+// Count heap allocations, to verify that hot paths do not allocate.
+static atomic<size_t> allocations_ {0};
+
+void *operator new(size_t size)
+{
+    allocations_++;
+    void *p = malloc(size);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
 
 int main(int argc, char **argv)
 {
@@ -48,6 +99,20 @@ int main(int argc, char **argv)
     test_linkmodes();
     test_ids();
     test_kdf();
+    test_publish();
+    test_cbor();
+    test_spool();
+    test_logwriter();
+    test_disabled_logging();
+    test_stats();
+    test_metrics();
+    test_detect();
+    test_commands();
+    test_dedup();
+    test_demod();
+    test_network();
+    test_forward();
+    test_serial_send();
     return 0;
 }
 
@@ -330,6 +395,49 @@ int test_linkmodes()
     }
     debug("test7 OK\n\n");
 
+    // An im871a on c1 next to an rtlwmbus, the receivers together hear both meters.
+    multical21_and_supercom587_config.link_mode_configured = false;
+    multical21_and_supercom587_config.listen_to_link_modes = LinkModeSet();
+    handleDevice(&multical21_and_supercom587_config, "/dev/ttyUSB0:im871a:c1");
+    handleDevice(&multical21_and_supercom587_config, "rtlwmbus:868.9M");
+    SpecifiedDevice &im871a_device = multical21_and_supercom587_config.devices[0];
+    SpecifiedDevice &rtlwmbus_device = multical21_and_supercom587_config.devices[1];
+    if (im871a_device.file != "/dev/ttyUSB0" || im871a_device.extra != "im871a" || rtlwmbus_device.extra != "868.9M")
+    {
+        printf("ERROR! Expected the link modes to be removed from the device!\n");
+    }
+    lmcr = calculateLinkModes(&multical21_and_supercom587_config, wmbus_im871a.get(), true, &im871a_device, false);
+    if (lmcr.type != LinkModeCalculationResultType::Success || im871a_device.listen_to.hr() != "c1")
+    {
+        printf("ERROR! Expected the im871a to listen to c1! Got instead:\n%s\n", lmcr.msg.c_str());
+    }
+    lmcr = calculateLinkModes(&multical21_and_supercom587_config, wmbus_rtlwmbus.get(), true, &rtlwmbus_device, false);
+    if (lmcr.type != LinkModeCalculationResultType::Success)
+    {
+        printf("ERROR! Expected success for the rtlwmbus! Got instead:\n%s\n", lmcr.msg.c_str());
+    }
+    lmcr = checkLinkModesCoverage(&multical21_and_supercom587_config);
+    if (lmcr.type != LinkModeCalculationResultType::Success)
+    {
+        printf("ERROR! Expected the receivers to hear all meters! Got instead:\n%s\n", lmcr.msg.c_str());
+    }
+    debug("test8 OK\n\n");
+
+    // Two im871a on c1 do not hear the t1 meter.
+    rtlwmbus_device.link_modes = im871a_device.link_modes;
+    rtlwmbus_device.link_modes_configured = true;
+    lmcr = calculateLinkModes(&multical21_and_supercom587_config, wmbus_im871a.get(), true, &rtlwmbus_device, false);
+    if (lmcr.type != LinkModeCalculationResultType::Success)
+    {
+        printf("ERROR! Expected success for the second im871a! Got instead:\n%s\n", lmcr.msg.c_str());
+    }
+    lmcr = checkLinkModesCoverage(&multical21_and_supercom587_config);
+    if (lmcr.type != LinkModeCalculationResultType::MightMissTelegrams)
+    {
+        printf("ERROR! Expected might miss telegrams! Got instead:\n%s\n", lmcr.msg.c_str());
+    }
+    debug("test9 OK\n\n");
+
     return 0;
 }
 
@@ -444,3 +552,1131 @@ void test_kdf()
         printf("ERROR in aes-cmac expected \"%s\" but got \"%s\"\n", ex.c_str(), s.c_str());
     }
 }
+
+static int connectUnix(string path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static Publication publication(string name, string id, string type, string json)
+{
+    Publication p;
+    p.name = name;
+    p.id = id;
+    p.type = type;
+    p.json = make_shared<const string>(json+"\n");
+    return p;
+}
+
+void test_publish()
+{
+    string path = "/tmp/wmbusmeters_testinternals_"+to_string(getpid())+".sock";
+    auto manager = createSerialCommunicationManager(0, 0, true);
+    manager->startEventLoop();
+    // A tiny queue to be able to test the slow consumer disconnect.
+    auto publisher = createPublisher({ "unix:"+path }, manager.get(), 64);
+
+    int filtered = connectUnix(path);
+    int slow = connectUnix(path);
+    if (filtered == -1 || slow == -1)
+    {
+        printf("ERROR in publish could not connect to %s\n", path.c_str());
+        return;
+    }
+    string filter = "id=1234* type=multical21\n";
+    write(filtered, filter.c_str(), filter.length());
+
+    for (int i = 0; i < 100 && publisher->numSubscribers() < 2; ++i) usleep(10*1000);
+    eqn(publisher->numSubscribers(), 2, "publish subscribers");
+    // Give the event loop time to pick up the filter.
+    usleep(100*1000);
+
+    Publication a = publication("Water", "12345678", "multical21", "{\"a\":1}");
+    Publication b = publication("Heat", "22222222", "multical302", "{\"b\":2}");
+    Publication c = publication("Other", "12340000", "multical21", "{\"c\":3}");
+    publisher->publish(a);
+    publisher->publish(b);
+    publisher->publish(c);
+
+    string got;
+    char buf[256];
+    for (int i = 0; i < 100 && got.length() < 16; ++i)
+    {
+        ssize_t n = recv(filtered, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n > 0) got.append(buf, n); else usleep(10*1000);
+    }
+    eq(got, "{\"a\":1}\n{\"c\":3}\n", "publish filter");
+    eqn(publisher->wantsCbor(), 0, "publish no cbor subscriber");
+
+    filter = "id=1234* type=multical21 format=cbor\n";
+    write(filtered, filter.c_str(), filter.length());
+    for (int i = 0; i < 100 && !publisher->wantsCbor(); ++i) usleep(10*1000);
+    eqn(publisher->wantsCbor(), 1, "publish cbor subscriber");
+    filter = "id=1234* type=multical21\n";
+    write(filtered, filter.c_str(), filter.length());
+    for (int i = 0; i < 100 && publisher->wantsCbor(); ++i) usleep(10*1000);
+    eqn(publisher->wantsCbor(), 0, "publish cbor subscriber gone");
+
+    // The slow subscriber never reads, it must be disconnected when its queue
+    // overflows. But the socket buffer must first fill up, so publish a lot.
+    Publication big = publication("Water", "12345678", "multical21", string(4000, 'x'));
+    warningSilenced(true);
+    for (int i = 0; i < 1000 && publisher->numSubscribers() == 2; ++i)
+    {
+        publisher->publish(big);
+        // The filtered subscriber keeps up.
+        while (recv(filtered, buf, sizeof(buf), MSG_DONTWAIT) > 0) {}
+    }
+    warningSilenced(false);
+    eqn(publisher->numSubscribers(), 1, "publish slow subscriber");
+
+    close(filtered);
+    close(slow);
+    publisher.reset();
+    manager->stop();
+    manager->waitForStop();
+    if (checkFileExists(path.c_str()))
+    {
+        printf("ERROR in publish socket %s was not removed\n", path.c_str());
+    }
+}
+
+void test_cbor()
+{
+    vector<uchar> out;
+    cborAddArray(out, 5);
+    cborAddUInt(out, 23);
+    cborAddUInt(out, 1000000);
+    cborAddInt(out, -500);
+    cborAddText(out, "total_m3");
+    cborAddDouble(out, 1.1);
+
+    eq(bin2hex(out), "85171A000F42403901F368746F74616C5F6D33FB3FF199999999999A", "cbor encode");
+
+    CborItem item;
+    size_t pos = 0;
+    bool ok = cborDecode(out, &pos, &item);
+    if (!ok || pos != out.size() || item.type != CborType::Array || item.items.size() != 5)
+    {
+        printf("ERROR in cbor decode of array\n");
+        return;
+    }
+    eqn(item.items[0].i, 23, "cbor decode small uint");
+    eqn(item.items[1].i, 1000000, "cbor decode uint");
+    eqn(item.items[2].i, -500, "cbor decode negative int");
+    eq(item.items[3].s, "total_m3", "cbor decode text");
+    if (item.items[4].type != CborType::Double || item.items[4].d != 1.1)
+    {
+        printf("ERROR in cbor decode of double\n");
+    }
+
+    // A data record with the device, rssi and link mode array at the end.
+    vector<uchar> rec;
+    cborAddArray(rec, 5);
+    cborAddUInt(rec, CBOR_DATA_RECORD);
+    cborAddUInt(rec, 0);
+    cborAddUInt(rec, 1700000000);
+    cborAddText(rec, "12345678");
+    cborAddArray(rec, 3);
+    cborAddText(rec, "im871a[12345678]");
+    cborAddInt(rec, -77);
+    cborAddText(rec, "t1");
+    pos = 0;
+    ok = cborDecode(rec, &pos, &item);
+    if (!ok || pos != rec.size() || item.items.size() != 5 || item.items[4].items.size() != 3)
+    {
+        printf("ERROR in cbor decode of data record with about\n");
+    }
+
+    // A truncated record must not be accepted.
+    out.pop_back();
+    pos = 0;
+    if (cborDecode(out, &pos, &item))
+    {
+        printf("ERROR in cbor decode accepted truncated data\n");
+    }
+
+    // Lengths and counts from the input that do not fit in the remaining bytes,
+    // and arrays nested without end.
+    vector<string> malformed = {
+        "9BFFFFFFFFFFFFFFFF",
+        "82017BFFFFFFFFFFFFFFFF",
+        "7B00000000FFFFFFFF41",
+        "9A7FFFFFFF01",
+        "818181818101",
+        [](){ string s; for (int i = 0; i < 1000; ++i) s += "81"; return s+"01"; }() };
+    for (string &hex : malformed)
+    {
+        vector<uchar> bad;
+        hex2bin(hex, &bad);
+        pos = 0;
+        if (cborDecode(bad, &pos, &item))
+        {
+            printf("ERROR in cbor decode accepted malformed %s\n", hex.substr(0, 32).c_str());
+        }
+    }
+}
+
+static int countSegments(string dir)
+{
+    int n = 0;
+    DIR *d = opendir(dir.c_str());
+    struct dirent *e;
+    while (d && (e = readdir(d)) != NULL)
+    {
+        if (!strncmp(e->d_name, "seg-", 4)) n++;
+    }
+    if (d) closedir(d);
+    return n;
+}
+
+void test_spool()
+{
+    string dir = "/tmp/wmbusmeters_testinternals_spool_"+to_string(getpid());
+    vector<string> delivered;
+    bool fail = true;
+    string rec(100, 'x');
+
+    {
+        // Tiny segments, to force many segment switches.
+        auto spool = createSpool(dir, 512);
+        spool->addSink("test", 0, [&](const uchar *data, size_t len)
+                       {
+                           if (fail) return false;
+                           delivered.push_back(string((const char*)data, len));
+                           return true;
+                       });
+        warningSilenced(true);
+        for (int i = 0; i < 20; ++i)
+        {
+            rec[0] = 'a'+i;
+            spool->append((const uchar*)rec.data(), rec.length());
+        }
+        // Let the delivery thread fail at least once.
+        usleep(100*1000);
+        eqn(delivered.size(), 0, "spool nothing delivered while failing");
+    }
+    warningSilenced(false);
+    eqn(countSegments(dir), 5, "spool segments kept for undelivered readings");
+
+    // A restart must deliver all readings in order and then recycle the segments.
+    fail = false;
+    {
+        auto spool = createSpool(dir, 512);
+        spool->addSink("test", 0, [&](const uchar *data, size_t len)
+                       {
+                           delivered.push_back(string((const char*)data, len));
+                           return true;
+                       });
+        for (int i = 0; i < 100 && spool->pending() > 0; ++i) usleep(10*1000);
+        for (int i = 20; i < 40; ++i)
+        {
+            rec[0] = 'a'+i;
+            spool->append((const uchar*)rec.data(), rec.length());
+        }
+        for (int i = 0; i < 100 && spool->pending() > 0; ++i) usleep(10*1000);
+    }
+    eqn(delivered.size(), 40, "spool all readings delivered");
+    for (size_t i = 0; i < delivered.size(); ++i)
+    {
+        if (delivered[i][0] != (char)('a'+i)) printf("ERROR in spool reading %zu out of order\n", i);
+    }
+    if (countSegments(dir) > 3)
+    {
+        printf("ERROR in spool expected segments to be recycled, but found %d\n", countSegments(dir));
+    }
+
+    string cmd = "rm -rf "+dir;
+    system(cmd.c_str());
+
+    // A full spool with a sink that always fails must not stop the other sink.
+    delivered.clear();
+    {
+        auto spool = createSpool(dir, 512, 3*512);
+        spool->addSink("dead", 0, [&](const uchar *data, size_t len) { return false; });
+        spool->addSink("live", 0, [&](const uchar *data, size_t len)
+                       {
+                           delivered.push_back(string((const char*)data, len));
+                           return true;
+                       });
+        warningSilenced(true);
+        int appended = 0;
+        for (int i = 0; i < 40; ++i)
+        {
+            rec[0] = 'a'+i;
+            if (spool->append((const uchar*)rec.data(), rec.length())) appended++;
+            // Give the live sink time to pass the segment.
+            usleep(2*1000);
+        }
+        for (int i = 0; i < 100 && delivered.size() < 40; ++i) usleep(10*1000);
+        eqn(appended, 40, "spool full with a dead sink still appends");
+        eqn(delivered.size(), 40, "spool full with a dead sink still delivers to the live sink");
+        if (spool->pending() > 12) printf("ERROR in spool expected the dead sink to skip readings\n");
+    }
+    warningSilenced(false);
+    system(cmd.c_str());
+
+    // A batch sink gets several readings at once and all of them again after a failure.
+    delivered.clear();
+    fail = true;
+    {
+        size_t largest = 0;
+        auto spool = createSpool(dir, SPOOL_SEGMENT_SIZE);
+        spool->addBatchSink("batch", 8, 0, [&](vector<SpoolRecord> &records)
+                       {
+                           if (fail) return false;
+                           largest = max(largest, records.size());
+                           for (auto &r : records) delivered.push_back(string((const char*)r.data, r.len));
+                           return true;
+                       });
+        warningSilenced(true);
+        for (int i = 0; i < 20; ++i)
+        {
+            rec[0] = 'a'+i;
+            spool->append((const uchar*)rec.data(), rec.length());
+        }
+        usleep(100*1000);
+        fail = false;
+        for (int i = 0; i < 300 && spool->pending() > 0; ++i) usleep(10*1000);
+        eqn(delivered.size(), 20, "spool batch sink delivers all readings");
+        eqn(largest, 8, "spool batch sink gets full batches");
+        for (size_t i = 0; i < delivered.size(); ++i)
+        {
+            if (delivered[i][0] != (char)('a'+i)) printf("ERROR in spool batch reading %zu out of order\n", i);
+        }
+    }
+    warningSilenced(false);
+    system(cmd.c_str());
+
+    // A reading that always fails is given up after max_attempts, the later readings are delivered.
+    delivered.clear();
+    {
+        uint64_t given_up = dropCount(Drop::spool_gave_up);
+        auto spool = createSpool(dir, 512, 3*512);
+        spool->addSink("picky", 2, [&](const uchar *data, size_t len)
+                       {
+                           if (data[0] == 'b') return false;
+                           delivered.push_back(string((const char*)data, len));
+                           return true;
+                       });
+        warningSilenced(true);
+        for (int i = 0; i < 3; ++i)
+        {
+            rec[0] = 'a'+i;
+            spool->append((const uchar*)rec.data(), rec.length());
+        }
+        for (int i = 0; i < 300 && spool->pending() > 0; ++i) usleep(10*1000);
+        eqn(delivered.size(), 2, "spool failing reading skipped");
+        if (delivered.size() == 2 && delivered[1][0] != 'c') printf("ERROR in spool expected c after the skipped b\n");
+        eqn(dropCount(Drop::spool_gave_up)-given_up, 1, "spool failing reading counted as dropped");
+
+        // A sink that always fails does not fill the spool.
+        spool.reset();
+        given_up = dropCount(Drop::spool_gave_up);
+        spool = createSpool(dir, 512, 3*512);
+        spool->addSink("broken", 1, [&](const uchar *data, size_t len) { return false; });
+        int appended = 0;
+        for (int i = 0; i < 40; ++i)
+        {
+            if (spool->append((const uchar*)rec.data(), rec.length())) appended++;
+            usleep(2*1000);
+        }
+        for (int i = 0; i < 100 && spool->pending() > 0; ++i) usleep(10*1000);
+        eqn(appended, 40, "spool always failing sink still appends");
+        eqn(dropCount(Drop::spool_gave_up)-given_up, 40, "spool always failing sink gives up every reading");
+    }
+    warningSilenced(false);
+    system(cmd.c_str());
+}
+
+static void *writeLogLines(void *a)
+{
+    LogWriter *w = (LogWriter*)a;
+    char line[600];
+    // Some lines are longer than a cell, to test that they are not split up.
+    for (int i = 0; i < 1000; ++i)
+    {
+        int n = snprintf(line, sizeof(line), "%lu %04d %s\n", (unsigned long)pthread_self(), i,
+                         string((i%10)*50, 'x').c_str());
+        while (!w->write(line, n)) usleep(100);
+    }
+    return NULL;
+}
+
+void test_logwriter()
+{
+    string file = "/tmp/wmbusmeters_testinternals_log_"+to_string(getpid());
+    unlink(file.c_str());
+    {
+        auto w = createLogWriter(file);
+        pthread_t threads[4];
+        for (int i = 0; i < 4; ++i) pthread_create(&threads[i], NULL, writeLogLines, w.get());
+        for (int i = 0; i < 4; ++i) pthread_join(threads[i], NULL);
+        w->flush();
+    }
+    vector<char> buf;
+    loadFile(file, &buf);
+    string content(buf.begin(), buf.end());
+    int lines = 0;
+    size_t start = 0, end;
+    while ((end = content.find('\n', start)) != string::npos)
+    {
+        string line = content.substr(start, end-start);
+        start = end+1;
+        // The writers retry when the ring is full, the drop reports are not test lines.
+        if (startsWith(line, "(wmbusmeters) log ring full")) continue;
+        size_t a = line.find(' ');
+        size_t b = line.find(' ', a+1);
+        if (a == string::npos || b == string::npos || line.length()-b-1 != (size_t)(atoi(line.c_str()+a+1)%10)*50)
+        {
+            printf("ERROR in logwriter, broken line %d \"%.60s\"\n", lines, line.c_str());
+            break;
+        }
+        lines++;
+    }
+    eqn(lines, 4000, "logwriter lines written");
+
+    // Rotate when the file grows beyond 1000 bytes.
+    unlink(file.c_str());
+    {
+        auto w = createLogWriter(file, 1000);
+        string big = string(1100, 'y')+"\n";
+        w->write(big.c_str(), big.length());
+        w->flush();
+        w->write("new\n", 4);
+        w->flush();
+    }
+    string rotated = file+".1";
+    buf.clear();
+    loadFile(file, &buf);
+    eqn(buf.size(), 4, "logwriter rotated log file");
+    if (!checkFileExists(rotated.c_str())) printf("ERROR in logwriter, expected %s to exist\n", rotated.c_str());
+    unlink(file.c_str());
+    unlink(rotated.c_str());
+
+    // Keep two rotated files, and reopen when the file is moved away by someone else.
+    string rotated2 = file+".2", rotated3 = file+".3", moved = file+".moved";
+    {
+        auto w = createLogWriter(file, 1000, 0, 2);
+        string big = string(1100, 'y')+"\n";
+        for (int i = 0; i < 3; ++i)
+        {
+            w->write(big.c_str(), big.length());
+            w->flush();
+        }
+        if (!checkFileExists(rotated2.c_str()) || checkFileExists(rotated3.c_str()))
+        {
+            printf("ERROR in logwriter, expected exactly two rotated files\n");
+        }
+        uint64_t g = w->generation();
+        rename(file.c_str(), moved.c_str());
+        for (int i = 0; i < 2000 && w->generation() == g; ++i) usleep(1000);
+        if (!w->writeAndWait("new\n", 4)) printf("ERROR in logwriter, write and wait failed\n");
+    }
+    buf.clear();
+    loadFile(file, &buf);
+    eqn(buf.size(), 4, "logwriter reopened externally rotated log file");
+    unlink(file.c_str());
+    unlink(rotated.c_str());
+    unlink(rotated2.c_str());
+    unlink(moved.c_str());
+
+    // Text that cannot be written goes to the fallback and is counted.
+    string fallen;
+    uint64_t errors = dropCount(Drop::log_write_error);
+    {
+        auto w = createLogWriter("/dev/full", 0, 0, 1, [&](const char *data, size_t len) { fallen.append(data, len); });
+        if (!w) return;
+        if (w->writeAndWait("lost\n", 5)) printf("ERROR in logwriter, write to a full disk succeeded\n");
+    }
+    if (fallen.find("could not be written") == string::npos || fallen.find("lost\n") == string::npos)
+    {
+        printf("ERROR in logwriter, expected the text in the fallback but got \"%s\"\n", fallen.c_str());
+    }
+    if (dropCount(Drop::log_write_error) == errors) printf("ERROR in logwriter, write error was not counted\n");
+}
+
+void test_disabled_logging()
+{
+    if (isDebugEnabled()) return;
+
+    vector<uchar> frame(64, 0x2e);
+    size_t before = allocations_;
+    debug("(test) frame %s\n", bin2hex(frame).c_str());
+    debugPayload("(test) a long intro that does not fit in a short string", frame);
+    verbose("(test) %s\n", safeString(frame).c_str());
+    eqn(allocations_-before, 0, "disabled debug and verbose logging does not allocate");
+}
+
+void test_stats()
+{
+    statsEnabled(true);
+    for (int i = 1; i <= 100; ++i) recordStage(Stage::decrypt, i*1000);
+    statsEnabled(false);
+
+    string table = statsTable();
+    size_t p = table.find("(stats) decrypt");
+    if (p == string::npos)
+    {
+        printf("ERROR in stats, no decrypt row in:\n%s", table.c_str());
+        return;
+    }
+    double mean, p50, p90, p99, max;
+    int count;
+    sscanf(table.c_str()+p, "(stats) decrypt %d %lf %lf %lf %lf %lf", &count, &mean, &p50, &p90, &p99, &max);
+    eqn(count, 100, "stats count");
+    eqn((int)(mean*10), 505, "stats mean");
+    eqn((int)max, 100, "stats max");
+    // The buckets are a quarter of a power of two wide.
+    if (p50 < 50 || p50 > 50*1.25 || p90 < 90 || p90 > 90*1.25)
+    {
+        printf("ERROR in stats, bad percentiles p50=%f p90=%f\n", p50, p90);
+    }
+
+    // A broken dll crc is counted.
+    vector<uchar> frame(20, 0x47);
+    uint64_t before = fateCount(Fate::crc_failure);
+    trimCRCsFrameFormatA(frame);
+    eqn(fateCount(Fate::crc_failure)-before, 1, "stats crc failure counted");
+
+    FateCounters *fc = meterFateCounters("Water");
+    countFate(Fate::update, fc);
+    countFate(Fate::update, fc);
+    eqn(fateCount(Fate::update, fc), 2, "stats meter updates");
+    if (fatesJson().find("\"Water\":{\"received\":0,\"framing_error\":0") == string::npos)
+    {
+        printf("ERROR in stats, meter missing in %s", fatesJson().c_str());
+    }
+    countFate(Fate::update, meterFateCounters("Hot \"tap\"\\\n"));
+    if (fatesJson().find("\"Hot \\\"tap\\\"\\\\\\u000a\":{") == string::npos)
+    {
+        printf("ERROR in stats, meter name not escaped in %s", fatesJson().c_str());
+    }
+}
+
+static string httpGet(int port, string path)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return "";
+    }
+    string req = "GET "+path+" HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    write(fd, req.c_str(), req.length());
+    string got;
+    char buf[1024];
+    ssize_t n;
+    // The server closes the connection when the response is sent.
+    while ((n = read(fd, buf, sizeof(buf))) > 0) got.append(buf, n);
+    close(fd);
+    return got;
+}
+
+void test_metrics()
+{
+    auto manager = createSerialCommunicationManager(0, 0, true);
+    manager->startEventLoop();
+    int port = 0;
+    unique_ptr<Metrics> metrics;
+    for (int i = 0; i < 10 && !metrics; ++i)
+    {
+        port = 20000+(getpid()+i)%20000;
+        warningSilenced(true);
+        metrics = createMetrics(port, manager.get());
+        warningSilenced(false);
+    }
+    if (!metrics)
+    {
+        printf("ERROR in metrics, could not listen\n");
+        return;
+    }
+    metrics->addGauge("test_depth", "A test gauge.", [](){ return 17.0; });
+    countFate(Fate::received, driverFateCounters("im871a"));
+    metrics->render();
+
+    string got = httpGet(port, "/metrics");
+    if (got.find("HTTP/1.0 200 OK") != 0 ||
+        got.find("\r\n\r\n# HELP wmbusmeters_telegrams_total") == string::npos ||
+        got.find("\nwmbusmeters_test_depth 17\n") == string::npos ||
+        got.find("\nwmbusmeters_driver_telegrams_total{fate=\"received\",driver=\"im871a\"} ") == string::npos)
+    {
+        printf("ERROR in metrics, got:\n%s\n", got.c_str());
+    }
+    got = httpGet(port, "/");
+    if (got.find("HTTP/1.0 404") != 0)
+    {
+        printf("ERROR in metrics, expected 404 got:\n%s\n", got.c_str());
+    }
+
+    // Clients that never send a request must not use up the connections forever,
+    // but until they are dropped, the number of connections is limited.
+    vector<int> idle;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 0; i < 64; ++i)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+        idle.push_back(fd);
+    }
+    usleep(100*1000);
+    warningSilenced(true);
+    got = httpGet(port, "/metrics");
+    warningSilenced(false);
+    if (got != "") printf("ERROR in metrics, expected a refused connection got:\n%.60s\n", got.c_str());
+    for (int fd : idle) close(fd);
+    usleep(100*1000);
+    got = httpGet(port, "/metrics");
+    if (got.find("HTTP/1.0 200 OK") != 0) printf("ERROR in metrics, expected 200 after the idle clients left\n");
+
+    metrics.reset();
+    manager->stop();
+    manager->waitForStop();
+}
+
+// A scripted fake dongle on the master side of a pty pair. It answers
+// the request with the reply, or never answers if the reply is empty.
+// Or the script is invoked with the bytes received so far, and consumes them.
+struct FakeDongle
+{
+    int master { -1 };
+    string device; // The slave side, eg /dev/pts/7
+    vector<uchar> request;
+    vector<uchar> reply;
+    function<void(FakeDongle*,vector<uchar>&)> script;
+    atomic<bool> running {};
+    pthread_t thread {};
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    vector<uchar> received; // All bytes written to the dongle, to check the probe order.
+};
+
+// Where the request begins in the received bytes, or -1 if it was never sent.
+static int receivedAt(FakeDongle *d, vector<uchar> request)
+{
+    pthread_mutex_lock(&d->lock);
+    auto i = search(d->received.begin(), d->received.end(), request.begin(), request.end());
+    int at = i == d->received.end() ? -1 : (int)(i-d->received.begin());
+    pthread_mutex_unlock(&d->lock);
+    return at;
+}
+
+static void clearReceived(FakeDongle *d)
+{
+    pthread_mutex_lock(&d->lock);
+    d->received.clear();
+    pthread_mutex_unlock(&d->lock);
+}
+
+static void *fakeDongleLoop(void *a)
+{
+    FakeDongle *d = (FakeDongle*)a;
+    vector<uchar> got;
+    while (d->running)
+    {
+        struct pollfd pfd = { d->master, POLLIN, 0 };
+        if (poll(&pfd, 1, 10) <= 0) continue;
+        uchar buf[256];
+        ssize_t n = read(d->master, buf, sizeof(buf));
+        if (n <= 0)
+        {
+            // EIO while nobody has the slave open.
+            usleep(1000);
+            continue;
+        }
+        got.insert(got.end(), buf, buf+n);
+        pthread_mutex_lock(&d->lock);
+        d->received.insert(d->received.end(), buf, buf+n);
+        pthread_mutex_unlock(&d->lock);
+        if (d->script)
+        {
+            d->script(d, got);
+        }
+        else if (d->reply.size() > 0 && search(got.begin(), got.end(), d->request.begin(), d->request.end()) != got.end())
+        {
+            write(d->master, &d->reply[0], d->reply.size());
+            got.clear();
+        }
+    }
+    return NULL;
+}
+
+static bool startFakeDongle(FakeDongle *d, vector<uchar> request, vector<uchar> reply,
+                            function<void(FakeDongle*,vector<uchar>&)> script = NULL)
+{
+    d->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (d->master == -1 || grantpt(d->master) != 0 || unlockpt(d->master) != 0) return false;
+    d->device = ptsname(d->master);
+    d->request = request;
+    d->reply = reply;
+    d->script = script;
+    d->running = true;
+    pthread_create(&d->thread, NULL, fakeDongleLoop, d);
+    return true;
+}
+
+static void stopFakeDongle(FakeDongle *d)
+{
+    d->running = false;
+    pthread_join(d->thread, NULL);
+    close(d->master);
+}
+
+void test_detect()
+{
+    auto manager = createSerialCommunicationManager(0, 0, false);
+
+    vector<uchar> amb_reply = { 0xff, 0x8b, 0x04, 0x01, 0x02, 0x03, 0x04, 0x00 };
+    for (int i = 0; i < 7; ++i) amb_reply[7] ^= amb_reply[i];
+    vector<uchar> im871a_ping = { 0xa5, 0x01, 0x01, 0x00 };
+    vector<uchar> amb_ping = { 0xff, 0x0b, 0x00, 0xf4 };
+
+    // No wall clock limits, they fail on a loaded machine. The order of the probes
+    // tells that the detection stops as soon as a dongle answers and that the
+    // candidates are probed at the same time.
+    FakeDongle im871a, amb8465, silent;
+    if (!startFakeDongle(&im871a, im871a_ping, { 0xa5, 0x01, 0x02, 0x00 }) ||
+        !startFakeDongle(&amb8465, amb_ping, amb_reply) ||
+        !startFakeDongle(&silent, {}, {}))
+    {
+        printf("ERROR in detect, could not create pty pairs\n");
+        return;
+    }
+
+    // The amb8465 answers the first probe, the others are never sent.
+    vector<DetectCandidate> candidates = { { amb8465.device, { probeAMB8465(), probeIM871A(), probeCUL() }, false } };
+    WMBusDeviceType type = DEVICE_UNKNOWN;
+    int found = detectConcurrently(candidates, manager.get(), &type);
+    if (found != 0 || type != DEVICE_AMB8465)
+    {
+        printf("ERROR in detect, expected amb8465 got %d %s\n", found, toLowerCaseString(type));
+    }
+    if (receivedAt(&amb8465, amb_ping) == -1 || receivedAt(&amb8465, im871a_ping) != -1)
+    {
+        printf("ERROR in detect, expected only the amb8465 probe to be sent to the amb8465\n");
+    }
+    clearReceived(&amb8465);
+
+    // All are probed at the same time, the im871a is preferred since it comes first.
+    // It answers when the amb8465 probe has timed out, without waiting for the silent one.
+    candidates =
+    {
+        { im871a.device, { probeAMB8465(), probeIM871A(), probeCUL() }, false },
+        { silent.device, { probeAMB8465(), probeIM871A(), probeCUL() }, false },
+        { amb8465.device, { probeAMB8465(), probeIM871A(), probeCUL() }, false },
+    };
+    found = detectConcurrently(candidates, manager.get(), &type);
+    if (found != 0 || type != DEVICE_IM871A)
+    {
+        printf("ERROR in detect, expected im871a got %d %s\n", found, toLowerCaseString(type));
+    }
+    int amb_at = receivedAt(&im871a, amb_ping);
+    int im871a_at = receivedAt(&im871a, im871a_ping);
+    if (amb_at == -1 || im871a_at == -1 || amb_at > im871a_at)
+    {
+        printf("ERROR in detect, expected the im871a to get the amb8465 probe and then the im871a probe\n");
+    }
+    // One after the other, the detection would have stopped at the im871a.
+    if (receivedAt(&amb8465, amb_ping) == -1)
+    {
+        printf("ERROR in detect, expected the last candidate to be probed at the same time\n");
+    }
+
+    candidates = { { silent.device, { probeAMB8465(), probeIM871A(), probeCUL() }, false } };
+    found = detectConcurrently(candidates, manager.get(), &type);
+    if (found != -1)
+    {
+        printf("ERROR in detect, expected nothing from the silent dongle got %d\n", found);
+    }
+
+    stopFakeDongle(&im871a);
+    stopFakeDongle(&amb8465);
+    stopFakeDongle(&silent);
+}
+
+void test_commands()
+{
+    auto manager = createSerialCommunicationManager(0, 0, true);
+
+    // A telegram indication from the radio link endpoint.
+    vector<uchar> telegram = { 0xa5, 0x02, 0x03, 0x0a, 0x44, 0x2d, 0x2c, 0x03, 0x00, 0x00, 0x90, 0x1b, 0x16, 0x8d };
+    atomic<int> set_configs {}, device_infos {};
+    atomic<bool> mute {};
+
+    // The first set config is lost, but a telegram arrives meanwhile. The device info is never answered.
+    FakeDongle im871a;
+    auto script = [&](FakeDongle *d, vector<uchar> &got)
+    {
+        while (got.size() >= 4 && got.size() >= 4u+got[3])
+        {
+            int msgid = got[2];
+            got.erase(got.begin(), got.begin()+4+got[3]);
+            vector<uchar> reply;
+            if (msgid == 0x03 && mute) set_configs++;
+            else if (msgid == 0x03 && set_configs++ == 0) reply = telegram;
+            else if (msgid == 0x03) reply = { 0xa5, 0x01, 0x04, 0x01, 0x00 };
+            // Only the link mode is present, 3 is t1.
+            else if (msgid == 0x05) reply = { 0xa5, 0x01, 0x06, 0x03, 0x02, 0x03, 0x00 };
+            else if (msgid == 0x0f) device_infos++;
+            if (reply.size() > 0) write(d->master, &reply[0], reply.size());
+        }
+    };
+    if (!startFakeDongle(&im871a, {}, {}, script))
+    {
+        printf("ERROR in commands, could not create pty pair\n");
+        return;
+    }
+
+    // Opened before the event loop starts, like in main, since there are no signals to wake it up.
+    auto wmbus = openIM871A(im871a.device, manager.get(), NULL);
+    manager->startEventLoop();
+    atomic<int> telegrams {};
+    atomic<int> set_configs_at_telegram { -1 };
+    wmbus->onTelegram([&](AboutTelegram &about, vector<uchar> frame)
+                      {
+                          telegrams++;
+                          set_configs_at_telegram = (int)set_configs;
+                          return true;
+                      });
+
+    LinkModeSet lms;
+    lms.addLinkMode(LinkMode::T1);
+    wmbus->setLinkModes(lms);
+    LinkModeSet got = wmbus->getLinkModes();
+    if (!got.has(LinkMode::T1) || set_configs != 2)
+    {
+        printf("ERROR in commands, expected t1 after one resend got %s after %d set configs\n",
+               got.hr().c_str(), (int)set_configs);
+    }
+    if (telegrams != 1 || set_configs_at_telegram != 1)
+    {
+        printf("ERROR in commands, expected a telegram while the set config was outstanding got %d\n",
+               (int)telegrams);
+    }
+
+    warningSilenced(true);
+    uint32_t id = wmbus->getDeviceId();
+    warningSilenced(false);
+    if (id != 0 || device_infos != 3)
+    {
+        printf("ERROR in commands, expected the device info to be given up after 3 attempts got %d\n",
+               (int)device_infos);
+    }
+
+    // A set config that nobody waits for is still resent and given up.
+    mute = true;
+    int before = set_configs;
+    warningSilenced(true);
+    wmbus->setLinkModes(lms);
+    for (int i = 0; i < 300 && set_configs-before < 3; ++i) usleep(10*1000);
+    usleep(500*1000);
+    warningSilenced(false);
+    if (set_configs-before != 3)
+    {
+        printf("ERROR in commands, expected an unawaited set config to be sent 3 times got %d\n",
+               (int)set_configs-before);
+    }
+
+    wmbus.reset();
+    manager->stop();
+    manager->waitForStop();
+    stopFakeDongle(&im871a);
+}
+
+void test_dedup()
+{
+    vector<uchar> frame, relayed, next, other;
+    // An ell frame with cc 0x20 and access number 0x45, relayed with the R bit set in cc.
+    hex2bin("1e442d2c998734761b168d2045aabbccddeeff00112233445566778899", &frame);
+    relayed = frame;
+    relayed[11] |= 0x10;
+    next = frame;
+    next[12] = 0x46;
+    other = frame;
+    other[20] ^= 0xff;
+
+    dedupEnabled(10, 3);
+    if (isDuplicate(frame, 1000, 0)) printf("ERROR dedup first copy dropped\n");
+    if (!isDuplicate(frame, 1001, 0)) printf("ERROR dedup second copy not dropped\n");
+    if (!isDuplicate(relayed, 1002, 0)) printf("ERROR dedup relayed copy not dropped\n");
+    if (isDuplicate(next, 1003, 0)) printf("ERROR dedup next access number dropped\n");
+    if (isDuplicate(other, 1004, 0)) printf("ERROR dedup other payload dropped\n");
+    // The window has passed for the first frame.
+    if (isDuplicate(frame, 1010, 0)) printf("ERROR dedup copy after the window dropped\n");
+    eqn(dedupEntries(), 3, "dedup entries within max");
+    if (memoryUsage(Memory::dedup_cache) <= 0) printf("ERROR dedup memory not accounted\n");
+
+    // Two receivers hear the same frame, the stronger copy is preferred whichever comes first.
+    dedupEnabled(10, 100);
+    if (isDuplicate(frame, 1000, -85)) printf("ERROR dedup weak first copy dropped\n");
+    if (isDuplicate(frame, 1001, -60)) printf("ERROR dedup stronger copy dropped\n");
+    if (!isDuplicate(frame, 1002, -85)) printf("ERROR dedup weaker copy not dropped\n");
+    if (!isDuplicate(frame, 1003, -60)) printf("ERROR dedup equally strong copy not dropped\n");
+    if (!isDuplicate(frame, 1004, 0)) printf("ERROR dedup copy without rssi not dropped\n");
+    if (isDuplicate(next, 1005, -60)) printf("ERROR dedup strong first copy dropped\n");
+    if (!isDuplicate(next, 1006, -85)) printf("ERROR dedup weaker second copy not dropped\n");
+
+    dedupEnabled(0, 0);
+    eqn(dedupEntries(), 0, "dedup entries after disable");
+    eqn(memoryUsage(Memory::dedup_cache), 0, "dedup memory after disable");
+}
+
+static void demodulate(const char *tn, LinkMode mode, const char *hex, bool format_b,
+                       double offset_hz, double noise, bool swap_iq)
+{
+    vector<uchar> frame;
+    hex2bin(hex, &frame);
+    vector<uchar> iq = modulateIQ(mode, frame, format_b, DEMOD_SAMPLE_RATE, offset_hz, noise, 4711);
+    if (swap_iq)
+    {
+        // The frequencies are mirrored, ie the chips are inverted.
+        for (size_t i = 0; i+1 < iq.size(); i += 2) swap(iq[i], iq[i+1]);
+    }
+
+    vector<vector<uchar>> received;
+    LinkMode received_mode = LinkMode::UNKNOWN;
+    Demodulator demod(DEMOD_SAMPLE_RATE, NULL, [&](LinkMode lm, vector<uchar> &f) { received_mode = lm; received.push_back(f); });
+    // Odd sized reads, as from a pipe.
+    for (size_t pos = 0; pos < iq.size(); pos += 1001)
+    {
+        demod.process(&iq[pos], min((size_t)1001, iq.size()-pos));
+    }
+    if (received.size() != 1 || received[0] != frame || received_mode != mode)
+    {
+        printf("ERROR in demod %s, got %zu frames\n", tn, received.size());
+    }
+}
+
+void test_demod()
+{
+    const char *t1 = "A244EE4D785634123C067A8F0000000C1348550000426CE1F14C130000000082046C21298C0413330000008D04931E3A3CFE3300000033000000330000003300000033000000330000003300000033000000330000003300000033000000330000004300000034180000046D0D0B5C2B03FD6C5E150082206C5C290BFD0F0200018C4079678885238310FD3100000082106C01018110FD610002FD66020002FD170000";
+    const char *c1 = "2A442D2C998734761B168D2091D37CAC21576C7802FF207100041308190000441308190000615B7F616713";
+
+    demodulate("t1", LinkMode::T1, t1, false, 0, 5, false);
+    demodulate("t1 offset and noise", LinkMode::T1, t1, false, -20000, 20, false);
+    demodulate("t1 inverted", LinkMode::T1, t1, false, 10000, 10, true);
+    demodulate("c1 format a", LinkMode::C1, c1, false, 15000, 10, false);
+    demodulate("c1 format b", LinkMode::C1, c1, true, 0, 10, false);
+}
+
+static unique_ptr<SerialDevice> listenSomewhere(SerialCommunicationManager *manager, string proto, bool lines, int *port)
+{
+    for (int i = 0; i < 10; ++i)
+    {
+        *port = 20000+(getpid()+i)%20000;
+        auto sd = manager->createSerialDeviceSocket(proto+":"+to_string(*port), lines);
+        if (sd->open(false)) return sd;
+    }
+    return NULL;
+}
+
+static int connectTcp(int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void test_network()
+{
+    auto manager = createSerialCommunicationManager(0, 0, true);
+    manager->startEventLoop();
+
+    int port;
+    auto sd = listenSomewhere(manager.get(), "tcp", false, &port);
+    if (!sd)
+    {
+        printf("ERROR in network, could not listen\n");
+        return;
+    }
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    vector<string> got;
+    SerialDevice *d = sd.get();
+    auto collect = [&]()
+    {
+        vector<uchar> data;
+        d->receive(&data);
+        if (data.size() == 0) return;
+        pthread_mutex_lock(&lock);
+        got.push_back(d->source()+" "+bin2hex(data));
+        pthread_mutex_unlock(&lock);
+    };
+    auto waitFor = [&](size_t n)
+    {
+        for (int i = 0; i < 100; ++i)
+        {
+            pthread_mutex_lock(&lock);
+            size_t s = got.size();
+            pthread_mutex_unlock(&lock);
+            if (s >= n) break;
+            usleep(10*1000);
+        }
+    };
+    manager->listenTo(d, collect);
+
+    // The first sender is interrupted by a second sender in the middle of a frame.
+    int a = connectTcp(port);
+    int b = connectTcp(port);
+    uchar a1[] = { 0x03, 0x01 }, a2[] = { 0x02, 0x03 }, b1[] = { 0x02, 0x09, 0x09 };
+    write(a, a1, sizeof(a1));
+    usleep(50*1000);
+    write(b, b1, sizeof(b1));
+    usleep(50*1000);
+    write(a, a2, sizeof(a2));
+    waitFor(2);
+    close(a);
+    close(b);
+    sd.reset();
+
+    pthread_mutex_lock(&lock);
+    string all;
+    for (string &s : got) all += s+"|";
+    got.clear();
+    pthread_mutex_unlock(&lock);
+    eq(all, "127.0.0.1 020909|127.0.0.1 03010203|", "network tcp frames");
+
+    // A datagram with a complete line and the start of the next.
+    sd = listenSomewhere(manager.get(), "udp", true, &port);
+    d = sd.get();
+    manager->listenTo(d, collect);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int u = socket(AF_INET, SOCK_DGRAM, 0);
+    string line = "T1;1\nT1;";
+    sendto(u, line.c_str(), line.length(), 0, (struct sockaddr*)&addr, sizeof(addr));
+    waitFor(1);
+    close(u);
+    sd.reset();
+
+    pthread_mutex_lock(&lock);
+    all = "";
+    for (string &s : got) all += s+"|";
+    pthread_mutex_unlock(&lock);
+    eq(all, "127.0.0.1 54313B310A|", "network udp lines");
+
+    // A sender that never completes a line is disconnected, it cannot fill the memory.
+    sd = listenSomewhere(manager.get(), "tcp", true, &port);
+    d = sd.get();
+    manager->listenTo(d, collect);
+    int c = connectTcp(port);
+    string junk(4096, 'x');
+    size_t sent = 0;
+    warningSilenced(true);
+    while (sent < 16*1024*1024)
+    {
+        ssize_t n = send(c, junk.c_str(), junk.length(), MSG_NOSIGNAL);
+        if (n <= 0) break;
+        sent += n;
+    }
+    warningSilenced(false);
+    close(c);
+    sd.reset();
+    if (sent >= 16*1024*1024) printf("ERROR in network, a sender without newlines was not disconnected\n");
+
+    manager->stop();
+    manager->waitForStop();
+}
+
+void test_forward()
+{
+    AboutTelegram about;
+    about.timestamp = 1588334400;
+    about.rssi_dbm = -75;
+    about.link_mode = LinkMode::T1;
+    vector<uchar> frame = { 0x0e, 0x44, 0xee, 0x4d, 0x78, 0x56, 0x34, 0x12, 0x3c, 0x06 };
+    eq(forwardLine(about, frame), "T1;1;1;2020-05-01T12:00:00Z;-75;0;12345678;0x0E44EE4D785634123C06\n", "forward t1 line");
+
+    about.link_mode = LinkMode::UNKNOWN;
+    about.rssi_dbm = 0;
+    frame.resize(4);
+    eq(forwardLine(about, frame), "ANY;1;1;2020-05-01T12:00:00Z;0;0;00000000;0x0E44EE4D\n", "forward unknown mode");
+}
+
+void test_serial_send()
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) != 0 || unlockpt(master) != 0)
+    {
+        printf("ERROR in serial send, could not open a pty\n");
+        return;
+    }
+    auto manager = createSerialCommunicationManager(0, 0, true);
+    auto tty = manager->createSerialDeviceTTY(ptsname(master), 9600);
+    if (!tty->open(false))
+    {
+        printf("ERROR in serial send, could not open %s\n", ptsname(master));
+        close(master);
+        return;
+    }
+    atomic<int> sent {};
+    atomic<int> failed {};
+    auto done = [&](bool ok) { if (ok) sent++; else failed++; };
+
+    // The event loop is not yet running, the bytes are written at once.
+    vector<uchar> a = { 0x01, 0x02 };
+    tty->send(a, done);
+    eqn(sent, 1, "serial send before event loop");
+
+    // Far more than the pty buffers, send returns before the reader has caught up.
+    manager->startEventLoop();
+    vector<uchar> big(1024*1024, 0x55);
+    vector<uchar> b = { 0x03 };
+    tty->send(big, done);
+    tty->send(b, done);
+    eqn(sent, 1, "serial send queued");
+
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    vector<uchar> got;
+    uchar buf[4096];
+    for (int i = 0; i < 500 && got.size() < 2+big.size()+1; ++i)
+    {
+        ssize_t n = read(master, buf, sizeof(buf));
+        if (n > 0) got.insert(got.end(), buf, buf+n);
+        else usleep(10*1000);
+    }
+    for (int i = 0; i < 100 && sent < 3; ++i) usleep(10*1000);
+    eqn(sent, 3, "serial send completed");
+    eqn(got.size(), 2+big.size()+1, "serial send bytes");
+    if (got.size() == 2+big.size()+1)
+    {
+        eqn(got[0] == 0x01 && got[1] == 0x02 && got[2] == 0x55 && got.back() == 0x03, 1, "serial send order");
+    }
+
+    // Nothing is sent on a closed tty.
+    tty->close();
+    eqn(tty->send(b, done), 0, "serial send closed");
+    eqn(failed, 0, "serial send failures");
+
+    close(master);
+    manager->stop();
+}
@@ -0,0 +1,214 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"stats.h"
+#include"util.h"
+
+#include<atomic>
+#include<pthread.h>
+#include<unistd.h>
+#include<vector>
+
+bool trace_enabled_ = false;
+
+// The last events of each thread are kept, at 1% sampling
+// this covers several hundred telegrams per thread.
+#define TRACE_BUFFER_EVENTS 8192
+
+// The whole handling of a telegram is recorded as this pseudo stage.
+#define TRACE_TELEGRAM ((int)Stage::NUM_STAGES)
+
+static const char *trace_names_[] = {
+#define X(name,hrname) #name,
+LIST_OF_STAGES
+#undef X
+    "telegram"
+};
+
+struct TraceEvent
+{
+    uint64_t start;
+    uint64_t end;
+    uint32_t telegram; // The traced telegrams are numbered from 1.
+    uint32_t id; // The dll id, eg 0x12345678 for id 12345678.
+    int stage;
+};
+
+// Only the owning thread writes an event and then increments head.
+// A reader copies the events and then discards those that might have
+// been overwritten while copying. No locks on the hot path.
+struct TraceBuffer
+{
+    int tid;
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+    atomic<uint64_t> head {};
+};
+
+// The telegram this thread is handling right now, and the latest receive and
+// frame check, that happen before it is known if the telegram is traced.
+struct TraceState
+{
+    TraceBuffer *buffer;
+    uint32_t telegram;
+    uint32_t id;
+    uint64_t start;
+    uint64_t receive_start, receive_end;
+    uint64_t frame_start, frame_end;
+};
+
+static pthread_mutex_t all_traces_lock_ = PTHREAD_MUTEX_INITIALIZER;
+// Never freed, the events of a thread that exits can still be written.
+static vector<TraceBuffer*> all_traces_;
+static thread_local TraceState my_trace_;
+
+static double sample_ {}; // The fraction of the telegrams to trace.
+static vector<string> ids_;
+static uint64_t trace_start_ {};
+static atomic<uint64_t> frames_seen_ {};
+static atomic<uint32_t> telegrams_traced_ {};
+
+void traceEnabled(double sample_percent, vector<string> ids)
+{
+    sample_ = sample_percent/100.0;
+    ids_ = ids;
+    trace_start_ = statsNow();
+    trace_enabled_ = true;
+}
+
+static void append(int stage, uint64_t start, uint64_t end)
+{
+    TraceBuffer *b = my_trace_.buffer;
+    if (b == NULL)
+    {
+        b = new TraceBuffer();
+        pthread_mutex_lock(&all_traces_lock_);
+        all_traces_.push_back(b);
+        b->tid = all_traces_.size();
+        pthread_mutex_unlock(&all_traces_lock_);
+        my_trace_.buffer = b;
+    }
+    uint64_t h = b->head.load(memory_order_relaxed);
+    TraceEvent &e = b->events[h % TRACE_BUFFER_EVENTS];
+    e.start = start;
+    e.end = end;
+    e.telegram = my_trace_.telegram;
+    e.id = my_trace_.id;
+    e.stage = stage;
+    b->head.store(h+1, memory_order_release);
+}
+
+void traceStage(Stage s, uint64_t start, uint64_t end)
+{
+    if (my_trace_.telegram)
+    {
+        append((int)s, start, end);
+        return;
+    }
+    if (s == Stage::serial_receive)
+    {
+        my_trace_.receive_start = start;
+        my_trace_.receive_end = end;
+    }
+    else if (s == Stage::frame_check)
+    {
+        my_trace_.frame_start = start;
+        my_trace_.frame_end = end;
+    }
+}
+
+void traceTelegramBegin(vector<unsigned char> &frame)
+{
+    uint32_t id = 0;
+    if (frame.size() >= 8) id = frame[7] << 24 | frame[6] << 16 | frame[5] << 8 | frame[4];
+
+    bool traced = false;
+    if (ids_.size() > 0 && frame.size() >= 8)
+    {
+        string s;
+        strprintf(s, "%08x", id);
+        traced = doesIdMatchExpressions(s, ids_);
+    }
+    if (!traced && sample_ > 0)
+    {
+        // Evenly spaced, eg every 100th frame for 1%.
+        uint64_t n = frames_seen_.fetch_add(1, memory_order_relaxed);
+        traced = (uint64_t)((n+1)*sample_) > (uint64_t)(n*sample_);
+    }
+    if (traced)
+    {
+        my_trace_.telegram = ++telegrams_traced_;
+        my_trace_.id = id;
+        my_trace_.start = statsNow();
+        if (my_trace_.receive_end) append((int)Stage::serial_receive, my_trace_.receive_start, my_trace_.receive_end);
+        if (my_trace_.frame_end) append((int)Stage::frame_check, my_trace_.frame_start, my_trace_.frame_end);
+    }
+    my_trace_.receive_end = 0;
+    my_trace_.frame_end = 0;
+}
+
+void traceTelegramEnd()
+{
+    if (!my_trace_.telegram) return;
+    append(TRACE_TELEGRAM, my_trace_.start, statsNow());
+    my_trace_.telegram = 0;
+}
+
+string traceJson()
+{
+    pthread_mutex_lock(&all_traces_lock_);
+    vector<TraceBuffer*> buffers = all_traces_;
+    pthread_mutex_unlock(&all_traces_lock_);
+
+    int pid = getpid();
+    string s = "{\"traceEvents\":[";
+    string line;
+    strprintf(line, "\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"wmbusmeters\"}}", pid);
+    s += line;
+
+    vector<TraceEvent> events;
+    for (TraceBuffer *b : buffers)
+    {
+        uint64_t head = b->head.load(memory_order_acquire);
+        uint64_t from = head > TRACE_BUFFER_EVENTS ? head-TRACE_BUFFER_EVENTS : 0;
+        events.clear();
+        for (uint64_t i = from; i < head; ++i) events.push_back(b->events[i % TRACE_BUFFER_EVENTS]);
+        // The slot of event i is rewritten when the owner writes event i+TRACE_BUFFER_EVENTS.
+        uint64_t now = b->head.load(memory_order_acquire);
+        uint64_t valid = now >= TRACE_BUFFER_EVENTS ? now-TRACE_BUFFER_EVENTS+1 : 0;
+
+        strprintf(line, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                  pid, b->tid, b->tid);
+        s += line;
+        for (uint64_t i = max(from, valid); i < head; ++i)
+        {
+            TraceEvent &e = events[i-from];
+            if (e.start < trace_start_) continue;
+            strprintf(line, ",\n{\"name\":\"%s\",\"cat\":\"telegram\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                      "\"pid\":%d,\"tid\":%d,\"args\":{\"telegram\":%u,\"id\":\"%08x\"}}",
+                      trace_names_[e.stage], (e.start-trace_start_)/1000.0, (e.end-e.start)/1000.0,
+                      pid, b->tid, e.telegram, e.id);
+            s += line;
+        }
+    }
+    s += "\n],\"displayTimeUnit\":\"ns\"}\n";
+    return s;
+}
+
+bool writeTraceFile(string file)
+{
+    return replaceFile(file, traceJson());
+}
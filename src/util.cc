@@ -16,6 +16,7 @@
 */
 
 #include"util.h"
+#include"logwriter.h"
 #include"meters.h"
 #include<assert.h>
 #include<dirent.h>
@@ -64,6 +65,22 @@ void doNothing(int signum)
 {
 }
 
+volatile sig_atomic_t stats_requested_ {};
+
+void gotUsr1(int signum, siginfo_t *info, void *context)
+{
+    // The threads wake each other up with pthread_kill(SIGUSR1) which is SI_TKILL,
+    // a kill -USR1 <pid> from the outside is SI_USER and a request for statistics.
+    if (info != NULL && info->si_code == SI_USER) stats_requested_ = 1;
+}
+
+bool gotStatsRequest()
+{
+    if (!stats_requested_) return false;
+    stats_requested_ = 0;
+    return true;
+}
+
 void signalMyself(int signum)
 {
     if (wake_me_up_on_sig_chld_)
@@ -95,9 +112,9 @@ void onExit(function<void()> cb)
     new_action.sa_flags = 0;
     sigaction(SIGCHLD, &new_action, &old_chld);
 
-    new_action.sa_handler = doNothing;
+    new_action.sa_sigaction = gotUsr1;
     sigemptyset (&new_action.sa_mask);
-    new_action.sa_flags = 0;
+    new_action.sa_flags = SA_SIGINFO;
     sigaction(SIGUSR1, &new_action, &old_usr1);
 
     new_action.sa_handler = doNothing;
@@ -253,6 +270,10 @@ bool stderr_enabled_ = false;
 bool log_telegrams_enabled_ = false;
 
 string log_file_;
+size_t log_rotate_size_ = 0;
+int log_rotate_seconds_ = 0;
+int log_keep_ = 1;
+unique_ptr<LogWriter> log_writer_;
 
 void warningSilenced(bool b) {
     warning_enabled_ = !b;
@@ -262,35 +283,73 @@ void enableSyslog() {
     syslog_enabled_ = true;
 }
 
+void setLogfileRotation(size_t size, int seconds, int keep)
+{
+    log_rotate_size_ = size;
+    log_rotate_seconds_ = seconds;
+    log_keep_ = keep;
+}
+
+// Where the log goes when it cannot be written to the log file.
+static void logFallback(const char *data, size_t len)
+{
+    if (syslog_enabled_)
+    {
+        syslog(LOG_NOTICE, "%.*s", (int)len, data);
+        return;
+    }
+    fwrite(data, 1, len, stderr_enabled_ ? stderr : stdout);
+}
+
 bool enableLogfile(string logfile, bool daemon)
 {
     log_file_ = logfile;
+    if (log_writer_ && log_writer_->path() == logfile)
+    {
+        // Restarted after a SIGHUP, the log file might have been rotated away.
+        log_writer_->reopen();
+    }
+    else
+    {
+        log_writer_ = createLogWriter(logfile, log_rotate_size_, log_rotate_seconds_, log_keep_, logFallback);
+        if (!log_writer_)
+        {
+            logfile_enabled_ = false;
+            return false;
+        }
+    }
     logfile_enabled_ = true;
-    FILE *output = fopen(log_file_.c_str(), "a");
-    if (output) {
+    if (daemon) {
         char buf[256];
         time_t now = time(NULL);
         strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
-        int n = 0;
-        if (daemon) {
-            n = fprintf(output, "(wmbusmeters) logging started %s\n", buf);
-            if (n == 0) {
-                logfile_enabled_ = false;
-                return false;
-            }
-        }
-        fclose(output);
-        return true;
+        notice("(wmbusmeters) logging started %s\n", buf);
     }
-    logfile_enabled_ = false;
-    return false;
+    return true;
 }
 
 void disableLogfile()
 {
+    flushLogfile();
     logfile_enabled_ = false;
 }
 
+bool writeLogfileAndWait(const char *data, size_t len)
+{
+    if (!logfile_enabled_ || !log_writer_) return false;
+    return log_writer_->writeAndWait(data, len);
+}
+
+void flushLogfile()
+{
+    if (log_writer_) log_writer_->flush();
+}
+
+uint64_t logfileGeneration()
+{
+    return log_writer_ ? log_writer_->generation() : 0;
+}
+
 void verboseEnabled(bool b) {
     verbose_enabled_ = b;
 }
@@ -315,11 +374,11 @@ void logTelegramsEnabled(bool b) {
 }
 
 bool isVerboseEnabled() {
-    return verbose_enabled_;
+    return LOGLEVEL_FLOOR < 2 && verbose_enabled_;
 }
 
 bool isDebugEnabled() {
-    return debug_enabled_;
+    return LOGLEVEL_FLOOR < 1 && debug_enabled_;
 }
 
 bool isLogTelegramsEnabled() {
@@ -328,25 +387,28 @@ bool isLogTelegramsEnabled() {
 
 void outputStuff(int syslog_level, const char *fmt, va_list args)
 {
-    if (logfile_enabled_)
+    if (logfile_enabled_ && log_writer_)
     {
-        // Open close at every log occasion, should not be too big of
-        // a performance issue, since normal reception speed of
-        // wmbusmessages are quite low.
-        FILE *output = fopen(log_file_.c_str(), "a");
-        if (output) {
-            vfprintf(output, fmt, args);
-            fclose(output);
-        } else {
-            // Ouch, disable the log file.
-            // Reverting to syslog or stdout depending on settings.
-            logfile_enabled_ = false;
-            // This warning might be written in syslog or stdout.
-            warning("Log file could not be written!\n");
-            // Try again with logfile disabled.
-            outputStuff(syslog_level, fmt, args);
-            return;
+        // The text is handed over to the log writer thread,
+        // no file is opened and no disk io happens here.
+        char buf[1024];
+        va_list copy;
+        va_copy(copy, args);
+        int n = vsnprintf(buf, sizeof(buf), fmt, copy);
+        va_end(copy);
+        if (n < 0) return;
+        if ((size_t)n < sizeof(buf))
+        {
+            // Better in syslog or on stdout than lost, when the ring is full.
+            if (!log_writer_->write(buf, n)) logFallback(buf, n);
         }
+        else
+        {
+            string big(n+1, 0);
+            vsnprintf(&big[0], n+1, fmt, args);
+            if (!log_writer_->write(big.c_str(), n)) logFallback(big.c_str(), n);
+        }
+        return;
     } else
     if (syslog_enabled_) {
         vsyslog(syslog_level, fmt, args);
@@ -387,22 +449,20 @@ void warning(const char* fmt, ...) {
     }
 }
 
-void verbose(const char* fmt, ...) {
-    if (verbose_enabled_) {
-        va_list args;
-        va_start(args, fmt);
-        outputStuff(LOG_NOTICE, fmt, args);
-        va_end(args);
-    }
+// Called through the verbose(...) macro, which has already checked the level.
+void verbose_(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    outputStuff(LOG_NOTICE, fmt, args);
+    va_end(args);
 }
 
-void debug(const char* fmt, ...) {
-    if (debug_enabled_) {
-        va_list args;
-        va_start(args, fmt);
-        outputStuff(LOG_NOTICE, fmt, args);
-        va_end(args);
-    }
+// Called through the debug(...) macro, which has already checked the level.
+void debug_(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    outputStuff(LOG_NOTICE, fmt, args);
+    va_end(args);
 }
 
 void error(const char* fmt, ...)
@@ -411,6 +471,7 @@ void error(const char* fmt, ...)
     va_start(args, fmt);
     outputStuff(LOG_NOTICE, fmt, args);
     va_end(args);
+    flushLogfile();
     exitHandler(0);
     exit(1);
 }
@@ -714,22 +775,16 @@ bool checkIfDirExists(const char *dir)
     return false;
 }
 
-void debugPayload(string intro, vector<uchar> &payload)
+void debugPayload_(string intro, vector<uchar> &payload)
 {
-    if (isDebugEnabled())
-    {
-        string msg = bin2hex(payload);
-        debug("%s \"%s\"\n", intro.c_str(), msg.c_str());
-    }
+    string msg = bin2hex(payload);
+    debug_("%s \"%s\"\n", intro.c_str(), msg.c_str());
 }
 
-void debugPayload(string intro, vector<uchar> &payload, vector<uchar>::iterator &pos)
+void debugPayload_(string intro, vector<uchar> &payload, vector<uchar>::iterator &pos)
 {
-    if (isDebugEnabled())
-    {
-        string msg = bin2hex(pos, payload.end(), 1024);
-        debug("%s \"%s\"\n", intro.c_str(), msg.c_str());
-    }
+    string msg = bin2hex(pos, payload.end(), 1024);
+    debug_("%s \"%s\"\n", intro.c_str(), msg.c_str());
 }
 
 void logTelegram(string intro, vector<uchar> &parsed, int header_size, int suffix_size)
@@ -813,6 +868,29 @@ int parseTime(string time) {
     return n*mul;
 }
 
+size_t parseSize(string size)
+{
+    if (size.length() == 0) return 0;
+    size_t mul = 1;
+    char c = size.back();
+    if (c == 'k' || c == 'K') mul = 1024;
+    if (c == 'M') mul = 1024*1024;
+    if (c == 'G') mul = 1024*1024*1024;
+    if (mul != 1) size.pop_back();
+    if (!isNumber(size)) return 0;
+    return (size_t)atoll(size.c_str())*mul;
+}
+
+double parsePercent(string percent)
+{
+    if (percent.length() > 0 && percent.back() == '%') percent.pop_back();
+    if (percent.length() == 0) return -1;
+    char *end;
+    double p = strtod(percent.c_str(), &end);
+    if (*end != 0 || p < 0 || p > 100) return -1;
+    return p;
+}
+
 #define CRC16_EN_13757 0x3D65
 
 uint16_t crc16_EN13757_per_byte(uint16_t crc, uchar b)
@@ -933,6 +1011,18 @@ bool loadFile(string file, vector<char> *buf)
     return true;
 }
 
+bool replaceFile(string file, const string &content)
+{
+    string tmp = file+".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) return false;
+    bool ok = fwrite(content.data(), 1, content.length(), f) == content.length();
+    if (fclose(f) != 0) ok = false;
+    if (ok && rename(tmp.c_str(), file.c_str()) == 0) return true;
+    unlink(tmp.c_str());
+    return false;
+}
+
 string eatToSkipWhitespace(vector<char> &v, vector<char>::iterator &i, int c, size_t max, bool *eof, bool *err)
 {
     eatWhitespace(v, i, eof);
@@ -29,6 +29,8 @@ enum class MeterType;
 void onExit(std::function<void()> cb);
 void restoreSignalHandlers();
 bool gotHupped();
+// True once after somebody sent kill -USR1 to the process.
+bool gotStatsRequest();
 void wakeMeUpOnSigChld(pthread_t t);
 bool signalsInstalled();
 
@@ -52,12 +54,20 @@ std::string strdatetime(struct tm *date);
 void xorit(uchar *srca, uchar *srcb, uchar *dest, int len);
 void shiftLeft(uchar *srca, uchar *srcb, int len);
 std::string format3fdot3f(double v);
+// Set before enableLogfile, the log file is rotated at this size or age, zero means never.
+// Keep is the number of old log files, <file>.1 to <file>.keep
+void setLogfileRotation(size_t size, int seconds, int keep);
 bool enableLogfile(std::string logfile, bool daemon);
 void disableLogfile();
+// Append text to the log file and wait until it is written, false if the log file
+// is not enabled, the log ring is full or the text could not be written.
+bool writeLogfileAndWait(const char *data, size_t len);
+// Wait until the log writer has written everything to the log file.
+void flushLogfile();
+// Changes when the log file has been rotated or reopened.
+uint64_t logfileGeneration();
 void enableSyslog();
 void error(const char* fmt, ...);
-void verbose(const char* fmt, ...);
-void debug(const char* fmt, ...);
 void warning(const char* fmt, ...);
 void info(const char* fmt, ...);
 void notice(const char* fmt, ...);
@@ -72,8 +82,25 @@ bool isVerboseEnabled();
 bool isDebugEnabled();
 bool isLogTelegramsEnabled();
 
-void debugPayload(std::string intro, std::vector<uchar> &payload);
-void debugPayload(std::string intro, std::vector<uchar> &payload, std::vector<uchar>::iterator &pos);
+// verbose(...) debug(...) and debugPayload(...) check the log level before the
+// arguments are evaluated. When disabled they cost a load and a branch, no
+// bin2hex or other temporary strings are built. Build with LOGLEVEL_FLOOR=1
+// to remove debug output from the binary, LOGLEVEL_FLOOR=2 removes verbose too.
+#ifndef LOGLEVEL_FLOOR
+#define LOGLEVEL_FLOOR 0
+#endif
+
+extern bool verbose_enabled_;
+extern bool debug_enabled_;
+
+#define verbose(...) do { if (LOGLEVEL_FLOOR < 2 && verbose_enabled_) verbose_(__VA_ARGS__); } while (0)
+#define debug(...) do { if (LOGLEVEL_FLOOR < 1 && debug_enabled_) debug_(__VA_ARGS__); } while (0)
+#define debugPayload(...) do { if (LOGLEVEL_FLOOR < 1 && debug_enabled_) debugPayload_(__VA_ARGS__); } while (0)
+
+void verbose_(const char* fmt, ...);
+void debug_(const char* fmt, ...);
+void debugPayload_(std::string intro, std::vector<uchar> &payload);
+void debugPayload_(std::string intro, std::vector<uchar> &payload, std::vector<uchar>::iterator &pos);
 void logTelegram(std::string intro, std::vector<uchar> &parsed, int header_size, int suffix_size);
 
 bool isValidMatchExpression(std::string id, bool non_compliant);
@@ -95,12 +122,18 @@ bool checkIfSimulationFile(const char *file);
 bool checkIfDirExists(const char *dir);
 bool listFiles(std::string dir, std::vector<std::string> *files);
 bool loadFile(std::string file, std::vector<char> *buf);
+// Write the content to file.tmp then rename it to file, readers never see a half written file.
+bool replaceFile(std::string file, const std::string &content);
 
 std::string eatTo(std::vector<uchar> &v, std::vector<uchar>::iterator &i, int c, size_t max, bool *eof, bool *err);
 
 void padWithZeroesTo(std::vector<uchar> *content, size_t len, std::vector<uchar> *full_content);
 
 int parseTime(std::string time);
+// Parse for example 512k 10M 1G, returns 0 if not a valid size.
+size_t parseSize(std::string size);
+// Parse 1% 0.1% or 50, returns -1 if not a percentage between 0 and 100.
+double parsePercent(std::string percent);
 
 uint16_t crc16_EN13757(uchar *data, size_t len);
 
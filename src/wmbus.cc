@@ -16,10 +16,16 @@
 */
 
 #include"aescmac.h"
+#include"dedup.h"
 #include"wmbus.h"
 #include"wmbus_utils.h"
 #include"dvparser.h"
+#include"stats.h"
+#include<algorithm>
 #include<assert.h>
+#include<limits.h>
+#include<map>
+#include<poll.h>
 #include<stdarg.h>
 #include<string.h>
 #include<sys/stat.h>
@@ -70,6 +76,11 @@ LinkModeInfo *getLinkModeInfoFromBit(int bit)
     return NULL;
 }
 
+const char *toLowerCaseString(LinkMode lm)
+{
+    return getLinkModeInfo(lm)->lcname;
+}
+
 LinkMode isLinkModeOption(const char *arg)
 {
     for (auto& s : link_modes_) {
@@ -497,80 +508,233 @@ string mediaTypeJSON(int a_field_device_type)
     return "Unknown";
 }
 
-#define CHECK_SAME_GROUP \
-if (ac == AccessCheck::NotSameGroup) \
-{ \
-    /* The device exists and is not locked, but we cannot read it! */ \
-    error("You are not in the same group as the device %s\n", devicefile.c_str()); \
+// The name of the /dev/serial/by-id link that udev created for the tty, it contains
+// the vendor, model and serial number of the usb dongle, eg usb-FTDI_FT232R_USB_UART_A1234567-if00-port0
+static string udevSerialId(string device)
+{
+    char real[PATH_MAX];
+    if (realpath(device.c_str(), real) == NULL) return "";
+    vector<string> links;
+    if (!listFiles("/dev/serial/by-id", &links)) return "";
+    for (string &l : links)
+    {
+        char target[PATH_MAX];
+        string path = "/dev/serial/by-id/"+l;
+        if (realpath(path.c_str(), target) != NULL && !strcmp(real, target)) return l;
+    }
+    return "";
 }
 
-Detected detectAuto(string devicefile,
-                    string suffix,
-                    SerialCommunicationManager *handler)
+// Lives as long as the process, ie a restart after SIGHUP remembers the dongles.
+static map<string,WMBusDeviceType> detected_by_serial_id_;
+
+struct Probing
 {
-    assert(devicefile == "auto");
+    DetectCandidate *candidate;
+    size_t probe {};
+    unique_ptr<SerialDevice> serial;
+    vector<uchar> data;
+    uint64_t deadline {}; // Milliseconds.
+    enum { Pending, Found, NotFound } state { Pending };
+    string serial_id;
+};
 
-    if (suffix != "")
+static uint64_t millisNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+// Open the tty at the baud rate of the current probe and send its request.
+// Moves on to the next probe if the tty cannot be opened.
+static void startProbe(Probing &p, SerialCommunicationManager *manager)
+{
+    vector<DetectProbe> &probes = p.candidate->probes;
+    for (; p.probe < probes.size(); p.probe++)
     {
-        error("You cannot have a suffix appended to auto.\n");
+        DetectProbe &dp = probes[p.probe];
+        p.serial = manager->createSerialDeviceTTY(p.candidate->device, dp.baud);
+        if (!p.serial->open(false)) continue;
+        // First clear out any data in the queue.
+        p.serial->receive(&p.data);
+        p.data.clear();
+        if (dp.request.size() == 0 && dp.check(p.data) == FullFrame)
+        {
+            p.state = Probing::Found;
+            return;
+        }
+        verbose("(%s) are you there?\n", toLowerCaseString(dp.type));
+        p.serial->send(dp.request);
+        p.deadline = millisNow()+dp.timeout_ms;
+        return;
     }
+    p.serial.reset();
+    p.state = Probing::NotFound;
+}
 
-    AccessCheck ac;
-
-    ac = findAndDetect(handler, &devicefile,
-                       [](string d, SerialCommunicationManager* m){ return detectIM871A(d, m);},
-                       "im871a",
-                       "/dev/im871a");
+static void nextProbe(Probing &p, SerialCommunicationManager *manager)
+{
+    p.serial->close();
+    p.probe++;
+    startProbe(p, manager);
+}
 
-    if (ac == AccessCheck::OK)
+int detectConcurrently(vector<DetectCandidate> &candidates, SerialCommunicationManager *manager,
+                       WMBusDeviceType *type)
+{
+    vector<Probing> probings(candidates.size());
+    for (size_t i = 0; i < candidates.size(); ++i)
     {
-        return { DEVICE_IM871A, devicefile, 0, false };
+        Probing &p = probings[i];
+        p.candidate = &candidates[i];
+        if (p.candidate->not_same_group)
+        {
+            p.state = Probing::NotFound;
+            continue;
+        }
+        p.serial_id = udevSerialId(p.candidate->device);
+        auto c = detected_by_serial_id_.find(p.serial_id);
+        if (p.serial_id != "" && c != detected_by_serial_id_.end())
+        {
+            // Try the type found last time first.
+            vector<DetectProbe> &probes = p.candidate->probes;
+            stable_partition(probes.begin(), probes.end(), [&](DetectProbe &dp){ return dp.type == c->second; });
+            debug("(detect) %s was %s last time\n", p.serial_id.c_str(), toLowerCaseString(c->second));
+        }
+        startProbe(p, manager);
     }
-    CHECK_SAME_GROUP
 
-    ac = findAndDetect(handler, &devicefile,
-                       [](string d, SerialCommunicationManager* m){ return detectAMB8465(d, m);},
-                       "amb8465",
-                       "/dev/amb8465");
+    for (;;)
+    {
+        // The candidates are in order of preference, wait only for the ones before the first found.
+        for (size_t i = 0; i < probings.size(); ++i)
+        {
+            Probing &p = probings[i];
+            if (p.state == Probing::Pending) break;
+            if (p.state == Probing::Found)
+            {
+                *type = p.candidate->probes[p.probe].type;
+                if (p.serial_id != "") detected_by_serial_id_[p.serial_id] = *type;
+                debug("(detect) found %s on %s\n", toLowerCaseString(*type), p.candidate->device.c_str());
+                for (Probing &o : probings) if (o.serial) o.serial->close();
+                return i;
+            }
+            if (i == probings.size()-1) return -1;
+        }
+        if (probings.size() == 0) return -1;
 
-    if (ac == AccessCheck::OK)
+        vector<struct pollfd> fds;
+        vector<Probing*> polled;
+        uint64_t now = millisNow();
+        uint64_t first_deadline = UINT64_MAX;
+        for (Probing &p : probings)
+        {
+            if (p.state != Probing::Pending) continue;
+            fds.push_back({ p.serial->fd(), POLLIN, 0 });
+            polled.push_back(&p);
+            first_deadline = min(first_deadline, p.deadline);
+        }
+        int timeout = first_deadline > now ? (int)(first_deadline-now) : 0;
+        int rc = poll(&fds[0], fds.size(), timeout);
+        if (rc < 0 && errno != EINTR) return -1;
+
+        now = millisNow();
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+            Probing &p = *polled[i];
+            if (fds[i].revents & POLLIN)
+            {
+                vector<uchar> more;
+                p.serial->receive(&more);
+                p.data.insert(p.data.end(), more.begin(), more.end());
+                FrameStatus status = p.candidate->probes[p.probe].check(p.data);
+                if (status == FullFrame)
+                {
+                    p.state = Probing::Found;
+                    continue;
+                }
+                if (status != PartialFrame)
+                {
+                    nextProbe(p, manager);
+                    continue;
+                }
+            }
+            if (now >= p.deadline) nextProbe(p, manager);
+        }
+    }
+}
+
+// Look for device_root, or if it does not exist device_root_0 to device_root_8.
+static void addCandidates(vector<DetectCandidate> *candidates, string device_root, vector<DetectProbe> probes)
+{
+    AccessCheck ac = checkIfExistsAndSameGroup(device_root);
+    if (ac == AccessCheck::OK) candidates->push_back({ device_root, probes, false });
+    if (ac != AccessCheck::NotThere)
+    {
+        if (ac == AccessCheck::NotSameGroup) candidates->push_back({ device_root, {}, true });
+        return;
+    }
+    for (int n=0; n < 9; ++n)
     {
-        return { DEVICE_AMB8465, devicefile, false };
+        string dev = device_root+"_"+to_string(n);
+        ac = checkIfExistsAndSameGroup(dev);
+        if (ac == AccessCheck::OK) candidates->push_back({ dev, probes, false });
+        if (ac == AccessCheck::NotSameGroup)
+        {
+            candidates->push_back({ dev, {}, true });
+            return;
+        }
     }
-    CHECK_SAME_GROUP
+}
 
-    ac = findAndDetect(handler, &devicefile,
-                       [](string d, SerialCommunicationManager* m){ return detectRawTTY(d, 38400, m);},
-                       "rfmrx2",
-                       "/dev/rfmrx2");
+Detected detectAuto(string devicefile,
+                    string suffix,
+                    SerialCommunicationManager *handler)
+{
+    assert(devicefile == "auto");
 
-    if (ac == AccessCheck::OK)
+    if (suffix != "")
     {
-        return { DEVICE_RFMRX2, devicefile, false };
+        error("You cannot have a suffix appended to auto.\n");
     }
-    CHECK_SAME_GROUP
 
-    ac = findAndDetect(handler, &devicefile,
-                       [](string d, SerialCommunicationManager* m){ return detectCUL(d, m);},
-                       "cul",
-                       "/dev/ttyUSB0");
+    vector<DetectCandidate> candidates;
+    addCandidates(&candidates, "/dev/im871a", { probeIM871A() });
+    addCandidates(&candidates, "/dev/amb8465", { probeAMB8465() });
+    addCandidates(&candidates, "/dev/rfmrx2", { probeRawTTY(DEVICE_RFMRX2, 38400) });
+    addCandidates(&candidates, "/dev/ttyUSB0", { probeCUL() });
 
-    if (ac == AccessCheck::OK)
+    WMBusDeviceType type = DEVICE_UNKNOWN;
+    int found = detectConcurrently(candidates, handler, &type);
+
+    for (int i = 0; i < (found == -1 ? (int)candidates.size() : found); ++i)
     {
-        return { DEVICE_CUL, "/dev/ttyUSB0" };
+        if (candidates[i].not_same_group)
+        {
+            /* The device exists and is not locked, but we cannot read it! */
+            error("You are not in the same group as the device %s\n", candidates[i].device.c_str());
+        }
+    }
+    if (found != -1)
+    {
+        return { type, candidates[found].device, 0, false };
     }
-    CHECK_SAME_GROUP
 
-    ac = findAndDetect(handler, &devicefile,
-                       [](string d, SerialCommunicationManager* m){ return detectRTLSDR(d, m);},
-                       "rtlsdr",
-                       "/dev/rtlsdr");
+    string devicefile_rtlsdr;
+    AccessCheck ac = findAndDetect(handler, &devicefile_rtlsdr,
+                                   [](string d, SerialCommunicationManager* m){ return detectRTLSDR(d, m);},
+                                   "rtlsdr",
+                                   "/dev/rtlsdr");
 
     if (ac == AccessCheck::OK)
     {
         return { DEVICE_RTLWMBUS, "rtlwmbus" };
     }
-    CHECK_SAME_GROUP
+    if (ac == AccessCheck::NotSameGroup)
+    {
+        error("You are not in the same group as the device %s\n", devicefile_rtlsdr.c_str());
+    }
 
     // We could not auto-detect any device.
     return { DEVICE_UNKNOWN, "", false };
@@ -586,24 +750,12 @@ Detected detectImstAmberCul(string devicefile,
     // confused by the 57600 speed....or maybe there is some other reason.
     // Anyway by testing for the amb8465 first, we can immediately continue
     // with the test for the im871a, without the need for a 1s delay.
+    vector<DetectCandidate> candidates = { { devicefile, { probeAMB8465(), probeIM871A(), probeCUL() }, false } };
 
-    // Talk amb8465 with it...
-    // assumes this device is configured for 9600 bps, which seems to be the default.
-    if (detectAMB8465(devicefile, handler))
-    {
-        return { DEVICE_AMB8465, devicefile, false };
-    }
-    // Talk im871a with it...
-    // assumes this device is configured for 57600 bps, which seems to be the default.
-    if (detectIM871A(devicefile, handler))
+    WMBusDeviceType type = DEVICE_UNKNOWN;
+    if (detectConcurrently(candidates, handler, &type) == 0)
     {
-        return { DEVICE_IM871A, devicefile, false };
-    }
-    // Talk CUL with it...
-    // assumes this device is configured for 38400 bps, which seems to be the default.
-    if (detectCUL(devicefile, handler))
-    {
-        return { DEVICE_CUL, devicefile, false };
+        return { type, devicefile, 0, false };
     }
 
     // We could not auto-detect either.
@@ -627,6 +779,11 @@ Detected detectImstAmberCul(string devicefile,
   d1tc
   rtlwmbus: the devicefile produces rtlwmbus messages, ie. T1;1;1;2019-04-03 19:00:42.000;97;148;88888888;0x6e440106...ae03a77
   simulation: assume the devicefile produces telegram=|....|+xx lines. This can also pace the simulated telegrams in time.
+  replay: the devicefile is a --logtelegrams capture, replayed as fast as possible with the capture timestamps,
+          or paced with eg replay,speed=1x or replay,speed=10x The capture time can be set with start=2020-05-01T12:00:00Z
+
+  The devicefile synthetic generates telegrams for load testing, the suffix is the
+  settings: rate=50000,meters=10000,mix=multical21+supercom587,encrypted=50,count=1000000,seed=1
   a baud rate like 38400: assume the devicefile is a raw tty character device.
 */
 Detected detectWMBusDeviceSetting(string devicefile,
@@ -650,6 +807,42 @@ Detected detectWMBusDeviceSetting(string devicefile,
         return { DEVICE_RTLWMBUS, "", false };
     }
 
+    // Likewise rtlsdr rtlsdr:868.95M rtlsdr:rtl_sdr -f 868.95M -s 1.6e6 -
+    if (devicefile == "rtlsdr")
+    {
+        debug("(detect) driver: rtlsdr\n");
+        return { DEVICE_RTLSDR, "", false };
+    }
+
+    // Generate telegrams, eg synthetic:rate=50000,meters=10000
+    if (devicefile == "synthetic")
+    {
+        debug("(detect) driver: synthetic\n");
+        return { DEVICE_SYNTHETIC, "", false };
+    }
+
+    // Frames forwarded by remote receivers, eg tcp:4712 or udp:4712:rtlwmbus
+    if (devicefile == "tcp" || devicefile == "udp")
+    {
+        string port = suffix;
+        string format;
+        size_t p = suffix.find(':');
+        if (p != string::npos)
+        {
+            port = suffix.substr(0, p);
+            format = suffix.substr(p+1);
+        }
+        if (!isNumber(port) || atoi(port.c_str()) <= 0 || atoi(port.c_str()) > 65535)
+        {
+            error("Expected a port number after %s: but got \"%s\"\n", devicefile.c_str(), port.c_str());
+        }
+        debug("(detect) driver: %s port %s\n", devicefile.c_str(), port.c_str());
+        string spec = devicefile+":"+port;
+        if (format == "rtlwmbus") return { DEVICE_RTLWMBUS, spec, 0, true };
+        if (format == "") return { DEVICE_RAWTTY, spec, 0, true };
+        error("Unknown format %s for %s, expected rtlwmbus or nothing for raw frames\n", format.c_str(), spec.c_str());
+    }
+
     // Is it a file named simulation_xxx.txt ?
     if (checkIfSimulationFile(devicefile.c_str()))
     {
@@ -675,10 +868,12 @@ Detected detectWMBusDeviceSetting(string devicefile,
     if (suffix == "im871a") return { DEVICE_IM871A, devicefile, 0, override_tty };
     if (suffix == "rfmrx2") return { DEVICE_RFMRX2, devicefile, 0, override_tty };
     if (suffix == "rtlwmbus") return { DEVICE_RTLWMBUS, devicefile, 0, override_tty };
+    if (suffix == "rtlsdr") return { DEVICE_RTLSDR, devicefile, 0, override_tty };
     if (suffix == "cul") return { DEVICE_CUL, devicefile, 0, override_tty };
     if (suffix == "d1tc") return { DEVICE_D1TC, devicefile, 0, override_tty };
     if (suffix == "wmb13u") return { DEVICE_WMB13U, devicefile, 0, override_tty };
     if (suffix == "simulation") return { DEVICE_SIMULATOR, devicefile, 0, override_tty };
+    if (suffix == "replay" || startsWith(suffix, "replay,")) return { DEVICE_REPLAY, devicefile, 0, false };
 
     // If the suffix is a number, then assume that it is a baud rate.
     if (isNumber(suffix)) return { DEVICE_RAWTTY, devicefile, atoi(suffix.c_str()), override_tty };
@@ -1048,7 +1243,11 @@ bool Telegram::parseELL(vector<uchar>::iterator &pos)
         if (ell_sec_mode == ELLSecurityMode::AES_CTR)
         {
             bool ok = decrypt_ELL_AES_CTR(this, frame, pos, meter_keys->confidentiality_key);
-            if (!ok) return false;
+            if (!ok)
+            {
+                decryption_failed = true;
+                return false;
+            }
             // Now the frame from pos and onwards has been decrypted.
         }
 
@@ -1412,7 +1611,11 @@ bool Telegram::potentiallyDecrypt(vector<uchar>::iterator &pos)
     if (tpl_sec_mode == TPLSecurityMode::AES_CBC_IV)
     {
         bool ok = decrypt_TPL_AES_CBC_IV(this, frame, pos, meter_keys->confidentiality_key);
-        if (!ok) return false;
+        if (!ok)
+        {
+            decryption_failed = true;
+            return false;
+        }
         // Now the frame from pos and onwards has been decrypted.
 
         CHECK(2);
@@ -1422,6 +1625,7 @@ bool Telegram::potentiallyDecrypt(vector<uchar>::iterator &pos)
             {
                 warning("(wmbus) decrypted content failed check, did you use the correct decryption key? Ignoring telegram.\n");
             }
+            decryption_failed = true;
             return false;
         }
         addExplanationAndIncrementPos(pos, 2, "%02x%02x decrypt check bytes", *(pos+0), *(pos+1));
@@ -1443,11 +1647,16 @@ bool Telegram::potentiallyDecrypt(vector<uchar>::iterator &pos)
             {
                 warning("(wmbus) telegram mac check failed, did you use the correct decryption key? Ignoring telegram.\n");
             }
+            decryption_failed = true;
             return false;
         }
 
         bool ok = decrypt_TPL_AES_CBC_NO_IV(this, frame, pos, tpl_generated_key);
-        if (!ok) return false;
+        if (!ok)
+        {
+            decryption_failed = true;
+            return false;
+        }
 
         // Now the frame from pos and onwards has been decrypted.
         CHECK(2);
@@ -1457,6 +1666,7 @@ bool Telegram::potentiallyDecrypt(vector<uchar>::iterator &pos)
             {
                 warning("(wmbus) decrypted content failed check, did you use the correct decryption key? Ignoring telegram.\n");
             }
+            decryption_failed = true;
             return false;
         }
         addExplanationAndIncrementPos(pos, 2, "%02x%02x decrypt check bytes", *(pos+0), *(pos+1));
@@ -1606,6 +1816,7 @@ bool Telegram::parseTPL(vector<uchar>::iterator &pos)
 
 bool Telegram::parseHeader(vector<uchar> &input_frame)
 {
+    STAGE_TIMER(parse_header);
     bool ok;
     explanations.clear();
     frame = input_frame;
@@ -1627,6 +1838,7 @@ bool Telegram::parseHeader(vector<uchar> &input_frame)
 
 bool Telegram::parse(vector<uchar> &input_frame, MeterKeys *mk)
 {
+    STAGE_TIMER(parse);
     explanations.clear();
     meter_keys = mk;
     assert(meter_keys != NULL);
@@ -3298,6 +3510,7 @@ bool Telegram::findFormatBytesFromKnownMeterSignatures(vector<uchar> *format_byt
 
 WMBusCommonImplementation::WMBusCommonImplementation(WMBusDeviceType t) : type_(t)
 {
+    fates_ = driverFateCounters(toLowerCaseString(t));
 }
 
 WMBusDeviceType WMBusCommonImplementation::type()
@@ -3310,30 +3523,66 @@ void WMBusCommonImplementation::setMeters(vector<unique_ptr<Meter>> *meters)
     meters_ = meters;
 }
 
-void WMBusCommonImplementation::onTelegram(function<bool(vector<uchar>)> cb)
+void WMBusCommonImplementation::onTelegram(function<bool(AboutTelegram&,vector<uchar>)> cb)
 {
     telegram_listeners_.push_back(cb);
 }
 
 bool WMBusCommonImplementation::handleTelegram(vector<uchar> frame)
 {
+    AboutTelegram about;
+    about.timestamp = time(NULL);
+    return handleTelegram(about, frame);
+}
+
+bool WMBusCommonImplementation::handleTelegram(AboutTelegram &about, vector<uchar> frame)
+{
+    TRACE_SCOPE(frame);
     bool handled = false;
+    if (about.arrival == 0) about.arrival = statsNow();
+    countFate(Fate::received, fates_);
+    if (dedup_enabled_ && isDuplicate(frame, about.timestamp, about.rssi_dbm))
+    {
+        // Already decoded, a cheap lookup instead of another decrypt.
+        countFate(Fate::duplicate, fates_);
+        debug("(wmbus) dropped duplicate telegram\n");
+        return true;
+    }
     for (auto f : telegram_listeners_)
     {
         if (f)
         {
-            bool h = f(frame);
+            bool h = f(about, frame);
             if (h) handled = true;
         }
     }
-    if (isVerboseEnabled() && !handled)
+    if (!handled)
     {
+        // Every meter has parsed the header, no need to parse it again to find out why.
+        countFate(about.header_failed ? Fate::header_failure : Fate::id_mismatch, fates_);
         verbose("(wmbus) telegram ignored by all configured meters!\n");
     }
 
     return handled;
 }
 
+static string deviceName(const char *name)
+{
+    string s = name+strlen("DEVICE_");
+    for (char &c : s) c = tolower(c);
+    return s;
+}
+
+const char *toLowerCaseString(WMBusDeviceType t)
+{
+    static const string names[] = {
+#define X(name) deviceName(#name),
+LIST_OF_MBUS_DEVICES
+#undef X
+    };
+    return names[t].c_str();
+}
+
 int toInt(TPLSecurityMode tsm)
 {
     switch (tsm) {
@@ -3542,6 +3791,7 @@ bool trimCRCsFrameFormatA(std::vector<uchar> &payload)
     if (calc_crc != check_crc)
     {
         debug("(wmbus) ff a dll crc first (calculated %04x) did not match (expected %04x) for bytes 0-%zu!\n", calc_crc, check_crc, 10);
+        countFate(Fate::crc_failure);
         return false;
     }
     out.insert(out.end(), payload.begin(), payload.begin()+10);
@@ -3557,6 +3807,7 @@ bool trimCRCsFrameFormatA(std::vector<uchar> &payload)
         {
             debug("(wmbus) ff a dll crc mid (calculated %04x) did not match (expected %04x) for bytes %zu-%zu!\n",
                   calc_crc, check_crc, pos, to-1);
+            countFate(Fate::crc_failure);
             return false;
         }
         out.insert(out.end(), payload.begin()+pos, payload.begin()+pos+16);
@@ -3573,6 +3824,7 @@ bool trimCRCsFrameFormatA(std::vector<uchar> &payload)
         {
             debug("(wmbus) ff a dll crc final (calculated %04x) did not match (expected %04x) for bytes %zu-%zu!\n",
                   calc_crc, check_crc, pos, tto-1);
+            countFate(Fate::crc_failure);
             return false;
         }
         out.insert(out.end(), payload.begin()+pos, payload.begin()+tto);
@@ -3619,6 +3871,7 @@ bool trimCRCsFrameFormatB(std::vector<uchar> &payload)
     if (calc_crc != check_crc)
     {
         debug("(wmbus) ff b dll crc (calculated %04x) did not match (expected %04x) for bytes 0-%zu!\n", calc_crc, check_crc, crc1_pos);
+        countFate(Fate::crc_failure);
         return false;
     }
 
@@ -3634,6 +3887,7 @@ bool trimCRCsFrameFormatB(std::vector<uchar> &payload)
         {
             debug("(wmbus) ff b dll crc (calculated %04x) did not match (expected %04x) for bytes %zu-%zu!\n",
                   calc_crc, check_crc, crc1_pos+2, crc2_pos);
+            countFate(Fate::crc_failure);
             return false;
         }
 
@@ -3658,6 +3912,7 @@ FrameStatus checkWMBusFrame(vector<uchar> &data,
                             int *payload_len_out,
                             int *payload_offset)
 {
+    STAGE_TIMER(frame_check);
     // Nice clean: 2A442D2C998734761B168D2021D0871921|58387802FF2071000413F81800004413F8180000615B
     // Ugly: 00615B2A442D2C998734761B168D2021D0871921|58387802FF2071000413F81800004413F8180000615B
     // Here the frame is prefixed with some random data.
@@ -232,8 +232,26 @@ struct MeterKeys
     bool isSimulation() { return simulation; }
 };
 
+// Information about a received telegram, that is not part of the telegram itself.
+struct AboutTelegram
+{
+    time_t timestamp {}; // When the telegram was received, or captured if it is replayed.
+    string device; // The receiver, only set when there are several.
+    int rssi_dbm {}; // The signal strength, zero when the receiver does not report it.
+    uint32_t hw_timestamp {}; // The clock of the dongle when it received the frame, if it reports one.
+    uint64_t arrival {}; // The monotonic statsNow() when the frame was handed over by the driver.
+    LinkMode link_mode {LinkMode::UNKNOWN}; // When the receiver knows which mode it heard.
+    bool header_failed {}; // Set by the meters when the header could not be parsed.
+};
+
+// The link mode in lower case, eg "t1".
+const char *toLowerCaseString(LinkMode lm);
+
 struct Telegram
 {
+    AboutTelegram about;
+
+
     // The meter address as a string usually printed on the meter.
     string id;
 
@@ -328,6 +346,7 @@ struct Telegram
     void extractMfctData(vector<uchar> *pl); // Extract frame data after the DIF 0x0F.
 
     bool handled {}; // Set to true, when a meter has accepted the telegram.
+    bool decryption_failed {}; // Set to true when parse failed because of a bad mac or decryption.
 
     bool parseHeader(vector<uchar> &input_frame);
     bool parse(vector<uchar> &input_frame, MeterKeys *mk);
@@ -389,6 +408,7 @@ private:
 };
 
 struct Meter;
+struct MeterInfo;
 
 #define LIST_OF_MBUS_DEVICES \
     X(DEVICE_UNKNOWN) \
@@ -398,7 +418,10 @@ struct Meter;
     X(DEVICE_AMB8465)\
     X(DEVICE_RFMRX2)\
     X(DEVICE_SIMULATOR)\
+    X(DEVICE_SYNTHETIC)\
+    X(DEVICE_REPLAY)\
     X(DEVICE_RTLWMBUS)\
+    X(DEVICE_RTLSDR)\
     X(DEVICE_RAWTTY)\
     X(DEVICE_WMB13U)
 
@@ -408,6 +431,9 @@ LIST_OF_MBUS_DEVICES
 #undef X
 };
 
+// Returns im871a for DEVICE_IM871A etc.
+const char *toLowerCaseString(WMBusDeviceType t);
+
 struct WMBus {
     virtual WMBusDeviceType type() = 0;
     virtual bool ping() = 0;
@@ -418,7 +444,7 @@ struct WMBus {
     virtual bool canSetLinkModes(LinkModeSet lms) = 0;
     virtual void setMeters(vector<unique_ptr<Meter>> *meters) = 0;
     virtual void setLinkModes(LinkModeSet lms) = 0;
-    virtual void onTelegram(function<bool(vector<uchar>)> cb) = 0;
+    virtual void onTelegram(function<bool(AboutTelegram&,vector<uchar>)> cb) = 0;
     virtual SerialDevice *serial() = 0;
     virtual void simulate() = 0;
     virtual ~WMBus() = 0;
@@ -447,6 +473,9 @@ unique_ptr<WMBus> openRawTTY(string device, int baudrate, SerialCommunicationMan
                              unique_ptr<SerialDevice> serial_override);
 unique_ptr<WMBus> openRTLWMBUS(string device, SerialCommunicationManager *manager, std::function<void()> on_exit,
                                unique_ptr<SerialDevice> serial_override);
+// Demodulates the IQ samples from the command, eg rtl_sdr -f 868.95M -s 1.6e6 -
+unique_ptr<WMBus> openRTLSDR(string command, SerialCommunicationManager *manager, std::function<void()> on_exit,
+                             unique_ptr<SerialDevice> serial_override);
 unique_ptr<WMBus> openCUL(string device, SerialCommunicationManager *manager,
                               unique_ptr<SerialDevice> serial_override);
 unique_ptr<WMBus> openD1TC(string device, SerialCommunicationManager *manager,
@@ -455,6 +484,17 @@ unique_ptr<WMBus> openWMB13U(string device, SerialCommunicationManager *manager,
                              unique_ptr<SerialDevice> serial_override);
 unique_ptr<WMBus> openSimulator(string file, SerialCommunicationManager *manager,
                                 unique_ptr<SerialDevice> serial_override);
+// Replays a --logtelegrams capture file, eg speed=max or speed=10x,start=2020-05-01T00:00:00Z
+unique_ptr<WMBus> openReplay(string file, string settings, SerialCommunicationManager *manager);
+// Generates telegrams for meters that it adds to the meters, eg rate=50000,meters=10000
+unique_ptr<WMBus> openSynthetic(string spec, SerialCommunicationManager *manager,
+                                vector<MeterInfo> *meters);
+// Feeds the telegrams from all the receivers into the same meters, tagged with the receiver name.
+unique_ptr<WMBus> openReceivers(vector<unique_ptr<WMBus>> receivers, vector<string> names);
+// The simulator, replay and synthetic devices feed telegrams from simulate() instead of a serial device.
+// simulate() runs in the main thread before it waits for the manager to stop. The devices do not stop
+// the manager themselves, main does that after simulate() when there are no live receivers.
+bool isSimulated(WMBusDeviceType t);
 
 string manufacturer(int m_field);
 string manufacturerFlag(int m_field);
@@ -497,6 +537,37 @@ FrameStatus checkWMBusFrame(vector<uchar> &data,
                             int *payload_len_out,
                             int *payload_offset);
 
+// How to recognize a dongle on a tty: send the request at the baud rate and check the
+// response. The check returns FullFrame when the response proves that it is this dongle
+// and PartialFrame while waiting for more bytes. Anything else means it is not.
+struct DetectProbe
+{
+    WMBusDeviceType type;
+    int baud;
+    vector<uchar> request; // If empty, then it is enough that the tty can be opened.
+    int timeout_ms; // Give up on this dongle type after this long without a response.
+    function<FrameStatus(vector<uchar>&)> check;
+};
+
+DetectProbe probeIM871A();
+DetectProbe probeAMB8465();
+DetectProbe probeCUL();
+DetectProbe probeRawTTY(WMBusDeviceType type, int baud);
+
+struct DetectCandidate
+{
+    string device; // /dev/im871a_0 /dev/ttyUSB0
+    vector<DetectProbe> probes; // Tried one at a time, since each probe sets its own baud rate.
+    bool not_same_group; // The device exists, but we cannot read it.
+};
+
+// Probe all candidates concurrently, each answer is checked as soon as it arrives.
+// Returns the index of the first candidate, in the given order, that was recognized
+// and sets the type, or returns -1. The recognized types are remembered by the
+// udev serial number of the dongle, that type is then probed first the next time.
+int detectConcurrently(vector<DetectCandidate> &candidates, SerialCommunicationManager *manager,
+                       WMBusDeviceType *type);
+
 bool detectIM871A(string device, SerialCommunicationManager *handler);
 bool detectAMB8465(string device, SerialCommunicationManager *handler);
 bool detectRawTTY(string device, int baud, SerialCommunicationManager *handler);
@@ -17,12 +17,13 @@
 
 #include"wmbus.h"
 #include"wmbus_utils.h"
+#include"wmbus_commands.h"
 #include"wmbus_amb8465.h"
 #include"serial.h"
+#include"stats.h"
 
 #include<assert.h>
 #include<pthread.h>
-#include<semaphore.h>
 #include<sys/errno.h>
 #include<unistd.h>
 
@@ -72,15 +73,14 @@ private:
     unique_ptr<SerialDevice> serial_;
     SerialCommunicationManager *manager_;
     vector<uchar> read_buffer_;
-    pthread_mutex_t command_lock_ = PTHREAD_MUTEX_INITIALIZER;
-    sem_t command_wait_;
-    int sent_command_ {};
-    int received_command_ {};
+    MemoryTracker read_buffer_memory_ { Memory::frame_buffers };
+    FrameScanner scanner_;
+    DongleCommands commands_;
+    // The set mode is pipelined, it is waited for by the next get config.
+    shared_ptr<DongleCommand> set_mode_;
     LinkModeSet link_modes_;
-    vector<uchar> received_payload_;
     bool rssi_expected_;
 
-    void waitForResponse();
     FrameStatus checkAMB8465Frame(vector<uchar> &data,
                                   size_t *frame_length,
                                   int *msgid_out,
@@ -104,9 +104,9 @@ unique_ptr<WMBus> openAMB8465(string device, SerialCommunicationManager *manager
 }
 
 WMBusAmber::WMBusAmber(unique_ptr<SerialDevice> serial, SerialCommunicationManager *manager) :
-    WMBusCommonImplementation(DEVICE_AMB8465), serial_(std::move(serial)), manager_(manager)
+    WMBusCommonImplementation(DEVICE_AMB8465), serial_(std::move(serial)), manager_(manager),
+    commands_("amb8465", serial_.get(), manager)
 {
-    sem_init(&command_wait_, 0, 0);
     manager_->listenTo(serial_.get(),call(this,processSerialData));
     serial_->open(true);
     rssi_expected_ = true;
@@ -125,9 +125,7 @@ bool WMBusAmber::ping()
 {
     if (serial_->readonly()) return true; // Feeding from stdin or file.
 
-    pthread_mutex_lock(&command_lock_);
     // Ping it...
-    pthread_mutex_unlock(&command_lock_);
 
     return true;
 }
@@ -136,8 +134,6 @@ uint32_t WMBusAmber::getDeviceId()
 {
     if (serial_->readonly()) { return 0; }  // Feeding from stdin or file.
 
-    pthread_mutex_lock(&command_lock_);
-
     vector<uchar> msg(4);
     msg[0] = AMBER_SERIAL_SOF;
     msg[1] = CMD_SERIALNO_REQ;
@@ -146,27 +142,19 @@ uint32_t WMBusAmber::getDeviceId()
 
     assert(msg[3] == 0xf4);
 
-    sent_command_ = CMD_SERIALNO_REQ;
     verbose("(amb8465) get device id\n");
-    bool sent = serial()->send(msg);
+    auto cmd = commands_.send("get device id", msg, 0x80|CMD_SERIALNO_REQ);
 
     uint32_t id = 0;
-
-    if (sent)
+    vector<uchar> &payload = cmd->payload;
+    if (commands_.wait(cmd) && payload.size() >= 8)
     {
-        waitForResponse();
-
-        if (received_command_ == (CMD_SERIALNO_REQ | 0x80))
-        {
-            id = received_payload_[4] << 24 |
-                received_payload_[5] << 16 |
-                received_payload_[6] << 8 |
-                received_payload_[7];
-            verbose("(amb8465) device id %08x\n", id);
-        }
+        id = payload[4] << 24 |
+            payload[5] << 16 |
+            payload[6] << 8 |
+            payload[7];
+        verbose("(amb8465) device id %08x\n", id);
     }
-
-    pthread_mutex_unlock(&command_lock_);
     return id;
 }
 
@@ -183,8 +171,6 @@ LinkModeSet WMBusAmber::getLinkModes()
 
 void WMBusAmber::getConfiguration()
 {
-    pthread_mutex_lock(&command_lock_);
-
     vector<uchar> msg(6);
     msg[0] = AMBER_SERIAL_SOF;
     msg[1] = CMD_GET_REQ;
@@ -196,17 +182,17 @@ void WMBusAmber::getConfiguration()
     assert(msg[5] == 0x77);
 
     verbose("(amb8465) get config\n");
-    bool sent = serial()->send(msg);
+    // Sent before the response to an outstanding set mode has arrived.
+    auto cmd = commands_.send("get config", msg, 0x80|CMD_GET_REQ);
 
-    if (!sent)
+    if (set_mode_)
     {
-        pthread_mutex_unlock(&command_lock_);
-        return;
+        commands_.wait(set_mode_);
+        set_mode_.reset();
     }
 
-    waitForResponse();
-
-    if (received_command_ == (0x80|CMD_GET_REQ))
+    vector<uchar> &payload = cmd->payload;
+    if (commands_.wait(cmd) && payload.size() > 72)
     {
         // These are the non-volatile values stored inside the dongle.
         // However the link mode, radio channel etc might not be the one
@@ -217,17 +203,15 @@ void WMBusAmber::getConfiguration()
         // Oh well.
         //
         // These are just some random config settings store in non-volatile memory.
-        verbose("(amb8465) config: uart %02x\n", received_payload_[2]);
-        verbose("(amb8465) config: radio Channel %02x\n", received_payload_[60+2]);
-        uchar re = received_payload_[69+2];
+        verbose("(amb8465) config: uart %02x\n", payload[2]);
+        verbose("(amb8465) config: radio Channel %02x\n", payload[60+2]);
+        uchar re = payload[69+2];
         verbose("(amb8465) config: rssi enabled %02x\n", re);
         if (re != 0) {
             rssi_expected_ = true;
         }
-        verbose("(amb8465) config: mode Preselect %02x\n", received_payload_[70+2]);
+        verbose("(amb8465) config: mode Preselect %02x\n", payload[70+2]);
     }
-
-    pthread_mutex_unlock(&command_lock_);
 }
 
 void WMBusAmber::setLinkModes(LinkModeSet lms)
@@ -240,12 +224,9 @@ void WMBusAmber::setLinkModes(LinkModeSet lms)
         error("(amb8465) setting link mode(s) %s is not supported for amb8465\n", modes.c_str());
     }
 
-    pthread_mutex_lock(&command_lock_);
-
     vector<uchar> msg(8);
     msg[0] = AMBER_SERIAL_SOF;
     msg[1] = CMD_SET_MODE_REQ;
-    sent_command_ = msg[1];
     msg[2] = 1; // Len
     if (lms.has(LinkMode::C1) && lms.has(LinkMode::T1))
     {
@@ -270,26 +251,10 @@ void WMBusAmber::setLinkModes(LinkModeSet lms)
     msg[4] = xorChecksum(msg, 4);
 
     verbose("(amb8465) set link mode %02x\n", msg[3]);
-    bool sent = serial()->send(msg);
-
-    if (sent) waitForResponse();
+    // Not waited for here, the get config that follows is pipelined after it.
+    set_mode_ = commands_.send("set mode", msg, 0x80|CMD_SET_MODE_REQ);
 
     link_modes_ = lms;
-    pthread_mutex_unlock(&command_lock_);
-}
-
-void WMBusAmber::waitForResponse()
-{
-    while (manager_->isRunning())
-    {
-        int rc = sem_wait(&command_wait_);
-        if (rc==0) break;
-        if (rc==-1)
-        {
-            if (errno==EINTR) continue;
-            break;
-        }
-    }
 }
 
 FrameStatus WMBusAmber::checkAMB8465Frame(vector<uchar> &data,
@@ -299,6 +264,7 @@ FrameStatus WMBusAmber::checkAMB8465Frame(vector<uchar> &data,
                                           int *payload_offset,
                                           uchar *rssi)
 {
+    STAGE_TIMER(frame_check);
     if (data.size() == 0) return PartialFrame;
     debugPayload("(amb8465) checkAMB8465Frame", data);
     int payload_len = 0;
@@ -352,6 +318,7 @@ void WMBusAmber::processSerialData()
     serial_->receive(&data);
 
     read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    read_buffer_memory_.update(read_buffer_.capacity());
 
     size_t frame_length;
     int msgid;
@@ -360,18 +327,25 @@ void WMBusAmber::processSerialData()
 
     for (;;)
     {
+        // The header has been seen but the frame is still incomplete.
+        if (scanner_.waitingFor(read_buffer_)) break;
+
+        frame_length = 0;
         FrameStatus status = checkAMB8465Frame(read_buffer_, &frame_length, &msgid, &payload_len, &payload_offset, &rssi);
 
         if (status == PartialFrame)
         {
+            scanner_.expect(frame_length);
             break;
         }
         if (status == ErrorInFrame)
         {
+            countFate(Fate::framing_error, driverFateCounters("amb8465"));
             verbose("(amb8465) protocol error in message received!\n");
             string msg = bin2hex(read_buffer_);
             debug("(amb8465) protocol error \"%s\"\n", msg.c_str());
             read_buffer_.clear();
+            scanner_.reset();
             break;
         }
         if (status == FullFrame)
@@ -385,6 +359,7 @@ void WMBusAmber::processSerialData()
             }
 
             read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            scanner_.consumed(frame_length);
 
             if (rssi_expected_)
             {
@@ -406,53 +381,32 @@ void WMBusAmber::handleMessage(int msgid, vector<uchar> &frame)
     case (0x80|CMD_SET_MODE_REQ):
     {
         verbose("(amb8465) set link mode completed\n");
-        received_command_ = msgid;
-        received_payload_.clear();
-        received_payload_.insert(received_payload_.end(), frame.begin(), frame.end());
-        debugPayload("(amb8465) set link mode response", received_payload_);
-        sem_post(&command_wait_);
+        debugPayload("(amb8465) set link mode response", frame);
+        commands_.handleResponse(msgid, frame);
         break;
     }
     case (0x80|CMD_GET_REQ):
     {
         verbose("(amb8465) get config completed\n");
-        received_command_ = msgid;
-        received_payload_.clear();
-        received_payload_.insert(received_payload_.end(), frame.begin(), frame.end());
-        debugPayload("(amb8465) get config response", received_payload_);
-        sem_post(&command_wait_);
+        debugPayload("(amb8465) get config response", frame);
+        commands_.handleResponse(msgid, frame);
         break;
     }
     case (0x80|CMD_SERIALNO_REQ):
     {
         verbose("(amb8465) get device id completed\n");
-        received_command_ = msgid;
-        received_payload_.clear();
-        received_payload_.insert(received_payload_.end(), frame.begin(), frame.end());
-        debugPayload("(amb8465) get device id response", received_payload_);
-        sem_post(&command_wait_);
+        debugPayload("(amb8465) get device id response", frame);
+        commands_.handleResponse(msgid, frame);
         break;
     }
     default:
         verbose("(amb8465) unhandled device message %d\n", msgid);
-        received_payload_.clear();
-        received_payload_.insert(received_payload_.end(), frame.begin(), frame.end());
-        debugPayload("(amb8465) unknown response", received_payload_);
+        debugPayload("(amb8465) unknown response", frame);
     }
 }
 
-bool detectAMB8465(string device, SerialCommunicationManager *manager)
+DetectProbe probeAMB8465()
 {
-    // Talk to the device and expect a very specific answer.
-    auto serial = manager->createSerialDeviceTTY(device.c_str(), 9600);
-    bool ok = serial->open(false);
-    if (!ok) return false;
-
-    vector<uchar> data;
-    // First clear out any data in the queue.
-    serial->receive(&data);
-    data.clear();
-
     vector<uchar> msg(4);
     msg[0] = AMBER_SERIAL_SOF;
     msg[1] = CMD_SERIALNO_REQ;
@@ -461,32 +415,29 @@ bool detectAMB8465(string device, SerialCommunicationManager *manager)
 
     assert(msg[3] == 0xf4);
 
-    verbose("(amb8465) are you there?\n");
-    serial->send(msg);
-    // Wait for 100ms so that the USB stick have time to prepare a response.
-    usleep(1000*100);
-    serial->receive(&data);
-    int limit = 0;
-    while (data.size() > 8 && data[0] != 0xff) {
-        // Eat bytes until a 0xff appears to get in sync with the proper response.
-        // Extraneous bytes might be due to a partially read telegram.
-        data.erase(data.begin());
-        vector<uchar> more;
-        serial->receive(&more);
-        if (more.size() > 0) {
-            data.insert(data.end(), more.begin(), more.end());
+    // Assumes that the device is configured for 9600 bps, which seems to be the default.
+    return { DEVICE_AMB8465, 9600, msg, 100, [](vector<uchar> &data)
+    {
+        for (;;)
+        {
+            // Eat bytes until a 0xff appears to get in sync with the proper response.
+            // Extraneous bytes might be due to a partially read telegram.
+            while (data.size() > 0 && data[0] != 0xff) data.erase(data.begin());
+            if (data.size() < 8) return PartialFrame;
+            if (data[1] == (0x80 | CMD_SERIALNO_REQ) &&
+                data[2] == 0x04 &&
+                data[7] == xorChecksum(data, 7))
+            {
+                return FullFrame;
+            }
+            data.erase(data.begin());
         }
-        if (limit++ > 100) break; // Do not wait too long.
-    }
-
-    serial->close();
+    }};
+}
 
-    if (data.size() < 8 ||
-        data[0] != 0xff ||
-        data[1] != (0x80 | msg[1]) ||
-        data[2] != 0x04 ||
-        data[7] != xorChecksum(data, 7)) {
-        return false;
-    }
-    return true;
+bool detectAMB8465(string device, SerialCommunicationManager *manager)
+{
+    vector<DetectCandidate> candidates = { { device, { probeAMB8465() }, false } };
+    WMBusDeviceType type;
+    return detectConcurrently(candidates, manager, &type) == 0;
 }
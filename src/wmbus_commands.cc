@@ -0,0 +1,207 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include"wmbus_commands.h"
+
+#include<algorithm>
+#include<time.h>
+#include<unistd.h>
+
+#if defined(__linux__)
+#include<sys/timerfd.h>
+#endif
+
+// Realtime since that is the clock of pthread_cond_timedwait everywhere.
+static uint64_t millisRealtime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+DongleCommands::DongleCommands(string driver, SerialDevice *serial, SerialCommunicationManager *manager) :
+    driver_(driver), serial_(serial), manager_(manager)
+{
+#if defined(__linux__)
+    timer_fd_ = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd_ != -1 && !manager_->watchFd(timer_fd_, [this](){ timerExpired(); }, NULL))
+    {
+        close(timer_fd_);
+        timer_fd_ = -1;
+    }
+#endif
+    // Without the timer the deadlines are only handled while someone waits.
+    if (timer_fd_ == -1) debug("(%s) no timer for the command deadlines\n", driver_.c_str());
+}
+
+DongleCommands::~DongleCommands()
+{
+    if (timer_fd_ != -1)
+    {
+        manager_->unwatchFdAndWait(timer_fd_);
+        close(timer_fd_);
+    }
+    pthread_cond_destroy(&answered_);
+    pthread_mutex_destroy(&lock_);
+}
+
+shared_ptr<DongleCommand> DongleCommands::send(string name, vector<uchar> msg, int response,
+                                               int timeout_ms, int retries)
+{
+    shared_ptr<DongleCommand> cmd = make_shared<DongleCommand>();
+    cmd->name = name;
+    cmd->msg = msg;
+    cmd->response = response;
+    cmd->timeout_ms = timeout_ms;
+    cmd->retries = retries;
+    cmd->attempts = 1;
+
+    debug("(%s) sending %s\n", driver_.c_str(), name.c_str());
+    pthread_mutex_lock(&lock_);
+    // Outstanding before it is sent, the response can arrive before send returns.
+    cmd->deadline = millisRealtime()+timeout_ms;
+    outstanding_.push_back(cmd);
+    armTimer();
+    pthread_mutex_unlock(&lock_);
+
+    // Not locked, a synchronous send can block and the responses must still be handled.
+    if (!serial_->send(msg))
+    {
+        pthread_mutex_lock(&lock_);
+        auto i = find(outstanding_.begin(), outstanding_.end(), cmd);
+        if (i != outstanding_.end()) outstanding_.erase(i);
+        cmd->done = true;
+        pthread_cond_broadcast(&answered_);
+        pthread_mutex_unlock(&lock_);
+    }
+    return cmd;
+}
+
+vector<vector<uchar>> DongleCommands::expire(uint64_t now)
+{
+    vector<vector<uchar>> resend;
+    bool gave_up = false;
+    for (auto i = outstanding_.begin(); i != outstanding_.end(); )
+    {
+        DongleCommand *c = i->get();
+        if (now >= c->deadline)
+        {
+            if (c->attempts > c->retries)
+            {
+                warning("(%s) no response to %s, giving up\n", driver_.c_str(), c->name.c_str());
+                c->done = true;
+                gave_up = true;
+                i = outstanding_.erase(i);
+                continue;
+            }
+            c->attempts++;
+            verbose("(%s) no response to %s, resending\n", driver_.c_str(), c->name.c_str());
+            c->deadline = now+c->timeout_ms;
+            resend.push_back(c->msg);
+        }
+        ++i;
+    }
+    if (gave_up) pthread_cond_broadcast(&answered_);
+    armTimer();
+    return resend;
+}
+
+void DongleCommands::armTimer()
+{
+#if defined(__linux__)
+    if (timer_fd_ == -1) return;
+    uint64_t next = 0;
+    for (auto &c : outstanding_)
+    {
+        if (next == 0 || c->deadline < next) next = c->deadline;
+    }
+    // A zero it_value disarms the timer.
+    struct itimerspec its {};
+    its.it_value.tv_sec = next/1000;
+    its.it_value.tv_nsec = (next%1000)*1000000;
+    timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &its, NULL);
+#endif
+}
+
+void DongleCommands::timerExpired()
+{
+    uint64_t expirations;
+    while (read(timer_fd_, &expirations, sizeof(expirations)) > 0) {}
+
+    pthread_mutex_lock(&lock_);
+    vector<vector<uchar>> resend = expire(millisRealtime());
+    pthread_mutex_unlock(&lock_);
+
+    for (auto &msg : resend) serial_->send(msg);
+}
+
+bool DongleCommands::wait(shared_ptr<DongleCommand> &cmd)
+{
+    pthread_mutex_lock(&lock_);
+    while (!cmd->done && manager_->isRunning())
+    {
+        uint64_t now = millisRealtime();
+        // Also handled here, the event loop might not run yet, eg while detecting the dongle.
+        vector<vector<uchar>> resend = expire(now);
+        if (resend.size() > 0)
+        {
+            pthread_mutex_unlock(&lock_);
+            for (auto &msg : resend) serial_->send(msg);
+            pthread_mutex_lock(&lock_);
+            continue;
+        }
+        if (cmd->done) break;
+
+        // Wake up at least every 100ms to notice when the manager is stopped.
+        uint64_t next = now+100;
+        for (auto &c : outstanding_) next = min(next, c->deadline);
+        struct timespec ts;
+        ts.tv_sec = next/1000;
+        ts.tv_nsec = (next%1000)*1000000;
+        pthread_cond_timedwait(&answered_, &lock_, &ts);
+    }
+    bool answered = cmd->answered;
+    pthread_mutex_unlock(&lock_);
+    return answered;
+}
+
+bool DongleCommands::handleResponse(int response, vector<uchar> &payload)
+{
+    bool found = false;
+    pthread_mutex_lock(&lock_);
+    for (auto i = outstanding_.begin(); i != outstanding_.end(); ++i)
+    {
+        DongleCommand *c = i->get();
+        if (c->response == response)
+        {
+            c->payload = payload;
+            c->answered = true;
+            c->done = true;
+            outstanding_.erase(i);
+            found = true;
+            break;
+        }
+    }
+    if (found)
+    {
+        armTimer();
+        pthread_cond_broadcast(&answered_);
+    }
+    pthread_mutex_unlock(&lock_);
+    return found;
+}
@@ -0,0 +1,80 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef WMBUS_COMMANDS_H
+#define WMBUS_COMMANDS_H
+
+#include"serial.h"
+#include"util.h"
+
+#include<memory>
+#include<pthread.h>
+
+// A command sent to a dongle. Works as a future for the response.
+struct DongleCommand
+{
+    string name; // For the log, eg "get config".
+    vector<uchar> msg;
+    int response {}; // The id of the expected response, eg its msgid.
+    int timeout_ms {};
+    int retries {};
+    int attempts {};
+    uint64_t deadline {}; // Milliseconds, realtime clock.
+    bool done {}; // Answered or given up.
+    bool answered {};
+    vector<uchar> payload; // The response.
+};
+
+// The command layer of a dongle driver. A command is sent at once, without
+// waiting for the responses to earlier commands, so independent commands are
+// pipelined. The responses are matched, in the order the commands were sent,
+// by their response ids. A command that is not answered before its deadline
+// is resent, and given up after its retries. The deadlines are handled by a
+// timer in the event loop, also for commands that nobody waits for. Nothing
+// is locked while waiting or sending, so the telegrams keep flowing while
+// commands are outstanding.
+struct DongleCommands
+{
+    DongleCommands(string driver, SerialDevice *serial, SerialCommunicationManager *manager);
+    ~DongleCommands();
+
+    shared_ptr<DongleCommand> send(string name, vector<uchar> msg, int response,
+                                   int timeout_ms = 300, int retries = 2);
+    // Block until the command is answered or given up, returns true if it was answered.
+    bool wait(shared_ptr<DongleCommand> &cmd);
+    // Invoked from the event loop when the dongle sends a response.
+    // Returns false if no outstanding command expects it.
+    bool handleResponse(int response, vector<uchar> &payload);
+
+private:
+    // Resends or gives up the commands past their deadline, returns the messages to resend.
+    // Called with the lock taken.
+    vector<vector<uchar>> expire(uint64_t now);
+    void armTimer();
+    void timerExpired();
+
+    string driver_;
+    SerialDevice *serial_ {};
+    SerialCommunicationManager *manager_ {};
+    int timer_fd_ {-1};
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t answered_ = PTHREAD_COND_INITIALIZER;
+    vector<shared_ptr<DongleCommand>> outstanding_;
+};
+
+#endif
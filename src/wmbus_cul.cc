@@ -17,14 +17,15 @@
 
 #include"wmbus.h"
 #include"wmbus_utils.h"
+#include"wmbus_commands.h"
 #include"wmbus_cul.h"
 #include"serial.h"
+#include"stats.h"
 
 #include<assert.h>
 #include<fcntl.h>
 #include<grp.h>
 #include<pthread.h>
-#include<semaphore.h>
 #include<string.h>
 #include<sys/errno.h>
 #include<sys/stat.h>
@@ -69,12 +70,9 @@ private:
     SerialCommunicationManager *manager_ {};
     LinkModeSet link_modes_ {};
     vector<uchar> read_buffer_;
-    vector<uchar> received_payload_;
-    sem_t command_wait_;
-    string sent_command_;
-    string received_response_;
-
-    void waitForResponse();
+    MemoryTracker read_buffer_memory_ { Memory::frame_buffers };
+    FrameScanner scanner_;
+    DongleCommands commands_;
 
     FrameStatus checkCULFrame(vector<uchar> &data,
                               size_t *hex_frame_length,
@@ -97,9 +95,9 @@ unique_ptr<WMBus> openCUL(string device, SerialCommunicationManager *manager, un
 }
 
 WMBusCUL::WMBusCUL(unique_ptr<SerialDevice> serial, SerialCommunicationManager *manager) :
-    WMBusCommonImplementation(DEVICE_CUL), serial_(std::move(serial)), manager_(manager)
+    WMBusCommonImplementation(DEVICE_CUL), serial_(std::move(serial)), manager_(manager),
+    commands_("cul", serial_.get(), manager)
 {
-    sem_init(&command_wait_, 0, 0);
     manager_->listenTo(serial_.get(),call(this,processSerialData));
     serial_->open(true);
 }
@@ -145,22 +143,19 @@ void WMBusCUL::setLinkModes(LinkModeSet lms)
     msg[4] = 0xd;
 
     verbose("(cul) set link mode %c\n", msg[2]);
-    sent_command_ = string(&msg[0], &msg[3]);
-    received_response_ = "";
-    bool sent = serial()->send(msg);
-
-    if (sent) waitForResponse();
+    auto cmd = commands_.send("set link mode", msg, SET_LINK_MODE);
+    if (!commands_.wait(cmd)) return;
 
-    sent_command_ = "";
-    debug("(cul) received \"%s\"", received_response_.c_str());
+    string response = string(cmd->payload.begin(), cmd->payload.end());
+    debug("(cul) received \"%s\"", response.c_str());
 
     bool ok = true;
     if (lms.has(LinkMode::C1)) {
-        if (received_response_ != "CMODE") ok = false;
+        if (response != "CMODE") ok = false;
     } else if (lms.has(LinkMode::S1)) {
-        if (received_response_ != "SMODE") ok = false;
+        if (response != "SMODE") ok = false;
     } else if (lms.has(LinkMode::T1)) {
-        if (received_response_ != "TMODE") ok = false;
+        if (response != "TMODE") ok = false;
     }
 
     if (!ok)
@@ -179,24 +174,11 @@ void WMBusCUL::setLinkModes(LinkModeSet lms)
     msg[3] = 0xa;
     msg[4] = 0xd;
 
-    sent = serial()->send(msg);
+    serial()->send(msg);
 
     // Any response here, or does it silently move into listening mode?
 }
 
-void WMBusCUL::waitForResponse()
-{
-    while (manager_->isRunning())
-    {
-        int rc = sem_wait(&command_wait_);
-        if (rc==0) break;
-        if (rc==-1) {
-            if (errno==EINTR) continue;
-            break;
-        }
-    }
-}
-
 void WMBusCUL::simulate()
 {
 }
@@ -217,6 +199,7 @@ void WMBusCUL::processSerialData()
     // Receive and accumulated serial data until a full frame has been received.
     serial_->receive(&data);
     read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    read_buffer_memory_.update(read_buffer_.capacity());
 
     size_t frame_length;
     vector<uchar> payload;
@@ -232,28 +215,29 @@ void WMBusCUL::processSerialData()
         if (status == TextAndNotFrame)
         {
             // The buffer has already been printed by serial cmd.
-            if (sent_command_ != "")
+            string r = expectedResponses(read_buffer_);
+            if (r != "")
             {
-                string r = expectedResponses(read_buffer_);
-                if (r != "")
-                {
-                    received_response_ = r;
-                    sem_post(&command_wait_);
-                }
+                vector<uchar> response(r.begin(), r.end());
+                commands_.handleResponse(SET_LINK_MODE, response);
             }
             read_buffer_.clear();
+            scanner_.reset();
             break;
         }
         if (status == ErrorInFrame)
         {
+            countFate(Fate::framing_error, driverFateCounters("cul"));
             debug("(cul) error in received message.\n");
             string msg = bin2hex(read_buffer_);
             read_buffer_.clear();
+            scanner_.reset();
             break;
         }
         if (status == FullFrame)
         {
             read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            scanner_.consumed(frame_length);
 
             handleTelegram(payload);
         }
@@ -264,24 +248,23 @@ FrameStatus WMBusCUL::checkCULFrame(vector<uchar> &data,
                                     size_t *hex_frame_length,
                                     vector<uchar> &payload)
 {
+    STAGE_TIMER(frame_check);
     if (data.size() == 0) return PartialFrame;
 
-    if (isDebugEnabled())
-    {
-        string s  = safeString(data);
-        debug("(cul) checkCULFrame \"%s\"\n", s.c_str());
-    }
-
-    size_t eolp = 0;
-    // Look for end of line
-    for (; eolp < data.size(); ++eolp) {
-        if (data[eolp] == '\n') break; // Expect CRLF, look for LF ('\n')
-    }
+    // Look for end of line, the bytes before it have been scanned by the previous calls.
+    size_t eolp = scanner_.find(data, '\n'); // Expect CRLF, look for LF ('\n')
     if (eolp >= data.size())
     {
         debug("(cul) no eol found yet, partial frame\n");
         return PartialFrame;
     }
+
+    if (isDebugEnabled())
+    {
+        vector<uchar> line(data.begin(), data.begin()+eolp);
+        string s  = safeString(line);
+        debug("(cul) checkCULFrame \"%s\"\n", s.c_str());
+    }
     eolp++; // Point to byte after CRLF.
     // Normally it is CRLF, but enable code to handle single LF as well.
     int eof_len = data[eolp-2] == '\r' ? 2 : 1;
@@ -351,49 +334,26 @@ FrameStatus WMBusCUL::checkCULFrame(vector<uchar> &data,
     }
 }
 
-bool detectCUL(string device, SerialCommunicationManager *manager)
+DetectProbe probeCUL()
 {
-    // Talk to the device and expect a very specific answer.
-    auto serial = manager->createSerialDeviceTTY(device.c_str(), 38400);
-    bool ok = serial->open(false);
-    if (!ok) return false;
-
-    vector<uchar> data;
-    // send '-'+CRLF -> should be an unsupported command for CUL
+    // Send '-'+CRLF which should be an unsupported command for CUL,
     // it should respond with "? (- is unknown) Use one of ..."
     vector<uchar> crlf(3);
     crlf[0] = '-';
     crlf[1] = 0x0d;
     crlf[2] = 0x0a;
 
-    serial->send(crlf);
-    usleep(1000*100);
-    serial->receive(&data);
-
-    if (data[0] != '?') {
-       // no CUL device detected
-       serial->close();
-       return false;
-    }
-
-    data.clear();
-
-    // get the version string: "V 1.67 nanoCUL868" or similar
-    vector<uchar> msg(3);
-    msg[0] = CMD_GET_VERSION;
-    msg[1] = 0x0a;
-    msg[2] = 0x0d;
-
-    verbose("(cul) are you there?\n");
-    serial->send(msg);
-    // Wait for 200ms so that the USB stick have time to prepare a response.
-    usleep(1000*200);
-    serial->receive(&data);
-    string strC(data.begin(), data.end());
-    verbose("CUL answered: %s", strC.c_str());
-
-    // TODO: check version string somehow
+    // Assumes that the device is configured for 38400 bps, which seems to be the default.
+    return { DEVICE_CUL, 38400, crlf, 100, [](vector<uchar> &data)
+    {
+        if (data.size() == 0) return PartialFrame;
+        return data[0] == '?' ? FullFrame : ErrorInFrame;
+    }};
+}
 
-    serial->close();
-    return true;
+bool detectCUL(string device, SerialCommunicationManager *manager)
+{
+    vector<DetectCandidate> candidates = { { device, { probeCUL() }, false } };
+    WMBusDeviceType type;
+    return detectConcurrently(candidates, manager, &type) == 0;
 }
@@ -18,6 +18,7 @@
 #include"wmbus.h"
 #include"wmbus_utils.h"
 #include"serial.h"
+#include"stats.h"
 
 #include<assert.h>
 #include<pthread.h>
@@ -49,6 +50,8 @@ private:
     unique_ptr<SerialDevice> serial_;
     SerialCommunicationManager *manager_;
     vector<uchar> read_buffer_;
+    MemoryTracker read_buffer_memory_ { Memory::frame_buffers };
+    FrameScanner scanner_;
     sem_t command_wait_;
     LinkModeSet link_modes_;
     vector<uchar> received_payload_;
@@ -119,6 +122,7 @@ FrameStatus WMBusD1TC::checkD1TCFrame(vector<uchar> &data,
                                           int *payload_len_out,
                                           int *payload_offset)
 {
+    STAGE_TIMER(frame_check);
     // Nice clean: 2A442D2C998734761B168D2021D0871921|58387802FF2071000413F81800004413F8180000615B
     // Ugly: 00615B2A442D2C998734761B168D2021D0871921|58387802FF2071000413F81800004413F8180000615B
     // Here the frame is prefixed with some random data.
@@ -186,25 +190,33 @@ void WMBusD1TC::processSerialData()
     serial_->receive(&data);
 
     read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    read_buffer_memory_.update(read_buffer_.capacity());
 
     size_t frame_length;
     int payload_len, payload_offset;
 
     for (;;)
     {
+        // The header has been seen but the frame is still incomplete.
+        if (scanner_.waitingFor(read_buffer_)) break;
+
+        frame_length = 0;
         FrameStatus status = checkD1TCFrame(read_buffer_, &frame_length, &payload_len, &payload_offset);
 
         if (status == PartialFrame)
         {
+            scanner_.expect(frame_length);
             // Partial frame, stop eating.
             break;
         }
         if (status == ErrorInFrame)
         {
+            countFate(Fate::framing_error, driverFateCounters("d1tc"));
             verbose("(d1tc) protocol error in message received!\n");
             string msg = bin2hex(read_buffer_);
             debug("(d1tc) protocol error \"%s\"\n", msg.c_str());
             read_buffer_.clear();
+            scanner_.reset();
             break;
         }
         if (status == FullFrame)
@@ -217,6 +229,7 @@ void WMBusD1TC::processSerialData()
                 payload.insert(payload.end(), read_buffer_.begin()+payload_offset, read_buffer_.begin()+payload_offset+payload_len);
             }
             read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            scanner_.consumed(frame_length);
             handleTelegram(payload);
         }
     }
@@ -17,13 +17,14 @@
 
 #include"wmbus.h"
 #include"wmbus_utils.h"
+#include"wmbus_commands.h"
 #include"wmbus_im871a.h"
 #include"serial.h"
+#include"stats.h"
 
 #include<assert.h>
 #include<pthread.h>
 #include<sys/errno.h>
-#include<semaphore.h>
 #include<unistd.h>
 
 using namespace std;
@@ -67,20 +68,19 @@ private:
     unique_ptr<SerialDevice> serial_;
     SerialCommunicationManager *manager_;
     vector<uchar> read_buffer_;
-    pthread_mutex_t command_lock_ = PTHREAD_MUTEX_INITIALIZER;
-    sem_t command_wait_;
-    int sent_command_ {};
-    int received_command_ {};
-    vector<uchar> received_payload_;
+    MemoryTracker read_buffer_memory_ { Memory::frame_buffers };
+    FrameScanner scanner_;
+    DongleCommands commands_;
+    // The set config is pipelined, it is waited for by the next get config.
+    shared_ptr<DongleCommand> set_config_;
     LinkModeSet link_modes_ {};
 
-    void waitForResponse();
     static FrameStatus checkIM871AFrame(vector<uchar> &data,
                                         size_t *frame_length, int *endpoint_out, int *msgid_out,
-                                        int *payload_len_out, int *payload_offset);
-    friend bool detectIM871A(string device, SerialCommunicationManager *manager);
+                                        int *payload_len_out, int *payload_offset, AboutTelegram *about);
+    friend DetectProbe probeIM871A();
     void handleDevMgmt(int msgid, vector<uchar> &payload);
-    void handleRadioLink(int msgid, vector<uchar> &payload);
+    void handleRadioLink(int msgid, vector<uchar> &payload, AboutTelegram &about);
     void handleRadioLinkTest(int msgid, vector<uchar> &payload);
     void handleHWTest(int msgid, vector<uchar> &payload);
 };
@@ -99,9 +99,9 @@ unique_ptr<WMBus> openIM871A(string device, SerialCommunicationManager *manager,
 }
 
 WMBusIM871A::WMBusIM871A(unique_ptr<SerialDevice> serial, SerialCommunicationManager *manager) :
-    WMBusCommonImplementation(DEVICE_IM871A), serial_(std::move(serial)), manager_(manager)
+    WMBusCommonImplementation(DEVICE_IM871A), serial_(std::move(serial)), manager_(manager),
+    commands_("im871a", serial_.get(), manager)
 {
-    sem_init(&command_wait_, 0, 0);
     manager_->listenTo(serial_.get(),call(this,processSerialData));
     serial_->open(true);
 }
@@ -110,21 +110,15 @@ bool WMBusIM871A::ping()
 {
     if (serial_->readonly()) return true; // Feeding from stdin or file.
 
-    pthread_mutex_lock(&command_lock_);
-
     vector<uchar> msg(4);
     msg[0] = IM871A_SERIAL_SOF;
     msg[1] = DEVMGMT_ID;
     msg[2] = DEVMGMT_MSG_PING_REQ;
     msg[3] = 0;
 
-    sent_command_ = DEVMGMT_MSG_PING_REQ;
     verbose("(im871a) ping\n");
-    bool sent = serial()->send(msg);
-
-    if (sent) waitForResponse();
-
-    pthread_mutex_unlock(&command_lock_);
+    auto cmd = commands_.send("ping", msg, DEVMGMT_MSG_PING_RSP);
+    commands_.wait(cmd);
     return true;
 }
 
@@ -132,42 +126,29 @@ uint32_t WMBusIM871A::getDeviceId()
 {
     if (serial_->readonly()) return 0; // Feeding from stdin or file.
 
-    pthread_mutex_lock(&command_lock_);
-
     vector<uchar> msg(4);
     msg[0] = IM871A_SERIAL_SOF;
     msg[1] = DEVMGMT_ID;
     msg[2] = DEVMGMT_MSG_GET_DEVICEINFO_REQ;
     msg[3] = 0;
 
-    sent_command_ = DEVMGMT_MSG_GET_DEVICEINFO_REQ;
     verbose("(im871a) get device info\n");
-    bool sent = serial()->send(msg);
+    auto cmd = commands_.send("get device info", msg, DEVMGMT_MSG_GET_DEVICEINFO_RSP);
 
     uint32_t id = 0;
-
-    if (sent)
+    vector<uchar> &payload = cmd->payload;
+    if (commands_.wait(cmd) && payload.size() >= 8)
     {
-        waitForResponse();
-
-        if (received_command_ == DEVMGMT_MSG_GET_DEVICEINFO_RSP) {
-            verbose("(im871a) device info: module Type %02x\n", received_payload_[0]);
-            verbose("(im871a) device info: device Mode %02x\n", received_payload_[1]);
-            verbose("(im871a) device info: firmware version %02x\n", received_payload_[2]);
-            verbose("(im871a) device info: hci protocol version %02x\n", received_payload_[3]);
-            id = received_payload_[4] << 24 |
-                received_payload_[5] << 16 |
-                received_payload_[6] << 8 |
-                received_payload_[7];
-            verbose("(im871a) devince info: id %08x\n", id);
-        }
+        verbose("(im871a) device info: module Type %02x\n", payload[0]);
+        verbose("(im871a) device info: device Mode %02x\n", payload[1]);
+        verbose("(im871a) device info: firmware version %02x\n", payload[2]);
+        verbose("(im871a) device info: hci protocol version %02x\n", payload[3]);
+        id = payload[4] << 24 |
+            payload[5] << 16 |
+            payload[6] << 8 |
+            payload[7];
+        verbose("(im871a) devince info: id %08x\n", id);
     }
-    else
-    {
-        id = 0;
-    }
-
-    pthread_mutex_unlock(&command_lock_);
     return id;
 }
 
@@ -175,152 +156,153 @@ LinkModeSet WMBusIM871A::getLinkModes()
 {
     if (serial_->readonly()) { return Any_bit; }  // Feeding from stdin or file.
 
-    pthread_mutex_lock(&command_lock_);
-
     vector<uchar> msg(4);
     msg[0] = IM871A_SERIAL_SOF;
     msg[1] = DEVMGMT_ID;
-    sent_command_ = msg[2] = DEVMGMT_MSG_GET_CONFIG_REQ;
+    msg[2] = DEVMGMT_MSG_GET_CONFIG_REQ;
     msg[3] = 0;
 
     verbose("(im871a) get config\n");
-    bool sent = serial()->send(msg);
+    // Sent before the response to an outstanding set config has arrived.
+    auto cmd = commands_.send("get config", msg, DEVMGMT_MSG_GET_CONFIG_RSP);
 
-    if (!sent)
+    if (set_config_)
+    {
+        commands_.wait(set_config_);
+        set_config_.reset();
+    }
+    if (!commands_.wait(cmd))
     {
-        pthread_mutex_unlock(&command_lock_);
         // Use the remembered link modes set before.
         return link_modes_;
     }
 
-    waitForResponse();
+    vector<uchar> &payload = cmd->payload;
+    // The optional fields are read without further checks.
+    payload.resize(max(payload.size(), (size_t)64));
     LinkMode lm = LinkMode::UNKNOWN;
-    if (received_command_ == DEVMGMT_MSG_GET_CONFIG_RSP)
+    int iff1 = payload[0];
+    bool has_device_mode = (iff1&1)==1;
+    bool has_link_mode = (iff1&2)==2;
+    bool has_wmbus_c_field = (iff1&4)==4;
+    bool has_wmbus_man_id = (iff1&8)==8;
+    bool has_wmbus_device_id = (iff1&16)==16;
+    bool has_wmbus_version = (iff1&32)==32;
+    bool has_wmbus_device_type = (iff1&64)==64;
+    bool has_radio_channel = (iff1&128)==128;
+
+    int offset = 1;
+    if (has_device_mode)
     {
-        int iff1 = received_payload_[0];
-        bool has_device_mode = (iff1&1)==1;
-        bool has_link_mode = (iff1&2)==2;
-        bool has_wmbus_c_field = (iff1&4)==4;
-        bool has_wmbus_man_id = (iff1&8)==8;
-        bool has_wmbus_device_id = (iff1&16)==16;
-        bool has_wmbus_version = (iff1&32)==32;
-        bool has_wmbus_device_type = (iff1&64)==64;
-        bool has_radio_channel = (iff1&128)==128;
-
-        int offset = 1;
-        if (has_device_mode)
-        {
-            verbose("(im871a) config: device mode %02x\n", received_payload_[offset]);
-            offset++;
-        }
-        if (has_link_mode)
-        {
-            verbose("(im871a) config: link mode %02x\n", received_payload_[offset]);
-            if (received_payload_[offset] == (int)LinkModeIM871A::C1a) {
-                lm = LinkMode::C1;
-            }
-            if (received_payload_[offset] == (int)LinkModeIM871A::S1) {
-                lm = LinkMode::S1;
-            }
-            if (received_payload_[offset] == (int)LinkModeIM871A::S1m) {
-                lm = LinkMode::S1m;
-            }
-            if (received_payload_[offset] == (int)LinkModeIM871A::T1) {
-                lm = LinkMode::T1;
-            }
-            if (received_payload_[offset] == (int)LinkModeIM871A::N1A) {
-                lm = LinkMode::N1a;
-            }
-            if (received_payload_[offset] == (int)LinkModeIM871A::N1B) {
-                lm = LinkMode::N1b;
-            }
-            if (received_payload_[offset] == (int)LinkModeIM871A::N1C) {
-                lm = LinkMode::N1c;
-            }
-            if (received_payload_[offset] == (int)LinkModeIM871A::N1D) {
-                lm = LinkMode::N1d;
-            }
-            if (received_payload_[offset] == (int)LinkModeIM871A::N1E) {
-                lm = LinkMode::N1e;
-            }
-            if (received_payload_[offset] == (int)LinkModeIM871A::N1F) {
-                lm = LinkMode::N1f;
-            }
-            offset++;
-        }
-        if (has_wmbus_c_field) {
-            verbose("(im871a) config: wmbus c-field %02x\n", received_payload_[offset]);
-            offset++;
-        }
-        if (has_wmbus_man_id) {
-            int flagid = 256*received_payload_[offset+1] +received_payload_[offset+0];
-            string flag = manufacturerFlag(flagid);
-            verbose("(im871a) config: wmbus mfg id %02x%02x (%s)\n", received_payload_[offset+1], received_payload_[offset+0],
-                    flag.c_str());
-            offset+=2;
-        }
-        if (has_wmbus_device_id) {
-            verbose("(im871a) config: wmbus device id %02x%02x%02x%02x\n", received_payload_[offset+3], received_payload_[offset+2],
-                    received_payload_[offset+1], received_payload_[offset+0]);
-            offset+=4;
-        }
-        if (has_wmbus_version) {
-            verbose("(im871a) config: wmbus version %02x\n", received_payload_[offset]);
-            offset++;
-        }
-        if (has_wmbus_device_type) {
-            verbose("(im871a) config: wmbus device type %02x\n", received_payload_[offset]);
-            offset++;
+        verbose("(im871a) config: device mode %02x\n", payload[offset]);
+        offset++;
+    }
+    if (has_link_mode)
+    {
+        verbose("(im871a) config: link mode %02x\n", payload[offset]);
+        if (payload[offset] == (int)LinkModeIM871A::C1a) {
+            lm = LinkMode::C1;
         }
-        if (has_radio_channel) {
-            verbose("(im871a) config: radio channel %02x\n", received_payload_[offset]);
-            offset++;
+        if (payload[offset] == (int)LinkModeIM871A::S1) {
+            lm = LinkMode::S1;
         }
-        int iff2 = received_payload_[offset];
-        offset++;
-        bool has_radio_power_level = (iff2&1)==1;
-        bool has_radio_data_rate = (iff2&2)==2;
-        bool has_radio_rx_window = (iff2&4)==4;
-        bool has_auto_power_saving = (iff2&8)==8;
-        bool has_auto_rssi_attachment = (iff2&16)==16;
-        bool has_auto_rx_timestamp_attachment = (iff2&32)==32;
-        bool has_led_control = (iff2&64)==64;
-        bool has_rtc_control = (iff2&128)==128;
-        if (has_radio_power_level) {
-            verbose("(im871a) config: radio power level %02x\n", received_payload_[offset]);
-            offset++;
+        if (payload[offset] == (int)LinkModeIM871A::S1m) {
+            lm = LinkMode::S1m;
         }
-        if (has_radio_data_rate) {
-            verbose("(im871a) config: radio data rate %02x\n", received_payload_[offset]);
-            offset++;
+        if (payload[offset] == (int)LinkModeIM871A::T1) {
+            lm = LinkMode::T1;
         }
-        if (has_radio_rx_window) {
-            verbose("(im871a) config: radio rx window %02x\n", received_payload_[offset]);
-            offset++;
+        if (payload[offset] == (int)LinkModeIM871A::N1A) {
+            lm = LinkMode::N1a;
         }
-        if (has_auto_power_saving) {
-            verbose("(im871a) config: auto power saving %02x\n", received_payload_[offset]);
-            offset++;
+        if (payload[offset] == (int)LinkModeIM871A::N1B) {
+            lm = LinkMode::N1b;
         }
-        if (has_auto_rssi_attachment) {
-            verbose("(im871a) config: auto RSSI attachment %02x\n", received_payload_[offset]);
-            offset++;
+        if (payload[offset] == (int)LinkModeIM871A::N1C) {
+            lm = LinkMode::N1c;
         }
-        if (has_auto_rx_timestamp_attachment) {
-            verbose("(im871a) config: auto rx timestamp attachment %02x\n", received_payload_[offset]);
-            offset++;
+        if (payload[offset] == (int)LinkModeIM871A::N1D) {
+            lm = LinkMode::N1d;
         }
-        if (has_led_control) {
-            verbose("(im871a) config: led control %02x\n", received_payload_[offset]);
-            offset++;
+        if (payload[offset] == (int)LinkModeIM871A::N1E) {
+            lm = LinkMode::N1e;
         }
-        if (has_rtc_control) {
-            verbose("(im871a) config: rtc control %02x\n", received_payload_[offset]);
-            offset++;
+        if (payload[offset] == (int)LinkModeIM871A::N1F) {
+            lm = LinkMode::N1f;
         }
+        offset++;
+    }
+    if (has_wmbus_c_field) {
+        verbose("(im871a) config: wmbus c-field %02x\n", payload[offset]);
+        offset++;
+    }
+    if (has_wmbus_man_id) {
+        int flagid = 256*payload[offset+1] +payload[offset+0];
+        string flag = manufacturerFlag(flagid);
+        verbose("(im871a) config: wmbus mfg id %02x%02x (%s)\n", payload[offset+1], payload[offset+0],
+                flag.c_str());
+        offset+=2;
+    }
+    if (has_wmbus_device_id) {
+        verbose("(im871a) config: wmbus device id %02x%02x%02x%02x\n", payload[offset+3], payload[offset+2],
+                payload[offset+1], payload[offset+0]);
+        offset+=4;
+    }
+    if (has_wmbus_version) {
+        verbose("(im871a) config: wmbus version %02x\n", payload[offset]);
+        offset++;
+    }
+    if (has_wmbus_device_type) {
+        verbose("(im871a) config: wmbus device type %02x\n", payload[offset]);
+        offset++;
+    }
+    if (has_radio_channel) {
+        verbose("(im871a) config: radio channel %02x\n", payload[offset]);
+        offset++;
+    }
+    int iff2 = payload[offset];
+    offset++;
+    bool has_radio_power_level = (iff2&1)==1;
+    bool has_radio_data_rate = (iff2&2)==2;
+    bool has_radio_rx_window = (iff2&4)==4;
+    bool has_auto_power_saving = (iff2&8)==8;
+    bool has_auto_rssi_attachment = (iff2&16)==16;
+    bool has_auto_rx_timestamp_attachment = (iff2&32)==32;
+    bool has_led_control = (iff2&64)==64;
+    bool has_rtc_control = (iff2&128)==128;
+    if (has_radio_power_level) {
+        verbose("(im871a) config: radio power level %02x\n", payload[offset]);
+        offset++;
+    }
+    if (has_radio_data_rate) {
+        verbose("(im871a) config: radio data rate %02x\n", payload[offset]);
+        offset++;
+    }
+    if (has_radio_rx_window) {
+        verbose("(im871a) config: radio rx window %02x\n", payload[offset]);
+        offset++;
+    }
+    if (has_auto_power_saving) {
+        verbose("(im871a) config: auto power saving %02x\n", payload[offset]);
+        offset++;
+    }
+    if (has_auto_rssi_attachment) {
+        verbose("(im871a) config: auto RSSI attachment %02x\n", payload[offset]);
+        offset++;
+    }
+    if (has_auto_rx_timestamp_attachment) {
+        verbose("(im871a) config: auto rx timestamp attachment %02x\n", payload[offset]);
+        offset++;
+    }
+    if (has_led_control) {
+        verbose("(im871a) config: led control %02x\n", payload[offset]);
+        offset++;
+    }
+    if (has_rtc_control) {
+        verbose("(im871a) config: rtc control %02x\n", payload[offset]);
+        offset++;
     }
 
-    pthread_mutex_unlock(&command_lock_);
     LinkModeSet lms;
     lms.addLinkMode(lm);
     return lms;
@@ -336,12 +318,10 @@ void WMBusIM871A::setLinkModes(LinkModeSet lms)
         error("(im871a) setting link mode(s) %s is not supported for im871a\n", modes.c_str());
     }
 
-    pthread_mutex_lock(&command_lock_);
-
     vector<uchar> msg(10);
     msg[0] = IM871A_SERIAL_SOF;
     msg[1] = DEVMGMT_ID;
-    sent_command_ = msg[2] = DEVMGMT_MSG_SET_CONFIG_REQ;
+    msg[2] = DEVMGMT_MSG_SET_CONFIG_REQ;
     msg[3] = 6; // Len
     msg[4] = 0; // Temporary
     msg[5] = 2; // iff1 bits: Set Radio Mode
@@ -374,32 +354,18 @@ void WMBusIM871A::setLinkModes(LinkModeSet lms)
     msg[9] = 1;  // Enable timestamp
 
     verbose("(im871a) set link mode %02x\n", msg[6]);
-    bool sent = serial()->send(msg);
-
-    if (sent) waitForResponse();
+    // Not waited for here, the get config that follows is pipelined after it.
+    set_config_ = commands_.send("set config", msg, DEVMGMT_MSG_SET_CONFIG_RSP);
 
     // Remember the link modes, necessary when using stdin or file.
     link_modes_ = lms;
-    pthread_mutex_unlock(&command_lock_);
-}
-
-void WMBusIM871A::waitForResponse()
-{
-    while (manager_->isRunning())
-    {
-        int rc = sem_wait(&command_wait_);
-        if (rc==0) break;
-        if (rc==-1) {
-            if (errno==EINTR) continue;
-            break;
-        }
-    }
 }
 
 FrameStatus WMBusIM871A::checkIM871AFrame(vector<uchar> &data,
                                           size_t *frame_length, int *endpoint_out, int *msgid_out,
-                                          int *payload_len_out, int *payload_offset)
+                                          int *payload_len_out, int *payload_offset, AboutTelegram *about)
 {
+    STAGE_TIMER(frame_check);
     if (data.size() == 0) return PartialFrame;
 
     debugPayload("(im871a) checkIM871AFrame", data);
@@ -496,11 +462,14 @@ FrameStatus WMBusIM871A::checkIM871AFrame(vector<uchar> &data,
 
         uint32_t ts = a+b*256+c*256*256+d*256*256*256;
         debug("(im871a) timestamp %08x\n", ts);
+        about->hw_timestamp = ts;
         i += 4;
     }
     if (has_rssi) {
-        uint32_t rssi = data[i];
-        verbose("(im871a) rssi %02x\n", rssi);
+        // A signed byte in dBm.
+        int rssi = (signed char)data[i];
+        verbose("(im871a) rssi %d dBm\n", rssi);
+        about->rssi_dbm = rssi;
         i++;
     }
     if (has_crc16) {
@@ -528,6 +497,7 @@ void WMBusIM871A::processSerialData()
     serial_->receive(&data);
 
     read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    read_buffer_memory_.update(read_buffer_.capacity());
 
     size_t frame_length;
     int endpoint;
@@ -536,10 +506,16 @@ void WMBusIM871A::processSerialData()
 
     for (;;)
     {
-        FrameStatus status = checkIM871AFrame(read_buffer_, &frame_length, &endpoint, &msgid, &payload_len, &payload_offset);
+        // The header has been seen but the frame is still incomplete.
+        if (scanner_.waitingFor(read_buffer_)) break;
+
+        frame_length = 0;
+        AboutTelegram about;
+        FrameStatus status = checkIM871AFrame(read_buffer_, &frame_length, &endpoint, &msgid, &payload_len, &payload_offset, &about);
 
         if (status == PartialFrame)
         {
+            scanner_.expect(frame_length);
             if (read_buffer_.size() > 0)
             {
                 debugPayload("(im871a) partial frame, expecting more.", read_buffer_);
@@ -548,8 +524,10 @@ void WMBusIM871A::processSerialData()
         }
         if (status == ErrorInFrame)
         {
+            countFate(Fate::framing_error, driverFateCounters("im871a"));
             debugPayload("(im871a) bad frame, clearing.", read_buffer_);
             read_buffer_.clear();
+            scanner_.reset();
             break;
         }
         if (status == FullFrame)
@@ -569,12 +547,13 @@ void WMBusIM871A::processSerialData()
                                read_buffer_.begin()+payload_offset+payload_len);
             }
             read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            scanner_.consumed(frame_length);
 
             // We now have a proper message in payload. Let us trigger actions based on it.
             // It can be wmbus receiver-dongle messages or wmbus remote meter messages received over the radio.
             switch (endpoint) {
             case DEVMGMT_ID: handleDevMgmt(msgid, payload); break;
-            case RADIOLINK_ID: handleRadioLink(msgid, payload); break;
+            case RADIOLINK_ID: handleRadioLink(msgid, payload, about); break;
             case RADIOLINKTEST_ID: handleRadioLinkTest(msgid, payload); break;
             case HWTEST_ID: handleHWTest(msgid, payload); break;
             }
@@ -587,40 +566,31 @@ void WMBusIM871A::handleDevMgmt(int msgid, vector<uchar> &payload)
     switch (msgid) {
         case DEVMGMT_MSG_PING_RSP: // 0x02
             verbose("(im871a) pong\n");
-            received_command_ = msgid;
-            sem_post(&command_wait_);
+            commands_.handleResponse(msgid, payload);
             break;
         case DEVMGMT_MSG_SET_CONFIG_RSP: // 0x04
             verbose("(im871a) set config completed\n");
-            received_command_ = msgid;
-            received_payload_.clear();
-            received_payload_.insert(received_payload_.end(), payload.begin(), payload.end());
-            sem_post(&command_wait_);
+            commands_.handleResponse(msgid, payload);
             break;
         case DEVMGMT_MSG_GET_CONFIG_RSP: // 0x06
             verbose("(im871a) get config completed\n");
-            received_command_ = msgid;
-            received_payload_.clear();
-            received_payload_.insert(received_payload_.end(), payload.begin(), payload.end());
-            sem_post(&command_wait_);
+            commands_.handleResponse(msgid, payload);
             break;
         case DEVMGMT_MSG_GET_DEVICEINFO_RSP: // 0x10
             verbose("(im871a) device info completed\n");
-            received_command_ = msgid;
-            received_payload_.clear();
-            received_payload_.insert(received_payload_.end(), payload.begin(), payload.end());
-            sem_post(&command_wait_);
+            commands_.handleResponse(msgid, payload);
             break;
     default:
         verbose("(im871a) Unhandled device management message %d\n", msgid);
     }
 }
 
-void WMBusIM871A::handleRadioLink(int msgid, vector<uchar> &frame)
+void WMBusIM871A::handleRadioLink(int msgid, vector<uchar> &frame, AboutTelegram &about)
 {
     switch (msgid) {
     case RADIOLINK_MSG_WMBUSMSG_IND: // 0x03
-        handleTelegram(frame);
+        about.timestamp = time(NULL);
+        handleTelegram(about, frame);
         break;
     default:
         verbose("(im871a) Unhandled radio link message %d\n", msgid);
@@ -643,44 +613,36 @@ void WMBusIM871A::handleHWTest(int msgid, vector<uchar> &payload)
     }
 }
 
-bool detectIM871A(string device, SerialCommunicationManager *manager)
+DetectProbe probeIM871A()
 {
-    // Talk to the device and expect a very specific answer.
-    auto serial = manager->createSerialDeviceTTY(device.c_str(), 57600);
-    bool ok = serial->open(false);
-    if (!ok) return false;
-
-    vector<uchar> data;
-    // First clear out any data in the queue.
-    serial->receive(&data);
-    data.clear();
-
     vector<uchar> msg(4);
     msg[0] = IM871A_SERIAL_SOF;
     msg[1] = DEVMGMT_ID;
     msg[2] = DEVMGMT_MSG_PING_REQ;
     msg[3] = 0;
 
-    verbose("(im871a) are you there?\n");
-    serial->send(msg);
-    // Wait for 100ms so that the USB stick have time to prepare a response.
-    usleep(1000*100);
-    serial->receive(&data);
-    serial->close();
-
-    string sent = bin2hex(msg);
-    string recv = bin2hex(data);
-
-    size_t frame_length;
-    int endpoint, msgid, payload_len, payload_offset;
-    FrameStatus status = WMBusIM871A::checkIM871AFrame(data,
-                                                       &frame_length, &endpoint, &msgid,
-                                                       &payload_len, &payload_offset);
-    if (status != FullFrame ||
-        endpoint != 1 ||
-        msgid != 2)
+    // Assumes that the device is configured for 57600 bps, which seems to be the default.
+    return { DEVICE_IM871A, 57600, msg, 100, [](vector<uchar> &data)
     {
-        return false;
-    }
-    return true;
+        for (;;)
+        {
+            size_t frame_length;
+            int endpoint, msgid, payload_len, payload_offset;
+            AboutTelegram about;
+            FrameStatus status = WMBusIM871A::checkIM871AFrame(data,
+                                                               &frame_length, &endpoint, &msgid,
+                                                               &payload_len, &payload_offset, &about);
+            if (status != FullFrame) return status;
+            if (endpoint == DEVMGMT_ID && msgid == DEVMGMT_MSG_PING_RSP) return FullFrame;
+            // Skip a telegram received before the ping response.
+            data.erase(data.begin(), data.begin()+frame_length);
+        }
+    }};
+}
+
+bool detectIM871A(string device, SerialCommunicationManager *manager)
+{
+    vector<DetectCandidate> candidates = { { device, { probeIM871A() }, false } };
+    WMBusDeviceType type;
+    return detectConcurrently(candidates, manager, &type) == 0;
 }
@@ -18,6 +18,7 @@
 #include"wmbus.h"
 #include"wmbus_utils.h"
 #include"serial.h"
+#include"stats.h"
 
 #include<assert.h>
 #include<pthread.h>
@@ -49,6 +50,8 @@ private:
     unique_ptr<SerialDevice> serial_;
     SerialCommunicationManager *manager_;
     vector<uchar> read_buffer_;
+    MemoryTracker read_buffer_memory_ { Memory::frame_buffers };
+    FrameScanner scanner_;
     sem_t command_wait_;
     LinkModeSet link_modes_;
     vector<uchar> received_payload_;
@@ -117,27 +120,37 @@ void WMBusRawTTY::processSerialData()
 
     // Receive and accumulated serial data until a full frame has been received.
     serial_->receive(&data);
+    // Set when the frames are forwarded by remote receivers.
+    string source = serial_->source();
 
     read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    read_buffer_memory_.update(read_buffer_.capacity());
 
     size_t frame_length;
     int payload_len, payload_offset;
 
     for (;;)
     {
+        // The header has been seen but the frame is still incomplete.
+        if (scanner_.waitingFor(read_buffer_)) break;
+
+        frame_length = 0;
         FrameStatus status = checkWMBusFrame(read_buffer_, &frame_length, &payload_len, &payload_offset);
 
         if (status == PartialFrame)
         {
+            scanner_.expect(frame_length);
             // Partial frame, stop eating.
             break;
         }
         if (status == ErrorInFrame)
         {
+            countFate(Fate::framing_error, driverFateCounters("rawtty"));
             verbose("(rawtty) protocol error in message received!\n");
             string msg = bin2hex(read_buffer_);
             debug("(rawtty) protocol error \"%s\"\n", msg.c_str());
             read_buffer_.clear();
+            scanner_.reset();
             break;
         }
         if (status == FullFrame)
@@ -150,11 +163,22 @@ void WMBusRawTTY::processSerialData()
                 payload.insert(payload.end(), read_buffer_.begin()+payload_offset, read_buffer_.begin()+payload_offset+payload_len);
             }
             read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
-            handleTelegram(payload);
+            scanner_.consumed(frame_length);
+            AboutTelegram about;
+            about.timestamp = time(NULL);
+            about.device = source;
+            handleTelegram(about, payload);
         }
     }
 }
 
+DetectProbe probeRawTTY(WMBusDeviceType type, int baud)
+{
+    // Since we do not know how to talk to the other end, it might not
+    // even respond. The only thing we can do is to try to open the serial device.
+    return { type, baud, {}, 0, [](vector<uchar> &data) { return FullFrame; } };
+}
+
 bool detectRawTTY(string device, int baud, SerialCommunicationManager *manager)
 {
     // Since we do not know how to talk to the other end, it might not
@@ -0,0 +1,146 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"wmbus.h"
+
+#include<pthread.h>
+
+using namespace std;
+
+// Several receivers in front of one decode pipeline. The meters register
+// once, here, and each receiver forwards its telegrams tagged with its name.
+// Each receiver still counts the fates of its own frames.
+struct WMBusReceivers : public virtual WMBus
+{
+    WMBusDeviceType type() { return receivers_[0]->type(); }
+    bool ping();
+    uint32_t getDeviceId() { return receivers_[0]->getDeviceId(); }
+    LinkModeSet getLinkModes();
+    LinkModeSet supportedLinkModes();
+    int numConcurrentLinkModes() { return receivers_[0]->numConcurrentLinkModes(); }
+    bool canSetLinkModes(LinkModeSet lms);
+    void setMeters(vector<unique_ptr<Meter>> *meters);
+    void setLinkModes(LinkModeSet lms);
+    void onTelegram(function<bool(AboutTelegram&,vector<uchar>)> cb) { telegram_listeners_.push_back(cb); }
+    SerialDevice *serial() { return NULL; }
+    void simulate();
+
+    WMBusReceivers(vector<unique_ptr<WMBus>> receivers, vector<string> names);
+    ~WMBusReceivers();
+
+private:
+
+    bool handleTelegram(AboutTelegram &about, vector<uchar> &frame);
+
+    vector<unique_ptr<WMBus>> receivers_;
+    vector<function<bool(AboutTelegram&,vector<uchar>)>> telegram_listeners_;
+    // The receivers deliver from the event loop thread and, when simulating,
+    // from the main thread. The meters expect one telegram at a time.
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+};
+
+WMBusReceivers::WMBusReceivers(vector<unique_ptr<WMBus>> receivers, vector<string> names)
+    : receivers_(std::move(receivers))
+{
+    for (size_t i = 0; i < receivers_.size(); ++i)
+    {
+        string name = names[i];
+        receivers_[i]->onTelegram([this,name](AboutTelegram &about, vector<uchar> frame)
+                                  {
+                                      // Keep the address of a remote receiver, it tells more.
+                                      if (about.device == "") about.device = name;
+                                      return handleTelegram(about, frame);
+                                  });
+    }
+}
+
+WMBusReceivers::~WMBusReceivers()
+{
+    // Close the receivers before the listeners that they call are gone.
+    receivers_.clear();
+}
+
+bool WMBusReceivers::handleTelegram(AboutTelegram &about, vector<uchar> &frame)
+{
+    bool handled = false;
+    pthread_mutex_lock(&lock_);
+    for (auto &f : telegram_listeners_)
+    {
+        if (f && f(about, frame)) handled = true;
+    }
+    pthread_mutex_unlock(&lock_);
+    return handled;
+}
+
+bool WMBusReceivers::ping()
+{
+    bool ok = true;
+    for (auto &r : receivers_) if (!r->ping()) ok = false;
+    return ok;
+}
+
+LinkModeSet WMBusReceivers::getLinkModes()
+{
+    LinkModeSet lms;
+    for (auto &r : receivers_) lms.unionLinkModeSet(r->getLinkModes());
+    return lms;
+}
+
+LinkModeSet WMBusReceivers::supportedLinkModes()
+{
+    LinkModeSet lms;
+    for (auto &r : receivers_) lms.unionLinkModeSet(r->supportedLinkModes());
+    return lms;
+}
+
+bool WMBusReceivers::canSetLinkModes(LinkModeSet lms)
+{
+    for (auto &r : receivers_) if (!r->canSetLinkModes(lms)) return false;
+    return true;
+}
+
+void WMBusReceivers::setMeters(vector<unique_ptr<Meter>> *meters)
+{
+    for (auto &r : receivers_) r->setMeters(meters);
+}
+
+// main sets the link modes of each receiver from its own device instead,
+// eg an im871a on c1 next to an rtlsdr on t1. This sets the same on all.
+void WMBusReceivers::setLinkModes(LinkModeSet lms)
+{
+    for (auto &r : receivers_) r->setLinkModes(lms);
+}
+
+void WMBusReceivers::simulate()
+{
+    // One simulation after the other, the live receivers keep receiving meanwhile.
+    for (auto &r : receivers_)
+    {
+        if (isSimulated(r->type())) r->simulate();
+    }
+}
+
+unique_ptr<WMBus> openReceivers(vector<unique_ptr<WMBus>> receivers, vector<string> names)
+{
+    WMBusReceivers *imp = new WMBusReceivers(std::move(receivers), names);
+    return unique_ptr<WMBus>(imp);
+}
+
+bool isSimulated(WMBusDeviceType t)
+{
+    return t == DEVICE_SIMULATOR || t == DEVICE_SYNTHETIC || t == DEVICE_REPLAY;
+}
@@ -0,0 +1,244 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"stats.h"
+#include"wmbus.h"
+#include"wmbus_utils.h"
+#include"serial.h"
+
+#include<errno.h>
+#include<fcntl.h>
+#include<string.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<time.h>
+#include<unistd.h>
+
+using namespace std;
+
+// Replays the telegrams logged with --logtelegrams, ie lines containing
+// telegram=|header|content|+seconds possibly after a prefix like (multical21) log "
+// The file is memory mapped and scanned in place, so a capture of millions
+// of telegrams does not have to fit in memory as strings.
+struct WMBusReplay : public WMBusCommonImplementation
+{
+    bool ping() { return true; }
+    uint32_t getDeviceId() { return 0x11111111; }
+    LinkModeSet getLinkModes() { return link_modes_; }
+    void setLinkModes(LinkModeSet lms) { link_modes_ = lms; }
+    LinkModeSet supportedLinkModes() { return Any_bit; }
+    int numConcurrentLinkModes() { return 0; }
+    bool canSetLinkModes(LinkModeSet lms) { return true; }
+    SerialDevice *serial() { return NULL; }
+    void simulate();
+
+    WMBusReplay(string file, string settings, SerialCommunicationManager *manager);
+    ~WMBusReplay();
+
+private:
+
+    void parseSettings(string settings);
+    bool parseLine(const char *line, const char *end, vector<uchar> *frame, time_t *offset);
+    time_t lastOffset();
+    void waitUntil(uint64_t due);
+
+    SerialCommunicationManager *manager_ {};
+    LinkModeSet link_modes_;
+    string file_;
+    const char *data_ {};
+    size_t size_ {};
+
+    double speed_ {}; // 1 is the original pace, zero means as fast as possible.
+    time_t start_ {}; // The capture time of offset +0.
+};
+
+WMBusReplay::WMBusReplay(string file, string settings, SerialCommunicationManager *manager)
+    : WMBusCommonImplementation(DEVICE_REPLAY), manager_(manager), file_(file)
+{
+    parseSettings(settings);
+
+    int fd = open(file.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        error("(replay) could not open %s %s\n", file.c_str(), strerror(errno));
+    }
+    size_ = st.st_size;
+    if (size_ > 0)
+    {
+        void *p = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            error("(replay) could not map %s %s\n", file.c_str(), strerror(errno));
+        }
+        madvise(p, size_, MADV_SEQUENTIAL);
+        data_ = (const char*)p;
+    }
+    close(fd);
+
+    if (start_ == 0)
+    {
+        // The capture only has offsets from when the logging started. The last
+        // telegram was most likely written just before the file was last modified.
+        start_ = st.st_mtime - lastOffset();
+    }
+    char captured[40], speed[32];
+    strftime(captured, sizeof(captured), "%FT%TZ", gmtime(&start_));
+    snprintf(speed, sizeof(speed), speed_ == 0 ? "max" : "%gx", speed_);
+    verbose("(replay) %s %zu bytes captured from %s speed %s\n", file.c_str(), size_, captured, speed);
+}
+
+WMBusReplay::~WMBusReplay()
+{
+    if (data_) munmap((void*)data_, size_);
+}
+
+void WMBusReplay::parseSettings(string settings)
+{
+    // replay,speed=10x,start=2020-05-01T12:00:00Z
+    size_t from = 0;
+    while (from < settings.length())
+    {
+        size_t to = settings.find(',', from);
+        if (to == string::npos) to = settings.length();
+        string p = settings.substr(from, to-from);
+        from = to+1;
+        if (p == "" || p == "replay") continue;
+
+        size_t eq = p.find('=');
+        string key = p.substr(0, eq);
+        string val = eq == string::npos ? "" : p.substr(eq+1);
+        if (key == "speed")
+        {
+            if (val == "max") speed_ = 0;
+            else if (val.length() > 1 && val.back() == 'x' && atof(val.c_str()) > 0) speed_ = atof(val.c_str());
+            else error("(replay) not a valid speed \"%s\", use max, 1x or eg 10x\n", val.c_str());
+        }
+        else if (key == "start")
+        {
+            struct tm tm {};
+            if (isNumber(val)) start_ = atol(val.c_str());
+            else if (strptime(val.c_str(), "%Y-%m-%dT%H:%M:%SZ", &tm) != NULL) start_ = timegm(&tm);
+            else error("(replay) not a valid start time \"%s\", use eg 2020-05-01T12:00:00Z\n", val.c_str());
+        }
+        else
+        {
+            error("(replay) unknown setting \"%s\"\n", p.c_str());
+        }
+    }
+}
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9') return c-'0';
+    if (c >= 'A' && c <= 'F') return c-'A'+10;
+    if (c >= 'a' && c <= 'f') return c-'a'+10;
+    return -1;
+}
+
+// Decode the telegram=|...|...|+offset in the line directly into the frame.
+bool WMBusReplay::parseLine(const char *line, const char *end, vector<uchar> *frame, time_t *offset)
+{
+    const char *p = (const char*)memmem(line, end-line, "telegram=", 9);
+    if (p == NULL) return false;
+    p += 9;
+
+    frame->clear();
+    *offset = 0;
+    while (p < end)
+    {
+        if (*p == '|') { p++; continue; }
+        if (*p == '+')
+        {
+            for (p++; p < end && *p >= '0' && *p <= '9'; ++p) *offset = *offset*10 + (*p-'0');
+            break;
+        }
+        if (p+1 >= end) return false;
+        int hi = hexValue(p[0]);
+        int lo = hexValue(p[1]);
+        if (hi < 0 || lo < 0) break; // The closing quote of a log line.
+        frame->push_back(hi << 4 | lo);
+        p += 2;
+    }
+    return frame->size() > 0;
+}
+
+time_t WMBusReplay::lastOffset()
+{
+    vector<uchar> frame;
+    time_t offset = 0;
+    const char *end = data_+size_;
+    while (end > data_)
+    {
+        const char *line = end;
+        while (line > data_ && line[-1] != '\n') line--;
+        if (parseLine(line, end, &frame, &offset)) return offset;
+        if (line == data_) break;
+        end = line-1;
+    }
+    return 0;
+}
+
+void WMBusReplay::waitUntil(uint64_t due)
+{
+    for (;;)
+    {
+        uint64_t now = statsNow();
+        if (now >= due || !manager_->isRunning()) return;
+        uint64_t wait = due-now;
+        // Sleep at most 100ms at a time to notice when the manager is stopped.
+        usleep(wait > 100000000ull ? 100000 : wait/1000);
+    }
+}
+
+// Stops at the end of the file or when the manager is stopped.
+void WMBusReplay::simulate()
+{
+    vector<uchar> frame;
+    AboutTelegram about;
+    time_t offset;
+    uint64_t sent = 0;
+    uint64_t start = statsNow();
+
+    const char *line = data_;
+    const char *end = data_+size_;
+    while (line < end && manager_->isRunning())
+    {
+        const char *nl = (const char*)memchr(line, '\n', end-line);
+        const char *eol = nl ? nl : end;
+        if (parseLine(line, eol, &frame, &offset))
+        {
+            if (speed_ > 0)
+            {
+                waitUntil(start + (uint64_t)(offset*1e9/speed_));
+            }
+            about.timestamp = start_+offset;
+            handleTelegram(about, frame);
+            sent++;
+            if (sent % 1024 == 0) manager_->invokeRegularCallbacks();
+        }
+        line = eol+1;
+    }
+    uint64_t nanos = statsNow()-start;
+    verbose("(replay) replayed %ju telegrams in %.3f s\n", (uintmax_t)sent, nanos/1e9);
+}
+
+unique_ptr<WMBus> openReplay(string file, string settings, SerialCommunicationManager *manager)
+{
+    WMBusReplay *imp = new WMBusReplay(file, settings, manager);
+    return unique_ptr<WMBus>(imp);
+}
@@ -0,0 +1,95 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"demod.h"
+#include"wmbus.h"
+#include"wmbus_utils.h"
+#include"serial.h"
+#include"stats.h"
+
+using namespace std;
+
+// Reads the raw IQ samples from rtl_sdr, or from a recorded file, and
+// demodulates them in process. Unlike rtlwmbus there is no rtl_wmbus
+// process and no hex text to parse.
+struct WMBusRTLSDR : public virtual WMBusCommonImplementation
+{
+    bool ping() { return true; }
+    uint32_t getDeviceId() { return 0x11111111; }
+    LinkModeSet getLinkModes() { return C1_bit | T1_bit; }
+    void setLinkModes(LinkModeSet lms) { }
+    LinkModeSet supportedLinkModes() { return C1_bit | T1_bit; }
+    int numConcurrentLinkModes() { return 2; }
+    // The demodulator listens to both modes always.
+    bool canSetLinkModes(LinkModeSet lms) { return supportedLinkModes().supports(lms); }
+    SerialDevice *serial() { return NULL; }
+    void simulate() { }
+
+    void processSerialData();
+
+    WMBusRTLSDR(unique_ptr<SerialDevice> serial, SerialCommunicationManager *manager);
+
+private:
+    unique_ptr<SerialDevice> serial_;
+    SerialCommunicationManager *manager_ {};
+    Demodulator demod_;
+    vector<uchar> samples_;
+    vector<pair<LinkMode,vector<uchar>>> frames_; // Demodulated from the latest samples.
+};
+
+unique_ptr<WMBus> openRTLSDR(string command, SerialCommunicationManager *manager,
+                             function<void()> on_exit, unique_ptr<SerialDevice> serial_override)
+{
+    if (serial_override)
+    {
+        WMBusRTLSDR *imp = new WMBusRTLSDR(std::move(serial_override), manager);
+        return unique_ptr<WMBus>(imp);
+    }
+    vector<string> args;
+    vector<string> envs;
+    args.push_back("-c");
+    args.push_back(command);
+    auto serial = manager->createSerialDeviceCommand("/bin/sh", args, envs, on_exit);
+    WMBusRTLSDR *imp = new WMBusRTLSDR(std::move(serial), manager);
+    return unique_ptr<WMBus>(imp);
+}
+
+WMBusRTLSDR::WMBusRTLSDR(unique_ptr<SerialDevice> serial, SerialCommunicationManager *manager) :
+    WMBusCommonImplementation(DEVICE_RTLSDR), serial_(std::move(serial)), manager_(manager),
+    demod_(DEMOD_SAMPLE_RATE, driverFateCounters("rtlsdr"),
+           [this](LinkMode lm, vector<uchar> &frame) { frames_.push_back({ lm, frame }); })
+{
+    manager_->listenTo(serial_.get(),call(this,processSerialData));
+    serial_->open(true);
+}
+
+void WMBusRTLSDR::processSerialData()
+{
+    serial_->receive(&samples_);
+    {
+        STAGE_TIMER(frame_check);
+        demod_.process(samples_.data(), samples_.size());
+    }
+    for (auto &f : frames_)
+    {
+        AboutTelegram about;
+        about.timestamp = time(NULL);
+        about.link_mode = f.first;
+        handleTelegram(about, f.second);
+    }
+    frames_.clear();
+}
@@ -18,6 +18,7 @@
 #include"wmbus.h"
 #include"wmbus_utils.h"
 #include"serial.h"
+#include"stats.h"
 
 #include<assert.h>
 #include<fcntl.h>
@@ -28,6 +29,7 @@
 #include<sys/errno.h>
 #include<sys/stat.h>
 #include<sys/types.h>
+#include<time.h>
 #include<unistd.h>
 
 using namespace std;
@@ -60,6 +62,8 @@ struct WMBusRTLWMBUS : public virtual WMBusCommonImplementation
 private:
     unique_ptr<SerialDevice> serial_;
     vector<uchar> read_buffer_;
+    MemoryTracker read_buffer_memory_ { Memory::frame_buffers };
+    FrameScanner scanner_;
     vector<uchar> received_payload_;
     bool warning_dll_len_printed_ {};
 
@@ -97,6 +101,51 @@ WMBusRTLWMBUS::WMBusRTLWMBUS(unique_ptr<SerialDevice> serial, SerialCommunicatio
     serial_->open(true);
 }
 
+// The mode at the start of the line, up to the first semicolon, eg T1 or C1.
+static LinkMode lineLinkMode(vector<uchar> &data, size_t eol, size_t *semicolon)
+{
+    size_t i = 0;
+    while (i < eol && i < 8 && data[i] != ';') i++;
+    if (i == 0 || i >= eol || data[i] != ';') return LinkMode::UNKNOWN;
+    string mode(data.begin(), data.begin()+i);
+    for (char &c : mode) c = tolower(c);
+    *semicolon = i;
+    return isLinkMode(mode.c_str());
+}
+
+// MODE;CRC_OK;3OUTOF6OK;TIMESTAMP;PACKET_RSSI;CURRENT_RSSI;LINK_LAYER_IDENT_NO; before the hex.
+// A forwarding wmbusmeters sends the time of reception in utc, eg 2020-05-01T12:00:00Z,
+// and the rssi in dBm. The rssi from rtl_wmbus is not calibrated and is not used.
+static void parseLineFields(vector<uchar> &data, size_t len, AboutTelegram *about)
+{
+    vector<string> fields;
+    string field;
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (data[i] == ';')
+        {
+            fields.push_back(field);
+            field = "";
+            continue;
+        }
+        field += data[i];
+    }
+    if (fields.size() < 1) return;
+    string mode = fields[0];
+    for (char &c : mode) c = tolower(c);
+    LinkMode lm = isLinkMode(mode.c_str());
+    if (lm != LinkMode::Any) about->link_mode = lm;
+
+    if (fields.size() < 5) return;
+    string &ts = fields[3];
+    if (ts.length() == 0 || ts.back() != 'Z') return;
+    struct tm tm {};
+    const char *end = strptime(ts.c_str(), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    if (end == NULL || *end != 0) return;
+    about->timestamp = timegm(&tm);
+    about->rssi_dbm = atoi(fields[4].c_str());
+}
+
 bool WMBusRTLWMBUS::ping()
 {
     return true;
@@ -127,7 +176,10 @@ void WMBusRTLWMBUS::processSerialData()
 
     // Receive and accumulated serial data until a full frame has been received.
     serial_->receive(&data);
+    // Set when the lines are forwarded by remote receivers.
+    string source = serial_->source();
     read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    read_buffer_memory_.update(read_buffer_.capacity());
 
     size_t frame_length;
     int hex_payload_len, hex_payload_offset;
@@ -144,13 +196,16 @@ void WMBusRTLWMBUS::processSerialData()
         {
             // The buffer has already been printed by serial cmd.
             read_buffer_.clear();
+            scanner_.reset();
             break;
         }
         if (status == ErrorInFrame)
         {
+            countFate(Fate::framing_error, driverFateCounters("rtlwmbus"));
             debug("(rtlwmbus) error in received message.\n");
             string msg = bin2hex(read_buffer_);
             read_buffer_.clear();
+            scanner_.reset();
             break;
         }
         if (status == FullFrame)
@@ -177,7 +232,14 @@ void WMBusRTLWMBUS::processSerialData()
                 }
             }
 
+            AboutTelegram about;
+            about.timestamp = time(NULL);
+            about.device = source;
+            // The line begins with the mode, eg T1;1;1;..., unless it is only the hex.
+            if (hex_payload_offset > 2) parseLineFields(read_buffer_, hex_payload_offset-2, &about);
+
             read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
+            scanner_.consumed(frame_length);
             if (payload.size() > 0)
             {
                 if (payload[0] != payload.size()-1)
@@ -190,7 +252,7 @@ void WMBusRTLWMBUS::processSerialData()
                     payload[0] = payload.size()-1;
                 }
             }
-            handleTelegram(payload);
+            handleTelegram(about, payload);
         }
     }
 }
@@ -200,28 +262,27 @@ FrameStatus WMBusRTLWMBUS::checkRTLWMBUSFrame(vector<uchar> &data,
                                               int *hex_payload_len_out,
                                               int *hex_payload_offset)
 {
+    STAGE_TIMER(frame_check);
     // C1;1;1;2019-02-09 07:14:18.000;117;102;94740459;0x49449344590474943508780dff5f3500827f0000f10007b06effff530100005f2c620100007f2118010000008000800080008000000000000000000e003f005500d4ff2f046d10086922
     // There might be a second telegram on the same line ;0x4944.......
     if (data.size() == 0) return PartialFrame;
 
-    if (isDebugEnabled())
-    {
-        string msg = safeString(data);
-        debug("(rtlwmbus) checkRTLWMBusFrame \"%s\"\n", msg.c_str());
-    }
-
     int payload_len = 0;
-    size_t eolp = 0;
-    // Look for end of line
-    for (; eolp < data.size(); ++eolp) {
-        if (data[eolp] == '\n') break;
-    }
-    if (eolp >= data.size())
+    // Look for end of line, the bytes before it have been scanned by the previous calls.
+    size_t eol = scanner_.find(data, '\n');
+    if (eol >= data.size())
     {
         debug("(rtlwmbus) no eol found, partial frame\n");
         return PartialFrame;
     }
 
+    if (isDebugEnabled())
+    {
+        vector<uchar> line(data.begin(), data.begin()+eol);
+        string msg = safeString(line);
+        debug("(rtlwmbus) checkRTLWMBusFrame \"%s\"\n", msg.c_str());
+    }
+
     // We got a full line, but if it is too short, then
     // there is something wrong. Discard the data.
     if (data.size() < 10)
@@ -233,10 +294,11 @@ FrameStatus WMBusRTLWMBUS::checkRTLWMBUSFrame(vector<uchar> &data,
 
     if (data[0] != '0' || data[1] != 'x')
     {
-        // Discard lines that do not begin with T1 or C1, these lines are probably
-        // stderr output from rtl_sdr/rtl_wmbus.
-        if (!(data[0] == 'T' && data[1] == '1') &&
-            !(data[0] == 'C' && data[1] == '1'))
+        // Discard lines that do not begin with a link mode, eg T1 or C1, these lines are
+        // probably stderr output from rtl_sdr/rtl_wmbus. A forwarding wmbusmeters also sends
+        // the other modes, or ANY when the dongle did not tell.
+        size_t semicolon = 0;
+        if (lineLinkMode(data, eol, &semicolon) == LinkMode::UNKNOWN)
         {
 
             debug("(rtlwmbus) only text\n");
@@ -244,12 +306,12 @@ FrameStatus WMBusRTLWMBUS::checkRTLWMBUSFrame(vector<uchar> &data,
         }
 
         // And the checksums should match.
-        if (strncmp((const char*)&data[1], "1;1", 3))
+        if (strncmp((const char*)&data[semicolon], ";1", 2))
         {
             // Packages that begin with C1;1 or with T1;1 are good. The full format is:
             // MODE;CRC_OK;3OUTOF6OK;TIMESTAMP;PACKET_RSSI;CURRENT_RSSI;LINK_LAYER_IDENT_NO;DATAGRAM_WITHOUT_CRC_BYTES.
             // 3OUTOF6OK makes sense only with mode T1 and no sense with mode C1 (always set to 1).
-            if (!strncmp((const char*)&data[1], "1;0", 3)) {
+            if (!strncmp((const char*)&data[semicolon], ";0", 2)) {
                 verbose("(rtlwmbus) telegram received but incomplete or with errors, since rtl_wmbus reports that CRC checks failed.\n");
             }
             return ErrorInFrame;
@@ -257,24 +319,19 @@ FrameStatus WMBusRTLWMBUS::checkRTLWMBUSFrame(vector<uchar> &data,
     }
     // Look for start of telegram 0x
     size_t i = 0;
-    for (; i+1 < data.size(); ++i) {
+    for (; i+1 < eol; ++i) {
         if (data[i] == '0' && data[i+1] == 'x') break;
     }
-    if (i+1 >= data.size())
+    if (i+1 >= eol)
     {
         return ErrorInFrame; // No 0x found, then discard the frame.
     }
     i+=2; // Skip 0x
 
-    // Look for end of line or semicolon.
-    for (eolp=i; eolp < data.size(); ++eolp) {
-        if (data[eolp] == '\n') break;
-        if (data[eolp] == ';' && data[eolp+1] == '0' && data[eolp+2] == 'x') break;
-    }
-    if (eolp >= data.size())
-    {
-        debug("(rtlwmbus) no eol or semicolon, partial frame\n");
-        return PartialFrame;
+    // Look for a semicolon before the end of line.
+    size_t eolp = i;
+    for (; eolp < eol; ++eolp) {
+        if (data[eolp] == ';' && eolp+2 < eol && data[eolp+1] == '0' && data[eolp+2] == 'x') break;
     }
 
     payload_len = eolp-i;
@@ -143,7 +143,7 @@ void WMBusSimulator::simulate()
 {
     time_t start_time = time(NULL);
 
-    for (auto l : lines_) {
+    for (const string &l : lines_) {
         string hex = "";
         int found_time = 0;
         time_t rel_time = 0;
@@ -182,5 +182,4 @@ void WMBusSimulator::simulate()
         }
         handleTelegram(payload);
     }
-    manager_->stop();
 }
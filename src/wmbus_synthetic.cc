@@ -0,0 +1,428 @@
+/*
+ Copyright (C) 2020 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"aes.h"
+#include"meters.h"
+#include"wmbus.h"
+#include"wmbus_utils.h"
+#include"serial.h"
+
+#include<assert.h>
+#include<string.h>
+#include<time.h>
+#include<unistd.h>
+
+using namespace std;
+
+// One plain text telegram for each meter driver, taken from the simulations and tests.
+// The encrypted ones have been decrypted, the synthetic device encrypts them again with
+// the generated keys.
+#define LIST_OF_SYNTHETIC_TELEGRAMS \
+    X(amiplus,     "4E4401061010101002027A000040052F2F0E035040691500000B2B300300066D00790C7423400C78371204860BABC8FC100000000E833C8074000000000BAB3C0000000AFDC9FC0136022F2F2F2F2F") \
+    X(apator08,    "73441486DD4444000303A0B9E527004C4034B31CED0106FF01D093270065F022009661230054D02300EC49240018B424005F012500936D2500FFD525000E3D26001EAC26000B2027000300000000371D0B2000000000000024000000000000280000000000002C0033150C010D2F000000000000") \
+    X(apator162,   "6E4401062020202005077A9A0060852F2F0F0A734393CC0000435B0183001A54E06F630291342510030F00007B013E0B00003E0B00003E0B00003E0B00003E0B00003E0B00003E0B0000650000003D0000003D0000003D00000000000000A0910CB003FFFFFFFFFFFFFFFFFFFFA62B") \
+    X(cma12w,      "2744961566666666201B7AF90000202F2F02651E094265180902FD1B30030DFD0F05302E302E340F") \
+    X(ebzwmbe,     "5B445A149922992202378C20F6900F002C25BC9E0000BF48954821BC508D72992299225A140102F6003007102F2F040330F92A0004A9FF01FF24000004A9FF026A29000004A9FF03460600000DFD11063132333435362F2F2F2F2F2F") \
+    X(eurisii,     "7644C5250188018855087201880188C5255508010000002F2F0B6E332211426E110182016E1102C2016E110382026E1104C2026E110582036E1106C2036E110782046E1108C2046E110982056E1110C2056E111182066E1112C2066E111382076E1114C2076E111582086E1116C2086E111702FD172100") \
+    X(ehzp,        "5344A8159955995502028C201D900F002C250C390000ED176BBBB1591ADB7A1D003007102F2F0700583B74020000000007803CBCD70200000000000728B070200000000000042092A406002F2F2F2F2F2F2F2F2F") \
+    X(esyswm,      "7B4479169977997730378C208B900F002C25E4EF0A002EA98E7D58B3ADC57290779977991611028B005087102F2F0DFD090F34302e3030562030303030303030300D790E31323334353637383839595345310DFD100AAAAAAAAAAAAAAAAAAAAA0D780E31323334353637383930594553312F2F2F2F2F2F2F2F2F2F2F") \
+    X(flowiq3100,  "2A442D2C998734761B168D2091D37CAC21576C7802FF207100041308190000441308190000615B7F616713") \
+    X(fhkvdataiii, "31446850226677116980A0119F27020480048300C408F709143C003D341A2B0B2A0707000000000000062D114457563D71A1850000") \
+    X(hydrus,      "4E44A5116464646470077AED0040052F2F01FD08300C13741100007C1300000000FC101300000000FC201300000000726C00000B3B00000002FD748713025A6800C4016D3B177F2ACC011300020000") \
+    X(hydrodigit,  "4E44B4098686868613077AF00040052F2F0C1366380000046D27287E2A0F150E00000000C10000D10000E60000FD00000C01002F0100410100540100680100890000A00000B30000002F2F2F2F2F2F") \
+    X(iperl,       "1844AE4C4455223368077A55000000041389E20100023B0000") \
+    X(izar,        "1944304C72242421D401A2013D4013DD8B46A4999C1293E582CC") \
+    X(lansenth,    "2e44333003020100071b7a634820252f2f0265840842658308820165950802fb1aae0142fb1aae018201fb1aa9012f") \
+    X(mkradio3,    "2F446850313233347462A2069F255900B029310000000306060906030609070606050509050505050407040605070500") \
+    X(multical21,  "2A442D2C998734761B168D2091D37CAC21576C7802FF207100041308190000441308190000615B7F616713") \
+    X(multical302, "2E442D2C6767676730048D2039D1684020BCDB7803062C000043060000000314630000426C7F2A022D130001FF2100") \
+    X(omnipower,   "15442D2C0403020101027A0100000004833B10270000") \
+    X(rfmamb,      "5744b40988227711101b7ab20800000265a00842658f088201659f08226589081265a0086265510852652b0902fb1aba0142fb1ab0018201fb1abd0122fb1aa90112fb1aba0162fb1aa60152fb1af501066d3b3bb36b2a00") \
+    X(rfmtx1,      "1A44B4094433221105077A010000000C1378560000046D27287E2A") \
+    X(q400,        "2E4409077272727210077AD71020052F2FF42D717A742C041300000000446D0000612C4413000000002F2F2F2F2F2F") \
+    X(qcaloric,    "314493441234567835087a740000200b6e2701004b6e450100426c5f2ccb086e790000c2086c7f21326cffff046d200b7422") \
+    X(supercom587, "A244EE4D785634123C067A8F0000000C1348550000426CE1F14C130000000082046C21298C0413330000008D04931E3A3CFE3300000033000000330000003300000033000000330000003300000033000000330000003300000033000000330000004300000034180000046D0D0B5C2B03FD6C5E150082206C5C290BFD0F0200018C4079678885238310FD3100000082106C01018110FD610002FD66020002FD170000") \
+    X(vario451,    "374468506549235827C3A2129F25383300A8622600008200800A2AF862115175552877A36F26C9AB1CB24400000004000000000004908002") \
+
+// The izar PRIOS scrambling uses the header, including the id, as part of the key.
+#define PRIOS_DEFAULT_KEY1 (0x39BC8A10^0xE66D83F8)
+#define PRIOS_DEFAULT_KEY2 (0x51728910^0xE66D83F8)
+
+// Offsets in a telegram, the dll crcs are already removed.
+#define SYNTH_ID_OFFSET 4
+#define SYNTH_CI_OFFSET 10
+#define SYNTH_ACC_OFFSET 11
+#define SYNTH_CFG_OFFSET 13
+#define SYNTH_PAYLOAD_OFFSET 15
+
+struct SyntheticMeter
+{
+    string type;
+    vector<uchar> frame; // Plain text, with this meter's id.
+    vector<uchar> key;   // Empty if not encrypted.
+    uint32_t prios_key {}; // Non-zero for a PRIOS scrambled telegram.
+    // The offsets and difs of the values that change for each telegram.
+    vector<pair<size_t,uchar>> values;
+    uint32_t seq {};
+};
+
+struct WMBusSynthetic : public WMBusCommonImplementation
+{
+    bool ping() { return true; }
+    uint32_t getDeviceId() { return 0x11111111; }
+    LinkModeSet getLinkModes() { return link_modes_; }
+    void setLinkModes(LinkModeSet lms) { link_modes_ = lms; }
+    LinkModeSet supportedLinkModes() { return Any_bit; }
+    int numConcurrentLinkModes() { return 0; }
+    bool canSetLinkModes(LinkModeSet lms) { return true; }
+    SerialDevice *serial() { return NULL; }
+    void simulate();
+
+    WMBusSynthetic(string spec, SerialCommunicationManager *manager, vector<MeterInfo> *meters);
+
+private:
+
+    void parseSpec(string spec);
+    void addMeter(int index, string type, bool encrypt, vector<MeterInfo> *meters);
+    void generate(SyntheticMeter &m, vector<uchar> &out);
+
+    SerialCommunicationManager *manager_ {};
+    LinkModeSet link_modes_;
+    vector<SyntheticMeter> meters_;
+
+    int rate_ {}; // Telegrams per second, zero means as fast as possible.
+    int num_meters_ {};
+    int encrypted_percent_ { 50 };
+    uint64_t count_ {}; // Stop after this many telegrams, zero means never.
+    uint64_t seed_ { 1 };
+    vector<string> mix_;
+    vector<uchar> plain_; // Reused for each encrypted telegram.
+};
+
+static const char *synthetic_types_[] = {
+#define X(type,hex) #type,
+LIST_OF_SYNTHETIC_TELEGRAMS
+#undef X
+};
+
+static const char *synthetic_hexes_[] = {
+#define X(type,hex) hex,
+LIST_OF_SYNTHETIC_TELEGRAMS
+#undef X
+};
+
+#define NUM_SYNTHETIC_TELEGRAMS (sizeof(synthetic_types_)/sizeof(synthetic_types_[0]))
+
+static uint64_t xorshift(uint64_t *s)
+{
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *s = x;
+    return x;
+}
+
+static vector<string> split(string s, char c)
+{
+    vector<string> r;
+    size_t from = 0;
+    for (;;)
+    {
+        size_t to = s.find(c, from);
+        r.push_back(s.substr(from, to-from));
+        if (to == string::npos) break;
+        from = to+1;
+    }
+    return r;
+}
+
+static uint32_t bytesToUint32(vector<uchar> &v, int offset)
+{
+    return (uint32_t)v[offset] << 24 | (uint32_t)v[offset+1] << 16 | (uint32_t)v[offset+2] << 8 | v[offset+3];
+}
+
+// The same operation scrambles and descrambles, see MeterIzar::decodePrios.
+static void priosScramble(vector<uchar> &frame, uint32_t key)
+{
+    key ^= bytesToUint32(frame, 2);
+    key ^= bytesToUint32(frame, 6);
+    key ^= bytesToUint32(frame, 10);
+    for (size_t i = SYNTH_PAYLOAD_OFFSET; i < frame.size(); ++i)
+    {
+        for (int j = 0; j < 8; ++j)
+        {
+            uchar bit = ((key & 0x2) != 0) ^ ((key & 0x4) != 0) ^ ((key & 0x800) != 0) ^ ((key & 0x80000000) != 0);
+            key = (key << 1) | bit;
+        }
+        frame[i] ^= key & 0xff;
+    }
+}
+
+static int difLength(uchar dif)
+{
+    switch (dif & 0x0f)
+    {
+    case 0x0: return 0;
+    case 0x1: return 1;
+    case 0x2: return 2;
+    case 0x3: return 3;
+    case 0x4: return 4;
+    case 0x5: return 4; // Real
+    case 0x6: return 6;
+    case 0x7: return 8;
+    case 0x8: return 0; // Selection for readout
+    case 0x9: return 1;
+    case 0xA: return 2;
+    case 0xB: return 3;
+    case 0xC: return 4;
+    case 0xE: return 6;
+    }
+    return -1; // Variable length or special function.
+}
+
+// Find the current energy, volume and heat cost allocation values, these
+// are the ones that are counted up for each telegram.
+static void findValues(vector<uchar> &frame, size_t pos, vector<pair<size_t,uchar>> *values)
+{
+    while (pos < frame.size())
+    {
+        uchar dif = frame[pos++];
+        if (dif == 0x2f) continue;
+        int len = difLength(dif);
+        if (len < 0) return;
+        bool current = (dif & 0xc0) == 0; // Storage nr 0 and no dife.
+        while ((frame[pos-1] & 0x80) && pos < frame.size()) pos++;
+        if (pos >= frame.size()) return;
+        uchar vif = frame[pos++] & 0x7f;
+        while ((frame[pos-1] & 0x80) && pos < frame.size()) pos++;
+        if (pos+len > frame.size()) return;
+        bool counter = vif <= 0x07 || (vif >= 0x10 && vif <= 0x17) || vif == 0x6e;
+        if (current && counter && (dif & 0x0f) != 0x5 && len > 0)
+        {
+            values->push_back({ pos, dif });
+        }
+        pos += len;
+    }
+}
+
+static void writeValue(vector<uchar> &frame, size_t pos, uchar dif, uint64_t v)
+{
+    int len = difLength(dif);
+    bool bcd = (dif & 0x0f) >= 0x9;
+    for (int i = 0; i < len; ++i)
+    {
+        if (bcd)
+        {
+            frame[pos+i] = (v % 10) | ((v / 10 % 10) << 4);
+            v /= 100;
+        }
+        else
+        {
+            frame[pos+i] = v & 0xff;
+            v >>= 8;
+        }
+    }
+}
+
+WMBusSynthetic::WMBusSynthetic(string spec, SerialCommunicationManager *manager, vector<MeterInfo> *meters)
+    : WMBusCommonImplementation(DEVICE_SYNTHETIC), manager_(manager)
+{
+    parseSpec(spec);
+    uint64_t s = seed_;
+    for (int i = 0; i < num_meters_; ++i)
+    {
+        bool encrypt = (int)(xorshift(&s) % 100) < encrypted_percent_;
+        addMeter(i, mix_[i % mix_.size()], encrypt, meters);
+    }
+    verbose("(synthetic) %d meters, %d telegrams per second\n", num_meters_, rate_);
+}
+
+void WMBusSynthetic::parseSpec(string spec)
+{
+    // rate=50000,meters=10000,mix=multical21+supercom587,encrypted=50,count=1000000,seed=1
+    vector<string> parts = split(spec, ',');
+    for (string &p : parts)
+    {
+        if (p == "") continue;
+        size_t eq = p.find('=');
+        string key = p.substr(0, eq);
+        string val = eq == string::npos ? "" : p.substr(eq+1);
+        if (key == "mix")
+        {
+            mix_ = split(val, '+');
+            continue;
+        }
+        if (!isNumber(val))
+        {
+            error("(synthetic) not a number \"%s\"\n", p.c_str());
+        }
+        if (key == "rate") rate_ = atoi(val.c_str());
+        else if (key == "meters") num_meters_ = atoi(val.c_str());
+        else if (key == "encrypted") encrypted_percent_ = atoi(val.c_str());
+        else if (key == "count") count_ = strtoull(val.c_str(), NULL, 10);
+        else if (key == "seed") seed_ = strtoull(val.c_str(), NULL, 10);
+        else error("(synthetic) unknown setting \"%s\"\n", p.c_str());
+    }
+    if (mix_.size() == 0)
+    {
+        for (size_t i = 0; i < NUM_SYNTHETIC_TELEGRAMS; ++i) mix_.push_back(synthetic_types_[i]);
+    }
+    for (string &m : mix_)
+    {
+        size_t i = 0;
+        while (i < NUM_SYNTHETIC_TELEGRAMS && m != synthetic_types_[i]) i++;
+        if (i == NUM_SYNTHETIC_TELEGRAMS) error("(synthetic) no telegram for meter type \"%s\"\n", m.c_str());
+    }
+    if (num_meters_ == 0) num_meters_ = mix_.size();
+    if (seed_ == 0) seed_ = 1;
+}
+
+void WMBusSynthetic::addMeter(int index, string type, bool encrypt, vector<MeterInfo> *meters)
+{
+    size_t t = 0;
+    while (type != synthetic_types_[t]) t++;
+
+    SyntheticMeter m;
+    m.type = type;
+    hex2bin(synthetic_hexes_[t], &m.frame);
+
+    // Ids 90000000 and up, replace the old id everywhere, ie also in a long tpl header.
+    char id[12];
+    snprintf(id, sizeof(id), "%08d", 90000000+index);
+    uchar new_id[4], old_id[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        new_id[i] = (id[6-2*i]-'0') << 4 | (id[7-2*i]-'0');
+        old_id[i] = m.frame[SYNTH_ID_OFFSET+i];
+    }
+    if (m.frame[SYNTH_CI_OFFSET] == 0xa2 && type == "izar")
+    {
+        // Descramble with the old id, it is scrambled again for each telegram.
+        uint32_t keys[] = { PRIOS_DEFAULT_KEY1, PRIOS_DEFAULT_KEY2 };
+        for (uint32_t k : keys)
+        {
+            vector<uchar> plain = m.frame;
+            priosScramble(plain, k);
+            if (plain[SYNTH_PAYLOAD_OFFSET] == 0x4b)
+            {
+                m.frame = plain;
+                m.prios_key = k;
+                break;
+            }
+        }
+        assert(m.prios_key != 0);
+        // The total water consumption in liters.
+        m.values.push_back({ SYNTH_PAYLOAD_OFFSET+1, 0x04 });
+    }
+    for (size_t i = 0; i+4 <= m.frame.size(); ++i)
+    {
+        if (!memcmp(&m.frame[i], old_id, 4)) memcpy(&m.frame[i], new_id, 4);
+    }
+
+    if (m.frame[SYNTH_CI_OFFSET] == 0x7a)
+    {
+        if (encrypt)
+        {
+            // Security mode 5, AES CBC with IV. The plain text starts with 2f2f
+            // and is padded with 2f to a whole number of blocks.
+            if (m.frame[SYNTH_PAYLOAD_OFFSET] != 0x2f || m.frame[SYNTH_PAYLOAD_OFFSET+1] != 0x2f)
+            {
+                m.frame.insert(m.frame.begin()+SYNTH_PAYLOAD_OFFSET, { 0x2f, 0x2f });
+            }
+            while ((m.frame.size()-SYNTH_PAYLOAD_OFFSET) % 16 != 0) m.frame.push_back(0x2f);
+            int blocks = (m.frame.size()-SYNTH_PAYLOAD_OFFSET)/16;
+            m.frame[SYNTH_CFG_OFFSET] = (m.frame[SYNTH_CFG_OFFSET] & 0x0f) | (blocks << 4);
+            m.frame[SYNTH_CFG_OFFSET+1] = (m.frame[SYNTH_CFG_OFFSET+1] & 0xe0) | 0x05;
+            m.frame[0] = m.frame.size()-1;
+            uint64_t s = seed_ ^ ((uint64_t)index << 32 | 0x5eed);
+            for (int i = 0; i < 16; ++i) m.key.push_back(xorshift(&s) & 0xff);
+        }
+        findValues(m.frame, SYNTH_PAYLOAD_OFFSET, &m.values);
+    }
+    m.seq = index*1000;
+
+    string key = m.key.size() > 0 ? bin2hex(m.key) : "";
+    vector<string> no_shells, no_jsons;
+    meters->push_back(MeterInfo("synthetic"+to_string(index), type, id, key,
+                                toMeterLinkModeSet(type), no_shells, no_jsons));
+    meters_.push_back(m);
+}
+
+void WMBusSynthetic::generate(SyntheticMeter &m, vector<uchar> &out)
+{
+    out = m.frame;
+    m.seq++;
+    for (auto &v : m.values) writeValue(out, v.first, v.second, m.seq);
+
+    if (m.prios_key != 0)
+    {
+        priosScramble(out, m.prios_key);
+        return;
+    }
+    if (m.key.size() == 0) return;
+
+    out[SYNTH_ACC_OFFSET] = m.seq & 0xff;
+    uchar iv[16];
+    // M-field, A-field and the ACC repeated, see decrypt_TPL_AES_CBC_IV.
+    memcpy(iv, &out[2], 8);
+    memset(iv+8, out[SYNTH_ACC_OFFSET], 8);
+    plain_.assign(out.begin()+SYNTH_PAYLOAD_OFFSET, out.end());
+    AES_CBC_encrypt_buffer(&out[SYNTH_PAYLOAD_OFFSET], &plain_[0], plain_.size(), &m.key[0], iv);
+}
+
+static uint64_t nowNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+// Stops after count telegrams or when the manager is stopped.
+void WMBusSynthetic::simulate()
+{
+    vector<uchar> frame;
+    uint64_t sent = 0;
+    uint64_t start = nowNanos();
+    size_t next = 0;
+
+    while (manager_->isRunning() && (count_ == 0 || sent < count_))
+    {
+        if (rate_ > 0)
+        {
+            uint64_t due = (nowNanos()-start)*rate_/1000000000ull;
+            if (sent >= due)
+            {
+                usleep(1000);
+                continue;
+            }
+        }
+        generate(meters_[next], frame);
+        next = (next+1) % meters_.size();
+        handleTelegram(frame);
+        sent++;
+        if (sent % 1024 == 0) manager_->invokeRegularCallbacks();
+    }
+    uint64_t nanos = nowNanos()-start;
+    verbose("(synthetic) sent %ju telegrams in %.3f s\n", (uintmax_t)sent, nanos/1e9);
+}
+
+unique_ptr<WMBus> openSynthetic(string spec, SerialCommunicationManager *manager, vector<MeterInfo> *meters)
+{
+    WMBusSynthetic *imp = new WMBusSynthetic(spec, manager, meters);
+    return unique_ptr<WMBus>(imp);
+}
@@ -17,14 +17,17 @@
 
 
 #include"aes.h"
+#include"stats.h"
 #include"util.h"
 #include"wmbus.h"
+#include"wmbus_utils.h"
 
 #include<assert.h>
 #include<memory.h>
 
 bool decrypt_ELL_AES_CTR(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, vector<uchar> &aeskey)
 {
+    STAGE_TIMER(decrypt);
     if (aeskey.size() == 0) return true;
 
     vector<uchar> encrypted_bytes;
@@ -94,6 +97,7 @@ string frameTypeKamstrupC1(int ft) {
 
 bool decrypt_TPL_AES_CBC_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, vector<uchar> &aeskey)
 {
+    STAGE_TIMER(decrypt);
     if (aeskey.size() == 0) return true;
 
     vector<uchar> buffer;
@@ -138,6 +142,7 @@ bool decrypt_TPL_AES_CBC_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::it
 
 bool decrypt_TPL_AES_CBC_NO_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, vector<uchar> &aeskey)
 {
+    STAGE_TIMER(decrypt);
     if (aeskey.size() == 0) return true;
 
     vector<uchar> buffer;
@@ -173,3 +178,23 @@ bool decrypt_TPL_AES_CBC_NO_IV(Telegram *t, vector<uchar> &frame, vector<uchar>:
     debugPayload("(TPL) decrypted", frame, pos);
     return true;
 }
+
+size_t FrameScanner::find(vector<uchar> &data, uchar c)
+{
+    if (scanned_ >= data.size()) return data.size();
+    const uchar *p = (const uchar*)memchr(&data[scanned_], c, data.size()-scanned_);
+    if (p == NULL)
+    {
+        scanned_ = data.size();
+        return data.size();
+    }
+    // Found again from here until it is consumed.
+    scanned_ = p-&data[0];
+    return scanned_;
+}
+
+void FrameScanner::consumed(size_t n)
+{
+    scanned_ = scanned_ > n ? scanned_-n : 0;
+    frame_length_ = 0;
+}
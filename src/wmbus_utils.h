@@ -21,25 +21,52 @@
 #include "util.h"
 #include "wmbus.h"
 
+struct FateCounters;
+
 bool decrypt_ELL_AES_CTR(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, vector<uchar> &aeskey);
 bool decrypt_TPL_AES_CBC_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, vector<uchar> &aeskey);
 bool decrypt_TPL_AES_CBC_NO_IV(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, vector<uchar> &aeskey);
 string frameTypeKamstrupC1(int ft);
 
+// The state of a framer between the reads from a dongle. A frame that arrives
+// in many small reads is then examined once, instead of from the start of the
+// read buffer after every read.
+struct FrameScanner
+{
+    // Find the first c in the data, continuing where the previous find stopped.
+    // Returns data.size() if there is none yet.
+    size_t find(vector<uchar> &data, uchar c);
+    // Remember the length of the frame when its header has been seen,
+    // then there is no need to look at the data until it is complete.
+    bool waitingFor(vector<uchar> &data) { return frame_length_ > 0 && data.size() < frame_length_; }
+    void expect(size_t frame_length) { frame_length_ = frame_length; }
+    // The first n bytes have been removed from the buffer.
+    void consumed(size_t n);
+    // The buffer has been cleared.
+    void reset() { scanned_ = 0; frame_length_ = 0; }
+
+private:
+    size_t scanned_ {};
+    size_t frame_length_ {};
+};
+
 struct WMBusCommonImplementation : public virtual WMBus
 {
     WMBusCommonImplementation(WMBusDeviceType t);
 
     WMBusDeviceType type();
     void setMeters(vector<unique_ptr<Meter>> *meters);
-    void onTelegram(function<bool(vector<uchar>)> cb);
+    void onTelegram(function<bool(AboutTelegram&,vector<uchar>)> cb);
+    // Received now.
     bool handleTelegram(vector<uchar> frame);
+    bool handleTelegram(AboutTelegram &about, vector<uchar> frame);
 
     private:
 
-    vector<function<bool(vector<uchar>)>> telegram_listeners_;
+    vector<function<bool(AboutTelegram&,vector<uchar>)>> telegram_listeners_;
     vector<unique_ptr<Meter>> *meters_;
     WMBusDeviceType type_ {};
+    FateCounters *fates_ {}; // The frames received by this driver.
 };
 
 #endif
@@ -19,6 +19,7 @@
 #include"wmbus_utils.h"
 #include"wmbus_cul.h"
 #include"serial.h"
+#include"stats.h"
 
 #include<assert.h>
 #include<fcntl.h>
@@ -81,6 +82,7 @@ private:
     SerialCommunicationManager *manager_ {};
     LinkModeSet link_modes_ {};
     vector<uchar> read_buffer_;
+    MemoryTracker read_buffer_memory_ { Memory::frame_buffers };
     pthread_mutex_t serial_lock_ = PTHREAD_MUTEX_INITIALIZER;
 
     FrameStatus checkWMB13UFrame(vector<uchar> &data,
@@ -200,6 +202,7 @@ void WMBusWMB13U::processSerialData()
     pthread_mutex_unlock(&serial_lock_);
 
     read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
+    read_buffer_memory_.update(read_buffer_.capacity());
 
     size_t frame_length;
     int payload_len, payload_offset;
@@ -215,6 +218,7 @@ void WMBusWMB13U::processSerialData()
         }
         if (status == ErrorInFrame)
         {
+            countFate(Fate::framing_error, driverFateCounters("wmb13u"));
             verbose("(wmb13u) protocol error in message received!\n");
             string msg = bin2hex(read_buffer_);
             debug("(wmb13u) protocol error \"%s\"\n", msg.c_str());
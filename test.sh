@@ -36,6 +36,12 @@ if [ "$?" != "0" ]; then RC="1"; fi
 tests/test_logfile.sh $PROG
 if [ "$?" != "0" ]; then RC="1"; fi
 
+tests/test_cbor.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_spool.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
 tests/test_elements.sh $PROG
 if [ "$?" != "0" ]; then RC="1"; fi
 
@@ -72,4 +78,22 @@ if [ "$?" != "0" ]; then RC="1"; fi
 tests/test_serial_bads.sh $PROG
 if [ "$?" != "0" ]; then RC="1"; fi
 
+tests/test_synthetic.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_replay.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_trace.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_receivers.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_rssi.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_forward.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
 exit $RC
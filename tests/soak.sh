@@ -0,0 +1,71 @@
+#!/bin/sh
+
+# Push a lot of synthetic telegrams through the full pipeline and check that
+# the resident memory and the memory of each subsystem stay flat after warmup.
+# Usage: tests/soak.sh build/wmbusmeters [count] [meters]
+
+PROG="$1"
+COUNT="${2:-20000000}"
+METERS="${3:-20}"
+
+mkdir -p testoutput
+TEST=testoutput
+
+TESTNAME="Soak test $COUNT telegrams from $METERS meters"
+TESTRESULT="ERROR"
+
+STATS=$TEST/soak_stats.json
+SAMPLES=$TEST/soak_memory.txt
+rm -f $STATS $SAMPLES
+
+$PROG --statsfile=$STATS --statsinterval=1s --format=json synthetic:count=$COUNT,meters=$METERS > /dev/null 2> $TEST/soak_stderr.txt &
+PID=$!
+
+while kill -0 $PID 2> /dev/null
+do
+    sleep 5
+    if [ -f $STATS ]
+    then
+        # "memory":{"rss":7843840,"meters":1693440,...} becomes rss=7843840 meters=1693440 ...
+        grep -o '"memory":{[^}]*}' $STATS | sed 's/"memory":{//;s/}//;s/"//g;s/:/=/g;s/,/ /g' >> $SAMPLES
+    fi
+done
+wait $PID
+RC=$?
+
+# Skip the first quarter of the samples as warmup, then nothing may grow
+# more than 10% above the first sample after the warmup. The slack covers
+# allocator noise for the small subsystems.
+RESULT=$(awk '
+{
+    n++
+    for (i = 1; i <= NF; i++) { split($i, kv, "="); v[n, kv[1]] = kv[2]; keys[kv[1]] = 1 }
+}
+END {
+    if (n < 4) { print "too few samples " n; exit }
+    base = int(n/4)+1
+    for (k in keys)
+    {
+        slack = (k == "rss") ? 1048576 : 65536
+        limit = v[base, k]*1.1 + slack
+        for (i = base; i <= n; i++)
+        {
+            if (v[i, k] > limit) { print k " grew from " v[base, k] " to " v[i, k] " bytes"; break }
+        }
+    }
+}' $SAMPLES)
+
+if [ "$RC" = "0" ] && [ "$RESULT" = "" ] && [ ! -s $TEST/soak_stderr.txt ]
+then
+    echo OK: $TESTNAME
+    TESTRESULT="OK"
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    echo "$RESULT"
+    cat $TEST/soak_stderr.txt
+    echo Memory samples in $SAMPLES
+    exit 1
+fi
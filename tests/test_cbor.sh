@@ -0,0 +1,88 @@
+#!/bin/sh
+
+PROG="$1"
+CBOR2JSON=$(dirname $PROG)/cbor2json
+
+mkdir -p testoutput
+TEST=testoutput
+
+TESTNAME="Test cbor output round trip"
+TESTRESULT="ERROR"
+
+METERS="MyWarmWater supercom587 12345678 NOKEY
+      MyColdWater supercom587 11111111 NOKEY
+      MoreWater   iperl       12345699 NOKEY
+      MyElectricity1 amiplus  10101010 NOKEY
+      HeatMeter   vario451    58234965 NOKEY
+      Room        fhkvdataiii 11776622 NOKEY
+      Tempoo      lansenth    00010203 NOKEY
+      IzarWater   izar        21242472 NOKEY
+      Q400Water   q400        72727272 AAA896100FED12DD614DD5D46369ACDD"
+
+OPTS="--addconversions=GJ --json_floor=5"
+
+$PROG --format=json $OPTS simulations/simulation_t1.txt $METERS \
+    | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' > $TEST/test_expected.txt
+
+$PROG --format=cbor $OPTS simulations/simulation_t1.txt $METERS > $TEST/test_output.cbor
+if [ "$?" = "0" ]
+then
+    $CBOR2JSON $TEST/test_output.cbor \
+        | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' > $TEST/test_responses.txt
+    diff $TEST/test_expected.txt $TEST/test_responses.txt
+    if [ "$?" = "0" ]
+    then
+        JSONSIZE=$(wc -c < $TEST/test_expected.txt)
+        CBORSIZE=$(wc -c < $TEST/test_output.cbor)
+        if [ "$CBORSIZE" -lt "$JSONSIZE" ]
+        then
+            echo OK: $TESTNAME
+            TESTRESULT="OK"
+        else
+            echo "Expected the cbor output ($CBORSIZE bytes) to be smaller than the json output ($JSONSIZE bytes)."
+        fi
+    fi
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi
+
+TESTNAME="Test cbor output round trip of device, rssi and link mode"
+TESTRESULT="ERROR"
+
+# Two receivers, the rtlwmbus one knows the link mode.
+RECEIVERS="--listento=any --device=simulations/simulation_t1.txt simulations/serial_rtlwmbus_ok.msg:rtlwmbus"
+METERS="Rummet1 lansenth 00010203 NOKEY MyWarmWater supercom587 12345678 NOKEY"
+# An im871a radio link message with the rssi b5 appended.
+IM871A="a56203A244EE4D785634123C067A8F0000000C1348550000426CE1F14C130000000082046C21298C0413330000008D04931E3A3CFE3300000033000000330000003300000033000000330000003300000033000000330000003300000033000000330000004300000034180000046D0D0B5C2B03FD6C5E150082206C5C290BFD0F0200018C4079678885238310FD3100000082106C01018110FD610002FD66020002FD17000001020304b5"
+
+$PROG --format=json $RECEIVERS $METERS > $TEST/test_expected_unsorted.txt
+echo $IM871A | xxd -r -p | $PROG --format=json stdin:im871a MyWarmWater supercom587 12345678 NOKEY >> $TEST/test_expected_unsorted.txt
+sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' $TEST/test_expected_unsorted.txt | sort > $TEST/test_expected.txt
+
+$PROG --format=cbor $RECEIVERS $METERS > $TEST/test_output.cbor
+echo $IM871A | xxd -r -p | $PROG --format=cbor stdin:im871a MyWarmWater supercom587 12345678 NOKEY >> $TEST/test_output.cbor
+$CBOR2JSON $TEST/test_output.cbor \
+    | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' | sort > $TEST/test_responses.txt
+
+if grep -q '"device":' $TEST/test_expected.txt && grep -q '"rssi_dbm":-75' $TEST/test_expected.txt \
+        && grep -q '"link_mode":"t1"' $TEST/test_expected.txt
+then
+    diff $TEST/test_expected.txt $TEST/test_responses.txt
+    if [ "$?" = "0" ]
+    then
+        echo OK: $TESTNAME
+        TESTRESULT="OK"
+    fi
+else
+    echo "Expected the json output to have a device, rssi and link mode."
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi
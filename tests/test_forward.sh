@@ -0,0 +1,43 @@
+#!/bin/sh
+
+PROG="$1"
+
+mkdir -p testoutput
+TEST=testoutput
+
+TESTNAME="Test forwarding frames to a collector, also after it was unreachable"
+TESTRESULT="ERROR"
+
+rm -rf $TEST/fwdspool
+
+cat > $TEST/test_expected.txt <<EOF2
+{"media":"warm water","meter":"supercom587","name":"MyWarmWater","id":"12345678","total_m3":5.548,"timestamp":"1111-11-11T11:11:11Z","device":"127.0.0.1","rssi_dbm":-75}
+{"media":"warm water","meter":"supercom587","name":"MyWarmWater","id":"12345678","total_m3":5.548,"timestamp":"1111-11-11T11:11:11Z","device":"127.0.0.1","rssi_dbm":-75}
+EOF2
+
+# A radio link message with the rssi b5 appended.
+FRAME="a56203A244EE4D785634123C067A8F0000000C1348550000426CE1F14C130000000082046C21298C0413330000008D04931E3A3CFE3300000033000000330000003300000033000000330000003300000033000000330000003300000033000000330000004300000034180000046D0D0B5C2B03FD6C5E150082206C5C290BFD0F0200018C4079678885238310FD3100000082106C01018110FD610002FD66020002FD17000001020304b5"
+
+# No collector yet, the frame waits in the spool.
+echo $FRAME | xxd -r -p | $PROG --forward=127.0.0.1:47149 --spool=$TEST/fwdspool stdin:im871a > /dev/null 2>&1
+
+$PROG --format=json --exitafter=3s tcp:47149:rtlwmbus MyWarmWater supercom587 12345678 "" \
+    | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' > $TEST/test_output.txt &
+sleep 1
+
+# The first frame is sent before the second.
+echo $FRAME | xxd -r -p | $PROG --forward=127.0.0.1:47149 --spool=$TEST/fwdspool stdin:im871a > /dev/null 2>&1
+wait
+
+diff $TEST/test_expected.txt $TEST/test_output.txt
+if [ "$?" = "0" ]
+then
+    echo OK: $TESTNAME
+    TESTRESULT="OK"
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi
@@ -0,0 +1,33 @@
+#!/bin/sh
+
+PROG="$1"
+
+mkdir -p testoutput
+TEST=testoutput
+
+TESTNAME="Test several receivers feeding the same meters"
+TESTRESULT="ERROR"
+
+cat > $TEST/test_expected.txt <<EOF2
+{"media":"warm water","meter":"supercom587","name":"MyWarmWater","id":"12345678","total_m3":5.548,"timestamp":"1111-11-11T11:11:11Z","device":"simulations/simulation_t1.txt"}
+{"media":"cold water","meter":"multical21","name":"MyTapWater","id":"76348799","total_m3":6.408,"target_m3":6.408,"max_flow_m3h":0,"flow_temperature_c":127,"external_temperature_c":19,"current_status":"DRY","time_dry":"22-31 days","time_reversed":"","time_leaking":"","time_bursting":"","timestamp":"1111-11-11T11:11:11Z","device":"simulations/simulation_c1.txt"}
+{"media":"cold water","meter":"multical21","name":"MyTapWater","id":"76348799","total_m3":6.408,"target_m3":6.408,"max_flow_m3h":0,"flow_temperature_c":127,"external_temperature_c":19,"current_status":"DRY","time_dry":"22-31 days","time_reversed":"","time_leaking":"","time_bursting":"","timestamp":"1111-11-11T11:11:11Z","device":"simulations/simulation_c1.txt"}
+EOF2
+
+$PROG --format=json --device=simulations/simulation_c1.txt simulations/simulation_t1.txt \
+      MyWarmWater supercom587 12345678 "" \
+      MyTapWater multical21 76348799 "" \
+    | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' > $TEST/test_output.txt
+
+diff $TEST/test_expected.txt $TEST/test_output.txt
+if [ "$?" = "0" ]
+then
+    echo OK: $TESTNAME
+    TESTRESULT="OK"
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi
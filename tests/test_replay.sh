@@ -0,0 +1,37 @@
+#!/bin/sh
+
+PROG="$1"
+
+mkdir -p testoutput
+TEST=testoutput
+
+TESTNAME="Test replay of logged telegrams"
+TESTRESULT="ERROR"
+
+METERS="MyWarmWater supercom587 12345678 NOKEY
+        MoreWater   iperl       12345699 NOKEY"
+
+$PROG --logtelegrams --format=json simulations/simulation_t1.txt $METERS > $TEST/capture.log
+
+# The telegrams are logged 7 seconds apart in the capture.
+awk '/\|\+0"$/ && n++ { sub(/\|\+0"$/, "|+7\"") } { print }' $TEST/capture.log > $TEST/capture.tmp
+mv $TEST/capture.tmp $TEST/capture.log
+
+grep '^{' $TEST/capture.log \
+    | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"2020-05-01T12:00:00Z"/' \
+    | sed '2s/12:00:00Z/12:00:07Z/' > $TEST/test_expected.txt
+
+$PROG --format=json $TEST/capture.log:replay,start=2020-05-01T12:00:00Z $METERS > $TEST/test_output.txt
+
+diff $TEST/test_expected.txt $TEST/test_output.txt
+if [ "$?" = "0" ]
+then
+    echo OK: $TESTNAME
+    TESTRESULT="OK"
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi
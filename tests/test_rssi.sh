@@ -0,0 +1,33 @@
+#!/bin/sh
+
+PROG="$1"
+
+mkdir -p testoutput
+TEST=testoutput
+
+TESTNAME="Test rssi reported by the im871a in json and shell envs"
+TESTRESULT="ERROR"
+
+cat > $TEST/test_expected.txt <<EOF2
+{"media":"warm water","meter":"supercom587","name":"MyWarmWater","id":"12345678","total_m3":5.548,"timestamp":"1111-11-11T11:11:11Z","rssi_dbm":-75}
+RSSI=-75
+EOF2
+
+# A radio link message with the dongle timestamp 04030201 and the rssi b5 appended.
+echo "a56203A244EE4D785634123C067A8F0000000C1348550000426CE1F14C130000000082046C21298C0413330000008D04931E3A3CFE3300000033000000330000003300000033000000330000003300000033000000330000003300000033000000330000004300000034180000046D0D0B5C2B03FD6C5E150082206C5C290BFD0F0200018C4079678885238310FD3100000082106C01018110FD610002FD66020002FD17000001020304b5" | xxd -r -p | \
+    $PROG --format=json --shell='echo $METER_JSON; echo RSSI=$METER_RSSI_DBM' stdin:im871a \
+      MyWarmWater supercom587 12345678 "" \
+    | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' > $TEST/test_output.txt
+
+diff $TEST/test_expected.txt $TEST/test_output.txt
+if [ "$?" = "0" ]
+then
+    echo OK: $TESTNAME
+    TESTRESULT="OK"
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi
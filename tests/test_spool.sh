@@ -0,0 +1,45 @@
+#!/bin/sh
+
+PROG="$1"
+
+mkdir -p testoutput
+TEST=testoutput
+
+TESTNAME="Test spool retries failed shells"
+TESTRESULT="ERROR"
+
+rm -rf $TEST/spool $TEST/spool_ok $TEST/spool_output.txt
+
+METERS="MyWarmWater supercom587 12345678 NOKEY
+        MyColdWater supercom587 11111111 NOKEY"
+
+# The shell fails until the spool_ok file exists, the readings must stay in the spool.
+SHELL='test -f testoutput/spool_ok && echo "$METER_ID" >> testoutput/spool_output.txt'
+
+$PROG --spool=$TEST/spool --shell="$SHELL" simulations/simulation_t1.txt $METERS > /dev/null 2>&1
+
+if [ -f $TEST/spool_output.txt ]
+then
+    echo ERROR: $TESTNAME
+    echo Expected no output from the failing shell.
+    exit 1
+fi
+
+touch $TEST/spool_ok
+
+# The first two readings are now delivered from the spool, before the new ones.
+$PROG --spool=$TEST/spool --shell="$SHELL" simulations/simulation_t1.txt $METERS > /dev/null 2>&1
+
+printf "12345678\n11111111\n12345678\n11111111\n" > $TEST/test_expected.txt
+diff $TEST/test_expected.txt $TEST/spool_output.txt
+if [ "$?" = "0" ]
+then
+    echo OK: $TESTNAME
+    TESTRESULT="OK"
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    exit 1
+fi
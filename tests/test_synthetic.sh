@@ -0,0 +1,28 @@
+#!/bin/sh
+
+PROG="$1"
+
+mkdir -p testoutput
+TEST=testoutput
+
+TESTNAME="Test synthetic telegrams"
+TESTRESULT="ERROR"
+
+$PROG --format=json synthetic:count=50,encrypted=100 > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+
+LINES=$(grep -c '^{' $TEST/test_output.txt)
+NAMES=$(grep -o '"name":"synthetic[0-9]*"' $TEST/test_output.txt | sort -u | wc -l)
+
+if [ "$LINES" = "50" ] && [ "$NAMES" = "25" ] && [ ! -s $TEST/test_stderr.txt ]
+then
+    echo OK: $TESTNAME
+    TESTRESULT="OK"
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    echo Expected 50 json readings from 25 meters, got $LINES readings from $NAMES meters.
+    cat $TEST/test_stderr.txt
+    exit 1
+fi
@@ -0,0 +1,29 @@
+#!/bin/sh
+
+PROG="$1"
+
+mkdir -p testoutput
+TEST=testoutput
+
+TESTNAME="Test trace telegrams from selected ids"
+TESTRESULT="ERROR"
+
+rm -f $TEST/test_trace.json
+$PROG --trace=$TEST/test_trace.json --traceids=90000003 --format=json synthetic:count=100,meters=5 > /dev/null 2> $TEST/test_stderr.txt
+
+TELEGRAMS=$(grep -c '"name":"telegram"' $TEST/test_trace.json)
+OTHERS=$(grep '"ph":"X"' $TEST/test_trace.json | grep -vc '"id":"90000003"')
+
+if [ "$TELEGRAMS" = "20" ] && [ "$OTHERS" = "0" ] && [ ! -s $TEST/test_stderr.txt ]
+then
+    echo OK: $TESTNAME
+    TESTRESULT="OK"
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]
+then
+    echo ERROR: $TESTNAME
+    echo Expected 20 traced telegrams from 90000003, got $TELEGRAMS and $OTHERS events from other ids.
+    cat $TEST/test_stderr.txt
+    exit 1
+fi